@@ -10,6 +10,12 @@ export TELEORBIT_IMG_PATH=/etc/TeleOrbit
 export TELEORBIT_BIN_PATH=/usr/local/bin
 export TELEORBIT_LIB_PATH=/usr/local/lib
 
+# --daemon: let flexibandd load firmware and bitstreams instead of the udev RUN scripts
+DAEMON=0
+if [ "$1" == "--daemon" ]; then
+    DAEMON=1
+fi
+
 cd src
 make clean
 make
@@ -84,10 +90,25 @@ cp flexiband.img ${TELEORBIT_IMG_PATH}/flexiband.img
 cp teleorbit.img ${TELEORBIT_IMG_PATH}/teleorbit.img
 cp goose2.img ${TELEORBIT_IMG_PATH}/goose2.img
 cp innosense.img ${TELEORBIT_IMG_PATH}/innosense.img
-cp 80-flexiband.rules /etc/udev/rules.d/80-flexiband.rules
-cp 80-teleorbit.rules /etc/udev/rules.d/80-teleorbit.rules
-cp 80-innosense.rules /etc/udev/rules.d/80-innosense.rules
-cp 80-goose.rules /etc/udev/rules.d/80-goose.rules
+if [ ${DAEMON} -eq 1 ]; then
+    rm -f /etc/udev/rules.d/80-flexiband.rules /etc/udev/rules.d/80-teleorbit.rules
+    rm -f /etc/udev/rules.d/80-innosense.rules /etc/udev/rules.d/80-goose.rules
+    cp 80-flexibandd.rules /etc/udev/rules.d/80-flexibandd.rules
+    if [ ! -f /etc/flexibandd.conf ]; then
+        cp flexibandd.conf /etc/flexibandd.conf
+    fi
+    cp src/flexibandd ${TELEORBIT_BIN_PATH}/flexibandd
+    chmod +x ${TELEORBIT_BIN_PATH}/flexibandd
+    cp flexibandd.service /etc/systemd/system/flexibandd.service
+    systemctl daemon-reload
+    systemctl enable --now flexibandd.service
+else
+    rm -f /etc/udev/rules.d/80-flexibandd.rules
+    cp 80-flexiband.rules /etc/udev/rules.d/80-flexiband.rules
+    cp 80-teleorbit.rules /etc/udev/rules.d/80-teleorbit.rules
+    cp 80-innosense.rules /etc/udev/rules.d/80-innosense.rules
+    cp 80-goose.rules /etc/udev/rules.d/80-goose.rules
+fi
 cp src/fwload_fx3 ${TELEORBIT_BIN_PATH}/fwload_fx3
 cp upload_fx3.sh ${TELEORBIT_BIN_PATH}/upload_fx3.sh
 cp src/libcyusb.so ${TELEORBIT_LIB_PATH}/libcyusb.so
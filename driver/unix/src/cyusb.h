@@ -15,17 +15,23 @@
  *                                                                               *
  \*******************************************************************************/
 
+#include <time.h>
+#include <sys/types.h>
 #include <libusb-1.0/libusb.h>
 
 typedef struct libusb_device               cyusb_device;
 typedef struct libusb_device_handle        cyusb_handle;
 
-/* This is the maximum number of 'devices of interest' we are willing to store as default. */
-/* These are the maximum number of devices we will communicate with simultaneously */
+/* All library state is kept in a cyusb_context, see cyusb_ctx_open(). */
+typedef struct cyusb_context               cyusb_context;
+
+/* This is the initial size of the table of 'devices of interest'. The table grows as needed,
+   so this is not a limit on the number of devices.
+ */
 #define MAXDEVICES        10
 
-/* This is the maximum number of VID/PID pairs that this library will consider. This limits
-   the number of valid VID/PID entries in the configuration file.
+/* This is the initial number of VID/PID pairs allocated while parsing the configuration file.
+   The table grows as needed.
  */
 #define MAX_ID_PAIRS    100
 
@@ -35,6 +41,17 @@ typedef struct libusb_device_handle        cyusb_handle;
  */
 #define MAX_STR_LEN     30
 
+/* This is the maximum number of bytes written to FX3 RAM with a single 0xA0 vendor request. */
+#define FX3_MAX_CHUNK        4096
+
+/* This is the number of 0xA0 vendor requests kept in flight while downloading FX3 firmware. */
+#define FX3_QUEUE_DEPTH      8
+
+/* This is the time cyusb_download_fx3() waits for the device to re-enumerate after the jump
+   to the program entry point.
+ */
+#define FX3_RENUM_TIMEOUT_MS 5000
+
 struct cydev {
     cyusb_device *dev;          /* as above ... */
     cyusb_handle *handle;       /* as above ... */
@@ -46,6 +63,27 @@ struct cydev {
     unsigned char filler;       /* Padding to make struct = 16 bytes */
 };
 
+/* One contiguous block of an FX3 firmware image, loaded to the given RAM address. */
+struct cyusb_fx3_section {
+    unsigned int address;       /* Load address in FX3 RAM */
+    unsigned int length;        /* Length in bytes, always a multiple of 4 */
+    unsigned char *data;        /* Points into the image blob */
+};
+
+/* A parsed and validated FX3 firmware image (.img) */
+struct cyusb_fx3_image {
+    char *filename;                         /* Path the image was loaded from */
+    off_t size;                             /* File size, used to revalidate the cache */
+    time_t mtime;                           /* Modification time, used to revalidate the cache */
+    unsigned int program_entry;             /* Address the FX3 jumps to after the download */
+    unsigned int checksum;                  /* Verified checksum over all sections */
+    unsigned int total_bytes;               /* Sum of all section lengths */
+    int num_sections;
+    struct cyusb_fx3_section *sections;
+    unsigned char *blob;                    /* The whole file */
+    struct cyusb_fx3_image *next;           /* Next entry in the image cache */
+};
+
 /* Function prototypes */
 
 /*******************************************************************************************
@@ -58,11 +96,90 @@ struct cydev {
  *******************************************************************************************/
 extern void cyusb_error(int err);
 
+/*******************************************************************************************
+  Prototype    : int cyusb_ctx_open(cyusb_context **ctx);
+  Description  : Creates a new library context with its own libusb context, parses
+                 /etc/cyusb.conf and opens all devices of interest. Contexts share no state,
+                 so several of them can be used independently. A single context may be used
+                 from several threads, e.g. to download firmware to different devices in
+                 parallel.
+  Parameters   :
+                 cyusb_context **ctx : Output location of the new context. Only set on success.
+  Return Value : Number of devices of interest detected, or a negative error code.
+ *******************************************************************************************/
+extern int cyusb_ctx_open(cyusb_context **ctx);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_ctx_init(cyusb_context **ctx);
+  Description  : Creates an empty library context. Neither the configuration file is read
+                 nor are devices opened. Useful for applications which discover devices
+                 themselves, e.g. with hotplug callbacks, but want to use the image cache
+                 and the download functions.
+  Parameters   :
+                 cyusb_context **ctx : Output location of the new context. Only set on success.
+  Return Value : 0 on success, or a negative error code.
+ *******************************************************************************************/
+extern int cyusb_ctx_init(cyusb_context **ctx);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_ctx_open_vid_pid(cyusb_context **ctx, unsigned short vid,
+                     unsigned short pid);
+  Description  : Creates a new library context holding just the first device that matches
+                 the provided vendor ID and Product ID. The configuration file is not read.
+  Parameters   :
+                 cyusb_context **ctx : Output location of the new context. Only set on success.
+                 unsigned short vid  : Vendor ID
+                 unsigned short pid  : Product ID
+  Return Value : Returns 1 if a device of interest exists, else a negative error code.
+ *******************************************************************************************/
+extern int cyusb_ctx_open_vid_pid(cyusb_context **ctx, unsigned short vid, unsigned short pid);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_ctx_close(cyusb_context *ctx);
+  Description  : Closes all devices of the context, frees cached firmware images and
+                 the context itself.
+  Parameters   :
+                 cyusb_context *ctx : Context from cyusb_ctx_open(), may be NULL.
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_ctx_close(cyusb_context *ctx);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_ctx_num_devices(cyusb_context *ctx);
+  Description  : Returns the number of devices of interest held by the context.
+  Parameters   :
+                 cyusb_context *ctx : Library context
+  Return Value : Number of devices.
+ *******************************************************************************************/
+extern int cyusb_ctx_num_devices(cyusb_context *ctx);
+
+/*******************************************************************************************
+  Prototype    : cyusb_handle * cyusb_ctx_gethandle(cyusb_context *ctx, int index);
+  Description  : Returns the handle of a device of interest held by the context.
+  Parameters   :
+                 cyusb_context *ctx : Library context
+                 int index          : 0 .. cyusb_ctx_num_devices() - 1
+  Return Value : The device handle, or NULL if the index is out of range.
+ *******************************************************************************************/
+extern cyusb_handle * cyusb_ctx_gethandle(cyusb_context *ctx, int index);
+
+/*******************************************************************************************
+  Prototype    : libusb_context * cyusb_ctx_libusb(cyusb_context *ctx);
+  Description  : Returns the libusb context owned by the library context, e.g. to register
+                 hotplug callbacks or to handle events.
+  Parameters   :
+                 cyusb_context *ctx : Library context
+  Return Value : The libusb context. It is valid until cyusb_ctx_close().
+ *******************************************************************************************/
+extern libusb_context * cyusb_ctx_libusb(cyusb_context *ctx);
+
 /*******************************************************************************************
   Prototype    : int cyusb_open(void);
   Description  : This initializes the underlying libusb library, populates the cydev[]
                  array, and returns the number of devices of interest detected. A
                  'device of interest' is a device which appears in the /etc/cyusb.conf file.
+                 This is a wrapper around cyusb_ctx_open() using a process wide default
+                 context, which is what all functions without a context argument use.
   Parameters   : None
   Return Value : Returns an integer, equal to number of devices of interest detected.
  *******************************************************************************************/
@@ -405,4 +522,68 @@ extern int cyusb_download_fx2(cyusb_handle *h, char *filename, unsigned char ven
  ***************************************************************************************/
 extern int cyusb_download_fx3(cyusb_handle *h, char *filename);
 
+/****************************************************************************************
+  Prototype    : int cyusb_fx3_image_load(const char *filename, struct cyusb_fx3_image **img);
+  Description  : Reads an FX3 firmware file, splits it into sections and verifies the
+                 checksum. Parsed images are cached, so loading the same file again only
+                 costs a stat() as long as the file did not change.
+  Parameters   :
+                 const char *filename          : Path where the firmware file is stored
+                 struct cyusb_fx3_image **img  : Output location of the parsed image. The image
+                                                 is owned by the cache, do not free it.
+  Return Value : 0 on success, or a negative error code (same as cyusb_download_fx3).
+ ***************************************************************************************/
+extern int cyusb_fx3_image_load(const char *filename, struct cyusb_fx3_image **img);
+
+/****************************************************************************************
+  Prototype    : void cyusb_fx3_cache_flush(void);
+  Description  : Frees all images loaded with cyusb_fx3_image_load().
+  Parameters   : none.
+  Return Value : none.
+ ***************************************************************************************/
+extern void cyusb_fx3_cache_flush(void);
+
+/****************************************************************************************
+  Prototype    : int cyusb_download_fx3_image(cyusb_handle *h, const struct cyusb_fx3_image *img,
+                     int renum_timeout_ms);
+  Description  : Performs firmware download on FX3 from a parsed image. Up to FX3_QUEUE_DEPTH
+                 asynchronous control transfers are kept in flight. After the jump to the
+                 program entry, the function waits for the device to re-enumerate on the
+                 same port path, through hotplug or, where libusb lacks it, by polling the
+                 device list. Timings are printed. Without cyusb_open(), the device is
+                 opened once more in a temporary context for the download.
+  Parameters   :
+                 cyusb_handle *h                    : Device handle
+                 const struct cyusb_fx3_image *img  : Image from cyusb_fx3_image_load()
+                 int renum_timeout_ms               : Max. time to wait for re-enumeration,
+                                                      0 to return right after the jump.
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ***************************************************************************************/
+extern int cyusb_download_fx3_image(cyusb_handle *h, const struct cyusb_fx3_image *img, int renum_timeout_ms);
+
+/****************************************************************************************
+  Prototype    : int cyusb_ctx_fx3_image_load(cyusb_context *ctx, const char *filename,
+                     struct cyusb_fx3_image **img);
+  Description  : Same as cyusb_fx3_image_load(), but uses the image cache of the given
+                 context. The image stays valid until cyusb_ctx_close().
+ ***************************************************************************************/
+extern int cyusb_ctx_fx3_image_load(cyusb_context *ctx, const char *filename, struct cyusb_fx3_image **img);
+
+/****************************************************************************************
+  Prototype    : int cyusb_ctx_download_fx3_image(cyusb_context *ctx, cyusb_handle *h,
+                     const struct cyusb_fx3_image *img, int renum_timeout_ms);
+  Description  : Same as cyusb_download_fx3_image(), but handles events on the libusb
+                 context of the given library context. Several threads may download to
+                 different devices of the same context at once.
+ ***************************************************************************************/
+extern int cyusb_ctx_download_fx3_image(cyusb_context *ctx, cyusb_handle *h, const struct cyusb_fx3_image *img,
+                                        int renum_timeout_ms);
+
+/****************************************************************************************
+  Prototype    : int cyusb_ctx_download_fx3(cyusb_context *ctx, cyusb_handle *h,
+                     const char *filename);
+  Description  : Same as cyusb_download_fx3(), but uses the given context.
+ ***************************************************************************************/
+extern int cyusb_ctx_download_fx3(cyusb_context *ctx, cyusb_handle *h, const char *filename);
+
 #endif
@@ -0,0 +1,518 @@
+/* flexiband_info: Reads, formats and caches the Flexiband device description
+ *
+ * Reading the description takes about 45 vendor requests. They are submitted as one batch of
+ * asynchronous control transfers, so the host controller has the next request queued while
+ * the device answers the current one. See flexiband_info.h.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "flexiband_info.h"
+
+#ifdef FLEXIBAND_INFO_TRANSPORT
+// Built into the tools of libusb_example, which reach the device through their transport layer
+#include "transport.h"
+#define libusb_submit_transfer         transport_submit_transfer
+#define libusb_cancel_transfer         transport_cancel_transfer
+#define libusb_handle_events_completed transport_handle_events_completed
+#endif
+
+#define VENDOR_IN        (LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR)
+#define STANDARD_IN      (LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_STANDARD)
+#define LANGID_EN_US     0x0409
+#define REQUEST_TIMEOUT  1000
+#define MAX_REQUESTS     64
+
+#define array_len(a) (sizeof(a) / sizeof(a[0]))
+
+enum field_type { FIELD_U8, FIELD_U16, FIELD_U32, FIELD_HEX32, FIELD_STR8, FIELD_REV };
+
+struct field {
+    const char     *key;
+    unsigned char   request;
+    unsigned short  value;
+    unsigned short  value_api2;  // register on devices with the Flexiband 2 API
+    unsigned short  length;
+    enum field_type type;
+    size_t          offset;  // into flexiband_description, or flexiband_rf_board if per_slot
+    bool            per_slot;
+};
+
+#define DEVICE_FIELD(key, req, val, len, type, member) \
+    { key, req, val, val, len, type, offsetof(struct flexiband_description, member), false }
+#define FPGA_FIELD(key, val, val2, len, type, member) \
+    { key, 0x03, val, val2, len, type, offsetof(struct flexiband_description, member), false }
+#define SLOT_FIELD(key, req, val, len, type, member) \
+    { key, req, val, val, len, type, offsetof(struct flexiband_rf_board, member), true }
+
+// Documented in README.md, the RF-board EEPROM with layout 1
+static const struct field fields[] = {
+    DEVICE_FIELD("interface_rev", 0x00, 0x00, 1, FIELD_U8, interface_revision),
+    DEVICE_FIELD("fx3_build", 0x00, 0x01, 2, FIELD_U16, fx3.build),
+    DEVICE_FIELD("fx3_hash", 0x00, 0x02, 4, FIELD_HEX32, fx3.hash),
+    DEVICE_FIELD("fx3_time", 0x00, 0x03, 4, FIELD_U32, fx3.timestamp),
+    DEVICE_FIELD("base_rev", 0x02, 0x00, 1, FIELD_U8, base_revision),
+    DEVICE_FIELD("atmel_build", 0x02, 0x01, 2, FIELD_U16, atmel.build),
+    DEVICE_FIELD("atmel_hash", 0x02, 0x02, 4, FIELD_HEX32, atmel.hash),
+    DEVICE_FIELD("atmel_time", 0x02, 0x03, 4, FIELD_U32, atmel.timestamp),
+    FPGA_FIELD("fpga_build", 0x01, 0x03, 2, FIELD_U16, fpga.build),
+    FPGA_FIELD("fpga_hash", 0x02, 0x01, 4, FIELD_HEX32, fpga.hash),
+    FPGA_FIELD("fpga_time", 0x03, 0x00, 4, FIELD_U32, fpga.timestamp),
+    SLOT_FIELD("layout", 0x04, 0x00, 1, FIELD_U8, layout),
+    SLOT_FIELD("serial", 0x04, 0x01, 1, FIELD_U8, serial),
+    SLOT_FIELD("antenna", 0x04, 0x02, 1, FIELD_U8, antenna),
+    SLOT_FIELD("bandwidth", 0x04, 0x03, 1, FIELD_U8, bandwidth),
+    SLOT_FIELD("lo", 0x04, 0x04, 4, FIELD_U32, lo),
+    SLOT_FIELD("band", 0x04, 0x08, 8, FIELD_STR8, band),
+    SLOT_FIELD("dac_min", 0x04, 0x10, 1, FIELD_U8, dac_min),
+    SLOT_FIELD("dac_max", 0x04, 0x11, 1, FIELD_U8, dac_max),
+    SLOT_FIELD("dac_default", 0x04, 0x12, 1, FIELD_U8, dac_default),
+    SLOT_FIELD("ant_power_default", 0x04, 0x13, 1, FIELD_U8, ant_power_default),
+    SLOT_FIELD("revision", 0x05, 0x00, 1, FIELD_REV, revision),
+};
+
+// Indices of the build hashes in fields[], they are part of the cache key
+enum { HASH_FX3 = 2, HASH_ATMEL = 6, HASH_FPGA = 9 };
+
+// Products with the Flexiband 2 API, which moved the FPGA registers, same list as in flexiband_fpga.c
+static const unsigned short flexiband2_pids[] = {0x1026, 0x1028, 0x10a2, 0x10a4};
+
+// The callbacks run in whichever thread handles the events, so the counter is only changed
+// under the lock
+struct batch {
+    pthread_mutex_t lock;
+    int             pending;
+    int             completed;
+};
+
+struct batch_item {
+    struct batch             *batch;
+    struct flexiband_request *req;
+};
+
+static int transfer_result(const struct libusb_transfer *xfer)
+{
+    switch (xfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED: return xfer->actual_length;
+    case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+    default: return LIBUSB_ERROR_IO;
+    }
+}
+
+static void LIBUSB_CALL batch_callback(struct libusb_transfer *xfer)
+{
+    struct batch_item        *item = (struct batch_item *)xfer->user_data;
+    struct flexiband_request *req  = item->req;
+
+    req->result = transfer_result(xfer);
+    if (req->result > 0 && (req->request_type & LIBUSB_ENDPOINT_IN))
+        memcpy(req->data, libusb_control_transfer_get_data(xfer), req->result);
+    pthread_mutex_lock(&item->batch->lock);
+    if (--item->batch->pending == 0) item->batch->completed = 1;
+    pthread_mutex_unlock(&item->batch->lock);
+}
+
+int flexiband_control_batch(libusb_context *usb, libusb_device_handle *h, struct flexiband_request *reqs, int num,
+                            unsigned int timeout)
+{
+    struct libusb_transfer **xfers = (struct libusb_transfer **)calloc(num, sizeof(struct libusb_transfer *));
+    struct batch_item       *items = (struct batch_item *)calloc(num, sizeof(struct batch_item));
+    struct batch             batch;
+    int                      status = 0;
+
+    // The submitting thread holds one count until all transfers are submitted, so the batch
+    // cannot complete while the first callbacks already run elsewhere
+    pthread_mutex_init(&batch.lock, NULL);
+    batch.pending   = 1;
+    batch.completed = 0;
+
+    if (xfers == NULL || items == NULL) {
+        status = LIBUSB_ERROR_NO_MEM;
+        goto out;
+    }
+    for (int i = 0; i < num; i++) {
+        struct flexiband_request *req = &reqs[i];
+        req->result = LIBUSB_ERROR_OTHER;
+        xfers[i] = libusb_alloc_transfer(0);
+        unsigned char *buffer = (unsigned char *)calloc(1, LIBUSB_CONTROL_SETUP_SIZE + req->length);
+        if (xfers[i] == NULL || buffer == NULL) {
+            free(buffer);
+            status = LIBUSB_ERROR_NO_MEM;
+            goto out;
+        }
+        libusb_fill_control_setup(buffer, req->request_type, req->request, req->value, req->index, req->length);
+        if (!(req->request_type & LIBUSB_ENDPOINT_IN))
+            memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, req->data, req->length);
+        items[i].batch = &batch;
+        items[i].req   = req;
+        libusb_fill_control_transfer(xfers[i], h, buffer, batch_callback, &items[i], timeout);
+        xfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+
+    for (int i = 0; i < num; i++) {
+        pthread_mutex_lock(&batch.lock);
+        batch.pending++;
+        pthread_mutex_unlock(&batch.lock);
+        status = libusb_submit_transfer(xfers[i]);
+        if (status) {
+            pthread_mutex_lock(&batch.lock);
+            batch.pending--;
+            pthread_mutex_unlock(&batch.lock);
+            break;
+        }
+    }
+    pthread_mutex_lock(&batch.lock);
+    if (--batch.pending == 0) batch.completed = 1;
+    pthread_mutex_unlock(&batch.lock);
+
+    // The callbacks may run in another thread handling events on the same context
+    while (!batch.completed) {
+        int r = libusb_handle_events_completed(usb, &batch.completed);
+        if (r && r != LIBUSB_ERROR_INTERRUPTED) {
+            // Cannot leave with transfers in flight, they reference this stack frame
+            for (int i = 0; i < num; i++) libusb_cancel_transfer(xfers[i]);
+        }
+    }
+
+out:
+    for (int i = 0; xfers && i < num; i++) {
+        if (xfers[i]) libusb_free_transfer(xfers[i]);
+    }
+    free(xfers);
+    free(items);
+    pthread_mutex_destroy(&batch.lock);
+    return status;
+}
+
+static void set_request(struct flexiband_request *req, unsigned char type, unsigned char request,
+                        unsigned short value, unsigned short index, unsigned short length)
+{
+    memset(req, 0, sizeof(*req));
+    req->request_type = type;
+    req->request      = request;
+    req->value        = value;
+    req->index        = index;
+    req->length       = length;
+}
+
+static int device_descriptor(libusb_device_handle *h, struct libusb_device_descriptor *desc)
+{
+#ifdef FLEXIBAND_INFO_TRANSPORT
+    // The emulator has no libusb_device, it answers the request like a device on the wire
+    if (strcmp(transport_name(), "usb")) {
+        unsigned char data[18];
+        int len = transport_control_transfer(h, STANDARD_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_DEVICE << 8, 0,
+                                             data, sizeof(data), REQUEST_TIMEOUT);
+        if (len != (int)sizeof(data)) return len < 0 ? len : LIBUSB_ERROR_IO;
+        memset(desc, 0, sizeof(*desc));
+        desc->idProduct     = data[10] | (data[11] << 8);
+        desc->iSerialNumber = data[16];
+        return 0;
+    }
+#endif
+    return libusb_get_device_descriptor(libusb_get_device(h), desc);
+}
+
+static bool is_flexiband2(libusb_device_handle *h)
+{
+    struct libusb_device_descriptor desc;
+    if (device_descriptor(h, &desc)) return false;
+    for (unsigned i = 0; i < array_len(flexiband2_pids); i++) {
+        if (desc.idProduct == flexiband2_pids[i]) return true;
+    }
+    return false;
+}
+
+static unsigned short field_value(const struct field *f, bool api2)
+{
+    return api2 ? f->value_api2 : f->value;
+}
+
+// Queues a GET_DESCRIPTOR request for the serial number string, if the device has one
+static int add_serial_request(struct flexiband_request *req, libusb_device_handle *h)
+{
+    struct libusb_device_descriptor desc;
+    if (device_descriptor(h, &desc) || desc.iSerialNumber == 0) return 0;
+    set_request(req, STANDARD_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) | desc.iSerialNumber,
+                LANGID_EN_US, 255);
+    return 1;
+}
+
+// Converts the UTF-16LE string descriptor to ASCII, replacing everything unsuitable for a file name
+static void decode_serial(const struct flexiband_request *req, char *serial, size_t size)
+{
+    size_t pos = 0;
+    if (req->result >= 2 && req->data[1] == LIBUSB_DT_STRING) {
+        int len = req->data[0] < req->result ? req->data[0] : req->result;
+        for (int i = 2; i + 1 < len && pos < size - 1; i += 2) {
+            unsigned char c = req->data[i];
+            bool          ok = req->data[i + 1] == 0 && ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') ||
+                                                (c >= 'a' && c <= 'z') || c == '-' || c == '.');
+            serial[pos++] = ok ? c : '_';
+        }
+    }
+    serial[pos] = '\0';
+}
+
+static void store_value(void *base, const struct field *f, unsigned long value)
+{
+    unsigned char *p = (unsigned char *)base + f->offset;
+    switch (f->type) {
+    case FIELD_U8:
+    case FIELD_REV: *p = (unsigned char)value; break;
+    case FIELD_U16: *(unsigned short *)p = (unsigned short)value; break;
+    case FIELD_U32:
+    case FIELD_HEX32: *(unsigned int *)p = (unsigned int)value; break;
+    case FIELD_STR8: break;
+    }
+}
+
+static void decode_field(void *base, const struct field *f, const struct flexiband_request *req)
+{
+    if (req->result <= 0) return;
+    if (f->type == FIELD_STR8) {
+        char *s = (char *)base + f->offset;
+        memcpy(s, req->data, req->result < 8 ? req->result : 8);
+        s[8] = '\0';
+        for (char *c = s; *c; c++) {
+            if (*c <= ' ' || *c > '~') *c = '_';  // keeps the text format parseable
+        }
+        return;
+    }
+    unsigned long value = 0;
+    for (int i = 0; i < req->result; i++) value = (value << 8) | req->data[i];  // multi byte values are big endian
+    if (f->type == FIELD_REV) value = ((value >> 2) & 0x03) + 1;            // bits 2-3, zero based
+    store_value(base, f, value);
+}
+
+static bool slot_present(const struct flexiband_request *layout)
+{
+    return layout->result == 1 && layout->data[0] != 0x00 && layout->data[0] != 0xff;
+}
+
+int flexiband_read_description(libusb_context *usb, libusb_device_handle *h, struct flexiband_description *desc)
+{
+    struct flexiband_request *reqs = (struct flexiband_request *)calloc(MAX_REQUESTS, sizeof(struct flexiband_request));
+    const struct field       *req_field[MAX_REQUESTS];
+    int                       req_slot[MAX_REQUESTS];
+    int                       num = 0;
+
+    if (reqs == NULL) return LIBUSB_ERROR_NO_MEM;
+    memset(desc, 0, sizeof(*desc));
+    bool api2 = is_flexiband2(h);
+    int has_serial = add_serial_request(&reqs[num], h);
+    num += has_serial;
+    for (int slot = -1; slot < FLEXIBAND_NUM_SLOTS; slot++) {
+        for (unsigned i = 0; i < array_len(fields); i++) {
+            if (fields[i].per_slot != (slot >= 0)) continue;
+            req_field[num] = &fields[i];
+            req_slot[num]  = slot;
+            set_request(&reqs[num++], VENDOR_IN, fields[i].request, field_value(&fields[i], api2),
+                        slot < 0 ? 0 : slot, fields[i].length);
+        }
+    }
+
+    int status = flexiband_control_batch(usb, h, reqs, num, REQUEST_TIMEOUT);
+    if (status == 0) {
+        if (has_serial) decode_serial(&reqs[0], desc->usb_serial, sizeof(desc->usb_serial));
+        for (int i = has_serial; i < num; i++) {
+            int   slot = req_slot[i];
+            void *base = slot < 0 ? (void *)desc : (void *)&desc->slot[slot];
+            decode_field(base, req_field[i], &reqs[i]);
+            if (slot >= 0 && req_field[i]->value == 0x00 && req_field[i]->request == 0x04)
+                desc->slot[slot].present = slot_present(&reqs[i]);
+        }
+        // A vanished device fails every request, an old firmware only some of them
+        if (reqs[has_serial].result == LIBUSB_ERROR_NO_DEVICE) status = LIBUSB_ERROR_NO_DEVICE;
+    }
+    free(reqs);
+    return status;
+}
+
+static void cache_path(char *path, size_t size, const char *cache_dir, const struct flexiband_description *desc)
+{
+    snprintf(path, size, "%s/%s-%08x-%08x-%08x.txt", cache_dir, desc->usb_serial, desc->fx3.hash, desc->atmel.hash,
+             desc->fpga.hash);
+}
+
+static int load_cache(const char *path, struct flexiband_description *desc)
+{
+    char  text[FLEXIBAND_DESCRIPTION_LEN];
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    size_t len = fread(text, 1, sizeof(text) - 1, fp);
+    fclose(fp);
+    text[len] = '\0';
+    return flexiband_parse_description(text, desc);
+}
+
+static void save_cache(const char *cache_dir, const char *path, const struct flexiband_description *desc)
+{
+    char text[FLEXIBAND_DESCRIPTION_LEN];
+    char tmp[512];
+    int  len = flexiband_format_description(desc, text, sizeof(text));
+    if (len < 0 || len >= (int)sizeof(text)) return;
+
+    if (mkdir(cache_dir, 0755) && errno != EEXIST) return;
+    // Readers never see a partial file
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) return;
+    bool ok = fwrite(text, 1, len, fp) == (size_t)len;
+    if (fclose(fp)) ok = false;
+    if (!ok || rename(tmp, path)) unlink(tmp);
+}
+
+int flexiband_describe(libusb_context *usb, libusb_device_handle *h, const char *cache_dir,
+                       struct flexiband_description *desc)
+{
+    struct flexiband_request     probe[1 + 3 + 2 * FLEXIBAND_NUM_SLOTS];
+    struct flexiband_description key;
+    struct flexiband_description cached;
+    char                         path[512];
+    int                          num  = 0;
+    bool                         api2 = is_flexiband2(h);
+
+    if (cache_dir == NULL) cache_dir = FLEXIBAND_CACHE_DIR;
+    if (!add_serial_request(&probe[num], h)) return flexiband_read_description(usb, h, desc);
+    num++;
+
+    // The key of the cache entry, plus layout and serial of the RF boards, which can be swapped
+    set_request(&probe[num++], VENDOR_IN, fields[HASH_FX3].request, field_value(&fields[HASH_FX3], api2), 0, 4);
+    set_request(&probe[num++], VENDOR_IN, fields[HASH_ATMEL].request, field_value(&fields[HASH_ATMEL], api2), 0, 4);
+    set_request(&probe[num++], VENDOR_IN, fields[HASH_FPGA].request, field_value(&fields[HASH_FPGA], api2), 0, 4);
+    for (int slot = 0; slot < FLEXIBAND_NUM_SLOTS; slot++) {
+        set_request(&probe[num++], VENDOR_IN, 0x04, 0x00, slot, 1);
+        set_request(&probe[num++], VENDOR_IN, 0x04, 0x01, slot, 1);
+    }
+    int status = flexiband_control_batch(usb, h, probe, num, REQUEST_TIMEOUT);
+    if (status) return status;
+    if (probe[0].result == LIBUSB_ERROR_NO_DEVICE) return LIBUSB_ERROR_NO_DEVICE;
+
+    memset(&key, 0, sizeof(key));
+    decode_serial(&probe[0], key.usb_serial, sizeof(key.usb_serial));
+    if (key.usb_serial[0] == '\0') return flexiband_read_description(usb, h, desc);
+    decode_field(&key, &fields[HASH_FX3], &probe[1]);
+    decode_field(&key, &fields[HASH_ATMEL], &probe[2]);
+    decode_field(&key, &fields[HASH_FPGA], &probe[3]);
+    cache_path(path, sizeof(path), cache_dir, &key);
+
+    if (load_cache(path, &cached) == 0) {
+        bool match = true;
+        for (int slot = 0; slot < FLEXIBAND_NUM_SLOTS; slot++) {
+            const struct flexiband_request *layout = &probe[4 + 2 * slot];
+            const struct flexiband_request *serial = &probe[5 + 2 * slot];
+            if (cached.slot[slot].present != slot_present(layout)) match = false;
+            else if (cached.slot[slot].present && (serial->result != 1 || serial->data[0] != cached.slot[slot].serial))
+                match = false;
+        }
+        if (match && strcmp(cached.usb_serial, key.usb_serial) == 0) {
+            *desc = cached;
+            return 1;
+        }
+    }
+
+    status = flexiband_read_description(usb, h, desc);
+    if (status == 0) {
+        cache_path(path, sizeof(path), cache_dir, desc);
+        save_cache(cache_dir, path, desc);
+    }
+    return status;
+}
+
+static int format_fields(char *buf, size_t size, const void *base, bool per_slot)
+{
+    int pos = 0;
+    for (unsigned i = 0; i < array_len(fields) && pos < (int)size; i++) {
+        const struct field  *f = &fields[i];
+        const unsigned char *p = (const unsigned char *)base + f->offset;
+        if (f->per_slot != per_slot) continue;
+        switch (f->type) {
+        case FIELD_U8:
+        case FIELD_REV: pos += snprintf(buf + pos, size - pos, " %s=%u", f->key, *p); break;
+        case FIELD_U16: pos += snprintf(buf + pos, size - pos, " %s=%u", f->key, *(const unsigned short *)p); break;
+        case FIELD_U32: pos += snprintf(buf + pos, size - pos, " %s=%u", f->key, *(const unsigned int *)p); break;
+        case FIELD_HEX32: pos += snprintf(buf + pos, size - pos, " %s=%08x", f->key, *(const unsigned int *)p); break;
+        case FIELD_STR8: pos += snprintf(buf + pos, size - pos, " %s=%s", f->key, (const char *)p); break;
+        }
+    }
+    return pos;
+}
+
+int flexiband_format_description(const struct flexiband_description *desc, char *buf, size_t size)
+{
+    int pos = snprintf(buf, size, "device usb_serial=%s", desc->usb_serial);
+    if (pos < (int)size) pos += format_fields(buf + pos, size - pos, desc, false);
+    for (int slot = 0; slot < FLEXIBAND_NUM_SLOTS && pos < (int)size; slot++) {
+        const struct flexiband_rf_board *board = &desc->slot[slot];
+        pos += snprintf(buf + pos, size - pos, "\nslot=%d present=%d", slot, board->present);
+        if (board->present && pos < (int)size) pos += format_fields(buf + pos, size - pos, board, true);
+    }
+    if (pos < (int)size) pos += snprintf(buf + pos, size - pos, "\n");
+    return pos;
+}
+
+static void parse_pair(void *base, bool per_slot, const char *key, const char *value)
+{
+    for (unsigned i = 0; i < array_len(fields); i++) {
+        const struct field *f = &fields[i];
+        if (f->per_slot != per_slot || strcmp(f->key, key)) continue;
+        if (f->type == FIELD_STR8) {
+            snprintf((char *)base + f->offset, 9, "%s", value);
+        } else {
+            store_value(base, f, strtoul(value, NULL, f->type == FIELD_HEX32 ? 16 : 10));
+        }
+        return;
+    }
+}
+
+int flexiband_parse_description(const char *text, struct flexiband_description *desc)
+{
+    char  buf[FLEXIBAND_DESCRIPTION_LEN];
+    char *line_save, *token_save;
+    bool  found = false;
+
+    memset(desc, 0, sizeof(*desc));
+    snprintf(buf, sizeof(buf), "%s", text);
+    for (char *line = strtok_r(buf, "\n", &line_save); line; line = strtok_r(NULL, "\n", &line_save)) {
+        char *token = strtok_r(line, " ", &token_save);
+        void *base;
+        bool  per_slot;
+        if (token == NULL) continue;
+        if (strcmp(token, "device") == 0) {
+            base     = desc;
+            per_slot = false;
+            found    = true;
+        } else if (strncmp(token, "slot=", 5) == 0) {
+            int slot = atoi(token + 5);
+            if (slot < 0 || slot >= FLEXIBAND_NUM_SLOTS) continue;
+            base     = &desc->slot[slot];
+            per_slot = true;
+        } else {
+            continue;
+        }
+        while ((token = strtok_r(NULL, " ", &token_save)) != NULL) {
+            char *value = strchr(token, '=');
+            if (value == NULL) continue;
+            *value++ = '\0';
+            if (!per_slot && strcmp(token, "usb_serial") == 0)
+                snprintf(desc->usb_serial, sizeof(desc->usb_serial), "%s", value);
+            else if (per_slot && strcmp(token, "present") == 0)
+                ((struct flexiband_rf_board *)base)->present = atoi(value);
+            else
+                parse_pair(base, per_slot, token, value);
+        }
+    }
+    return found ? 0 : -1;
+}
@@ -0,0 +1,127 @@
+#ifndef __FLEXIBAND_INFO_H
+#define __FLEXIBAND_INFO_H
+
+/* Flexiband device description: build infos of FX3, Atmel and FPGA and the RF-board EEPROMs.
+ *
+ * All vendor requests are documented in README.md. The description is read with one batch of
+ * asynchronous control transfers and can be persisted in a cache directory, keyed by the USB
+ * serial number and the three build hashes.
+ *
+ * libusb_example builds flexiband_info.c with FLEXIBAND_INFO_TRANSPORT defined, so the requests
+ * go through its transport layer and work on the emulator, too.
+ */
+
+#include <stddef.h>
+#include <libusb-1.0/libusb.h>
+
+#define FLEXIBAND_NUM_SLOTS       3
+#define FLEXIBAND_DESCRIPTION_LEN 2048
+#define FLEXIBAND_CACHE_DIR       "/var/cache/flexiband"
+
+/* One control request of a batch, see flexiband_control_batch() */
+struct flexiband_request {
+    unsigned char  request_type;  /* bmRequestType                                 */
+    unsigned char  request;       /* bRequest                                      */
+    unsigned short value;         /* wValue                                        */
+    unsigned short index;         /* wIndex                                        */
+    unsigned short length;        /* wLength, at most 255                          */
+    unsigned char  data[255];     /* Data stage                                    */
+    int            result;        /* Bytes transferred or a negative LIBUSB_ERROR  */
+};
+
+struct flexiband_build_info {
+    unsigned short build;      /* Jenkins build number                */
+    unsigned int   hash;       /* First eight hex digits of git hash  */
+    unsigned int   timestamp;  /* Seconds since 01.01.2000            */
+};
+
+struct flexiband_rf_board {
+    int            present;            /* EEPROM answered with a known layout        */
+    unsigned char  layout;             /* EEPROM layout ID, 1 is documented          */
+    unsigned char  serial;
+    unsigned char  antenna;
+    unsigned char  bandwidth;
+    unsigned int   lo;                 /* LO frequency                               */
+    char           band[9];            /* Band name, zero terminated                 */
+    unsigned char  dac_min;
+    unsigned char  dac_max;
+    unsigned char  dac_default;
+    unsigned char  ant_power_default;
+    unsigned char  revision;           /* Board revision, one based                  */
+};
+
+struct flexiband_description {
+    char                        usb_serial[64];   /* Empty if the device has none  */
+    unsigned char               interface_revision;
+    unsigned char               base_revision;
+    struct flexiband_build_info fx3;
+    struct flexiband_build_info atmel;
+    struct flexiband_build_info fpga;
+    struct flexiband_rf_board   slot[FLEXIBAND_NUM_SLOTS];
+};
+
+/****************************************************************************************
+  Prototype    : int flexiband_control_batch(libusb_context *usb, libusb_device_handle *h,
+                     struct flexiband_request *reqs, int num, unsigned int timeout);
+  Description  : Submits all requests as asynchronous control transfers at once and waits
+                 until all of them completed. EP0 still executes them one after the other,
+                 but without a round trip through the application between two requests.
+                 Other threads may handle events on the same libusb context.
+  Parameters   :
+                 libusb_context *usb             : Context the handle belongs to
+                 libusb_device_handle *h         : Device handle
+                 struct flexiband_request *reqs  : Requests, result is set for each
+                 int num                         : Number of requests
+                 unsigned int timeout            : Timeout per request in ms
+  Return Value : 0 if all requests were submitted, or an appropriate LIBUSB_ERROR.
+                 Failures of single requests are reported in their result.
+ ***************************************************************************************/
+extern int flexiband_control_batch(libusb_context *usb, libusb_device_handle *h, struct flexiband_request *reqs,
+                                   int num, unsigned int timeout);
+
+/****************************************************************************************
+  Prototype    : int flexiband_read_description(libusb_context *usb, libusb_device_handle *h,
+                     struct flexiband_description *desc);
+  Description  : Reads the complete description with a single batch of control transfers.
+                 Values a firmware does not support are left zero.
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ***************************************************************************************/
+extern int flexiband_read_description(libusb_context *usb, libusb_device_handle *h,
+                                      struct flexiband_description *desc);
+
+/****************************************************************************************
+  Prototype    : int flexiband_describe(libusb_context *usb, libusb_device_handle *h,
+                     const char *cache_dir, struct flexiband_description *desc);
+  Description  : Returns the description from the cache if possible. A small probe batch
+                 reads the USB serial number, the build hashes and the RF-board serials;
+                 if the cache holds a matching entry, nothing else is read. Otherwise the
+                 full description is read and stored in the cache. Devices without USB
+                 serial number are never cached.
+  Parameters   :
+                 const char *cache_dir : Cache directory, NULL for FLEXIBAND_CACHE_DIR.
+                                         Errors while writing the cache are ignored.
+  Return Value : 1 if the description was taken from the cache, 0 if it was read from the
+                 device, or an appropriate LIBUSB_ERROR.
+ ***************************************************************************************/
+extern int flexiband_describe(libusb_context *usb, libusb_device_handle *h, const char *cache_dir,
+                              struct flexiband_description *desc);
+
+/****************************************************************************************
+  Prototype    : int flexiband_format_description(const struct flexiband_description *desc,
+                     char *buf, size_t size);
+  Description  : Formats the description as text: a "device" line followed by one line per
+                 RF slot, each with space separated key=value pairs. This is the format of
+                 the cache files and of the INFO reply of flexibandd.
+  Return Value : Length of the text, like snprintf().
+ ***************************************************************************************/
+extern int flexiband_format_description(const struct flexiband_description *desc, char *buf, size_t size);
+
+/****************************************************************************************
+  Prototype    : int flexiband_parse_description(const char *text,
+                     struct flexiband_description *desc);
+  Description  : Parses text from flexiband_format_description(). Unknown keys are ignored.
+  Return Value : 0 on success, -1 if the text contains no device line.
+ ***************************************************************************************/
+extern int flexiband_parse_description(const char *text, struct flexiband_description *desc);
+
+#endif
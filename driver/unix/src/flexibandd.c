@@ -0,0 +1,818 @@
+/* flexibandd: Flexiband device manager daemon
+ *
+ * Replaces the RUN scripts of the udev rules. FX3 firmware and FPGA bitstreams are loaded
+ * from libusb hotplug callbacks as soon as devices appear. Ready devices are kept open and
+ * configured, their description is read once, and clients get them handed over through a
+ * unix socket (see flexibandd.h), so a capture can start right after the request.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <grp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "cyusb.h"
+#include "flexiband_info.h"
+#include "flexibandd.h"
+
+#define VID                0x27ae
+#define INTERFACE          0
+#define CONFIGURATION      1
+#define ALT_INTERFACE_FPGA 4
+#define ENDPOINT_FPGA      0x03
+#define MAX_ENTRIES        64
+#define MAX_CLIENTS        32
+#define INFO_LEN           FLEXIBAND_DESCRIPTION_LEN
+#define MAX_CFG_LINE_LEN   512
+
+// FPGA states, see flexiband_fpga.c
+#define FPGA_STATE_BUSY       0x10
+#define FPGA_STATE_FLASH_BUSY 0x11
+#define FPGA_STATE_IDLE       0xF0
+
+enum bitstream_method { BITSTREAM_JTAG, BITSTREAM_ALT };
+
+struct pid_entry {
+    unsigned short pid;
+    int            method;  // only used for bitstreams
+    char           path[256];
+};
+
+struct config {
+    char             socket_path[108];
+    char             cache_dir[256];
+    struct pid_entry firmware[MAX_ENTRIES];
+    int              num_firmware;
+    struct pid_entry bitstream[MAX_ENTRIES];
+    int              num_bitstream;
+    unsigned short   devices[MAX_ENTRIES];
+    int              num_devices;
+};
+
+enum device_state { DEVICE_LOADING, DEVICE_READY, DEVICE_FAILED };
+static const char *state_names[] = {"loading", "ready", "failed"};
+
+struct device {
+    int               id;
+    int               busnum;
+    int               devaddr;
+    unsigned short    vid;
+    unsigned short    pid;
+    cyusb_handle     *h;
+    enum device_state state;
+    int               owner;  // client socket the device is reserved for, -1 if free
+    char              info[INFO_LEN];
+    struct device    *next;
+};
+
+struct job {
+    libusb_hotplug_event event;
+    libusb_device       *dev;
+    struct job          *next;
+};
+
+struct bitstream {
+    char              path[256];
+    unsigned char    *data;
+    long              size;
+    struct bitstream *next;
+};
+
+struct client {
+    int  fd;
+    bool watch;
+    char buf[FLEXIBANDD_LINE_LEN];
+    int  len;
+};
+
+static volatile sig_atomic_t do_exit = false;
+
+static struct config   config;
+static cyusb_context  *ctx;
+static libusb_context *usb;
+
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct device  *devices;
+static int             next_id;
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct job     *jobs;
+static struct job    **jobs_tail = &jobs;
+
+static struct bitstream *bitstreams;  // only touched by the worker thread
+
+// The worker thread reports device changes through this pipe to the socket server
+static int notify_pipe[2] = {-1, -1};
+
+static const uint8_t VENDOR_IN  = LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR;
+static const uint8_t VENDOR_OUT = LIBUSB_ENDPOINT_OUT | LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR;
+
+static void sighandler(int signum) { do_exit = true; }
+
+static void log_msg(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    fflush(stdout);
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void notify(const char *fmt, ...)
+{
+    char    line[FLEXIBANDD_LINE_LEN];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if (len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+    line[len++] = '\n';
+    if (write(notify_pipe[1], line, len) != len) log_msg("Lost notification: %.*s", len - 1, line);
+}
+
+/* Configuration file, same style as /etc/cyusb.conf:
+ *
+ *   Socket=/run/flexibandd.sock
+ *   CacheDir=/var/cache/flexiband
+ *   <Firmware>   <pid> <image>               </Firmware>
+ *   <Bitstream>  <pid> <jtag|alt> <bitfile>  </Bitstream>
+ *   <Devices>    <pid> ...                   </Devices>
+ */
+static int parse_config(const char *filename)
+{
+    char  line[MAX_CFG_LINE_LEN];
+    char *save;
+    char  section[32] = "";
+    FILE *fp          = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Open config %s\n%s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    snprintf(config.socket_path, sizeof(config.socket_path), "%s", FLEXIBANDD_SOCKET);
+    snprintf(config.cache_dir, sizeof(config.cache_dir), "%s", FLEXIBAND_CACHE_DIR);
+    while (fgets(line, sizeof(line), fp)) {
+        char *tok = strtok_r(line, " =\t\n", &save);
+        if (tok == NULL || tok[0] == '#') continue;
+
+        if (tok[0] == '<') {
+            snprintf(section, sizeof(section), "%s", tok[1] == '/' ? "" : tok);
+        } else if (!strcmp(tok, "Socket")) {
+            tok = strtok_r(NULL, " \t\n", &save);
+            if (tok) snprintf(config.socket_path, sizeof(config.socket_path), "%s", tok);
+        } else if (!strcmp(tok, "CacheDir")) {
+            tok = strtok_r(NULL, " \t\n", &save);
+            if (tok) snprintf(config.cache_dir, sizeof(config.cache_dir), "%s", tok);
+        } else if (!strcmp(section, "<Firmware>") && config.num_firmware < MAX_ENTRIES) {
+            struct pid_entry *e = &config.firmware[config.num_firmware];
+            char             *path = strtok_r(NULL, " \t\n", &save);
+            if (path == NULL) continue;
+            e->pid = strtol(tok, NULL, 16);
+            snprintf(e->path, sizeof(e->path), "%s", path);
+            config.num_firmware++;
+        } else if (!strcmp(section, "<Bitstream>") && config.num_bitstream < MAX_ENTRIES) {
+            struct pid_entry *e      = &config.bitstream[config.num_bitstream];
+            char             *method = strtok_r(NULL, " \t\n", &save);
+            char             *path   = strtok_r(NULL, " \t\n", &save);
+            if (method == NULL || path == NULL) continue;
+            e->pid    = strtol(tok, NULL, 16);
+            e->method = strcmp(method, "alt") ? BITSTREAM_JTAG : BITSTREAM_ALT;
+            snprintf(e->path, sizeof(e->path), "%s", path);
+            config.num_bitstream++;
+        } else if (!strcmp(section, "<Devices>")) {
+            for (; tok != NULL && config.num_devices < MAX_ENTRIES; tok = strtok_r(NULL, " \t\n", &save))
+                config.devices[config.num_devices++] = strtol(tok, NULL, 16);
+        } else {
+            fprintf(stderr, "Error in config file %s: %s\n", filename, tok);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static const struct pid_entry *find_entry(const struct pid_entry *entries, int num, unsigned short pid)
+{
+    for (int i = 0; i < num; i++) {
+        if (entries[i].pid == pid) return &entries[i];
+    }
+    return NULL;
+}
+
+static bool is_managed(unsigned short pid)
+{
+    for (int i = 0; i < config.num_devices; i++) {
+        if (config.devices[i] == pid) return true;
+    }
+    return false;
+}
+
+static unsigned char reverse(unsigned char b)
+{
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+// Bitstreams are read once and kept in memory, already bit reversed for the alt interface
+static const struct bitstream *load_bitstream_file(const struct pid_entry *entry)
+{
+    struct bitstream *bs;
+    for (bs = bitstreams; bs != NULL; bs = bs->next) {
+        if (!strcmp(bs->path, entry->path)) return bs;
+    }
+
+    FILE *fp = fopen(entry->path, "rb");
+    if (fp == NULL) {
+        log_msg("Error: Open file %s: %s", entry->path, strerror(errno));
+        return NULL;
+    }
+    bs = (struct bitstream *)calloc(1, sizeof(*bs));
+    fseek(fp, 0L, SEEK_END);
+    bs->size = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+    bs->data = (unsigned char *)malloc(bs->size);
+    if (bs->data == NULL || fread(bs->data, 1, bs->size, fp) != (size_t)bs->size) {
+        log_msg("Error: Read file %s", entry->path);
+        fclose(fp);
+        free(bs->data);
+        free(bs);
+        return NULL;
+    }
+    fclose(fp);
+    if (entry->method == BITSTREAM_ALT) {
+        for (long i = 0; i < bs->size; i++) bs->data[i] = reverse(bs->data[i]);
+    }
+    snprintf(bs->path, sizeof(bs->path), "%s", entry->path);
+    bs->next   = bitstreams;
+    bitstreams = bs;
+    return bs;
+}
+
+static int wait_fpga_ready(cyusb_handle *h)
+{
+    uint8_t fpga_state = FPGA_STATE_FLASH_BUSY;
+    for (int t = 0; t < 60000 / 10 && !do_exit; t++) {
+        int status = libusb_control_transfer(h, VENDOR_IN, 0x00, 0x05, 0x00, &fpga_state, sizeof(fpga_state), 1000);
+        if (status < 0) return status;
+        if (fpga_state == FPGA_STATE_BUSY || fpga_state >= FPGA_STATE_IDLE) return 0;
+        if (fpga_state != FPGA_STATE_FLASH_BUSY) return LIBUSB_ERROR_IO;
+        usleep(10000);
+    }
+    return LIBUSB_ERROR_TIMEOUT;
+}
+
+static int load_bitstream(struct device *d, const struct pid_entry *entry)
+{
+    int                     status = 0;
+    struct timespec         start;
+    const struct bitstream *bs = load_bitstream_file(entry);
+    if (bs == NULL) return LIBUSB_ERROR_NOT_FOUND;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (entry->method == BITSTREAM_ALT) {
+        status = libusb_claim_interface(d->h, INTERFACE);
+        if (status) return status;
+        status = libusb_set_interface_alt_setting(d->h, INTERFACE, ALT_INTERFACE_FPGA);
+        if (status == 0) {
+            int transferred = 0;
+            status = libusb_bulk_transfer(d->h, ENDPOINT_FPGA, bs->data, bs->size, &transferred, 5000);
+        }
+        if (status == 0) status = wait_fpga_ready(d->h);
+        libusb_release_interface(d->h, INTERFACE);
+    } else {
+        const unsigned ep0_buf_size = 512;
+        unsigned       page         = 0;
+        for (long pos = 0; pos < bs->size && status >= 0; pos += ep0_buf_size, page++) {
+            unsigned len = bs->size - pos < ep0_buf_size ? bs->size - pos : ep0_buf_size;
+            status = libusb_control_transfer(d->h, VENDOR_OUT, 0x00, 0xff00, page, bs->data + pos, len, 1000);
+        }
+        if (status >= 0) status = libusb_control_transfer(d->h, VENDOR_OUT, 0x00, 0xff00, 0xffff, NULL, 0, 1000);
+        if (status >= 0) status = wait_fpga_ready(d->h);
+    }
+    if (status) return status;
+    log_msg("[%d-%d] Bitstream %s loaded in %.1f ms", d->busnum, d->devaddr, entry->path, elapsed_ms(&start));
+    return 0;
+}
+
+// Takes the description from the cache if the device is known, otherwise reads it in one batch
+static void read_info(struct device *d)
+{
+    struct flexiband_description desc;
+    struct timespec              start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = flexiband_describe(usb, d->h, config.cache_dir, &desc);
+    if (status < 0) {
+        log_msg("[%d-%d] Read description: %s", d->busnum, d->devaddr, libusb_error_name(status));
+        d->info[0] = '\0';
+        return;
+    }
+    flexiband_format_description(&desc, d->info, INFO_LEN);
+    log_msg("[%d-%d] Description %s in %.1f ms", d->busnum, d->devaddr, status ? "cached" : "read",
+            elapsed_ms(&start));
+}
+
+static int load_firmware(libusb_device *dev, const struct pid_entry *entry)
+{
+    struct cyusb_fx3_image *img;
+    cyusb_handle           *h;
+    int                     status = libusb_open(dev, &h);
+    if (status) return status;
+    status = cyusb_ctx_fx3_image_load(ctx, entry->path, &img);
+    // The re-enumerated device is reported by our own hotplug callback, no need to wait for it
+    if (status == 0) status = cyusb_ctx_download_fx3_image(ctx, h, img, 0);
+    libusb_close(h);
+    return status;
+}
+
+// Clients get a usbfs descriptor of their own. A duplicate of the one behind d->h would share
+// its open file description, and the event thread of the daemon would reap the client's URBs.
+static int open_usbfs(const struct device *d)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", d->busnum, d->devaddr);
+    return open(path, O_RDWR | O_CLOEXEC);
+}
+
+static void setup_device(libusb_device *dev, const struct libusb_device_descriptor *desc)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct device *d = (struct device *)calloc(1, sizeof(struct device));
+    if (d == NULL) return;
+    d->busnum  = libusb_get_bus_number(dev);
+    d->devaddr = libusb_get_device_address(dev);
+    d->vid     = desc->idVendor;
+    d->pid     = desc->idProduct;
+    d->owner   = -1;
+    d->state   = DEVICE_LOADING;
+
+    int status = libusb_open(dev, &d->h);
+    if (status) {
+        log_msg("[%d-%d] Open: %s", d->busnum, d->devaddr, libusb_error_name(status));
+        free(d);
+        return;
+    }
+    pthread_mutex_lock(&devices_lock);
+    d->id   = next_id++;
+    d->next = devices;
+    devices = d;
+    pthread_mutex_unlock(&devices_lock);
+
+    if (libusb_kernel_driver_active(d->h, INTERFACE) == 1) libusb_detach_kernel_driver(d->h, INTERFACE);
+    status = libusb_set_configuration(d->h, CONFIGURATION);
+    if (status == 0) {
+        const struct pid_entry *bs = find_entry(config.bitstream, config.num_bitstream, d->pid);
+        if (bs) status = load_bitstream(d, bs);
+    }
+    if (status == 0) read_info(d);
+
+    pthread_mutex_lock(&devices_lock);
+    d->state = status ? DEVICE_FAILED : DEVICE_READY;
+    pthread_mutex_unlock(&devices_lock);
+    if (status) {
+        log_msg("[%d-%d] Setup failed: %s", d->busnum, d->devaddr, libusb_error_name(status));
+        return;
+    }
+    log_msg("[%d-%d] Device %d (%04x:%04x) ready after %.1f ms", d->busnum, d->devaddr, d->id, d->vid, d->pid,
+            elapsed_ms(&start));
+    notify("ADDED %d %04x:%04x", d->id, d->vid, d->pid);
+}
+
+static void free_device(struct device *d)
+{
+    libusb_close(d->h);
+    free(d);
+}
+
+static void device_left(libusb_device *dev)
+{
+    int             busnum  = libusb_get_bus_number(dev);
+    int             devaddr = libusb_get_device_address(dev);
+    struct device  *found   = NULL;
+    struct device **it;
+
+    pthread_mutex_lock(&devices_lock);
+    for (it = &devices; *it != NULL; it = &(*it)->next) {
+        if ((*it)->busnum == busnum && (*it)->devaddr == devaddr) {
+            found = *it;
+            *it   = found->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&devices_lock);
+    if (found == NULL) return;
+
+    log_msg("[%d-%d] Device %d removed", busnum, devaddr, found->id);
+    notify("REMOVED %d", found->id);
+    free_device(found);
+}
+
+static void device_arrived(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    struct timespec                 start;
+    if (libusb_get_device_descriptor(dev, &desc)) return;
+
+    const struct pid_entry *fw = find_entry(config.firmware, config.num_firmware, desc.idProduct);
+    if (fw) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int status = load_firmware(dev, fw);
+        log_msg("[%d-%d] Firmware %s %s after %.1f ms", libusb_get_bus_number(dev), libusb_get_device_address(dev),
+                fw->path, status ? "failed" : "loaded", elapsed_ms(&start));
+    } else if (is_managed(desc.idProduct)) {
+        setup_device(dev, &desc);
+    }
+}
+
+// Hotplug callbacks must not do I/O, so events are only queued for the worker thread
+static int LIBUSB_CALL hotplug_callback(libusb_context *usb_ctx, libusb_device *dev, libusb_hotplug_event event,
+                                        void *user_data)
+{
+    struct job *job = (struct job *)malloc(sizeof(struct job));
+    if (job == NULL) return 0;
+    job->event = event;
+    job->dev   = libusb_ref_device(dev);
+    job->next  = NULL;
+    pthread_mutex_lock(&jobs_lock);
+    *jobs_tail = job;
+    jobs_tail  = &job->next;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+    return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+    while (true) {
+        pthread_mutex_lock(&jobs_lock);
+        while (jobs == NULL && !do_exit) pthread_cond_wait(&jobs_cond, &jobs_lock);
+        struct job *job = jobs;
+        if (job) {
+            jobs = job->next;
+            if (jobs == NULL) jobs_tail = &jobs;
+        }
+        pthread_mutex_unlock(&jobs_lock);
+        if (job == NULL) break;
+
+        if (job->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) device_arrived(job->dev);
+        else device_left(job->dev);
+        libusb_unref_device(job->dev);
+        free(job);
+    }
+    return NULL;
+}
+
+static void *event_thread(void *arg)
+{
+    while (!do_exit) {
+        struct timeval tv = {0, 200000};
+        libusb_handle_events_timeout_completed(usb, &tv, NULL);
+    }
+    return NULL;
+}
+
+static int send_fd(int sock, const char *line, int fd)
+{
+    struct iovec  iov = {(void *)line, strlen(line)};
+    struct msghdr msg;
+    char          cbuf[CMSG_SPACE(sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level     = SOL_SOCKET;
+    cmsg->cmsg_type      = SCM_RIGHTS;
+    cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// Replies are formatted while devices_lock is held and sent after releasing it, so a client
+// that does not read cannot stall the hotplug handling
+struct reply {
+    char  *data;
+    size_t len;
+    size_t size;
+};
+
+static void reply(struct reply *r, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len <= 0) return;
+    if (r->len + len + 1 > r->size) {
+        size_t size = (r->len + len + 1) * 2;
+        char  *data = (char *)realloc(r->data, size);
+        if (data == NULL) return;
+        r->data = data;
+        r->size = size;
+    }
+    va_start(ap, fmt);
+    vsnprintf(r->data + r->len, len + 1, fmt, ap);
+    va_end(ap);
+    r->len += len;
+}
+
+static void send_reply(int sock, struct reply *r)
+{
+    for (size_t pos = 0; pos < r->len;) {
+        ssize_t sent = send(sock, r->data + pos, r->len - pos, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) break;
+        pos += sent;
+    }
+    free(r->data);
+}
+
+static struct device *find_device(int id)
+{
+    for (struct device *d = devices; d != NULL; d = d->next) {
+        if (d->id == id) return d;
+    }
+    return NULL;
+}
+
+static void handle_request(struct client *c, char *line)
+{
+    char *save;
+    char *cmd = strtok_r(line, " \t\r\n", &save);
+    char *arg = strtok_r(NULL, " \t\r\n", &save);
+    if (cmd == NULL) return;
+
+    struct reply r       = {NULL, 0, 0};
+    int          open_id = -1;
+    int          open_fd = -1;
+    char         ok[64];
+    pthread_mutex_lock(&devices_lock);
+    if (!strcmp(cmd, "LIST")) {
+        for (struct device *d = devices; d != NULL; d = d->next) {
+            reply(&r, "%d %d %d %04x:%04x %s %s\n", d->id, d->busnum, d->devaddr, d->vid, d->pid,
+                  state_names[d->state], d->owner < 0 ? "free" : "busy");
+        }
+        reply(&r, ".\n");
+    } else if (!strcmp(cmd, "INFO") && arg) {
+        struct device *d = find_device(atoi(arg));
+        if (d && d->state == DEVICE_READY) reply(&r, "%s", d->info);
+        reply(&r, ".\n");
+    } else if (!strcmp(cmd, "OPEN")) {
+        struct device *d = arg ? find_device(atoi(arg)) : NULL;
+        if (arg == NULL) {
+            for (d = devices; d != NULL && (d->state != DEVICE_READY || d->owner >= 0); d = d->next) {}
+        }
+        if (d == NULL || d->state != DEVICE_READY) {
+            reply(&r, "ERR no ready device\n");
+        } else if (d->owner >= 0) {
+            reply(&r, "ERR busy\n");
+        } else if ((open_fd = open_usbfs(d)) < 0) {
+            reply(&r, "ERR open %s\n", strerror(errno));
+        } else {
+            // Reserved now, the descriptor is sent after releasing the lock
+            snprintf(ok, sizeof(ok), "OK %d %04x %04x\n", d->id, d->vid, d->pid);
+            d->owner = c->fd;
+            open_id  = d->id;
+        }
+    } else if (!strcmp(cmd, "RELEASE") && arg) {
+        struct device *d = find_device(atoi(arg));
+        if (d && d->owner == c->fd) {
+            d->owner = -1;
+            reply(&r, "OK\n");
+        } else {
+            reply(&r, "ERR not owner\n");
+        }
+    } else if (!strcmp(cmd, "WATCH")) {
+        c->watch = true;
+    } else {
+        reply(&r, "ERR unknown request\n");
+    }
+    pthread_mutex_unlock(&devices_lock);
+
+    send_reply(c->fd, &r);
+    if (open_fd >= 0) {
+        if (send_fd(c->fd, ok, open_fd)) {
+            pthread_mutex_lock(&devices_lock);
+            struct device *d = find_device(open_id);
+            if (d && d->owner == c->fd) d->owner = -1;
+            pthread_mutex_unlock(&devices_lock);
+        }
+        close(open_fd);
+    }
+}
+
+static void drop_client(struct client *c)
+{
+    pthread_mutex_lock(&devices_lock);
+    for (struct device *d = devices; d != NULL; d = d->next) {
+        if (d->owner == c->fd) d->owner = -1;
+    }
+    pthread_mutex_unlock(&devices_lock);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 8)) {
+        close(sock);
+        return -1;
+    }
+    // Same access rules as for the devices themselves, see the udev rules
+    struct group *grp = getgrnam("plugdev");
+    if (grp) chown(path, -1, grp->gr_gid);
+    chmod(path, 0660);
+    return sock;
+}
+
+// Serves clients until exit. Device changes arrive through notify_pipe.
+static void serve(int sock)
+{
+    struct client clients[MAX_CLIENTS];
+    for (int i = 0; i < MAX_CLIENTS; i++) clients[i].fd = -1;
+
+    while (!do_exit) {
+        struct pollfd fds[MAX_CLIENTS + 2];
+        fds[0].fd     = sock;
+        fds[0].events = POLLIN;
+        fds[1].fd     = notify_pipe[0];
+        fds[1].events = POLLIN;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            fds[i + 2].fd     = clients[i].fd;
+            fds[i + 2].events = POLLIN;
+        }
+        if (poll(fds, MAX_CLIENTS + 2, 500) <= 0) continue;
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(sock, NULL, NULL);
+            int i;
+            for (i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; i++) {}
+            if (i == MAX_CLIENTS) {
+                if (fd >= 0) close(fd);
+            } else if (fd >= 0) {
+                clients[i].fd    = fd;
+                clients[i].watch = false;
+                clients[i].len   = 0;
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            char    buf[FLEXIBANDD_LINE_LEN * 4];
+            ssize_t len = read(notify_pipe[0], buf, sizeof(buf));
+            for (int i = 0; i < MAX_CLIENTS && len > 0; i++) {
+                if (clients[i].fd >= 0 && clients[i].watch) send(clients[i].fd, buf, len, MSG_NOSIGNAL);
+            }
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            struct client *c = &clients[i];
+            if (c->fd < 0 || !(fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            ssize_t len = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+            if (len <= 0) {
+                drop_client(c);
+                continue;
+            }
+            c->len += len;
+            c->buf[c->len] = '\0';
+            char *nl;
+            while ((nl = strchr(c->buf, '\n')) != NULL) {
+                *nl = '\0';
+                handle_request(c, c->buf);
+                c->len -= nl + 1 - c->buf;
+                memmove(c->buf, nl + 1, c->len + 1);
+            }
+            if (c->len == (int)sizeof(c->buf) - 1) drop_client(c);  // line too long
+        }
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) close(clients[i].fd);
+    }
+}
+
+static void print_usage(const char *program_name)
+{
+    printf("Usage: %s [-c <config>]\n", program_name);
+    printf("  -c  Configuration file (default %s)\n", FLEXIBANDD_CONFIG);
+}
+
+int main(int argc, char *argv[])
+{
+    const char                   *config_file = FLEXIBANDD_CONFIG;
+    libusb_hotplug_callback_handle cb_handle;
+    pthread_t                      worker, events;
+    int                            opt;
+    int                            sock;
+    int                            status;
+
+    while ((opt = getopt(argc, argv, "hc:")) != -1) {
+        switch (opt) {
+        case 'c': config_file = optarg; break;
+        default: print_usage(argv[0]); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (parse_config(config_file)) return EXIT_FAILURE;
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+    signal(SIGQUIT, sighandler);
+
+    status = cyusb_ctx_init(&ctx);
+    if (status) {
+        fprintf(stderr, "Error: Init library\n");
+        return EXIT_FAILURE;
+    }
+    usb = cyusb_ctx_libusb(ctx);
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        fprintf(stderr, "Error: libusb has no hotplug support on this platform\n");
+        goto err_ctx;
+    }
+
+    // Parse all firmware images up front, so a bootloader device only costs the download
+    for (int i = 0; i < config.num_firmware; i++) {
+        struct cyusb_fx3_image *img;
+        if (cyusb_ctx_fx3_image_load(ctx, config.firmware[i].path, &img))
+            log_msg("Warning: Cannot load firmware %s", config.firmware[i].path);
+    }
+
+    if (pipe(notify_pipe)) goto err_ctx;
+    fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK);
+    sock = open_socket(config.socket_path);
+    if (sock < 0) {
+        fprintf(stderr, "Error: Open socket %s\n%s\n", config.socket_path, strerror(errno));
+        goto err_pipe;
+    }
+
+    pthread_create(&worker, NULL, worker_thread, NULL);
+    // With LIBUSB_HOTPLUG_ENUMERATE, devices present at startup are reported as arrivals
+    status = libusb_hotplug_register_callback(usb,
+                                              (libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                                                     LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                                              LIBUSB_HOTPLUG_ENUMERATE, VID, LIBUSB_HOTPLUG_MATCH_ANY,
+                                              LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &cb_handle);
+    if (status) {
+        fprintf(stderr, "Error: Register hotplug callback\n%s\n", libusb_error_name(status));
+        do_exit = true;
+    } else {
+        pthread_create(&events, NULL, event_thread, NULL);
+        log_msg("Listening on %s", config.socket_path);
+        serve(sock);
+        pthread_join(events, NULL);
+        libusb_hotplug_deregister_callback(usb, cb_handle);
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    do_exit = true;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+    pthread_join(worker, NULL);
+
+    while (devices) {
+        struct device *next = devices->next;
+        free_device(devices);
+        devices = next;
+    }
+    close(sock);
+    unlink(config.socket_path);
+err_pipe:
+    close(notify_pipe[0]);
+    close(notify_pipe[1]);
+err_ctx:
+    cyusb_ctx_close(ctx);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
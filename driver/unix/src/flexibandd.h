@@ -0,0 +1,26 @@
+#ifndef __FLEXIBANDD_H
+#define __FLEXIBANDD_H
+
+/* Protocol of the Flexiband device manager daemon 'flexibandd'.
+ *
+ * Clients connect to a unix stream socket and send one request per line. Replies are lines
+ * as well; multi line replies are terminated by a line containing a single '.'.
+ *
+ *   LIST            One line per device: "<id> <bus> <addr> <vid>:<pid> <state> <free|busy>"
+ *   INFO <id>       Cached description of the device, see flexiband_format_description().
+ *   OPEN [<id>]     Hands over the first free ready device (or the given one):
+ *                   "OK <id> <vid> <pid>" with a usbfs file descriptor of its own attached
+ *                   as SCM_RIGHTS ancillary data, or "ERR <reason>". The device is configured,
+ *                   the interface is not claimed. Wrap the descriptor with
+ *                   libusb_wrap_sys_device(). It stays reserved for the client until it
+ *                   sends RELEASE or closes the connection.
+ *   RELEASE <id>    Gives a device back: "OK" or "ERR <reason>".
+ *   WATCH           Turns the connection into an event stream:
+ *                   "ADDED <id> <vid>:<pid>" and "REMOVED <id>" lines.
+ */
+
+#define FLEXIBANDD_SOCKET   "/run/flexibandd.sock"
+#define FLEXIBANDD_CONFIG   "/etc/flexibandd.conf"
+#define FLEXIBANDD_LINE_LEN 256
+
+#endif
@@ -12,6 +12,7 @@
 #include "cyusb.h"
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,10 +22,11 @@
 
 /********** Cut and paste the following & modify as required  **********/
 static const char         *program_name;
-static const char *const   short_options  = "hvf:d:b:";
+static const char *const   short_options  = "hvaf:d:b:";
 static const struct option long_options[] = {{"help", 0, NULL, 'h'}, {"version", 0, NULL, 'v'},
-                                             {"file", 1, NULL, 'f'}, {"device", 1, NULL, 'd'},
-                                             {"bus", 1, NULL, 'b'},  {NULL, 0, NULL, 0}};
+                                             {"all", 0, NULL, 'a'},  {"file", 1, NULL, 'f'},
+                                             {"device", 1, NULL, 'd'}, {"bus", 1, NULL, 'b'},
+                                             {NULL, 0, NULL, 0}};
 
 static int next_option;
 
@@ -33,6 +35,7 @@ static void print_usage(FILE *stream, int exit_code)
     fprintf(stream, "Usage: %s [options] [filename]\n", program_name);
     fprintf(stream, "  -h  --help      Display this usage information.\n"
                     "  -v  --version   Print version.\n"
+                    "  -a  --all       Download to all devices in parallel.\n"
                     "  -f  --file      firmware file name (.hex) format\n"
                     "  -b  --bus       Bus number of target device.\n"
                     "  -d  --dev       Device number of target device.\n");
@@ -43,6 +46,69 @@ static void print_usage(FILE *stream, int exit_code)
 static char *filename = NULL;
 static int   busnum   = -1;
 static int   devnum   = -1;
+static int   all      = 0;
+
+struct download_job {
+    cyusb_context *ctx;
+    cyusb_handle  *h;
+    pthread_t      thread;
+    int            status;
+};
+
+static void *download_thread(void *arg)
+{
+    struct download_job *job = (struct download_job *)arg;
+    job->status              = cyusb_ctx_download_fx3(job->ctx, job->h, filename);
+    return NULL;
+}
+
+// Downloads the firmware to all devices of interest at once, one thread per device.
+static int download_all(void)
+{
+    cyusb_context      *ctx;
+    struct download_job *jobs;
+    int                 num;
+    int                 started;
+    int                 status = 0;
+
+    num = cyusb_ctx_open(&ctx);
+    if (num < 0) {
+        printf("Error opening library\n");
+        return -1;
+    }
+    jobs = (struct download_job *)calloc(num > 0 ? num : 1, sizeof(struct download_job));
+    if (jobs == NULL) {
+        printf("Error allocating %d download jobs\n", num);
+        cyusb_ctx_close(ctx);
+        return -1;
+    }
+    printf("Downloading to %d devices...\n", num);
+
+    // The thread owns job->status from its start, so pthread_create reports elsewhere
+    for (started = 0; started < num; started++) {
+        jobs[started].ctx = ctx;
+        jobs[started].h   = cyusb_ctx_gethandle(ctx, started);
+        int r             = pthread_create(&jobs[started].thread, NULL, download_thread, &jobs[started]);
+        if (r) {
+            printf("Warning: cannot start download thread: %s, skipping %d of %d devices\n", strerror(r),
+                   num - started, num);
+            status = -1;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(jobs[i].thread, NULL);
+        if (jobs[i].status) {
+            printf("Download to bus %d dev %d failed: %d\n", cyusb_get_busnumber(jobs[i].h),
+                   cyusb_get_devaddr(jobs[i].h), jobs[i].status);
+            status = jobs[i].status;
+        }
+    }
+
+    free(jobs);
+    cyusb_ctx_close(ctx);
+    return status;
+}
 
 int main(int argc, char **argv)
 {
@@ -74,6 +140,9 @@ int main(int argc, char **argv)
             printf("%s (Ver 1.0)\n", program_name);
             printf("Copyright (C) 2012 Cypress Semiconductors Inc. / ATR-LABS\n");
             exit(0);
+        case 'a':  // -a or --all
+            all = 1;
+            break;
         case 'f':  // -f or --file
             filename = optarg;
             break;
@@ -105,6 +174,8 @@ int main(int argc, char **argv)
     }
     fclose(fp);
 
+    if (all) return download_all() ? EXIT_FAILURE : EXIT_SUCCESS;
+
     r = cyusb_open();
     if (r < 0) {
         printf("Error opening library\n");
@@ -15,6 +15,9 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <libusb-1.0/libusb.h>
 
@@ -23,26 +26,37 @@
 /* Maximum length of a string read from the Configuration file (/etc/cyusb.conf) for the library. */
 #define MAX_CFG_LINE_LENGTH                     (120)
 
-static struct cydev cydev[MAXDEVICES];
-static int nid;		/* Number of Interesting Devices	*/
-
 struct VPD {
 	unsigned short	vid;
 	unsigned short	pid;
 	char		desc[MAX_STR_LEN];
 };
 
-static struct VPD vpd[MAX_ID_PAIRS];
+/* All state of the library lives in a context. Functions taking a context may be called from
+   several threads at once; the device table and the image cache are protected by 'lock'. */
+struct cyusb_context {
+	libusb_context		*usb;
+	pthread_mutex_t		lock;
+	struct cydev		*cydev;		/* Devices of interest, grows as needed	*/
+	int			nid;		/* Number of Interesting Devices	*/
+	int			cydev_size;	/* Allocated entries in cydev[]		*/
+	struct VPD		*vpd;
+	int			maxdevices;	/* Number of entries in vpd[]		*/
+	int			vpd_size;	/* Allocated entries in vpd[]		*/
+	libusb_device		**list;
+	struct cyusb_fx3_image	*fx3_cache;
+	char			pidfile[256];
+	char			logfile[256];
+};
+
+/* Context used by the legacy functions without a context argument */
+static cyusb_context *default_ctx;
 
-static int maxdevices;
-static int numdev;
-static libusb_device **list;
-static unsigned int checksum = 0;
+/* Holds the images of cyusb_fx3_image_load() while there is no default context */
+static cyusb_context *image_ctx;
+static pthread_mutex_t image_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
 
-char pidfile[256];
-char logfile[256];
-int logfd;
-int pidfd;
+static void free_fx3_image(struct cyusb_fx3_image *img);
 
 static int isempty(char *buf, int L)
 {
@@ -62,19 +76,39 @@ static int isempty(char *buf, int L)
 	return flag;
 }
 
-static void parse_configfile(void)
+static int add_vpd(cyusb_context *ctx, char *cp1, char *cp2, char *cp3)
+{
+	if ( ctx->maxdevices == ctx->vpd_size ) {
+	   int size = ctx->vpd_size ? ctx->vpd_size * 2 : MAX_ID_PAIRS;
+	   struct VPD *vpd = (struct VPD *)realloc(ctx->vpd, size * sizeof(struct VPD));
+	   if ( vpd == NULL ) return -11;
+	   ctx->vpd = vpd;
+	   ctx->vpd_size = size;
+	}
+	ctx->vpd[ctx->maxdevices].vid = strtol(cp1,NULL,16);
+	ctx->vpd[ctx->maxdevices].pid = strtol(cp2,NULL,16);
+	strncpy(ctx->vpd[ctx->maxdevices].desc,cp3 ? cp3 : "",MAX_STR_LEN);
+	ctx->vpd[ctx->maxdevices].desc[MAX_STR_LEN - 1] = '\0';   /* Make sure of NULL-termination. */
+	++ctx->maxdevices;
+	return 0;
+}
+
+static int parse_configfile(cyusb_context *ctx)
 {
 	FILE *inp;
 	char buf[MAX_CFG_LINE_LENGTH];
 	char *cp1, *cp2, *cp3;
-	int i;
+	char *save;
+	int r = 0;
 	
 	inp = fopen("/etc/cyusb.conf", "r");
-        if (inp == NULL)
-            return;
+        if (inp == NULL) {
+	   printf("/etc/cyusb.conf file not found. Exiting\n");
+	   return -1;
+	}
 
 	memset(buf,'\0',MAX_CFG_LINE_LENGTH);
-	while ( fgets(buf,MAX_CFG_LINE_LENGTH,inp) ) {
+	while ( r == 0 && fgets(buf,MAX_CFG_LINE_LENGTH,inp) ) {
 		if ( buf[0] == '#' ) 			/* Any line starting with a # is a comment 	*/
 		   continue;
 		if ( buf[0] == '\n' )
@@ -82,14 +116,14 @@ static void parse_configfile(void)
 		if ( isempty(buf,strlen(buf)) )		/* Any blank line is also ignored		*/
 		   continue;
 
-		cp1 = strtok(buf," =\t\n");
+		cp1 = strtok_r(buf," =\t\n",&save);
 		if ( !strcmp(cp1,"LogFile") ) {
-		   cp2 = strtok(NULL," \t\n");
-		   strcpy(logfile,cp2);
+		   cp2 = strtok_r(NULL," \t\n",&save);
+		   if ( cp2 ) snprintf(ctx->logfile,sizeof(ctx->logfile),"%s",cp2);
 		}
 		else if ( !strcmp(cp1,"PIDFile") ) {
-			cp2 = strtok(NULL," \t\n");
-			strcpy(pidfile,cp2);
+			cp2 = strtok_r(NULL," \t\n",&save);
+			if ( cp2 ) snprintf(ctx->pidfile,sizeof(ctx->pidfile),"%s",cp2);
 		}
 		else if ( !strcmp(cp1,"<VPD>") ) {
 			while ( fgets(buf,MAX_CFG_LINE_LENGTH,inp) ) {
@@ -99,45 +133,38 @@ static void parse_configfile(void)
 				   continue;
 				if ( isempty(buf,strlen(buf)) )	/* Any blank line is also ignored		*/
 				   continue;
-				if ( maxdevices == (MAX_ID_PAIRS - 1) )
-				   continue;
-				cp1 = strtok(buf," \t\n");
+				cp1 = strtok_r(buf," \t\n",&save);
 				if ( !strcmp(cp1,"</VPD>") )
 				   break;
-				cp2 = strtok(NULL, " \t");
-				cp3 = strtok(NULL, " \t\n");
-
-				vpd[maxdevices].vid = strtol(cp1,NULL,16);
-				vpd[maxdevices].pid = strtol(cp2,NULL,16);
-				strncpy(vpd[maxdevices].desc,cp3,MAX_STR_LEN);
-                                vpd[maxdevices].desc[MAX_STR_LEN - 1] = '\0';   /* Make sure of NULL-termination. */
+				cp2 = strtok_r(NULL, " \t",&save);
+				cp3 = strtok_r(NULL, " \t\n",&save);
+				if ( cp2 == NULL )
+				   continue;
 
-				++maxdevices;
+				r = add_vpd(ctx, cp1, cp2, cp3);
+				if ( r ) break;
 			}
 		}
 		else {
 		     printf("Error in config file /etc/cyusb.conf: %s \n",buf);
-		     exit(1);
+		     r = -2;
 		}
 	}
 
 	fclose(inp);
+	return r;
 }
 
-static int device_is_of_interest(cyusb_device *d)
+static int device_is_of_interest(cyusb_context *ctx, cyusb_device *d)
 {
 	int i;
 	int found = 0;
 	struct libusb_device_descriptor desc;
-	int vid;
-	int pid;
 
 	libusb_get_device_descriptor(d, &desc);
-	vid = desc.idProduct;
-	pid = desc.idProduct;
 	
-	for ( i = 0; i < maxdevices; ++i ) {
-	    if ( (vpd[i].vid == desc.idVendor) && (vpd[i].pid == desc.idProduct) ) {
+	for ( i = 0; i < ctx->maxdevices; ++i ) {
+	    if ( (ctx->vpd[i].vid == desc.idVendor) && (ctx->vpd[i].pid == desc.idProduct) ) {
 	       	found = 1;
 		break;
 	    }
@@ -159,101 +186,192 @@ unsigned short cyusb_getproduct(cyusb_handle *h)
 	return d.idProduct;
 } 
 
-static int renumerate(void)
+/* Appends an opened device to the device table. Called with ctx->lock held. */
+static int add_device(cyusb_context *ctx, cyusb_device *tdev, cyusb_handle *handle)
+{
+	struct cydev *cydev;
+
+	if ( ctx->nid == ctx->cydev_size ) {
+	   int size = ctx->cydev_size ? ctx->cydev_size * 2 : MAXDEVICES;
+	   cydev = (struct cydev *)realloc(ctx->cydev, size * sizeof(struct cydev));
+	   if ( cydev == NULL ) return -11;
+	   ctx->cydev = cydev;
+	   ctx->cydev_size = size;
+	}
+	cydev = &ctx->cydev[ctx->nid];
+	memset(cydev, 0, sizeof(*cydev));
+	cydev->dev     = tdev;
+	cydev->handle  = handle;
+	cydev->vid     = cyusb_getvendor(handle);
+	cydev->pid     = cyusb_getproduct(handle);
+	cydev->is_open = 1;
+	cydev->busnum  = cyusb_get_busnumber(handle);
+	cydev->devaddr = cyusb_get_devaddr(handle);
+	++ctx->nid;
+	return 0;
+}
+
+static int renumerate(cyusb_context *ctx)
 {
-	cyusb_device *dev = NULL;
 	cyusb_handle *handle = NULL;
-	int found = 0;
+	ssize_t numdev;
 	int i;
 	int r;
 
-	numdev = libusb_get_device_list(NULL, &list);
+	numdev = libusb_get_device_list(ctx->usb, &ctx->list);
 	if ( numdev < 0 ) {
 	   printf("Library: Error in enumerating devices...\n");
 	   return -4;
 	}
-//	printf("Library: Total number of devices detected = %d\n",numdev);
-//	printf("Library: -------------------------------------\n");
-
-	nid = 0;
 
 	for ( i = 0; i < numdev; ++i ) {
-		cyusb_device *tdev = list[i];
-		if ( device_is_of_interest(tdev) ) {
-		   cydev[nid].dev = tdev;
-		   r = libusb_open(tdev, &cydev[nid].handle);
+		cyusb_device *tdev = ctx->list[i];
+		if ( device_is_of_interest(ctx, tdev) ) {
+		   r = libusb_open(tdev, &handle);
 		   if ( r ) {
 		      printf("Error in opening device\n");
 		      return -5;
 		   }
-		   else handle = cydev[nid].handle;
-		   cydev[nid].vid     = cyusb_getvendor(handle);
-		   cydev[nid].pid     = cyusb_getproduct(handle);
-		   cydev[nid].is_open = 1;
-		   cydev[nid].busnum  = cyusb_get_busnumber(handle);
-		   cydev[nid].devaddr = cyusb_get_devaddr(handle);
-//		   printf("Device of interest found. Bus = %d, DevAddr = %d, VID = %04x, PID = %04x\n",
-//					cydev[nid].busnum, cydev[nid].devaddr, cydev[nid].vid, cydev[nid].pid );
-		   ++nid;
+		   r = add_device(ctx, tdev, handle);
+		   if ( r ) {
+		      libusb_close(handle);
+		      return r;
+		   }
 		}
 	}
-	return nid;
+	return ctx->nid;
 }
 
-int cyusb_open(void)
+static int context_create(cyusb_context **pctx)
 {
-	int fd1;
+	cyusb_context *ctx;
 	int r;
 
-	fd1 = open("/etc/cyusb.conf", O_RDONLY);
-	if ( fd1 < 0 ) {
-	   printf("/etc/cyusb.conf file not found. Exiting\n");
-	   return -1;
-	}
-	else {
-	   close(fd1);
-	   parse_configfile();	/* Parses the file and stores critical information inside exported data structures */
-	}
+	ctx = (cyusb_context *)calloc(1, sizeof(cyusb_context));
+	if ( ctx == NULL ) return -11;
+	pthread_mutex_init(&ctx->lock, NULL);
 
-	r = libusb_init(NULL);
+	r = libusb_init(&ctx->usb);
 	if (r) {
 	      printf("Error in initializing libusb library...\n");
+	      pthread_mutex_destroy(&ctx->lock);
+	      free(ctx);
 	      return -2;
 	}
-	else {
-//	      printf("Successfully initialized libusb library...\n");
-	}
-	r = renumerate();
+	*pctx = ctx;
+	return 0;
+}
 
-	return r;
+int cyusb_ctx_init(cyusb_context **pctx)
+{
+	return context_create(pctx);
 }
 
-int cyusb_open(unsigned short vid, unsigned short pid)
+int cyusb_ctx_open(cyusb_context **pctx)
 {
+	cyusb_context *ctx;
 	int r;
-	cyusb_handle *h = NULL;
-	
-	r = libusb_init(NULL);
-	if (r) {
-	      printf("Error in initializing libusb library...\n");
-	      return -1;
+
+	r = context_create(&ctx);
+	if ( r ) return r;
+
+	r = parse_configfile(ctx);	/* Parses the file and stores critical information inside the context */
+	if ( r == 0 ) {
+	   pthread_mutex_lock(&ctx->lock);
+	   r = renumerate(ctx);
+	   pthread_mutex_unlock(&ctx->lock);
 	}
-	h = libusb_open_device_with_vid_pid(NULL, vid, pid);
+	if ( r < 0 ) {
+	   cyusb_ctx_close(ctx);
+	   return r;
+	}
+	*pctx = ctx;
+	return r;
+}
+
+int cyusb_ctx_open_vid_pid(cyusb_context **pctx, unsigned short vid, unsigned short pid)
+{
+	cyusb_context *ctx;
+	cyusb_handle *h = NULL;
+	int r;
+
+	r = context_create(&ctx);
+	if ( r ) return -1;
+
+	h = libusb_open_device_with_vid_pid(ctx->usb, vid, pid);
 	if ( !h ) {
 	   printf("Device not found\n");
+	   cyusb_ctx_close(ctx);
 	   return -2;
 	}
-	cydev[0].dev     = libusb_get_device(h);
-	cydev[0].handle  = h;
-  	cydev[nid].vid     = cyusb_getvendor(h);
-	cydev[nid].pid     = cyusb_getproduct(h);
-	cydev[nid].is_open = 1;
-	cydev[nid].busnum  = cyusb_get_busnumber(h);
-	cydev[nid].devaddr = cyusb_get_devaddr(h);
-	nid = 1;
+	r = add_device(ctx, libusb_get_device(h), h);
+	if ( r ) {
+	   libusb_close(h);
+	   cyusb_ctx_close(ctx);
+	   return r;
+	}
+	*pctx = ctx;
 	return 1;
 }
 
+void cyusb_ctx_close(cyusb_context *ctx)
+{
+	int i;
+
+	if ( ctx == NULL ) return;
+	for ( i = 0; i < ctx->nid; ++i ) {
+		libusb_close(ctx->cydev[i].handle);
+	}
+	if ( ctx->list ) libusb_free_device_list(ctx->list, 1);
+	while ( ctx->fx3_cache ) {
+	      struct cyusb_fx3_image *next = ctx->fx3_cache->next;
+	      free_fx3_image(ctx->fx3_cache);
+	      ctx->fx3_cache = next;
+	}
+	libusb_exit(ctx->usb);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->cydev);
+	free(ctx->vpd);
+	free(ctx);
+}
+
+int cyusb_ctx_num_devices(cyusb_context *ctx)
+{
+	int n;
+
+	pthread_mutex_lock(&ctx->lock);
+	n = ctx->nid;
+	pthread_mutex_unlock(&ctx->lock);
+	return n;
+}
+
+cyusb_handle * cyusb_ctx_gethandle(cyusb_context *ctx, int index)
+{
+	cyusb_handle *h = NULL;
+
+	pthread_mutex_lock(&ctx->lock);
+	if ( index >= 0 && index < ctx->nid ) h = ctx->cydev[index].handle;
+	pthread_mutex_unlock(&ctx->lock);
+	return h;
+}
+
+libusb_context * cyusb_ctx_libusb(cyusb_context *ctx)
+{
+	return ctx->usb;
+}
+
+int cyusb_open(void)
+{
+	if ( default_ctx ) return -6;	/* Resource busy, cyusb_close() was not called */
+	return cyusb_ctx_open(&default_ctx);
+}
+
+int cyusb_open(unsigned short vid, unsigned short pid)
+{
+	if ( default_ctx ) return -6;
+	return cyusb_ctx_open_vid_pid(&default_ctx, vid, pid);
+}
+
 void cyusb_error(int err)
 {	if ( err == -1 )
 	   fprintf(stderr, "Input/output error\n");
@@ -285,18 +403,14 @@ void cyusb_error(int err)
 
 cyusb_handle * cyusb_gethandle(int index)	
 {
-	return cydev[index].handle;
+	if ( default_ctx == NULL ) return NULL;
+	return cyusb_ctx_gethandle(default_ctx, index);
 }
 
 void cyusb_close(void)
 {
-	int i;
-
-	for ( i = 0; i < nid; ++i ) {
-		libusb_close(cydev[i].handle);
-	}
-	libusb_free_device_list(list, 1);
-	libusb_exit(NULL);
+	cyusb_ctx_close(default_ctx);
+	default_ctx = NULL;
 }
 
 int cyusb_get_busnumber(cyusb_handle *h)
@@ -499,97 +613,527 @@ int cyusb_download_fx2(cyusb_handle *h, char *filename, unsigned char vendor_com
 }
 
 
-static void control_transfer(cyusb_handle *h, unsigned int address, unsigned char *dbuf, int len)
+static double elapsed_ms(const struct timespec *start)
 {
-	int j;
-	int r;
-	int b;
-	unsigned int *pint;
-	int index;
-
-	int balance = len;
-	pint = (unsigned int *)dbuf;
-
-	index = 0;
-	while ( balance > 0 ) {
-	      if ( balance > 4096 )
-	 	 b = 4096;
-	      else b = balance;
-	      r = cyusb_control_transfer(h, 0x40, 0xA0, ( address & 0x0000ffff ), address >> 16, &dbuf[index], b, 1000);
-	      if ( r != b ) {
-	   	   printf("Error in control_transfer\n");
-	      }
-	      address += b ;
-	      balance -= b;
-	      index += b;
-	}
-	for ( j = 0; j < len/4; ++j )
-	    checksum += pint[j];
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
 }
 
-int cyusb_download_fx3(cyusb_handle *h, char *filename)
+static unsigned int get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void free_fx3_image(struct cyusb_fx3_image *img)
+{
+	if ( img == NULL ) return;
+	free(img->sections);
+	free(img->blob);
+	free(img->filename);
+	free(img);
+}
+
+/* Reads the whole image into memory and splits it into sections. The sections point into the
+   image blob, so nothing is copied again during the download. The checksum is verified here,
+   before a single byte is sent to the device. */
+static int parse_fx3_image(const char *filename, struct cyusb_fx3_image **out)
 {
+	struct cyusb_fx3_image *img;
+	struct stat st;
+	size_t pos;
+	size_t max_sections;
+	unsigned int checksum = 0;
+	ssize_t nbr;
 	int fd;
-	unsigned char buf[1000000];
-	int nbr;
-	int dlen;
-	int count;
-	unsigned int *pdbuf = NULL;
-	unsigned int address;
-	unsigned int *pint;
-	unsigned int program_entry;
-	int r;
+	int r = 0;
 
 	fd = open(filename, O_RDONLY);
-	if ( fd < 0 ) { 
+	if ( fd < 0 ) {
 	   printf("File not found\n");
 	   return -1;
 	}
-	else printf("File successfully opened\n");
-	count = 0;
-	checksum = 0;
-	nbr = read(fd, buf, 2);		/* Read first 2 bytes, must be equal to 'CY'	*/
-	if ( strncmp((char *)buf,"CY",2) ) {
-	   printf("Image does not have 'CY' at start. aborting\n");
+	if ( fstat(fd, &st) || st.st_size < 16 ) {
+	   printf("Image is too short\n");
+	   close(fd);
 	   return -2;
 	}
-	nbr = read(fd, buf, 1);		/* Read 1 byte. bImageCTL	*/
-	if ( buf[0] & 0x01 ) {
+
+	img = (struct cyusb_fx3_image *)calloc(1, sizeof(*img));
+	if ( img ) img->blob = (unsigned char *)malloc(st.st_size);
+	if ( img ) img->filename = strdup(filename);
+	if ( !img || !img->blob || !img->filename ) {
+	   printf("Out of memory\n");
+	   close(fd);
+	   free_fx3_image(img);
+	   return -11;
+	}
+	img->size  = st.st_size;
+	img->mtime = st.st_mtime;
+
+	for ( pos = 0; pos < (size_t)st.st_size; pos += nbr ) {
+	    nbr = read(fd, img->blob + pos, st.st_size - pos);
+	    if ( nbr <= 0 ) {
+	       printf("Error reading image\n");
+	       r = -1;
+	       goto out;
+	    }
+	}
+
+	if ( strncmp((char *)img->blob, "CY", 2) ) {		/* First 2 bytes must be equal to 'CY'	*/
+	   printf("Image does not have 'CY' at start. aborting\n");
+	   r = -2;
+	   goto out;
+	}
+	if ( img->blob[2] & 0x01 ) {				/* bImageCTL	*/
 	   printf("Image does not contain executable code\n");
-	   return -3;
+	   r = -3;
+	   goto out;
 	}
-	nbr = read(fd, buf, 1);		/* Read 1 byte. bImageType	*/
-	if ( !(buf[0] == 0xB0) ) {
+	if ( img->blob[3] != 0xB0 ) {				/* bImageType	*/
 	   printf("Not a normal FW binary with checksum\n");
-	   return -4;
+	   r = -4;
+	   goto out;
+	}
+
+	/* Every section has an 8 byte header, so this is an upper bound for the section count */
+	max_sections = st.st_size / 8;
+	img->sections = (struct cyusb_fx3_section *)calloc(max_sections, sizeof(struct cyusb_fx3_section));
+	if ( img->sections == NULL ) {
+	   printf("Out of memory\n");
+	   r = -11;
+	   goto out;
 	}
+
+	pos = 4;
 	while (1) {
-	   nbr = read(fd, buf, 4);	/* Read Length of section 1,2,3, ...	*/
-	   pdbuf = (unsigned int *)buf;
-	   dlen = *pdbuf;
-	   nbr = read(fd,buf,4);	/* Read Address of section 1,2,3,...	*/
-	   pint = (unsigned int *)buf;   
-	   address = *pint;
-	   if ( dlen != 0 ) {
-	      nbr = read(fd, buf, dlen*4);	/* Read data bytes	*/
-	      control_transfer(h, address, buf, dlen*4);
+	   unsigned int dlen;
+	   unsigned int address;
+
+	   if ( pos + 8 > (size_t)st.st_size ) {
+	      printf("Image is truncated\n");
+	      r = -4;
+	      goto out;
 	   }
-	   else {
-	      program_entry = address;
+	   dlen    = get_le32(img->blob + pos);		/* Length of section in 32 bit words	*/
+	   address = get_le32(img->blob + pos + 4);	/* Address of section			*/
+	   pos += 8;
+	   if ( dlen == 0 ) {
+	      img->program_entry = address;
 	      break;
 	   }
+	   if ( (size_t)dlen * 4 > st.st_size - pos ) {
+	      printf("Image is truncated\n");
+	      r = -4;
+	      goto out;
+	   }
+	   img->sections[img->num_sections].address = address;
+	   img->sections[img->num_sections].length  = dlen * 4;
+	   img->sections[img->num_sections].data    = img->blob + pos;
+	   img->num_sections++;
+	   img->total_bytes += dlen * 4;
+	   for ( ; dlen > 0; --dlen, pos += 4 )
+	       checksum += get_le32(img->blob + pos);
 	}
-	nbr = read(fd, buf, 4);			/* Read checksum	*/
-	pdbuf = (unsigned int *)buf;
-	if ( *pdbuf != checksum ) {
+
+	if ( pos + 4 > (size_t)st.st_size || get_le32(img->blob + pos) != checksum ) {
 	   printf("Error in checksum\n");
-	   return -5;
+	   r = -5;
+	   goto out;
 	}
-	sleep(1);
-	r = cyusb_control_transfer(h, 0x40, 0xA0, (program_entry & 0x0000ffff ) , program_entry >> 16, NULL, 0, 1000);
+	img->checksum = checksum;
+
+out:
+	close(fd);
+	if ( r ) free_fx3_image(img);
+	else *out = img;
+	return r;
+}
+
+/* Parsed images are kept in the context until it is closed. An entry is reused as long as the
+   file on disk still has the same size and modification time. Entries are never modified once
+   they are in the cache, so several threads can download the same image at once. */
+int cyusb_ctx_fx3_image_load(cyusb_context *ctx, const char *filename, struct cyusb_fx3_image **img)
+{
+	struct cyusb_fx3_image *it;
+	struct stat st;
+	int r;
+
+	if ( ctx == NULL ) return -2;
+	if ( stat(filename, &st) ) {
+	   printf("File not found\n");
+	   return -1;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	for ( it = ctx->fx3_cache; it != NULL; it = it->next ) {
+	    if ( !strcmp(it->filename, filename) && it->size == st.st_size && it->mtime == st.st_mtime ) {
+	       *img = it;
+	       pthread_mutex_unlock(&ctx->lock);
+	       return 0;
+	    }
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	/* Parse without holding the lock. If two threads race for the same file, both
+	   entries end up in the cache, which is harmless. */
+	r = parse_fx3_image(filename, img);
+	if ( r ) return r;
+	pthread_mutex_lock(&ctx->lock);
+	(*img)->next = ctx->fx3_cache;
+	ctx->fx3_cache = *img;
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+int cyusb_fx3_image_load(const char *filename, struct cyusb_fx3_image **img)
+{
+	int r;
+
+	if ( default_ctx ) return cyusb_ctx_fx3_image_load(default_ctx, filename, img);
+	/* Works without cyusb_open(), like before there were contexts */
+	pthread_mutex_lock(&image_ctx_lock);
+	r = image_ctx ? 0 : context_create(&image_ctx);
+	pthread_mutex_unlock(&image_ctx_lock);
+	if ( r ) return r;
+	return cyusb_ctx_fx3_image_load(image_ctx, filename, img);
+}
+
+void cyusb_fx3_cache_flush(void)
+{
+	struct cyusb_fx3_image *cache;
+
+	pthread_mutex_lock(&image_ctx_lock);
+	cyusb_ctx_close(image_ctx);
+	image_ctx = NULL;
+	pthread_mutex_unlock(&image_ctx_lock);
+
+	if ( default_ctx == NULL ) return;
+	pthread_mutex_lock(&default_ctx->lock);
+	cache = default_ctx->fx3_cache;
+	default_ctx->fx3_cache = NULL;
+	pthread_mutex_unlock(&default_ctx->lock);
+	while ( cache ) {
+	      struct cyusb_fx3_image *next = cache->next;
+	      free_fx3_image(cache);
+	      cache = next;
+	}
+}
+
+/* State of a pipelined download. The image is cut into chunks of at most FX3_MAX_CHUNK bytes,
+   which are written with 0xA0 requests. FX3_QUEUE_DEPTH of them are in flight at any time;
+   EP0 requests are executed in submission order, so the next chunk is already queued on the
+   host controller when the previous one completes. The callbacks run in whichever thread
+   handles the events of the context, so everything but 'img' is protected by 'lock'. */
+struct fx3_download {
+	const struct cyusb_fx3_image *img;
+	pthread_mutex_t lock;
+	int section;			/* Next section to send		*/
+	unsigned int offset;		/* Next offset in that section	*/
+	int in_flight;			/* Counted before the submission	*/
+	int error;
+	int completed;			/* Set when the last transfer returned	*/
+};
+
+static int fill_next_chunk(struct fx3_download *dl, struct libusb_transfer *xfer)
+{
+	const struct cyusb_fx3_section *sec;
+	unsigned int address;
+	unsigned int b;
+
+	if ( dl->section >= dl->img->num_sections ) return 0;
+
+	sec = &dl->img->sections[dl->section];
+	b = sec->length - dl->offset;
+	if ( b > FX3_MAX_CHUNK ) b = FX3_MAX_CHUNK;
+	address = sec->address + dl->offset;
+
+	libusb_fill_control_setup(xfer->buffer, 0x40, 0xA0, address & 0x0000ffff, address >> 16, b);
+	memcpy(xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, sec->data + dl->offset, b);
+	xfer->length = LIBUSB_CONTROL_SETUP_SIZE + b;
+
+	dl->offset += b;
+	if ( dl->offset == sec->length ) {
+	   dl->section++;
+	   dl->offset = 0;
+	}
+	return 1;
+}
+
+static void LIBUSB_CALL download_callback(struct libusb_transfer *xfer)
+{
+	struct fx3_download *dl = (struct fx3_download *)xfer->user_data;
+	int next = 0;
+
+	pthread_mutex_lock(&dl->lock);
+	if ( xfer->status != LIBUSB_TRANSFER_COMPLETED ||
+	     xfer->actual_length != xfer->length - (int)LIBUSB_CONTROL_SETUP_SIZE ) {
+	   printf("Error in control_transfer\n");
+	   dl->error = -1;
+	} else if ( !dl->error ) {
+	   next = fill_next_chunk(dl, xfer);
+	}
+	pthread_mutex_unlock(&dl->lock);
+
+	/* A resubmitted transfer stays counted */
+	if ( next && libusb_submit_transfer(xfer) == 0 ) return;
+
+	pthread_mutex_lock(&dl->lock);
+	if ( next ) {
+	   printf("Error in control_transfer\n");
+	   dl->error = -1;
+	}
+	if ( --dl->in_flight == 0 ) dl->completed = 1;
+	pthread_mutex_unlock(&dl->lock);
+}
+
+static int stream_fx3_image(libusb_context *usb, cyusb_handle *h, const struct cyusb_fx3_image *img)
+{
+	struct libusb_transfer *xfers[FX3_QUEUE_DEPTH];
+	struct fx3_download dl;
+	unsigned char *buffer;
+	int next;
+	int i;
+	int r = 0;
+
+	memset(xfers, 0, sizeof(xfers));
+	memset(&dl, 0, sizeof(dl));
+	dl.img = img;
+	pthread_mutex_init(&dl.lock, NULL);
+
+	for ( i = 0; i < FX3_QUEUE_DEPTH; ++i ) {
+	    xfers[i] = libusb_alloc_transfer(0);
+	    if ( xfers[i] == NULL ) {
+	       r = -11;
+	       goto out;
+	    }
+	    buffer = (unsigned char *)calloc(1, LIBUSB_CONTROL_SETUP_SIZE + FX3_MAX_CHUNK);
+	    if ( buffer == NULL ) {
+	       r = -11;
+	       goto out;
+	    }
+	    libusb_fill_control_transfer(xfers[i], h, buffer, download_callback, &dl, 1000);
+	    xfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	}
+
+	/* The first transfers may complete in another thread while the rest are submitted */
+	for ( i = 0; i < FX3_QUEUE_DEPTH; ++i ) {
+	    pthread_mutex_lock(&dl.lock);
+	    next = !dl.error && fill_next_chunk(&dl, xfers[i]);
+	    if ( next ) dl.in_flight++;
+	    pthread_mutex_unlock(&dl.lock);
+	    if ( !next ) break;
+	    r = libusb_submit_transfer(xfers[i]);
+	    if ( r ) {
+	       printf("Error in control_transfer\n");
+	       pthread_mutex_lock(&dl.lock);
+	       dl.error = r;
+	       dl.in_flight--;
+	       pthread_mutex_unlock(&dl.lock);
+	       break;
+	    }
+	}
+
+	pthread_mutex_lock(&dl.lock);
+	if ( dl.in_flight == 0 ) dl.completed = 1;
+	pthread_mutex_unlock(&dl.lock);
+
+	/* Other threads may handle events on the same context, so the callback of this download
+	   can run anywhere. libusb_handle_events_completed() copes with that. */
+	while ( !dl.completed ) {
+	      r = libusb_handle_events_completed(usb, &dl.completed);
+	      if ( r && r != LIBUSB_ERROR_INTERRUPTED ) {
+	         /* Cannot leave with transfers in flight, they reference this stack frame */
+	         for ( i = 0; i < FX3_QUEUE_DEPTH; ++i )
+	             libusb_cancel_transfer(xfers[i]);
+	      }
+	}
+	pthread_mutex_lock(&dl.lock);
+	r = dl.error;
+	pthread_mutex_unlock(&dl.lock);
+
+out:
+	for ( i = 0; i < FX3_QUEUE_DEPTH; ++i ) {
+	    if ( xfers[i] ) libusb_free_transfer(xfers[i]);
+	}
+	pthread_mutex_destroy(&dl.lock);
+	return r;
+}
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+struct renumeration {
+	int busnum;
+	uint8_t ports[8];	/* Port path, the address changes on re-enumeration */
+	int nports;
+	int old_address;
+	int arrived;
+};
+
+static int is_renumerated(libusb_device *dev, const struct renumeration *re)
+{
+	uint8_t ports[8];
+	int nports;
+
+	if ( libusb_get_bus_number(dev) != re->busnum || libusb_get_device_address(dev) == re->old_address )
+	   return 0;
+	nports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	return nports == re->nports && !memcmp(ports, re->ports, nports);
+}
+
+static int LIBUSB_CALL renumeration_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event,
+					     void *user_data)
+{
+	struct renumeration *re = (struct renumeration *)user_data;
+
+	if ( is_renumerated(dev, re) ) {
+	   re->arrived = 1;
+	   return 1;		/* Deregister, we are done */
+	}
+	return 0;
+}
+
+/* Without hotplug support, the device list is polled for the same port path */
+static int poll_renumeration(libusb_context *usb, struct renumeration *re)
+{
+	libusb_device **list;
+	ssize_t n, i;
+
+	n = libusb_get_device_list(usb, &list);
+	if ( n < 0 ) return 0;
+	for ( i = 0; i < n && !re->arrived; ++i ) {
+	    if ( is_renumerated(list[i], re) ) re->arrived = 1;
+	}
+	libusb_free_device_list(list, 1);
+	return re->arrived;
+}
+#endif
+
+int cyusb_ctx_download_fx3_image(cyusb_context *ctx, cyusb_handle *h, const struct cyusb_fx3_image *img,
+				 int renum_timeout_ms)
+{
+	struct timespec start;
+	int r;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	libusb_hotplug_callback_handle cb_handle;
+	struct renumeration re;
+	int has_hotplug = 0;
+
+	re.busnum      = cyusb_get_busnumber(h);
+	re.nports      = libusb_get_port_numbers(libusb_get_device(h), re.ports, sizeof(re.ports));
+	re.old_address = libusb_get_device_address(libusb_get_device(h));
+	re.arrived     = 0;
+	/* The callback has to be registered before the jump, otherwise the arrival can be missed */
+	if ( renum_timeout_ms > 0 && re.nports > 0 && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) ) {
+	   has_hotplug = !libusb_hotplug_register_callback(ctx->usb, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+							    LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+							    LIBUSB_HOTPLUG_MATCH_ANY, renumeration_callback, &re, &cb_handle);
+	}
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = stream_fx3_image(ctx->usb, h, img);
+	if ( r ) goto out;
+	printf("Downloaded %u bytes in %.1f ms (%.2f MB/s)\n", img->total_bytes, elapsed_ms(&start),
+	       img->total_bytes / (elapsed_ms(&start) * 1000.0));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = cyusb_control_transfer(h, 0x40, 0xA0, (img->program_entry & 0x0000ffff ) , img->program_entry >> 16, NULL, 0, 1000);
 	if ( r ) {
 	   printf("Ignored error in control_transfer: %d\n", r);
+	   r = 0;
 	}
-	close(fd);
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	if ( renum_timeout_ms > 0 && re.nports > 0 ) {
+	   while ( !re.arrived && elapsed_ms(&start) < renum_timeout_ms ) {
+	         struct timeval tv = { 0, 100000 };
+	         if ( has_hotplug ) libusb_handle_events_timeout_completed(ctx->usb, &tv, &re.arrived);
+	         else if ( !poll_renumeration(ctx->usb, &re) ) usleep(100000);
+	   }
+	   if ( re.arrived ) printf("Device re-enumerated after %.1f ms\n", elapsed_ms(&start));
+	   else printf("Device did not re-enumerate within %d ms\n", renum_timeout_ms);
+	}
+#endif
+
+out:
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	if ( has_hotplug && !re.arrived ) libusb_hotplug_deregister_callback(ctx->usb, cb_handle);
+#endif
+	return r;
+}
+
+int cyusb_ctx_download_fx3(cyusb_context *ctx, cyusb_handle *h, const char *filename)
+{
+	struct cyusb_fx3_image *img;
+	struct timespec start;
+	int r;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = cyusb_ctx_fx3_image_load(ctx, filename, &img);
+	if ( r ) return r;
+	printf("Image parsed in %.1f ms: %d sections, %u bytes, checksum %08x\n", elapsed_ms(&start),
+	       img->num_sections, img->total_bytes, img->checksum);
+
+	return cyusb_ctx_download_fx3_image(ctx, h, img, FX3_RENUM_TIMEOUT_MS);
+}
+
+/* Without cyusb_open(), the handle belongs to a libusb context this library cannot handle
+   events on. The device is opened once more in a temporary context for the download. */
+static int open_temporary(cyusb_handle *h, cyusb_context **pctx, cyusb_handle **th)
+{
+	cyusb_context *ctx;
+	libusb_device **list;
+	ssize_t n, i;
+	int r;
+
+	r = context_create(&ctx);
+	if ( r ) return r;
+	*th = NULL;
+	n = libusb_get_device_list(ctx->usb, &list);
+	for ( i = 0; i < n && *th == NULL; ++i ) {
+	    if ( libusb_get_bus_number(list[i]) == cyusb_get_busnumber(h) &&
+		 libusb_get_device_address(list[i]) == cyusb_get_devaddr(h) ) {
+	       if ( libusb_open(list[i], th) ) *th = NULL;
+	       else if ( add_device(ctx, list[i], *th) ) {
+		  libusb_close(*th);
+		  *th = NULL;
+	       }
+	    }
+	}
+	if ( n >= 0 ) libusb_free_device_list(list, 1);
+	if ( *th == NULL ) {
+	   printf("Error in opening device\n");
+	   cyusb_ctx_close(ctx);
+	   return -5;
+	}
+	*pctx = ctx;
 	return 0;
 }
+
+int cyusb_download_fx3_image(cyusb_handle *h, const struct cyusb_fx3_image *img, int renum_timeout_ms)
+{
+	cyusb_context *ctx;
+	cyusb_handle *th;
+	int r;
+
+	if ( default_ctx ) return cyusb_ctx_download_fx3_image(default_ctx, h, img, renum_timeout_ms);
+	r = open_temporary(h, &ctx, &th);
+	if ( r ) return r;
+	r = cyusb_ctx_download_fx3_image(ctx, th, img, renum_timeout_ms);
+	cyusb_ctx_close(ctx);
+	return r;
+}
+
+int cyusb_download_fx3(cyusb_handle *h, char *filename)
+{
+	cyusb_context *ctx;
+	cyusb_handle *th;
+	int r;
+
+	if ( default_ctx ) return cyusb_ctx_download_fx3(default_ctx, h, filename);
+	r = open_temporary(h, &ctx, &th);
+	if ( r ) return r;
+	r = cyusb_ctx_download_fx3(ctx, th, filename);
+	cyusb_ctx_close(ctx);
+	return r;
+}
@@ -0,0 +1,484 @@
+/* libusb_example/flexiband_acq.c
+ *
+ * Acquisition, see flexiband_acq.h. The snapshot is mixed to baseband by an NCO and
+ * integrated and dumped to n samples per millisecond, the largest power of two up to 4096
+ * that the sample rate allows. For each Doppler bin the spectra of all code periods are
+ * computed once and shared by the PRNs; each PRN then multiplies them with the conjugate
+ * spectrum of its code replica and transforms back, which gives the correlation at all n
+ * code phases at once. The power of the code periods is summed per cell.
+ *
+ * The mean of the snapshot is removed before mixing: the quantizer codes are not centred on
+ * zero, and the offset would correlate with the code like a signal at the IF.
+ *
+ * The first thread coordinates: it prepares the snapshot and hands the Doppler bins and then
+ * the PRNs to all threads, itself included, one at a time.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "flexiband_acq.h"
+#include "flexiband_fft.h"
+#include "flexiband_nco.h"
+#include "flexiband_unpack.h"
+
+#define CA_CHIPS    1023
+#define CA_RATE     1.023e6
+#define MAX_N       4096    // samples per code period after resampling
+#define MIN_N       2048    // two samples per chip
+#define DOPPLER_BIN 500.0   // Hz, half the bandwidth of one coherent millisecond
+
+enum acq_state { ACQ_IDLE, ACQ_ARMED, ACQ_SEARCHING, ACQ_DONE };
+enum acq_job { JOB_SPECTRA, JOB_PRNS };
+
+struct acq_worker {
+    struct acq *acq;
+    pthread_t thread;
+    bool started;
+    float *re;
+    float *im;
+    float *grid;             // summed power, num_dopplers rows of n code phases
+    double cpu_sec;
+};
+
+struct acq {
+    struct acq_config config;
+    unsigned per_frame;      // L1 samples per frame
+    unsigned frames;         // per snapshot
+    double sample_rate;      // L1 samples per second
+    unsigned n;
+    unsigned num_dopplers;
+    struct fft *fft;
+    struct nco *nco;
+    float *code_re;          // spectra of the code replicas, ACQ_NUM_PRNS rows of n
+    float *code_im;
+    uint8_t *snapshot;
+    int8_t *unpacked;        // the whole snapshot
+    float *centred;          // one frame
+    float *mixed;
+    float *sig_re;           // baseband, ms rows of n
+    float *sig_im;
+    float *spec_re;          // spectra, num_dopplers * ms rows of n
+    float *spec_im;
+    struct acq_worker *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;     // state changes
+    pthread_cond_t job_cond; // tasks handed out and finished
+    enum acq_state state;
+    bool quit;
+    unsigned fill;           // frames in the snapshot
+    uint32_t next_counter;
+    enum acq_job job;
+    unsigned tasks;
+    unsigned next_task;
+    unsigned finished;
+    struct acq_report report;
+};
+
+static double thread_cpu_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// C/A code of one PRN as +-1: G1 XOR the G2 register tapped at the two stages assigned to
+// the PRN (IS-GPS-200)
+static void ca_code(int prn, int8_t code[CA_CHIPS]) {
+    static const uint8_t taps[ACQ_NUM_PRNS][2] = {
+        {2, 6}, {3, 7}, {4, 8}, {5, 9}, {1, 9}, {2, 10}, {1, 8}, {2, 9}, {3, 10}, {2, 3}, {3, 4},
+        {5, 6}, {6, 7}, {7, 8}, {8, 9}, {9, 10}, {1, 4}, {2, 5}, {3, 6}, {4, 7}, {5, 8}, {6, 9},
+        {1, 3}, {4, 6}, {5, 7}, {6, 8}, {7, 9}, {8, 10}, {1, 6}, {2, 7}, {3, 8}, {4, 9}};
+    uint8_t g1[10], g2[10];
+    memset(g1, 1, sizeof(g1));
+    memset(g2, 1, sizeof(g2));
+    for (int i = 0; i < CA_CHIPS; i++) {
+        int chip = g1[9] ^ g2[taps[prn - 1][0] - 1] ^ g2[taps[prn - 1][1] - 1];
+        code[i] = chip ? -1 : 1;
+        uint8_t f1 = g1[2] ^ g1[9];
+        uint8_t f2 = g2[1] ^ g2[2] ^ g2[5] ^ g2[7] ^ g2[8] ^ g2[9];
+        memmove(g1 + 1, g1, 9);
+        memmove(g2 + 1, g2, 9);
+        g1[0] = f1;
+        g2[0] = f2;
+    }
+}
+
+// Unpacks, centres, mixes and integrates the snapshot into ms code periods of n samples
+static void prepare(struct acq *acq) {
+    size_t total = (size_t)acq->config.ms * acq->n, count = (size_t)acq->frames * acq->per_frame;
+    double ratio = acq->n * 1000.0 / acq->sample_rate;
+    int64_t sum_i = 0, sum_q = 0;
+    uint64_t i = 0;
+
+    for (unsigned f = 0; f < acq->frames; f++) {
+        int8_t *out[NUM_BANDS] = {acq->unpacked + (size_t)f * 2 * acq->per_frame, NULL, NULL};
+        unpack_frame((enum payload_layout)acq->config.layout, acq->snapshot + (size_t)f * FRAME_LEN, out);
+    }
+    for (size_t k = 0; k < count; k++) {
+        sum_i += acq->unpacked[2 * k];
+        sum_q += acq->unpacked[2 * k + 1];
+    }
+    float mean_i = (float)((double)sum_i / count), mean_q = (float)((double)sum_q / count);
+
+    memset(acq->sig_re, 0, total * sizeof(float));
+    memset(acq->sig_im, 0, total * sizeof(float));
+    for (unsigned f = 0; f < acq->frames; f++) {
+        const int8_t *in = acq->unpacked + (size_t)f * 2 * acq->per_frame;
+        for (unsigned k = 0; k < acq->per_frame; k++) {
+            acq->centred[2 * k] = in[2 * k] - mean_i;
+            acq->centred[2 * k + 1] = in[2 * k + 1] - mean_q;
+        }
+        nco_mix_float(acq->nco, acq->centred, acq->per_frame, acq->mixed);
+        for (unsigned k = 0; k < acq->per_frame; k++, i++) {
+            size_t j = (size_t)(i * ratio);
+            if (j >= total) return;
+            acq->sig_re[j] += acq->mixed[2 * k];
+            acq->sig_im[j] += acq->mixed[2 * k + 1];
+        }
+    }
+}
+
+// Spectra of all code periods wiped off by Doppler bin d
+static void spectra(struct acq *acq, struct acq_worker *worker, unsigned d) {
+    unsigned n = acq->n;
+    double doppler = (d - (acq->num_dopplers - 1) / 2.0) * DOPPLER_BIN;
+    for (unsigned m = 0; m < acq->config.ms; m++) {
+        float *re = acq->spec_re + ((size_t)d * acq->config.ms + m) * n;
+        float *im = acq->spec_im + ((size_t)d * acq->config.ms + m) * n;
+        const float *x_re = acq->sig_re + (size_t)m * n, *x_im = acq->sig_im + (size_t)m * n;
+        for (unsigned j = 0; j < n; j++) {
+            double phase = -2 * M_PI * fmod(doppler * ((double)m * n + j) / (n * 1000.0), 1.0);
+            float c = (float)cos(phase), s = (float)sin(phase);
+            re[j] = x_re[j] * c - x_im[j] * s;
+            im[j] = x_re[j] * s + x_im[j] * c;
+        }
+        fft_forward(acq->fft, re, im);
+    }
+}
+
+static void search_prn(struct acq *acq, struct acq_worker *worker, unsigned p) {
+    unsigned n = acq->n, ms = acq->config.ms;
+    const float *c_re = acq->code_re + (size_t)p * n, *c_im = acq->code_im + (size_t)p * n;
+    unsigned peak_d = 0, peak_j = 0;
+    float peak = 0;
+
+    memset(worker->grid, 0, (size_t)acq->num_dopplers * n * sizeof(float));
+    for (unsigned d = 0; d < acq->num_dopplers; d++) {
+        float *row = worker->grid + (size_t)d * n;
+        for (unsigned m = 0; m < ms; m++) {
+            const float *x_re = acq->spec_re + ((size_t)d * ms + m) * n;
+            const float *x_im = acq->spec_im + ((size_t)d * ms + m) * n;
+            for (unsigned j = 0; j < n; j++) {
+                worker->re[j] = x_re[j] * c_re[j] + x_im[j] * c_im[j];
+                worker->im[j] = x_im[j] * c_re[j] - x_re[j] * c_im[j];
+            }
+            fft_inverse(acq->fft, worker->re, worker->im);
+            for (unsigned j = 0; j < n; j++) row[j] += worker->re[j] * worker->re[j] + worker->im[j] * worker->im[j];
+        }
+        for (unsigned j = 0; j < n; j++) {
+            if (row[j] > peak) {
+                peak = row[j];
+                peak_d = d;
+                peak_j = j;
+            }
+        }
+    }
+
+    // Noise and the second highest peak away from the correlation triangle of the first one
+    double noise = 0, second = 0;
+    uint64_t cells = 0;
+    unsigned lobe = 2 * n / CA_CHIPS + 1;
+    for (unsigned d = 0; d < acq->num_dopplers; d++) {
+        const float *row = worker->grid + (size_t)d * n;
+        bool near = d + 1 >= peak_d && d <= peak_d + 1;
+        for (unsigned j = 0; j < n; j++) {
+            unsigned dist = j > peak_j ? j - peak_j : peak_j - j;
+            if (near && (dist <= lobe || n - dist <= lobe)) continue;
+            noise += row[j];
+            if (row[j] > second) second = row[j];
+            cells++;
+        }
+    }
+    noise /= cells;
+
+    // The power of the peak over the noise per cell is the SNR of one coherent millisecond
+    struct acq_result *result = &acq->report.prn[p];
+    double snr = noise > 0 ? (peak - noise) / noise : 0;
+    result->cn0 = 10 * log10((snr > 1e-3 ? snr : 1e-3) * 1000);
+    result->doppler = (peak_d - (acq->num_dopplers - 1) / 2.0) * DOPPLER_BIN;
+    result->code_phase = (double)peak_j * CA_CHIPS / n;
+    result->peak_ratio = second > 0 ? peak / second : 0;
+    result->acquired = result->peak_ratio >= ACQ_PEAK_RATIO;
+}
+
+static void run_task(struct acq *acq, struct acq_worker *worker, unsigned task) {
+    double start = thread_cpu_sec();
+    if (acq->job == JOB_SPECTRA) spectra(acq, worker, task);
+    else search_prn(acq, worker, task);
+    worker->cpu_sec += thread_cpu_sec() - start;
+}
+
+// Called with the lock held, returns with it held
+static void work_on_job(struct acq *acq, struct acq_worker *worker) {
+    while (acq->next_task < acq->tasks) {
+        unsigned task = acq->next_task++;
+        pthread_mutex_unlock(&acq->lock);
+        run_task(acq, worker, task);
+        pthread_mutex_lock(&acq->lock);
+        if (++acq->finished == acq->tasks) pthread_cond_broadcast(&acq->job_cond);
+    }
+}
+
+static void run_job(struct acq *acq, enum acq_job job, unsigned tasks) {
+    pthread_mutex_lock(&acq->lock);
+    acq->job = job;
+    acq->tasks = tasks;
+    acq->next_task = 0;
+    acq->finished = 0;
+    pthread_cond_broadcast(&acq->job_cond);
+    work_on_job(acq, &acq->workers[0]);
+    while (acq->finished < acq->tasks) pthread_cond_wait(&acq->job_cond, &acq->lock);
+    pthread_mutex_unlock(&acq->lock);
+}
+
+static void lower_priority(const struct acq *acq) {
+    if (acq->config.nice) setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), acq->config.nice);
+}
+
+static void *helper_thread(void *arg) {
+    struct acq_worker *worker = (struct acq_worker*)arg;
+    struct acq *acq = worker->acq;
+    lower_priority(acq);
+    pthread_mutex_lock(&acq->lock);
+    while (!acq->quit) {
+        work_on_job(acq, worker);
+        if (!acq->quit) pthread_cond_wait(&acq->job_cond, &acq->lock);
+    }
+    pthread_mutex_unlock(&acq->lock);
+    return NULL;
+}
+
+static void *coordinator_thread(void *arg) {
+    struct acq *acq = (struct acq*)arg;
+    lower_priority(acq);
+    for (;;) {
+        pthread_mutex_lock(&acq->lock);
+        while (acq->state != ACQ_SEARCHING && !acq->quit) pthread_cond_wait(&acq->cond, &acq->lock);
+        pthread_mutex_unlock(&acq->lock);
+        if (acq->quit) break;
+
+        int64_t start = now_usec();
+        for (unsigned t = 0; t < acq->config.threads; t++) acq->workers[t].cpu_sec = 0;
+        double cpu = thread_cpu_sec();
+        prepare(acq);
+        acq->workers[0].cpu_sec += thread_cpu_sec() - cpu;
+        run_job(acq, JOB_SPECTRA, acq->num_dopplers);
+        run_job(acq, JOB_PRNS, ACQ_NUM_PRNS);
+
+        pthread_mutex_lock(&acq->lock);
+        acq->report.search_sec = (now_usec() - start) / 1e6;
+        acq->report.cpu_sec = 0;
+        for (unsigned t = 0; t < acq->config.threads; t++) acq->report.cpu_sec += acq->workers[t].cpu_sec;
+        acq->report.acquired = 0;
+        for (int p = 0; p < ACQ_NUM_PRNS; p++) acq->report.acquired += acq->report.prn[p].acquired;
+        acq->state = ACQ_DONE;
+        pthread_cond_broadcast(&acq->cond);
+        pthread_mutex_unlock(&acq->lock);
+    }
+    return NULL;
+}
+
+struct acq *acq_create(const struct acq_config *config) {
+    struct acq *acq = (struct acq*)calloc(1, sizeof(struct acq));
+    if (acq == NULL) {
+        fprintf(stderr, "Error: allocating acquisition\n");
+        return NULL;
+    }
+    acq->config = *config;
+    pthread_mutex_init(&acq->lock, NULL);
+    pthread_cond_init(&acq->cond, NULL);
+    pthread_cond_init(&acq->job_cond, NULL);
+
+    acq->per_frame = config->layout < NUM_LAYOUTS ? unpack_samples_per_frame((enum payload_layout)config->layout, BAND_L1) : 0;
+    if (acq->per_frame == 0 || config->ms == 0 || config->threads == 0 || config->data_rate <= 0) {
+        fprintf(stderr, "Error: Acquisition needs L1 in the layout, a data rate, periods and threads\n");
+        goto err;
+    }
+    acq->sample_rate = config->data_rate / FRAME_LEN * acq->per_frame;
+    for (acq->n = MAX_N; acq->n * 1000.0 > acq->sample_rate && acq->n >= MIN_N; acq->n /= 2) {}
+    if (acq->n < MIN_N) {
+        fprintf(stderr, "Error: L1 sample rate %.3f MHz too low for acquisition\n", acq->sample_rate / 1e6);
+        goto err;
+    }
+    acq->num_dopplers = 2 * (unsigned)(config->max_doppler / DOPPLER_BIN) + 1;
+    acq->frames = (unsigned)ceil(config->ms * acq->sample_rate / 1000 / acq->per_frame) + 1;
+
+    size_t total = (size_t)config->ms * acq->n;
+    size_t spectra = (size_t)acq->num_dopplers * total;
+    acq->fft = fft_create(acq->n);
+    acq->nco = nco_create(config->shift);
+    acq->code_re = (float*)malloc((size_t)ACQ_NUM_PRNS * acq->n * sizeof(float));
+    acq->code_im = (float*)malloc((size_t)ACQ_NUM_PRNS * acq->n * sizeof(float));
+    acq->snapshot = (uint8_t*)malloc((size_t)acq->frames * FRAME_LEN);
+    acq->unpacked = (int8_t*)malloc((size_t)acq->frames * 2 * acq->per_frame);
+    acq->centred = (float*)malloc(2 * FRAME_MAX_PAYLOAD * sizeof(float));
+    acq->mixed = (float*)malloc(2 * FRAME_MAX_PAYLOAD * sizeof(float));
+    acq->sig_re = (float*)malloc(total * sizeof(float));
+    acq->sig_im = (float*)malloc(total * sizeof(float));
+    acq->spec_re = (float*)malloc(spectra * sizeof(float));
+    acq->spec_im = (float*)malloc(spectra * sizeof(float));
+    acq->workers = (struct acq_worker*)calloc(config->threads, sizeof(struct acq_worker));
+    if (acq->fft == NULL || acq->nco == NULL || acq->code_re == NULL || acq->code_im == NULL || acq->snapshot == NULL ||
+        acq->unpacked == NULL || acq->centred == NULL || acq->mixed == NULL || acq->sig_re == NULL || acq->sig_im == NULL ||
+        acq->spec_re == NULL || acq->spec_im == NULL || acq->workers == NULL) {
+        fprintf(stderr, "Error: allocating acquisition\n");
+        goto err;
+    }
+    for (unsigned t = 0; t < config->threads; t++) {
+        struct acq_worker *worker = &acq->workers[t];
+        worker->acq = acq;
+        worker->re = (float*)malloc(acq->n * sizeof(float));
+        worker->im = (float*)malloc(acq->n * sizeof(float));
+        worker->grid = (float*)malloc((size_t)acq->num_dopplers * acq->n * sizeof(float));
+        if (worker->re == NULL || worker->im == NULL || worker->grid == NULL) {
+            fprintf(stderr, "Error: allocating acquisition\n");
+            goto err;
+        }
+    }
+
+    // Replicas sampled like the resampled signal
+    for (int p = 0; p < ACQ_NUM_PRNS; p++) {
+        int8_t code[CA_CHIPS];
+        float *re = acq->code_re + (size_t)p * acq->n, *im = acq->code_im + (size_t)p * acq->n;
+        ca_code(p + 1, code);
+        for (unsigned j = 0; j < acq->n; j++) {
+            re[j] = code[(unsigned)((uint64_t)j * CA_CHIPS / acq->n)];
+            im[j] = 0;
+        }
+        fft_forward(acq->fft, re, im);
+    }
+
+    for (unsigned t = 0; t < config->threads; t++) {
+        void *(*start)(void*) = t == 0 ? coordinator_thread : helper_thread;
+        void *arg = t == 0 ? (void*)acq : (void*)&acq->workers[t];
+        if (pthread_create(&acq->workers[t].thread, NULL, start, arg)) {
+            fprintf(stderr, "Error: Start acquisition thread\n");
+            goto err;
+        }
+        acq->workers[t].started = true;
+    }
+    return acq;
+
+err:
+    acq_free(acq);
+    return NULL;
+}
+
+void acq_free(struct acq *acq) {
+    if (acq == NULL) return;
+    pthread_mutex_lock(&acq->lock);
+    acq->quit = true;
+    pthread_cond_broadcast(&acq->cond);
+    pthread_cond_broadcast(&acq->job_cond);
+    pthread_mutex_unlock(&acq->lock);
+    if (acq->workers) {
+        for (unsigned t = 0; t < acq->config.threads; t++) {
+            if (acq->workers[t].started) pthread_join(acq->workers[t].thread, NULL);
+            free(acq->workers[t].re);
+            free(acq->workers[t].im);
+            free(acq->workers[t].grid);
+        }
+    }
+    free(acq->workers);
+    fft_free(acq->fft);
+    nco_free(acq->nco);
+    free(acq->code_re);
+    free(acq->code_im);
+    free(acq->snapshot);
+    free(acq->unpacked);
+    free(acq->centred);
+    free(acq->mixed);
+    free(acq->sig_re);
+    free(acq->sig_im);
+    free(acq->spec_re);
+    free(acq->spec_im);
+    pthread_cond_destroy(&acq->job_cond);
+    pthread_cond_destroy(&acq->cond);
+    pthread_mutex_destroy(&acq->lock);
+    free(acq);
+}
+
+unsigned acq_snapshot_frames(const struct acq *acq) {
+    return acq->frames;
+}
+
+bool acq_start(struct acq *acq) {
+    pthread_mutex_lock(&acq->lock);
+    bool idle = acq->state == ACQ_IDLE;
+    if (idle) {
+        acq->state = ACQ_ARMED;
+        acq->fill = 0;
+    }
+    pthread_mutex_unlock(&acq->lock);
+    return idle;
+}
+
+bool acq_feed(struct acq *acq, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t*)data;
+    pthread_mutex_lock(&acq->lock);
+    bool armed = acq->state == ACQ_ARMED;
+    pthread_mutex_unlock(&acq->lock);
+    if (!armed) return false;
+
+    // Only the state change needs the lock, the snapshot belongs to the feeder while armed
+    for (size_t pos = 0; pos + FRAME_LEN <= len && acq->fill < acq->frames; pos += FRAME_LEN) {
+        const uint8_t *frame = p + pos;
+        if (!frame_has_preamble(frame)) continue;
+        uint32_t counter = frame_counter(frame);
+        if (acq->fill > 0 && counter != acq->next_counter) acq->fill = 0;
+        if (acq->fill == 0) acq->report.counter = counter;
+        memcpy(acq->snapshot + (size_t)acq->fill * FRAME_LEN, frame, FRAME_LEN);
+        acq->fill++;
+        acq->next_counter = counter + 1;
+    }
+    if (acq->fill < acq->frames) return false;
+
+    pthread_mutex_lock(&acq->lock);
+    acq->report.snapshot_usec = now_usec();
+    acq->state = ACQ_SEARCHING;
+    pthread_cond_broadcast(&acq->cond);
+    pthread_mutex_unlock(&acq->lock);
+    return true;
+}
+
+bool acq_poll(struct acq *acq, struct acq_report *report) {
+    pthread_mutex_lock(&acq->lock);
+    bool done = acq->state == ACQ_DONE;
+    if (done) {
+        *report = acq->report;
+        acq->state = ACQ_IDLE;
+    }
+    pthread_mutex_unlock(&acq->lock);
+    return done;
+}
+
+bool acq_wait(struct acq *acq, struct acq_report *report) {
+    pthread_mutex_lock(&acq->lock);
+    while (acq->state == ACQ_SEARCHING) pthread_cond_wait(&acq->cond, &acq->lock);
+    pthread_mutex_unlock(&acq->lock);
+    return acq_poll(acq, report);
+}
@@ -0,0 +1,77 @@
+/* libusb_example/flexiband_acq.h
+ *
+ * Quick-look acquisition of the GPS C/A signals in the L1 band: a snapshot of a few
+ * milliseconds of consecutive frames is mixed to baseband, resampled to a power of two
+ * samples per code period and searched over all code phases at once by FFT correlation, for
+ * every PRN and Doppler bin. The search runs on a pool of threads at reduced priority, so it
+ * can share the host with a running capture.
+ *
+ * acq_feed() only copies frames while a snapshot is armed and never blocks, so it may be
+ * called from the transfer callback. The report of a snapshot is picked up with acq_poll() or
+ * waited for with acq_wait().
+ */
+
+#ifndef FLEXIBAND_ACQ_H
+#define FLEXIBAND_ACQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ACQ_NUM_PRNS   32
+#define ACQ_PEAK_RATIO 2.0   // correlation peak over the highest one elsewhere to count as acquired
+
+struct acq_config {
+    uint32_t layout;          // enum payload_layout, must contain L1
+    double data_rate;         // bytes per second of the stream, sets the sample rate
+    double shift;             // cycles per sample that move the L1 carrier to 0 Hz
+    unsigned ms;              // code periods summed non-coherently
+    double max_doppler;       // Hz, searched in steps of half the coherent bandwidth
+    unsigned threads;
+    int nice;                 // added to the priority of the search threads
+};
+
+struct acq_result {
+    double cn0;               // dB-Hz, estimated from the correlation peak over the noise
+    double doppler;           // Hz
+    double code_phase;        // chips, 0 to 1023
+    double peak_ratio;
+    bool acquired;            // peak_ratio at least ACQ_PEAK_RATIO
+};
+
+struct acq_report {
+    uint32_t counter;         // of the first frame of the snapshot
+    int64_t snapshot_usec;    // CLOCK_MONOTONIC when the snapshot was complete
+    double search_sec;        // wall clock time of the search
+    double cpu_sec;           // CPU time of all search threads
+    unsigned acquired;
+    struct acq_result prn[ACQ_NUM_PRNS];   // PRN 1 at index 0
+};
+
+struct acq;
+
+// Returns NULL and prints the error on failure
+struct acq *acq_create(const struct acq_config *config);
+
+// Stops the search threads and frees acq
+void acq_free(struct acq *acq);
+
+// Frames of one snapshot
+unsigned acq_snapshot_frames(const struct acq *acq);
+
+// Arms a snapshot. Returns false while the previous one is collected or searched or its report
+// was not picked up yet.
+bool acq_start(struct acq *acq);
+
+// data holds whole frames. A jump of the frame counter restarts the snapshot. Returns true if
+// the snapshot got complete and was handed to the search.
+bool acq_feed(struct acq *acq, const void *data, size_t len);
+
+// Returns true and fills report once per finished search
+bool acq_poll(struct acq *acq, struct acq_report *report);
+
+// Waits for the search of a complete snapshot. Returns false if none is searched or its
+// report was already picked up.
+bool acq_wait(struct acq *acq, struct acq_report *report);
+
+#endif
@@ -0,0 +1,352 @@
+/* libusb_example/flexiband_acquire.c
+ *
+ * Quick look whether the antenna sees GPS satellites: takes a few milliseconds of the L1 band
+ * live from the device or from a recording and searches all C/A codes (see flexiband_acq.h).
+ * The L1 carrier is put to 0 Hz by the LO of the RF-board, read from the device or the capture
+ * container. Prints C/N0, Doppler and code phase per PRN and how long the search took.
+ *
+ * Live, the stream keeps running while the threads search, like in a recording; the transfer
+ * callback only copies the frames of the snapshot.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libusb-1.0/libusb.h>
+
+#include "libusb_version_fixes.h"
+#include "flexiband_acq.h"
+#include "flexiband_reader.h"
+#include "flexiband_reduce.h"
+#include "transport.h"
+
+#define INTERFACE     0
+#define ALT_INTERFACE 1
+
+#define VID      0x27ae
+#define PID      0x1016
+#define ENDPOINT 0x83
+#define PKG_LEN (16 * 1024)
+#define NUM_PKG 32
+#define XFER_LEN (NUM_PKG * PKG_LEN)
+#define TIMEOUT_MS 1000
+#define QUEUE_SIZE 4
+
+static volatile sig_atomic_t do_exit = false;
+
+struct options {
+    struct acq_config acq;
+    double if_freq;          // Hz where the L1 carrier is in the samples, NAN to take it from the LO
+    double offset;           // seconds into the recording
+    double repeat;           // seconds between live searches, 0 for one
+    bool all;                // print every PRN, not only the acquired ones
+    const char *recording;   // NULL for live
+};
+
+struct live {
+    struct acq *acq;
+    unsigned pending;
+    bool stopping;
+    int status;
+};
+
+static void sighandler(int signum) {
+    do_exit = true;
+}
+
+static int64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void print_report(const struct options *opt, const struct acq_report *report) {
+    printf("Frame %" PRIu32 ": %u of %d PRNs acquired, searched in %.3f s, %.3f s CPU\n", report->counter,
+           report->acquired, ACQ_NUM_PRNS, report->search_sec, report->cpu_sec);
+    for (int p = 0; p < ACQ_NUM_PRNS; p++) {
+        const struct acq_result *r = &report->prn[p];
+        if (!r->acquired && !opt->all) continue;
+        printf("  PRN %2d  %4.1f dB-Hz  %+6.0f Hz  %7.2f chips  peak ratio %4.2f%s\n", p + 1, r->cn0, r->doppler,
+               r->code_phase, r->peak_ratio, r->acquired ? "" : "  -");
+    }
+    fflush(stdout);
+}
+
+// The shift from the IF given with -i or from the LO of the L1 RF-board in header
+static bool set_shift(struct options *opt, struct capture_header *header) {
+    double shift[NUM_BANDS];
+    double sample_rate = opt->acq.data_rate / FRAME_LEN *
+                         unpack_samples_per_frame((enum payload_layout)opt->acq.layout, BAND_L1);
+    if (!isnan(opt->if_freq)) {
+        opt->acq.shift = -opt->if_freq / sample_rate;
+        return true;
+    }
+    shift[BAND_L1] = NAN;
+    header->layout = opt->acq.layout;
+    reduce_baseband_shifts(header, reduce_carriers, opt->acq.data_rate, shift);
+    if (isnan(shift[BAND_L1])) {
+        fprintf(stderr, "Error: No LO frequency of the L1 RF-board, use -i\n");
+        return false;
+    }
+    opt->acq.shift = shift[BAND_L1];
+    double if_freq = -opt->acq.shift * sample_rate;
+    printf("L1 carrier at %.0f Hz\n", if_freq == 0 ? 0.0 : if_freq);
+    return true;
+}
+
+static int run_recording(struct options *opt) {
+    struct acq_report report;
+    struct capture_reader *reader = reader_open(opt->recording);
+    if (reader == NULL) return 1;
+    int status = 1;
+    if (opt->acq.layout >= NUM_LAYOUTS) {
+        if (!reader->container || reader->header.layout >= NUM_LAYOUTS) {
+            fprintf(stderr, "Error: Unknown layout, use -l\n");
+            goto err_reader;
+        }
+        opt->acq.layout = reader->header.layout;
+    }
+    if (!reader->container && isnan(opt->if_freq)) {
+        fprintf(stderr, "Error: No LO frequencies in %s, use -i\n", opt->recording);
+        goto err_reader;
+    }
+    if (!set_shift(opt, &reader->header)) goto err_reader;
+    struct acq *acq = acq_create(&opt->acq);
+    if (acq == NULL) goto err_reader;
+
+    uint64_t first = (uint64_t)(opt->offset * opt->acq.data_rate / FRAME_LEN);
+    uint64_t chunk = acq_snapshot_frames(acq);
+    bool complete = false;
+    acq_start(acq);
+    for (; first < reader->num_frames && !complete && !do_exit; first += chunk) {
+        uint64_t count = chunk;
+        const uint8_t *frames = reader_frames(reader, first, &count);
+        if (frames) complete = acq_feed(acq, frames, count * FRAME_LEN);
+    }
+    if (complete && acq_wait(acq, &report)) {
+        print_report(opt, &report);
+        status = 0;
+    } else if (!do_exit) {
+        fprintf(stderr, "Error: Fewer than %" PRIu64 " consecutive frames after %.1f s\n", chunk, opt->offset);
+    }
+    acq_free(acq);
+err_reader:
+    reader_close(reader);
+    return status;
+}
+
+static void transfer_callback(struct libusb_transfer *transfer) {
+    struct live *live = (struct live*)transfer->user_data;
+    live->pending--;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "Error: Transfer not completed, status %i\n", transfer->status);
+        live->status = transfer->status;
+        return;
+    }
+    for (int i = 0; i < transfer->num_iso_packets; i++) {
+        if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED) continue;
+        acq_feed(live->acq, libusb_get_iso_packet_buffer_simple(transfer, i), transfer->iso_packet_desc[i].actual_length);
+    }
+    if (!live->stopping && !do_exit) {
+        live->status = transport_submit_transfer(transfer);
+        if (live->status == 0) live->pending++;
+    }
+}
+
+// LO and band of each RF-board from its EEPROM, see README.md
+static void read_rf_boards(libusb_device_handle *dev_handle, struct capture_header *header) {
+    uint8_t request_type = LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN;
+    unsigned char data[8];
+    for (int slot = 0; slot < CAPTURE_NUM_SLOTS; slot++) {
+        struct capture_slot *s = &header->slot[slot];
+        if (transport_control_transfer(dev_handle, request_type, 0x04, 0x00, slot, data, 1, 1000) != 1 ||
+            data[0] == 0x00 || data[0] == 0xff) {
+            continue;
+        }
+        s->present = 1;
+        if (transport_control_transfer(dev_handle, request_type, 0x04, 0x04, slot, data, 4, 1000) == 4) {
+            s->lo = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+        }
+        if (transport_control_transfer(dev_handle, request_type, 0x04, 0x08, slot, data, 8, 1000) == 8) {
+            memcpy(s->band, data, 8);
+        }
+    }
+}
+
+static int run_live(struct options *opt) {
+    libusb_context *ctx;
+    libusb_device_handle *dev_handle;
+    struct libusb_transfer *transfers[QUEUE_SIZE];
+    struct capture_header header;
+    struct live live;
+    struct acq_report report;
+    int status;
+
+    memset(transfers, 0, sizeof(transfers));
+    memset(&live, 0, sizeof(live));
+    memset(&header, 0, sizeof(header));
+    status = transport_init(&ctx);
+    if (status) {
+        fprintf(stderr, "%s\n", libusb_strerror((enum libusb_error)status));
+        return 1;
+    }
+    dev_handle = transport_open_device_with_vid_pid(ctx, VID, PID);
+    if (dev_handle == NULL) {
+        fprintf(stderr, "Error: No device with VID=0x%04X, PID=0x%04X\n", VID, PID);
+        status = 1;
+        goto err_usb;
+    }
+    if (transport_kernel_driver_active(dev_handle, INTERFACE) == 1) transport_detach_kernel_driver(dev_handle, INTERFACE);
+    status = transport_claim_interface(dev_handle, INTERFACE);
+    if (status) {
+        fprintf(stderr, "Claim interface: %s\n", libusb_strerror((enum libusb_error)status));
+        goto err_dev;
+    }
+    status = transport_set_interface_alt_setting(dev_handle, INTERFACE, ALT_INTERFACE);
+    if (status) {
+        fprintf(stderr, "Set alternate interface: %s\n", libusb_strerror((enum libusb_error)status));
+        goto err_intf;
+    }
+    read_rf_boards(dev_handle, &header);
+    if (!set_shift(opt, &header)) {
+        status = 1;
+        goto err_intf;
+    }
+    live.acq = acq_create(&opt->acq);
+    if (live.acq == NULL) {
+        status = 1;
+        goto err_intf;
+    }
+
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        transfers[i] = libusb_alloc_transfer(NUM_PKG);
+        unsigned char *buffer = (unsigned char*)malloc(XFER_LEN);
+        if (transfers[i] == NULL || buffer == NULL) {
+            fprintf(stderr, "Error: allocating transfer\n");
+            free(buffer);
+            status = 1;
+            goto err_alloc;
+        }
+        libusb_fill_iso_transfer(transfers[i], dev_handle, ENDPOINT, buffer, XFER_LEN, NUM_PKG, transfer_callback, &live, TIMEOUT_MS);
+        libusb_set_iso_packet_lengths(transfers[i], PKG_LEN);
+        transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+
+    status = transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x00, 0x00, NULL, 0, 1000);
+    if (status) {
+        fprintf(stderr, "Error: Start command\n%s\n", libusb_strerror((enum libusb_error)status));
+        goto err_alloc;
+    }
+    int64_t start = now_usec(), next = start;
+    acq_start(live.acq);
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        status = transport_submit_transfer(transfers[i]);
+        if (status) {
+            fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)status));
+            break;
+        }
+        live.pending++;
+    }
+
+    bool done = false;
+    while (!status && live.status == 0 && !do_exit && !done) {
+        struct timeval tv = {0, 10000};
+        status = transport_handle_events_timeout_completed(ctx, &tv, NULL);
+        if (acq_poll(live.acq, &report)) {
+            printf("%.3f s after start: ", (now_usec() - start) / 1e6);
+            print_report(opt, &report);
+            next += (int64_t)(opt->repeat * 1e6);
+            done = opt->repeat <= 0;
+        }
+        if (!done && now_usec() >= next) acq_start(live.acq);
+    }
+    live.stopping = true;
+    while (live.pending > 0) transport_handle_events(ctx);
+    transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x01, 0x00, NULL, 0, 1000);
+
+err_alloc:
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        if (transfers[i]) libusb_free_transfer(transfers[i]);
+    }
+    acq_free(live.acq);
+err_intf:
+    transport_release_interface(dev_handle, INTERFACE);
+err_dev:
+    transport_close(dev_handle);
+err_usb:
+    transport_exit(ctx);
+    return status ? status : live.status;
+}
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [-m <ms>] [-D <Hz>] [-j <threads>] [-n <nice>] [-r <bytes/s>] [-i <Hz>] [-t <seconds>] [-a] [-l <layout>] [-f <recording> [-o <seconds>]]\n", program_name);
+    printf("  -m  Code periods summed per cell, default 10\n");
+    printf("  -D  Search Doppler shifts up to +-<Hz>, default 5000\n");
+    printf("  -j  Search threads, default all cores but one\n");
+    printf("  -n  Niceness added to the search threads, default 10\n");
+    printf("  -r  Data rate of the stream in bytes per second, default 40e6\n");
+    printf("  -i  The L1 carrier is at <Hz> in the samples, by default from the LO of the RF-board\n");
+    printf("  -t  Search again every <seconds> until interrupted, default once\n");
+    printf("  -a  Print all PRNs, not only the acquired ones\n");
+    printf("  -l  Payload layout III-1a or III-1b, taken from capture containers by default\n");
+    printf("  -f  Read a recording instead of the device\n");
+    printf("  -o  Start <seconds> into the recording\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct options opt;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    int layout = -1;
+    int c;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.acq.layout = CAPTURE_LAYOUT_UNKNOWN;
+    opt.acq.data_rate = 40e6;
+    opt.acq.ms = 10;
+    opt.acq.max_doppler = 5000;
+    opt.acq.threads = threads > 0 ? (unsigned)threads : 1;
+    opt.acq.nice = 10;
+    opt.if_freq = NAN;
+
+    while ((c = getopt(argc, argv, "m:D:j:n:r:i:t:al:f:o:")) != -1) {
+        switch (c) {
+        case 'm': opt.acq.ms = (unsigned)atoi(optarg); break;
+        case 'D': opt.acq.max_doppler = atof(optarg); break;
+        case 'j': opt.acq.threads = (unsigned)atoi(optarg); break;
+        case 'n': opt.acq.nice = atoi(optarg); break;
+        case 'r': opt.acq.data_rate = atof(optarg); break;
+        case 'i': opt.if_freq = atof(optarg); break;
+        case 't': opt.repeat = atof(optarg); break;
+        case 'a': opt.all = true; break;
+        case 'l':
+            for (layout = 0; layout < NUM_LAYOUTS && strcmp(layout_names[layout], optarg); layout++) {}
+            if (layout == NUM_LAYOUTS) {
+                fprintf(stderr, "Error: Unknown layout %s\n", optarg);
+                return 1;
+            }
+            opt.acq.layout = (uint32_t)layout;
+            break;
+        case 'f': opt.recording = optarg; break;
+        case 'o': opt.offset = atof(optarg); break;
+        default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (opt.acq.ms == 0 || opt.acq.threads == 0 || opt.acq.data_rate <= 0 || opt.acq.max_doppler < 0 ||
+        (opt.recording == NULL && layout < 0)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+    signal(SIGQUIT, sighandler);
+
+    return opt.recording ? run_recording(&opt) : run_live(&opt);
+}
@@ -0,0 +1,461 @@
+/* libusb_example/flexiband_align.c
+ *
+ * Time alignment of recordings of several devices that saw the same signals, to a fraction
+ * of a sample. One band of every recording is cross-correlated with the reference recording
+ * (the first one) in sparse windows spread over the file, so only those pages are read even
+ * of terabyte recordings. A window of the reference holds w/2 samples and is searched in w
+ * samples of the other recording around the predicted position, i.e. over +-w/4 samples;
+ * the peak is interpolated to a fraction of a sample.
+ *
+ * Windows are processed in batches of one per thread. The first batch is placed by the start
+ * times in the capture containers or by -o, later ones by a linear fit of offset and drift
+ * over the windows found so far, so a drift of the sample clocks is followed along the file.
+ * The table of matched windows and the fit are written to <recording>.align, which the
+ * reader loads (see flexiband_reader.h).
+ *
+ * The correlation is coherent, so the devices have to share their reference clock, or their
+ * frequency difference has to stay well below the inverse of a window. With -e the power
+ * envelopes are correlated instead, for strong signals received with independent clocks.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flexiband_fft.h"
+#include "flexiband_reader.h"
+#include "flexiband_unpack.h"
+
+#define MIN_QUALITY 25.0   // peak over mean; noise alone reaches about ln(w/2)
+
+struct options {
+    enum band band;
+    enum payload_layout layout;
+    unsigned window;          // samples searched, power of two
+    unsigned num_windows;
+    int num_threads;
+    double data_rate;         // bytes per second, for the container start times
+    bool envelope;
+    bool have_offset;
+    double offset;            // samples, other minus reference, -o
+    double min_quality;
+};
+
+struct window {
+    uint64_t ref_sample;      // first sample of the reference window
+    double predicted;         // offset the search is centred on
+    double offset;            // found: the reference sample s is sample s + offset of the other
+    double quality;
+    bool valid;
+};
+
+struct worker {
+    pthread_t thread;
+    const struct options *opt;
+    const struct fft *fft;
+    struct capture_reader *ref;
+    struct capture_reader *other;
+    struct window *windows;
+    unsigned first;           // windows of the batch taken by this worker
+    unsigned step;
+    unsigned end;
+    float *a_re, *a_im;       // reference, zero padded
+    float *b_re, *b_im;
+    int8_t *samples;          // one frame
+    double cpu_sec;
+};
+
+static double thread_cpu_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Samples [first, first + count) of the band into re and im. Returns false past the end of
+// the recording.
+static bool load_samples(struct worker *w, struct capture_reader *reader, uint64_t first, unsigned count, float *re,
+                         float *im) {
+    unsigned per_frame = unpack_samples_per_frame(w->opt->layout, w->opt->band);
+    uint64_t frame = first / per_frame;
+    unsigned skip = (unsigned)(first % per_frame), pos = 0;
+    uint64_t frames = (skip + (uint64_t)count + per_frame - 1) / per_frame, got = frames;
+    const uint8_t *data = reader_frames(reader, frame, &got);
+    if (data == NULL || got < frames) return false;
+
+    int8_t *out[NUM_BANDS] = {NULL, NULL, NULL};
+    out[w->opt->band] = w->samples;
+    for (uint64_t f = 0; f < frames && pos < count; f++, skip = 0) {
+        unpack_frame(w->opt->layout, data + f * FRAME_LEN, out);
+        for (unsigned k = skip; k < per_frame && pos < count; k++, pos++) {
+            re[pos] = w->samples[2 * k];
+            im[pos] = w->samples[2 * k + 1];
+        }
+    }
+    if (w->opt->envelope) {
+        for (unsigned k = 0; k < count; k++) {
+            re[k] = re[k] * re[k] + im[k] * im[k];
+            im[k] = 0;
+        }
+    }
+    // Without the mean, whose correlation over all lags would bury the peak
+    double mean_re = 0, mean_im = 0;
+    for (unsigned k = 0; k < count; k++) {
+        mean_re += re[k];
+        mean_im += im[k];
+    }
+    mean_re /= count;
+    mean_im /= count;
+    for (unsigned k = 0; k < count; k++) {
+        re[k] -= (float)mean_re;
+        im[k] -= (float)mean_im;
+    }
+    return true;
+}
+
+static void correlate(struct worker *w, struct window *win) {
+    unsigned n = w->opt->window, half = n / 2, quarter = n / 4;
+    double start = win->ref_sample + win->predicted - quarter;
+    win->valid = false;
+    if (start < 0) return;
+    uint64_t other_first = (uint64_t)llround(start);
+
+    if (!load_samples(w, w->ref, win->ref_sample, half, w->a_re, w->a_im) ||
+        !load_samples(w, w->other, other_first, n, w->b_re, w->b_im)) {
+        return;
+    }
+    memset(w->a_re + half, 0, half * sizeof(float));
+    memset(w->a_im + half, 0, half * sizeof(float));
+    fft_forward(w->fft, w->a_re, w->a_im);
+    fft_forward(w->fft, w->b_re, w->b_im);
+
+    // B conj(A): lag t holds sum b[k + t] conj(a[k]), without wrap for t up to n / 2
+    for (unsigned k = 0; k < n; k++) {
+        float re = w->b_re[k] * w->a_re[k] + w->b_im[k] * w->a_im[k];
+        float im = w->b_im[k] * w->a_re[k] - w->b_re[k] * w->a_im[k];
+        w->b_re[k] = re;
+        w->b_im[k] = im;
+    }
+    fft_inverse(w->fft, w->b_re, w->b_im);
+
+    double sum = 0, peak = 0;
+    unsigned lag = 0;
+    for (unsigned t = 0; t <= half; t++) {
+        double p = (double)w->b_re[t] * w->b_re[t] + (double)w->b_im[t] * w->b_im[t];
+        w->a_re[t] = (float)p;
+        sum += p;
+        if (p > peak) {
+            peak = p;
+            lag = t;
+        }
+    }
+    double mean = sum / (half + 1);
+    win->quality = mean > 0 ? peak / mean : 0;
+    if (win->quality < w->opt->min_quality || lag == 0 || lag == half) return;
+
+    // Parabola through the peak and its neighbours
+    double l = w->a_re[lag - 1], c = w->a_re[lag], r = w->a_re[lag + 1];
+    double frac = l - 2 * c + r < 0 ? 0.5 * (l - r) / (l - 2 * c + r) : 0;
+    win->offset = other_first + lag + frac - (double)win->ref_sample;
+    win->valid = true;
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *w = (struct worker*)arg;
+    double start = thread_cpu_sec();
+    for (unsigned i = w->first; i < w->end; i += w->step) correlate(w, &w->windows[i]);
+    w->cpu_sec += thread_cpu_sec() - start;
+    return NULL;
+}
+
+// Least squares line of the offset over the reference sample. Returns the valid windows.
+static unsigned fit(const struct window *windows, unsigned count, double *offset, double *drift) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    unsigned n = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (!windows[i].valid) continue;
+        double x = (double)windows[i].ref_sample, y = windows[i].offset;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        n++;
+    }
+    if (n == 0) return 0;
+    double det = n * sxx - sx * sx;
+    if (n == 1 || det <= 0) {
+        *offset = sy / n;
+        *drift = 0;
+    } else {
+        *drift = (n * sxy - sx * sy) / det;
+        *offset = (sy - *drift * sx) / n;
+    }
+    return n;
+}
+
+// Offset of other to reference in samples from the start times of both containers
+static double start_offset(const struct options *opt, const struct capture_reader *ref, const struct capture_reader *other) {
+    if (opt->have_offset) return opt->offset;
+    if (!ref->container || !other->container) return 0;
+    double rate = opt->data_rate / FRAME_LEN * unpack_samples_per_frame(opt->layout, opt->band);
+    return -(double)(other->header.start_realtime_ns - ref->header.start_realtime_ns) / 1e9 * rate;
+}
+
+static int write_table(const char *filename, const char *reference, const struct options *opt,
+                       const struct window *windows, unsigned count, double offset, double drift) {
+    char path[4096];
+    struct align_header header;
+    unsigned per_frame = unpack_samples_per_frame(opt->layout, opt->band);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ALIGN_MAGIC, sizeof(header.magic));
+    header.version = ALIGN_VERSION;
+    header.band = opt->band;
+    header.samples_per_frame = per_frame;
+    // In frames of this recording: reference = frame * (1 + drift) + offset
+    header.drift = -drift / (1 + drift);
+    header.offset = -offset / (1 + drift) / per_frame;
+    snprintf(header.reference, sizeof(header.reference), "%s", reference);
+    for (unsigned i = 0; i < count; i++) header.num_entries += windows[i].valid;
+
+    snprintf(path, sizeof(path), "%s.align", filename);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s\n%s\n", path, strerror(errno));
+        return -1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (unsigned i = 0; i < count && ok; i++) {
+        if (!windows[i].valid) continue;
+        struct align_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.frame = (windows[i].ref_sample + windows[i].offset) / per_frame;
+        entry.reference_frame = (double)windows[i].ref_sample / per_frame;
+        entry.quality = (float)windows[i].quality;
+        ok = fwrite(&entry, sizeof(entry), 1, fp) == 1;
+    }
+    if (fclose(fp)) ok = false;
+    if (!ok) {
+        fprintf(stderr, "Failed to write %s\n%s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int align(const struct options *opt, const struct fft *fft, struct worker *workers, const char *reference,
+                 struct capture_reader *ref, const char *filename) {
+    struct capture_reader *other = reader_open(filename);
+    if (other == NULL) return 1;
+    int status = 1;
+    unsigned per_frame = unpack_samples_per_frame(opt->layout, opt->band);
+    uint64_t ref_samples = ref->num_frames * per_frame;
+    unsigned n = opt->num_windows;
+    struct window *windows = (struct window*)calloc(n, sizeof(struct window));
+    if (windows == NULL) {
+        fprintf(stderr, "Error: allocating windows\n");
+        goto err_reader;
+    }
+
+    // Spread over the reference, leaving room for the search before the first window
+    uint64_t lo = opt->window / 4, hi = ref_samples > opt->window ? ref_samples - opt->window : 0;
+    if (hi < lo) {
+        fprintf(stderr, "Error: %s is shorter than a window\n", reference);
+        goto err_windows;
+    }
+    for (unsigned i = 0; i < n; i++) windows[i].ref_sample = n > 1 ? lo + (hi - lo) * i / (n - 1) : lo;
+
+    double offset = start_offset(opt, ref, other), drift = 0;
+    double cpu_sec = 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (unsigned batch = 0; batch < n; batch += opt->num_threads) {
+        unsigned end = batch + opt->num_threads < n ? batch + opt->num_threads : n;
+        for (unsigned i = batch; i < end; i++) windows[i].predicted = offset + drift * windows[i].ref_sample;
+        int started = 0;
+        for (int t = 0; t < opt->num_threads && batch + t < end; t++) {
+            struct worker *w = &workers[t];
+            w->ref = ref;
+            w->other = other;
+            w->windows = windows;
+            w->first = batch + t;
+            w->step = opt->num_threads;
+            w->end = end;
+            w->cpu_sec = 0;
+            if (pthread_create(&w->thread, NULL, worker_thread, w)) {
+                fprintf(stderr, "Error: Start worker\n");
+                break;
+            }
+            started++;
+        }
+        for (int t = 0; t < started; t++) {
+            pthread_join(workers[t].thread, NULL);
+            cpu_sec += workers[t].cpu_sec;
+        }
+        if (started == 0) goto err_windows;
+        fit(windows, end, &offset, &drift);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("%s against %s, %s:\n", filename, reference, band_names[opt->band]);
+    printf("  reference frame     offset/samples  quality\n");
+    for (unsigned i = 0; i < n; i++) {
+        if (windows[i].valid) {
+            printf("  %15.3f  %16.3f  %7.1f\n", (double)windows[i].ref_sample / per_frame, windows[i].offset,
+                   windows[i].quality);
+        } else {
+            printf("  %15.3f  %16s  %7.1f\n", (double)windows[i].ref_sample / per_frame, "-", windows[i].quality);
+        }
+    }
+    unsigned found = fit(windows, n, &offset, &drift);
+    if (found == 0) {
+        fprintf(stderr, "Error: No window of %s matched\n", filename);
+        goto err_windows;
+    }
+    printf("  %u of %u windows matched: offset %.3f samples at the start, drift %.3f ppm; %.2f s, %.2f s CPU\n",
+           found, n, offset, drift * 1e6, elapsed, cpu_sec);
+    status = write_table(filename, reference, opt, windows, n, offset, drift) ? 1 : 0;
+
+err_windows:
+    free(windows);
+err_reader:
+    reader_close(other);
+    return status;
+}
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [-b <band>] [-w <samples>] [-n <windows>] [-j <threads>] [-o <samples>] [-r <bytes/s>] [-q <quality>] [-e] [-l <layout>] <reference> <recording>...\n", program_name);
+    printf("  -b  Band to correlate, L1, L2 or L5, default L1\n");
+    printf("  -w  Samples per window, power of two, default 262144; offsets are searched within +-1/4 of it\n");
+    printf("  -n  Windows spread over the reference, default 16\n");
+    printf("  -j  Threads (default: online CPUs)\n");
+    printf("  -o  Start offset of the recordings to the reference in samples, by default from the start\n"
+           "      times of the capture containers\n");
+    printf("  -r  Data rate in bytes per second for the start times, default 40e6\n");
+    printf("  -q  Minimum correlation peak over its mean, default %.0f\n", MIN_QUALITY);
+    printf("  -e  Correlate the power envelopes, for devices with independent clocks\n");
+    printf("  -l  Payload layout I-3, III-1a or III-1b, taken from capture containers by default\n");
+    printf("Writes <recording>.align for every recording\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct options opt;
+    int layout = -1;
+    int status = 0;
+    int c;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.band = BAND_L1;
+    opt.window = 262144;
+    opt.num_windows = 16;
+    opt.num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    opt.data_rate = 40e6;
+    opt.min_quality = MIN_QUALITY;
+
+    while ((c = getopt(argc, argv, "b:w:n:j:o:r:q:el:")) != -1) {
+        switch (c) {
+        case 'b':
+            for (opt.band = BAND_L1; opt.band < NUM_BANDS && strcmp(band_names[opt.band], optarg); opt.band = (enum band)(opt.band + 1)) {}
+            if (opt.band == NUM_BANDS) {
+                fprintf(stderr, "Error: Unknown band %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'w': opt.window = (unsigned)atoi(optarg); break;
+        case 'n': opt.num_windows = (unsigned)atoi(optarg); break;
+        case 'j': opt.num_threads = atoi(optarg); break;
+        case 'o':
+            opt.offset = atof(optarg);
+            opt.have_offset = true;
+            break;
+        case 'r': opt.data_rate = atof(optarg); break;
+        case 'q': opt.min_quality = atof(optarg); break;
+        case 'e': opt.envelope = true; break;
+        case 'l':
+            for (layout = 0; layout < NUM_LAYOUTS && strcmp(layout_names[layout], optarg); layout++) {}
+            if (layout == NUM_LAYOUTS) {
+                fprintf(stderr, "Error: Unknown layout %s\n", optarg);
+                return 1;
+            }
+            break;
+        default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 2 || opt.num_windows == 0 || opt.num_threads <= 0 || opt.window < 16 || opt.data_rate <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct fft *fft = fft_create(opt.window);
+    if (fft == NULL) {
+        fprintf(stderr, "Error: Window of %u samples is not a power of two\n", opt.window);
+        return 1;
+    }
+    const char *reference = argv[optind];
+    struct capture_reader *ref = reader_open(reference);
+    if (ref == NULL) {
+        fft_free(fft);
+        return 1;
+    }
+    if (layout < 0) {
+        if (!ref->container || ref->header.layout >= NUM_LAYOUTS) {
+            fprintf(stderr, "Error: Unknown layout, use -l\n");
+            status = 1;
+            goto err_ref;
+        }
+        layout = (int)ref->header.layout;
+    }
+    opt.layout = (enum payload_layout)layout;
+    if (unpack_samples_per_frame(opt.layout, opt.band) == 0) {
+        fprintf(stderr, "Error: Layout %s has no %s\n", layout_names[opt.layout], band_names[opt.band]);
+        status = 1;
+        goto err_ref;
+    }
+
+    struct worker *workers = (struct worker*)calloc(opt.num_threads, sizeof(struct worker));
+    if (workers == NULL) {
+        fprintf(stderr, "Error: allocating workers\n");
+        status = 1;
+        goto err_ref;
+    }
+    for (int t = 0; t < opt.num_threads; t++) {
+        struct worker *w = &workers[t];
+        w->opt = &opt;
+        w->fft = fft;
+        w->a_re = (float*)malloc(opt.window * sizeof(float));
+        w->a_im = (float*)malloc(opt.window * sizeof(float));
+        w->b_re = (float*)malloc(opt.window * sizeof(float));
+        w->b_im = (float*)malloc(opt.window * sizeof(float));
+        w->samples = (int8_t*)malloc(2 * FRAME_MAX_PAYLOAD);
+        if (w->a_re == NULL || w->a_im == NULL || w->b_re == NULL || w->b_im == NULL || w->samples == NULL) {
+            fprintf(stderr, "Error: allocating workers\n");
+            status = 1;
+            goto err_workers;
+        }
+    }
+
+    for (int i = optind + 1; i < argc; i++) {
+        if (align(&opt, fft, workers, reference, ref, argv[i])) status = 1;
+    }
+
+err_workers:
+    for (int t = 0; t < opt.num_threads; t++) {
+        free(workers[t].a_re);
+        free(workers[t].a_im);
+        free(workers[t].b_re);
+        free(workers[t].b_im);
+        free(workers[t].samples);
+    }
+    free(workers);
+err_ref:
+    reader_close(ref);
+    fft_free(fft);
+    return status;
+}
@@ -0,0 +1,631 @@
+/* libusb_example/flexiband_archive.c
+ *
+ * Writer and reader of compressed archives, see flexiband_archive.h.
+ *
+ * The writer fills block buffers with the frame stream; full blocks are queued for a pool of
+ * workers that encode and deflate them. Blocks are written in order by whichever worker
+ * finishes the oldest block. Block buffers are used round robin, so the producer only has to
+ * wait if every buffer is still being compressed or written.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "flexiband_archive.h"
+#include "flexiband_io.h"
+
+#define BLOCK_LEN        (ARCHIVE_BLOCK_FRAMES * FRAME_LEN)
+#define MAX_THREADS      64
+#define JOBS_PER_THREAD  2
+
+enum job_state { JOB_FREE, JOB_QUEUED, JOB_BUSY, JOB_DONE };
+
+struct job {
+    enum job_state state;
+    uint64_t seq;
+    uint8_t *raw;                  // frame stream
+    size_t raw_len;
+    uint8_t *encoded;
+    uint8_t *compressed;
+    struct archive_block_header header;
+    uint32_t first_counter;
+};
+
+struct archive_writer {
+    int fd;
+    unsigned payload_len;
+    int level;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[MAX_THREADS];
+    int num_threads;
+    struct job *jobs;
+    int num_jobs;
+    struct job *filling;           // owned by the producer
+    uint64_t next_seq;             // seq of the next block to fill
+    uint64_t next_write;           // seq of the next block to write
+    bool writing;                  // a worker writes blocks
+    bool stopping;
+    int error;                     // errno of the first failure
+    uint64_t offset;               // file offset of the next block
+    uint64_t frames;               // frames in written blocks
+    struct archive_index_entry *index;
+    uint64_t num_index;
+    uint64_t cap_index;
+    struct archive_statistics stat;
+};
+
+static int read_all(int fd, void *data, size_t len, off_t offset) {
+    char *p = (char*)data;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static size_t put_varint(uint8_t *out, uint32_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+    return len;
+}
+
+static size_t get_varint(const uint8_t *in, size_t avail, uint32_t *value) {
+    size_t len = 0;
+    *value = 0;
+    for (int shift = 0; len < avail && shift < 35; shift += 7) {
+        uint8_t b = in[len++];
+        *value |= (uint32_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) return len;
+    }
+    return 0;
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+    memcpy(out, &value, 4);
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+    uint32_t value;
+    memcpy(&value, in, 4);
+    return value;
+}
+
+static bool is_zero(const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i]) return false;
+    }
+    return true;
+}
+
+// Worst case of the encoding: every frame with both exceptions and a five byte delta
+static size_t encoded_bound(size_t raw_len) {
+    return 8 + raw_len + (raw_len / FRAME_LEN) * (5 + 3 + 2);
+}
+
+// Encodes the frame stream of a block as described in flexiband_archive.h
+static size_t encode_block(unsigned payload_len, const uint8_t *raw, size_t raw_len, uint8_t *out,
+                           uint32_t *first_counter) {
+    unsigned padding_len = FRAME_LEN - FRAME_HEADER_LEN - payload_len;
+    uint32_t num_frames = raw_len / FRAME_LEN;
+    uint32_t num_exceptions = 0;
+    size_t pos = 8;
+
+    *first_counter = num_frames ? frame_counter(raw) : 0;
+    for (uint32_t i = 1; i < num_frames; i++) {
+        const uint8_t *frame = raw + (size_t)i * FRAME_LEN;
+        pos += put_varint(out + pos, frame_counter(frame) - frame_counter(frame - FRAME_LEN) - 1);
+    }
+    for (uint32_t i = 0; i < num_frames; i++) {
+        const uint8_t *frame = raw + (size_t)i * FRAME_LEN;
+        uint8_t kind = 0;
+        if (!frame_has_preamble(frame)) kind |= ARCHIVE_RAW_PREAMBLE;
+        if (!is_zero(frame + FRAME_LEN - padding_len, padding_len)) kind |= ARCHIVE_RAW_PADDING;
+        if (kind == 0) continue;
+        out[pos++] = i & 0xff;
+        out[pos++] = i >> 8;
+        out[pos++] = kind;
+        if (kind & ARCHIVE_RAW_PREAMBLE) {
+            memcpy(out + pos, frame, 2);
+            pos += 2;
+        }
+        if (kind & ARCHIVE_RAW_PADDING) {
+            memcpy(out + pos, frame + FRAME_LEN - padding_len, padding_len);
+            pos += padding_len;
+        }
+        num_exceptions++;
+    }
+    for (uint32_t i = 0; i < num_frames; i++) {
+        memcpy(out + pos, raw + (size_t)i * FRAME_LEN + FRAME_HEADER_LEN, payload_len);
+        pos += payload_len;
+    }
+    memcpy(out + pos, raw + (size_t)num_frames * FRAME_LEN, raw_len % FRAME_LEN);
+    pos += raw_len % FRAME_LEN;
+
+    put_u32(out, *first_counter);
+    put_u32(out + 4, num_exceptions);
+    return pos;
+}
+
+static long decode_block(unsigned payload_len, const uint8_t *in, size_t len, uint32_t num_frames, uint32_t tail_len,
+                         uint8_t *out) {
+    unsigned padding_len = FRAME_LEN - FRAME_HEADER_LEN - payload_len;
+    size_t pos = 8;
+    if (len < 8 || num_frames > ARCHIVE_BLOCK_FRAMES || tail_len >= FRAME_LEN) return -1;
+    uint32_t counter = get_u32(in);
+    uint32_t num_exceptions = get_u32(in + 4);
+
+    for (uint32_t i = 0; i < num_frames; i++) {
+        uint8_t *frame = out + (size_t)i * FRAME_LEN;
+        if (i > 0) {
+            uint32_t delta;
+            size_t n = get_varint(in + pos, len - pos, &delta);
+            if (n == 0) return -1;
+            pos += n;
+            counter += delta + 1;
+        }
+        frame_set_header(frame, counter);
+        memset(frame + FRAME_LEN - padding_len, 0, padding_len);
+    }
+    for (uint32_t e = 0; e < num_exceptions; e++) {
+        if (pos + 3 > len) return -1;
+        uint32_t i = in[pos] | (in[pos + 1] << 8);
+        uint8_t kind = in[pos + 2];
+        pos += 3;
+        if (i >= num_frames) return -1;
+        uint8_t *frame = out + (size_t)i * FRAME_LEN;
+        if (kind & ARCHIVE_RAW_PREAMBLE) {
+            if (pos + 2 > len) return -1;
+            memcpy(frame, in + pos, 2);
+            pos += 2;
+        }
+        if (kind & ARCHIVE_RAW_PADDING) {
+            if (pos + padding_len > len) return -1;
+            memcpy(frame + FRAME_LEN - padding_len, in + pos, padding_len);
+            pos += padding_len;
+        }
+    }
+    if (pos + (size_t)num_frames * payload_len + tail_len != len) return -1;
+    for (uint32_t i = 0; i < num_frames; i++) {
+        memcpy(out + (size_t)i * FRAME_LEN + FRAME_HEADER_LEN, in + pos, payload_len);
+        pos += payload_len;
+    }
+    memcpy(out + (size_t)num_frames * FRAME_LEN, in + pos, tail_len);
+    return (long)num_frames * FRAME_LEN + tail_len;
+}
+
+/* ---------------------------------------------------------------------------------------
+ * Writer
+ */
+
+static double thread_cpu_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_error(struct archive_writer *writer, int error) {
+    if (writer->error == 0) writer->error = error ? error : EIO;
+    pthread_cond_broadcast(&writer->cond);
+}
+
+static int compress_job(struct archive_writer *writer, z_stream *zs, struct job *job) {
+    size_t encoded_len = encode_block(writer->payload_len, job->raw, job->raw_len, job->encoded, &job->first_counter);
+    size_t bound = deflateBound(zs, encoded_len);
+
+    deflateReset(zs);
+    zs->next_in = job->encoded;
+    zs->avail_in = encoded_len;
+    zs->next_out = job->compressed;
+    zs->avail_out = bound;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) return -1;
+
+    memset(&job->header, 0, sizeof(job->header));
+    memcpy(job->header.magic, ARCHIVE_BLOCK_MAGIC, sizeof(job->header.magic));
+    job->header.encoded_len = encoded_len;
+    job->header.compressed_len = zs->total_out;
+    job->header.crc = crc32(0, job->encoded, encoded_len);
+    job->header.num_frames = job->raw_len / FRAME_LEN;
+    job->header.tail_len = job->raw_len % FRAME_LEN;
+    return 0;
+}
+
+static bool add_index(struct archive_writer *writer, const struct archive_index_entry *entry) {
+    if (writer->num_index == writer->cap_index) {
+        uint64_t cap = writer->cap_index ? 2 * writer->cap_index : 1024;
+        struct archive_index_entry *index = (struct archive_index_entry*)realloc(writer->index, cap * sizeof(*index));
+        if (index == NULL) return false;
+        writer->index = index;
+        writer->cap_index = cap;
+    }
+    writer->index[writer->num_index++] = *entry;
+    return true;
+}
+
+// Writes all finished blocks that are next in order. Called with the lock held by the worker
+// that finished a block; only one worker writes at a time.
+static void write_done_jobs(struct archive_writer *writer) {
+    if (writer->writing) return;
+    writer->writing = true;
+    for (;;) {
+        struct job *job = &writer->jobs[writer->next_write % writer->num_jobs];
+        if (job->state != JOB_DONE || job->seq != writer->next_write) break;
+        struct archive_index_entry entry;
+        entry.offset = writer->offset;
+        entry.first_frame = writer->frames;
+        entry.num_frames = job->header.num_frames;
+        entry.first_counter = job->first_counter;
+        job->header.first_frame = writer->frames;
+        pthread_mutex_unlock(&writer->lock);
+
+        int error = 0;
+        if (write_all(writer->fd, &job->header, sizeof(job->header)) ||
+            write_all(writer->fd, job->compressed, job->header.compressed_len)) {
+            error = errno;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        if (error || !add_index(writer, &entry)) set_error(writer, error ? error : ENOMEM);
+        writer->offset += sizeof(job->header) + job->header.compressed_len;
+        writer->frames += job->header.num_frames;
+        writer->stat.raw_bytes += job->raw_len;
+        writer->stat.compressed_bytes += sizeof(job->header) + job->header.compressed_len;
+        writer->stat.blocks++;
+        job->state = JOB_FREE;
+        writer->next_write++;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    writer->writing = false;
+}
+
+static void *worker_thread(void *arg) {
+    struct archive_writer *writer = (struct archive_writer*)arg;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int level = writer->level > 0 ? writer->level : 1;
+    int strategy = writer->level > 0 ? Z_DEFAULT_STRATEGY : Z_HUFFMAN_ONLY;
+    bool ok = deflateInit2(&zs, level, Z_DEFLATED, 15, 8, strategy) == Z_OK;
+
+    pthread_mutex_lock(&writer->lock);
+    if (!ok) set_error(writer, ENOMEM);
+    for (;;) {
+        struct job *job = NULL;
+        for (int i = 0; i < writer->num_jobs && job == NULL; i++) {
+            if (writer->jobs[i].state == JOB_QUEUED) job = &writer->jobs[i];
+        }
+        if (job == NULL) {
+            if (writer->stopping) break;
+            pthread_cond_wait(&writer->cond, &writer->lock);
+            continue;
+        }
+        job->state = JOB_BUSY;
+        pthread_mutex_unlock(&writer->lock);
+
+        double start = thread_cpu_sec();
+        int status = ok ? compress_job(writer, &zs, job) : -1;
+        double cpu = thread_cpu_sec() - start;
+
+        pthread_mutex_lock(&writer->lock);
+        writer->stat.cpu_sec += cpu;
+        if (status) set_error(writer, EIO);
+        job->state = JOB_DONE;
+        write_done_jobs(writer);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    deflateEnd(&zs);
+    return NULL;
+}
+
+// Takes the next block buffer in order, waiting until it is written
+static struct job *next_job(struct archive_writer *writer) {
+    struct job *job = &writer->jobs[writer->next_seq % writer->num_jobs];
+    pthread_mutex_lock(&writer->lock);
+    if (job->state != JOB_FREE) writer->stat.stalls++;
+    while (job->state != JOB_FREE && writer->error == 0) pthread_cond_wait(&writer->cond, &writer->lock);
+    pthread_mutex_unlock(&writer->lock);
+    if (writer->error) return NULL;
+    job->seq = writer->next_seq++;
+    job->raw_len = 0;
+    return job;
+}
+
+static void queue_job(struct archive_writer *writer, struct job *job) {
+    pthread_mutex_lock(&writer->lock);
+    job->state = JOB_QUEUED;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+struct archive_writer *archive_create(const char *filename, const struct capture_header *capture, unsigned payload_len,
+                                      int num_threads, int level) {
+    struct archive_header header;
+    struct archive_writer *writer = (struct archive_writer*)calloc(1, sizeof(struct archive_writer));
+    if (writer == NULL) {
+        fprintf(stderr, "Error: allocating archive writer\n");
+        return NULL;
+    }
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    if (payload_len > FRAME_MAX_PAYLOAD) payload_len = FRAME_MAX_PAYLOAD;
+    writer->payload_len = payload_len;
+    writer->level = level;
+    writer->num_jobs = num_threads * JOBS_PER_THREAD + 1;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+
+    writer->jobs = (struct job*)calloc(writer->num_jobs, sizeof(struct job));
+    if (writer->jobs == NULL) goto err_alloc;
+    for (int i = 0; i < writer->num_jobs; i++) {
+        struct job *job = &writer->jobs[i];
+        job->raw = (uint8_t*)malloc(BLOCK_LEN + FRAME_LEN);
+        job->encoded = (uint8_t*)malloc(encoded_bound(BLOCK_LEN + FRAME_LEN));
+        job->compressed = (uint8_t*)malloc(compressBound(encoded_bound(BLOCK_LEN + FRAME_LEN)) + 1024);
+        if (job->raw == NULL || job->encoded == NULL || job->compressed == NULL) goto err_alloc;
+    }
+
+    writer->fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (writer->fd < 0) {
+        fprintf(stderr, "Failed to open %s\n%s\n", filename, strerror(errno));
+        goto err_free;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = ARCHIVE_VERSION;
+    header.byte_order = CAPTURE_BYTE_ORDER;
+    header.frame_len = FRAME_LEN;
+    header.payload_len = payload_len;
+    header.block_frames = ARCHIVE_BLOCK_FRAMES;
+    header.capture_header_len = capture ? CAPTURE_HEADER_LEN : 0;
+    if (write_all(writer->fd, &header, sizeof(header))) goto err_write;
+    writer->offset = sizeof(header);
+    if (capture) {
+        uint8_t block[CAPTURE_HEADER_LEN];
+        memset(block, 0, sizeof(block));
+        memcpy(block, capture, sizeof(*capture));
+        ((struct capture_header*)block)->header_len = CAPTURE_HEADER_LEN;
+        if (write_all(writer->fd, block, sizeof(block))) goto err_write;
+        writer->offset += sizeof(block);
+    }
+
+    writer->filling = next_job(writer);
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&writer->threads[i], NULL, worker_thread, writer)) break;
+        writer->num_threads++;
+    }
+    if (writer->num_threads == 0) {
+        fprintf(stderr, "Error: Start archive workers\n");
+        goto err_close;
+    }
+    return writer;
+
+err_write:
+    fprintf(stderr, "Failed to write %s\n%s\n", filename, strerror(errno));
+err_close:
+    close(writer->fd);
+    goto err_free;
+err_alloc:
+    fprintf(stderr, "Error: allocating archive buffers\n");
+err_free:
+    for (int i = 0; writer->jobs && i < writer->num_jobs; i++) {
+        free(writer->jobs[i].raw);
+        free(writer->jobs[i].encoded);
+        free(writer->jobs[i].compressed);
+    }
+    free(writer->jobs);
+    pthread_cond_destroy(&writer->cond);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+    return NULL;
+}
+
+int archive_write(struct archive_writer *writer, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t*)data;
+    if (writer->filling == NULL) {
+        errno = writer->error;
+        return -1;
+    }
+    while (len > 0) {
+        struct job *job = writer->filling;
+        size_t n = BLOCK_LEN - job->raw_len < len ? BLOCK_LEN - job->raw_len : len;
+        memcpy(job->raw + job->raw_len, p, n);
+        job->raw_len += n;
+        p += n;
+        len -= n;
+        if (job->raw_len == BLOCK_LEN) {
+            queue_job(writer, job);
+            writer->filling = next_job(writer);
+            if (writer->filling == NULL) {
+                errno = writer->error;
+                return -1;
+            }
+        }
+    }
+    return writer->error ? -1 : 0;
+}
+
+int archive_close(struct archive_writer *writer, struct archive_statistics *stat) {
+    struct archive_trailer trailer;
+    int status = 0;
+
+    if (writer->filling && writer->filling->raw_len > 0) queue_job(writer, writer->filling);
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    for (int i = 0; i < writer->num_threads; i++) pthread_join(writer->threads[i], NULL);
+
+    if (writer->error == 0) {
+        memset(&trailer, 0, sizeof(trailer));
+        memcpy(trailer.magic, ARCHIVE_INDEX_MAGIC, sizeof(trailer.magic));
+        trailer.index_offset = writer->offset;
+        trailer.num_blocks = writer->num_index;
+        trailer.data_len = writer->stat.raw_bytes;
+        if (write_all(writer->fd, writer->index, writer->num_index * sizeof(struct archive_index_entry)) ||
+            write_all(writer->fd, &trailer, sizeof(trailer))) {
+            writer->error = errno;
+        }
+    }
+    if (close(writer->fd) && writer->error == 0) writer->error = errno;
+    if (writer->error) {
+        errno = writer->error;
+        status = -1;
+    }
+    if (stat) *stat = writer->stat;
+
+    for (int i = 0; i < writer->num_jobs; i++) {
+        free(writer->jobs[i].raw);
+        free(writer->jobs[i].encoded);
+        free(writer->jobs[i].compressed);
+    }
+    free(writer->jobs);
+    free(writer->index);
+    pthread_cond_destroy(&writer->cond);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+    return status;
+}
+
+/* ---------------------------------------------------------------------------------------
+ * Reader
+ */
+
+// Rebuilds the index from the block headers of an archive without trailer
+static int scan_blocks(struct archive_reader *reader, uint64_t offset, uint64_t file_len) {
+    uint64_t cap = 0;
+    struct archive_block_header header;
+    while (offset + sizeof(header) <= file_len) {
+        if (read_all(reader->fd, &header, sizeof(header), offset) ||
+            memcmp(header.magic, ARCHIVE_BLOCK_MAGIC, sizeof(header.magic)) ||
+            offset + sizeof(header) + header.compressed_len > file_len) {
+            break;
+        }
+        if (reader->num_blocks == cap) {
+            cap = cap ? 2 * cap : 1024;
+            struct archive_index_entry *index = (struct archive_index_entry*)realloc(reader->index, cap * sizeof(*index));
+            if (index == NULL) return -1;
+            reader->index = index;
+        }
+        struct archive_index_entry *entry = &reader->index[reader->num_blocks++];
+        entry->offset = offset;
+        entry->first_frame = header.first_frame;
+        entry->num_frames = header.num_frames;
+        entry->first_counter = 0;
+        reader->data_len = header.first_frame * FRAME_LEN + (uint64_t)header.num_frames * FRAME_LEN + header.tail_len;
+        offset += sizeof(header) + header.compressed_len;
+    }
+    return 0;
+}
+
+struct archive_reader *archive_open(const char *filename) {
+    struct stat sb;
+    struct archive_trailer trailer;
+    struct archive_reader *reader = (struct archive_reader*)calloc(1, sizeof(struct archive_reader));
+    if (reader == NULL) {
+        fprintf(stderr, "Error: allocating archive reader\n");
+        return NULL;
+    }
+
+    reader->fd = open(filename, O_RDONLY);
+    if (reader->fd < 0 || fstat(reader->fd, &sb)) {
+        fprintf(stderr, "Failed to open %s\n%s\n", filename, strerror(errno));
+        goto err_free;
+    }
+    if (read_all(reader->fd, &reader->header, sizeof(reader->header), 0) ||
+        memcmp(reader->header.magic, ARCHIVE_MAGIC, sizeof(reader->header.magic)) ||
+        reader->header.version != ARCHIVE_VERSION || reader->header.byte_order != CAPTURE_BYTE_ORDER ||
+        reader->header.frame_len != FRAME_LEN || reader->header.payload_len > FRAME_MAX_PAYLOAD ||
+        reader->header.block_frames > ARCHIVE_BLOCK_FRAMES) {
+        fprintf(stderr, "Error: %s is no archive of this version\n", filename);
+        goto err_close;
+    }
+    uint64_t offset = sizeof(reader->header);
+    if (reader->header.capture_header_len) {
+        if (reader->header.capture_header_len < sizeof(reader->capture) ||
+            read_all(reader->fd, &reader->capture, sizeof(reader->capture), offset)) {
+            fprintf(stderr, "Error: %s has a broken capture header\n", filename);
+            goto err_close;
+        }
+        offset += reader->header.capture_header_len;
+    }
+
+    if ((uint64_t)sb.st_size >= offset + sizeof(trailer) &&
+        read_all(reader->fd, &trailer, sizeof(trailer), sb.st_size - sizeof(trailer)) == 0 &&
+        memcmp(trailer.magic, ARCHIVE_INDEX_MAGIC, sizeof(trailer.magic)) == 0 &&
+        trailer.index_offset + trailer.num_blocks * sizeof(struct archive_index_entry) + sizeof(trailer) == (uint64_t)sb.st_size) {
+        reader->num_blocks = trailer.num_blocks;
+        reader->data_len = trailer.data_len;
+        reader->index = (struct archive_index_entry*)malloc(trailer.num_blocks * sizeof(struct archive_index_entry) + 1);
+        if (reader->index == NULL ||
+            read_all(reader->fd, reader->index, trailer.num_blocks * sizeof(struct archive_index_entry), trailer.index_offset)) {
+            fprintf(stderr, "Failed to read index of %s\n%s\n", filename, strerror(errno));
+            goto err_close;
+        }
+    } else {
+        fprintf(stderr, "Warning: %s has no index, scanning blocks\n", filename);
+        if (scan_blocks(reader, offset, sb.st_size)) {
+            fprintf(stderr, "Error: allocating index\n");
+            goto err_close;
+        }
+    }
+    return reader;
+
+err_close:
+    free(reader->index);
+    close(reader->fd);
+err_free:
+    free(reader);
+    return NULL;
+}
+
+void archive_reader_close(struct archive_reader *reader) {
+    if (reader == NULL) return;
+    free(reader->index);
+    close(reader->fd);
+    free(reader);
+}
+
+long archive_read_block(const struct archive_reader *reader, uint64_t block, uint8_t *out) {
+    struct archive_block_header header;
+    long len = -1;
+    if (block >= reader->num_blocks) return -1;
+    uint64_t offset = reader->index[block].offset;
+    if (read_all(reader->fd, &header, sizeof(header), offset) || memcmp(header.magic, ARCHIVE_BLOCK_MAGIC, sizeof(header.magic)) ||
+        header.encoded_len > encoded_bound(BLOCK_LEN + FRAME_LEN)) {
+        return -1;
+    }
+
+    uint8_t *compressed = (uint8_t*)malloc(header.compressed_len + 1);
+    uint8_t *encoded = (uint8_t*)malloc(header.encoded_len + 1);
+    if (compressed == NULL || encoded == NULL) goto out;
+    if (read_all(reader->fd, compressed, header.compressed_len, offset + sizeof(header))) goto out;
+    uLongf encoded_len = header.encoded_len;
+    if (uncompress(encoded, &encoded_len, compressed, header.compressed_len) != Z_OK || encoded_len != header.encoded_len ||
+        crc32(0, encoded, encoded_len) != header.crc) {
+        goto out;
+    }
+    len = decode_block(reader->header.payload_len, encoded, encoded_len, header.num_frames, header.tail_len, out);
+out:
+    free(compressed);
+    free(encoded);
+    return len;
+}
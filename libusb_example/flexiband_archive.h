@@ -0,0 +1,120 @@
+/* libusb_example/flexiband_archive.h
+ *
+ * Compressed archive of a recording, written by flexiband_record -a and flexiband_compress.
+ *
+ * struct archive_header
+ * capture header          capture_header_len bytes, copied from a capture container
+ * blocks                  struct archive_block_header followed by compressed_len bytes
+ * block index             num_blocks struct archive_index_entry
+ * struct archive_trailer
+ *
+ * Every block holds block_frames frames and is compressed on its own, so blocks are encoded
+ * and decoded in parallel and can be read in any order via the index. Before deflate a block
+ * is encoded as
+ *
+ *   uint32_t first_counter
+ *   uint32_t num_exceptions
+ *   varint   counter deltas   counter[i] - counter[i - 1] - 1 for every frame but the first
+ *   exceptions                uint16_t frame, uint8_t kind, then the 2 preamble bytes if kind
+ *                             has ARCHIVE_RAW_PREAMBLE and the padding if ARCHIVE_RAW_PADDING
+ *   payloads                  payload_len bytes of every frame
+ *   tail                      tail_len bytes after the last whole frame, last block only
+ *
+ * so preamble and padding cost nothing as long as they are what the device sends. The
+ * encoding is lossless for any input. If the trailer is missing after an interruption, the
+ * blocks are found by their headers.
+ */
+
+#ifndef FLEXIBAND_ARCHIVE_H
+#define FLEXIBAND_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flexiband_capture.h"
+
+#define ARCHIVE_MAGIC         "FLXBARC"
+#define ARCHIVE_INDEX_MAGIC   "FLXBAIX"
+#define ARCHIVE_BLOCK_MAGIC   "FBLK"
+#define ARCHIVE_VERSION       1
+#define ARCHIVE_BLOCK_FRAMES  4096   // 4 MiB of frames
+#define ARCHIVE_RAW_PREAMBLE  0x01
+#define ARCHIVE_RAW_PADDING   0x02
+
+struct archive_header {
+    char magic[8];                 // ARCHIVE_MAGIC
+    uint32_t version;              // ARCHIVE_VERSION
+    uint32_t byte_order;           // CAPTURE_BYTE_ORDER
+    uint32_t frame_len;            // FRAME_LEN
+    uint32_t payload_len;          // payload bytes kept per frame, the rest is padding
+    uint32_t block_frames;
+    uint32_t capture_header_len;   // 0 for raw recordings
+};
+
+struct archive_block_header {
+    char magic[4];                 // ARCHIVE_BLOCK_MAGIC
+    uint32_t encoded_len;          // before deflate
+    uint32_t compressed_len;
+    uint32_t crc;                  // crc32 of the encoded block
+    uint64_t first_frame;
+    uint32_t num_frames;
+    uint32_t tail_len;
+};
+
+struct archive_index_entry {
+    uint64_t offset;               // of the block header
+    uint64_t first_frame;
+    uint32_t num_frames;
+    uint32_t first_counter;
+};
+
+struct archive_trailer {
+    char magic[8];                 // ARCHIVE_INDEX_MAGIC
+    uint64_t index_offset;
+    uint64_t num_blocks;
+    uint64_t data_len;             // bytes of frame data, without capture header
+};
+
+struct archive_statistics {
+    uint64_t raw_bytes;
+    uint64_t compressed_bytes;     // blocks including their headers
+    uint64_t blocks;
+    double cpu_sec;                // encoding and compression, all workers
+    uint64_t stalls;               // archive_write() waited for a free block
+};
+
+struct archive_writer;
+
+struct archive_reader {
+    int fd;
+    struct archive_header header;
+    struct capture_header capture;   // valid if header.capture_header_len > 0
+    struct archive_index_entry *index;
+    uint64_t num_blocks;
+    uint64_t data_len;
+};
+
+// Creates the archive and starts num_threads workers. payload_len is the payload of the
+// layout, see layout_payload_len(); capture is NULL for raw recordings. level is the zlib
+// level, Z_HUFFMAN_ONLY is used for level 0. Returns NULL and prints the error on failure.
+struct archive_writer *archive_create(const char *filename, const struct capture_header *capture, unsigned payload_len,
+                                      int num_threads, int level);
+
+// Appends data of the frame stream. Blocks until a block buffer is free if all workers are
+// busy. Returns 0 or -1 after an error of a worker.
+int archive_write(struct archive_writer *writer, const void *data, size_t len);
+
+// Compresses the rest, writes the index and closes the archive. stat may be NULL. Returns 0
+// or -1 with errno set.
+int archive_close(struct archive_writer *writer, struct archive_statistics *stat);
+
+// Opens an archive for reading. Returns NULL and prints the error on failure.
+struct archive_reader *archive_open(const char *filename);
+
+void archive_reader_close(struct archive_reader *reader);
+
+// Decodes a block into out, which holds ARCHIVE_BLOCK_FRAMES * FRAME_LEN + FRAME_LEN bytes.
+// Safe to call from several threads. Returns the length or -1.
+long archive_read_block(const struct archive_reader *reader, uint64_t block, uint8_t *out);
+
+#endif
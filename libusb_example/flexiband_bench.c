@@ -0,0 +1,885 @@
+/* libusb_example/flexiband_bench.c
+ *
+ * Benchmark of the record and playback pipelines, stage by stage.
+ *
+ * Record:   iso callback -> handoff to a writer thread -> frame validation -> unpacking
+ *           -> disk sink
+ * Playback: file read -> bulk submit -> bulk completion
+ * Stream:   the capture engine of flexiband_stream.h with frame validation in place, once
+ *           standalone in a thread of its own ("thread") and once embedded in an epoll loop
+ *           that also serves a 1 ms timer ("epoll"). The latency is how late each callback
+ *           runs against the line rate, relative to the earliest one.
+ *
+ * Unless FLEXIBAND_TRANSPORT is set, the emulator (see transport_emu.c) is the frame source,
+ * run at multiples of the base data rate. For every stage the suite reports CPU ticks per
+ * byte (TSC cycles on x86, nanoseconds elsewhere) and the latency distribution; for every run
+ * the sustained throughput and lost data. Results are printed as a table and optionally
+ * appended as JSON lines to a file, one object per run and pipeline, for comparing hosts and
+ * commits.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/utsname.h>
+#include <libusb-1.0/libusb.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "libusb_version_fixes.h"
+#include "flexiband_frame.h"
+#include "flexiband_stream.h"
+#include "flexiband_unpack.h"
+#include "transport.h"
+
+#define ALT_RECORD    1
+#define ALT_PLAYBACK  3
+
+#define ENDPOINT_OUT 0x03
+#define PKG_LEN (16 * 1024)
+#define NUM_PKG 32
+#define XFER_LEN (NUM_PKG * PKG_LEN)
+#define TIMEOUT_MS 1000
+#define QUEUE_SIZE 4
+#define RING_SLOTS 64
+#define BASE_RATE 40e6
+#define MAX_MULTIPLES 16
+#define SERVICE_TIMER_NS 1000000  // timer of the epoll loop besides the stream
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TICKS_UNIT "tsc"
+static inline uint64_t ticks(void) { return __rdtsc(); }
+#else
+#define TICKS_UNIT "ns"
+static inline uint64_t ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+#ifndef GIT_VERSION
+#define GIT_VERSION "unknown"
+#endif
+
+static volatile sig_atomic_t do_exit = false;
+
+// Latency samples in usec and CPU ticks spent in one stage
+struct stage {
+    const char *name;
+    uint64_t ticks;
+    uint64_t bytes;
+    double *latency;
+    size_t num;
+    size_t cap;
+};
+
+enum { REC_HANDOFF, REC_VALIDATE, REC_UNPACK, REC_SINK, NUM_REC_STAGES };
+enum { PLAY_READ, PLAY_SUBMIT, PLAY_COMPLETE, NUM_PLAY_STAGES };
+enum { STREAM_CALLBACK, NUM_STREAM_STAGES };
+
+struct slot {
+    uint8_t *data;
+    size_t len;
+    int64_t enqueued;
+};
+
+// Frame counter continuity of a stream
+struct frame_check {
+    uint64_t bad_frames;
+    uint64_t lost_frames;
+    bool synced;
+    uint32_t next_counter;
+};
+
+struct record_ctrl {
+    struct stage stages[NUM_REC_STAGES];
+    struct slot slots[RING_SLOTS];
+    unsigned head;  // next slot filled by the callback
+    unsigned tail;  // next slot consumed by the writer
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+    bool writer_done;
+    unsigned pending;
+    int status;
+    int fd;
+    enum payload_layout layout;
+    uint64_t bytes;
+    uint64_t ring_overflows;
+    struct frame_check check;
+};
+
+struct playback_ctrl {
+    struct stage stages[NUM_PLAY_STAGES];
+    int64_t submitted[QUEUE_SIZE];
+    struct libusb_transfer *transfers[QUEUE_SIZE];
+    bool stopping;
+    unsigned pending;
+    int status;
+    int fd;
+    uint64_t bytes;
+};
+
+struct stream_ctrl {
+    struct stage stages[NUM_STREAM_STAGES];
+    struct frame_check check;
+    double rate;
+    uint64_t bytes;
+    uint32_t first_counter;   // of the first frame of the run
+    uint64_t timer_ticks;     // of the service timer in the epoll loop
+};
+
+struct options {
+    double base_rate;
+    double multiples[MAX_MULTIPLES];
+    int num_multiples;
+    double duration;
+    enum payload_layout layout;
+    const char *sink;
+    const char *json;
+    const char *tag;
+    bool keep;
+};
+
+static void sighandler(int signum) {
+    do_exit = true;
+}
+
+static int64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_latency(struct stage *stage, double usec) {
+    if (stage->num == stage->cap) {
+        size_t cap = stage->cap ? 2 * stage->cap : 4096;
+        double *latency = (double*)realloc(stage->latency, cap * sizeof(double));
+        if (latency == NULL) return;
+        stage->latency = latency;
+        stage->cap = cap;
+    }
+    stage->latency[stage->num++] = usec;
+}
+
+static void free_stages(struct stage *stages, int num) {
+    for (int i = 0; i < num; i++) free(stages[i].latency);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct stage *stage, double p) {
+    if (stage->num == 0) return 0;
+    size_t i = (size_t)(p * (stage->num - 1) + 0.5);
+    return stage->latency[i];
+}
+
+/* ---------------------------------------------------------------------------------------
+ * Record pipeline
+ */
+
+static void record_callback(struct libusb_transfer *transfer) {
+    struct record_ctrl *ctrl = (struct record_ctrl*)transfer->user_data;
+    struct stage *handoff = &ctrl->stages[REC_HANDOFF];
+    uint64_t start = ticks();
+
+    ctrl->pending--;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "Error: Transfer not completed, status %i\n", transfer->status);
+        ctrl->status = transfer->status;
+        return;
+    }
+
+    pthread_mutex_lock(&ctrl->lock);
+    bool full = ctrl->head - ctrl->tail == RING_SLOTS;
+    pthread_mutex_unlock(&ctrl->lock);
+    if (full) {
+        ctrl->ring_overflows++;
+    } else {
+        // Only the callback writes the head slot, no lock needed for the copy
+        struct slot *slot = &ctrl->slots[ctrl->head % RING_SLOTS];
+        slot->len = 0;
+        for (int i = 0; i < transfer->num_iso_packets; i++) {
+            if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED) continue;
+            unsigned len = transfer->iso_packet_desc[i].actual_length;
+            memcpy(slot->data + slot->len, libusb_get_iso_packet_buffer_simple(transfer, i), len);
+            slot->len += len;
+        }
+        slot->enqueued = now_usec();
+        handoff->bytes += slot->len;
+        pthread_mutex_lock(&ctrl->lock);
+        ctrl->head++;
+        pthread_cond_signal(&ctrl->cond);
+        pthread_mutex_unlock(&ctrl->lock);
+    }
+
+    if (!ctrl->stopping && !do_exit) {
+        ctrl->status = transport_submit_transfer(transfer);
+        if (ctrl->status == 0) ctrl->pending++;
+    }
+    handoff->ticks += ticks() - start;
+}
+
+static void validate_frames(struct frame_check *check, const uint8_t *data, size_t len) {
+    for (size_t pos = 0; pos + FRAME_LEN <= len; pos += FRAME_LEN) {
+        const uint8_t *frame = data + pos;
+        if (!frame_has_preamble(frame)) {
+            check->bad_frames++;
+            continue;
+        }
+        uint32_t counter = frame_counter(frame);
+        if (check->synced) check->lost_frames += (uint32_t)(counter - check->next_counter);
+        check->next_counter = counter + 1;
+        check->synced = true;
+    }
+}
+
+static void *writer_thread(void *arg) {
+    struct record_ctrl *ctrl = (struct record_ctrl*)arg;
+    int8_t *samples[NUM_BANDS];
+    for (int b = 0; b < NUM_BANDS; b++) samples[b] = (int8_t*)malloc(2 * FRAME_MAX_PAYLOAD);
+
+    for (;;) {
+        pthread_mutex_lock(&ctrl->lock);
+        while (ctrl->head == ctrl->tail && !ctrl->writer_done) pthread_cond_wait(&ctrl->cond, &ctrl->lock);
+        if (ctrl->head == ctrl->tail) {
+            pthread_mutex_unlock(&ctrl->lock);
+            break;
+        }
+        struct slot *slot = &ctrl->slots[ctrl->tail % RING_SLOTS];
+        pthread_mutex_unlock(&ctrl->lock);
+
+        int64_t t0 = now_usec();
+        add_latency(&ctrl->stages[REC_HANDOFF], t0 - slot->enqueued);
+
+        uint64_t start = ticks();
+        validate_frames(&ctrl->check, slot->data, slot->len);
+        uint64_t t_validate = ticks();
+        int64_t t1 = now_usec();
+        for (size_t pos = 0; pos + FRAME_LEN <= slot->len; pos += FRAME_LEN) {
+            unpack_frame(ctrl->layout, slot->data + pos, samples);
+        }
+        uint64_t t_unpack = ticks();
+        int64_t t2 = now_usec();
+        if (write(ctrl->fd, slot->data, slot->len) != (ssize_t)slot->len) ctrl->status = -1;
+        uint64_t t_sink = ticks();
+        int64_t t3 = now_usec();
+
+        ctrl->stages[REC_VALIDATE].ticks += t_validate - start;
+        ctrl->stages[REC_UNPACK].ticks += t_unpack - t_validate;
+        ctrl->stages[REC_SINK].ticks += t_sink - t_unpack;
+        for (int s = REC_VALIDATE; s <= REC_SINK; s++) ctrl->stages[s].bytes += slot->len;
+        add_latency(&ctrl->stages[REC_VALIDATE], t1 - t0);
+        add_latency(&ctrl->stages[REC_UNPACK], t2 - t1);
+        add_latency(&ctrl->stages[REC_SINK], t3 - t2);
+        ctrl->bytes += slot->len;
+
+        pthread_mutex_lock(&ctrl->lock);
+        ctrl->tail++;
+        pthread_mutex_unlock(&ctrl->lock);
+    }
+
+    for (int b = 0; b < NUM_BANDS; b++) free(samples[b]);
+    return NULL;
+}
+
+static int run_record(libusb_context *ctx, libusb_device_handle *dev_handle, const struct options *opt,
+                      struct record_ctrl *ctrl, double *elapsed) {
+    struct libusb_transfer *transfers[QUEUE_SIZE];
+    pthread_t writer;
+    int status = 0;
+
+    memset(transfers, 0, sizeof(transfers));
+    ctrl->stages[REC_HANDOFF].name = "handoff";
+    ctrl->stages[REC_VALIDATE].name = "validate";
+    ctrl->stages[REC_UNPACK].name = "unpack";
+    ctrl->stages[REC_SINK].name = "sink";
+    ctrl->layout = opt->layout;
+    pthread_mutex_init(&ctrl->lock, NULL);
+    pthread_cond_init(&ctrl->cond, NULL);
+    for (int i = 0; i < RING_SLOTS; i++) {
+        ctrl->slots[i].data = (uint8_t*)malloc(XFER_LEN);
+        if (ctrl->slots[i].data == NULL) {
+            fprintf(stderr, "Error: allocating buffer\n");
+            status = 1;
+            goto err_ring;
+        }
+    }
+
+    ctrl->fd = open(opt->sink, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (ctrl->fd < 0) {
+        fprintf(stderr, "Failed to open %s\n%s\n", opt->sink, strerror(errno));
+        status = 1;
+        goto err_ring;
+    }
+
+    status = transport_set_interface_alt_setting(dev_handle, STREAM_INTERFACE, ALT_RECORD);
+    if (status) {
+        fprintf(stderr, "Set alternate interface: %s\n", libusb_strerror((enum libusb_error)status));
+        goto err_file;
+    }
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        transfers[i] = libusb_alloc_transfer(NUM_PKG);
+        unsigned char *buffer = (unsigned char*)malloc(XFER_LEN);
+        if (transfers[i] == NULL || buffer == NULL) {
+            fprintf(stderr, "Error: allocating transfer\n");
+            free(buffer);
+            status = 1;
+            goto err_alloc;
+        }
+        libusb_fill_iso_transfer(transfers[i], dev_handle, STREAM_ENDPOINT, buffer, XFER_LEN, NUM_PKG, record_callback, ctrl, TIMEOUT_MS);
+        libusb_set_iso_packet_lengths(transfers[i], PKG_LEN);
+        transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+
+    pthread_create(&writer, NULL, writer_thread, ctrl);
+    status = transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x00, 0x00, NULL, 0, 1000);
+    if (status) {
+        fprintf(stderr, "Error: Start command\n%s\n", libusb_strerror((enum libusb_error)status));
+        goto err_writer;
+    }
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        status = transport_submit_transfer(transfers[i]);
+        if (status) {
+            fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)status));
+            break;
+        }
+        ctrl->pending++;
+    }
+
+    int64_t start = now_usec();
+    while (!status && ctrl->status == 0 && !do_exit && now_usec() - start < opt->duration * 1e6) {
+        struct timeval tv = {0, 100000};
+        status = transport_handle_events_timeout_completed(ctx, &tv, NULL);
+    }
+    ctrl->stopping = true;
+    while (ctrl->pending > 0) transport_handle_events(ctx);
+    *elapsed = (now_usec() - start) / 1e6;
+
+    transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x01, 0x00, NULL, 0, 1000);
+
+err_writer:
+    pthread_mutex_lock(&ctrl->lock);
+    ctrl->writer_done = true;
+    pthread_cond_signal(&ctrl->cond);
+    pthread_mutex_unlock(&ctrl->lock);
+    pthread_join(writer, NULL);
+err_alloc:
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        if (transfers[i]) libusb_free_transfer(transfers[i]);
+    }
+err_file:
+    close(ctrl->fd);
+err_ring:
+    for (int i = 0; i < RING_SLOTS; i++) free(ctrl->slots[i].data);
+    pthread_cond_destroy(&ctrl->cond);
+    pthread_mutex_destroy(&ctrl->lock);
+    return status ? status : ctrl->status;
+}
+
+/* ---------------------------------------------------------------------------------------
+ * Playback pipeline
+ */
+
+static int submit_next(struct playback_ctrl *ctrl, struct libusb_transfer *transfer, int index) {
+    struct stage *read_stage = &ctrl->stages[PLAY_READ];
+    struct stage *submit_stage = &ctrl->stages[PLAY_SUBMIT];
+
+    int64_t t0 = now_usec();
+    uint64_t start = ticks();
+    ssize_t len = read(ctrl->fd, transfer->buffer, XFER_LEN);
+    uint64_t t_read = ticks();
+    int64_t t1 = now_usec();
+    read_stage->ticks += t_read - start;
+    add_latency(read_stage, t1 - t0);
+    if (len <= 0) return 1;  // end of file
+    read_stage->bytes += len;
+
+    transfer->length = (int)len;
+    int status = transport_submit_transfer(transfer);
+    uint64_t t_submit = ticks();
+    ctrl->submitted[index] = now_usec();
+    submit_stage->ticks += t_submit - t_read;
+    submit_stage->bytes += len;
+    add_latency(submit_stage, ctrl->submitted[index] - t1);
+    if (status) {
+        fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)status));
+        return status;
+    }
+    ctrl->pending++;
+    return 0;
+}
+
+static void playback_callback(struct libusb_transfer *transfer) {
+    struct playback_ctrl *ctrl = (struct playback_ctrl*)transfer->user_data;
+    int index = 0;
+    while (ctrl->transfers[index] != transfer) index++;
+
+    ctrl->pending--;
+    add_latency(&ctrl->stages[PLAY_COMPLETE], now_usec() - ctrl->submitted[index]);
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "Error: Transfer not completed, status %i\n", transfer->status);
+        ctrl->status = transfer->status;
+        return;
+    }
+    ctrl->stages[PLAY_COMPLETE].bytes += transfer->actual_length;
+    ctrl->bytes += transfer->actual_length;
+    if (ctrl->stopping || do_exit) return;
+    int status = submit_next(ctrl, transfer, index);
+    if (status) {
+        ctrl->stopping = true;
+        if (status < 0) ctrl->status = status;
+    }
+}
+
+static int run_playback(libusb_context *ctx, libusb_device_handle *dev_handle, const struct options *opt,
+                        struct playback_ctrl *ctrl, double *elapsed) {
+    int status = 0;
+
+    ctrl->stages[PLAY_READ].name = "file_read";
+    ctrl->stages[PLAY_SUBMIT].name = "bulk_submit";
+    ctrl->stages[PLAY_COMPLETE].name = "bulk_complete";
+    ctrl->fd = open(opt->sink, O_RDONLY);
+    if (ctrl->fd < 0) {
+        fprintf(stderr, "Failed to open %s\n%s\n", opt->sink, strerror(errno));
+        return 1;
+    }
+
+    status = transport_set_interface_alt_setting(dev_handle, STREAM_INTERFACE, ALT_PLAYBACK);
+    if (status) {
+        fprintf(stderr, "Set alternate interface: %s\n", libusb_strerror((enum libusb_error)status));
+        goto err_file;
+    }
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        ctrl->transfers[i] = libusb_alloc_transfer(0);
+        unsigned char *buffer = (unsigned char*)malloc(XFER_LEN);
+        if (ctrl->transfers[i] == NULL || buffer == NULL) {
+            fprintf(stderr, "Error: allocating transfer\n");
+            free(buffer);
+            status = 1;
+            goto err_alloc;
+        }
+        libusb_fill_bulk_transfer(ctrl->transfers[i], dev_handle, ENDPOINT_OUT, buffer, XFER_LEN, playback_callback, ctrl, TIMEOUT_MS);
+        ctrl->transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+
+    status = transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x00, 0x00, NULL, 0, 1000);
+    if (status) {
+        fprintf(stderr, "Error: Start command\n%s\n", libusb_strerror((enum libusb_error)status));
+        goto err_alloc;
+    }
+
+    int64_t start = now_usec();
+    for (unsigned i = 0; i < QUEUE_SIZE && !status; i++) status = submit_next(ctrl, ctrl->transfers[i], i);
+    if (status > 0) status = 0;  // file shorter than the queue
+    while (ctrl->pending > 0) transport_handle_events(ctx);
+    *elapsed = (now_usec() - start) / 1e6;
+
+    transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x01, 0x00, NULL, 0, 1000);
+
+err_alloc:
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        if (ctrl->transfers[i]) libusb_free_transfer(ctrl->transfers[i]);
+    }
+err_file:
+    close(ctrl->fd);
+    return status ? status : ctrl->status;
+}
+
+/* ---------------------------------------------------------------------------------------
+ * Stream engine, standalone and embedded
+ */
+
+// Runs where the engine handles its events. The block is read in place.
+static void stream_block_callback(const struct stream_block *block, void *user_data) {
+    struct stream_ctrl *ctrl = (struct stream_ctrl*)user_data;
+    struct stage *stage = &ctrl->stages[STREAM_CALLBACK];
+    uint64_t start = ticks();
+    bool synced = ctrl->check.synced;
+    for (unsigned i = 0; i < block->num_packets; i++) {
+        if (!synced && block->len[i] >= FRAME_LEN && frame_has_preamble(block->data[i])) {
+            ctrl->first_counter = frame_counter(block->data[i]);
+            synced = true;
+        }
+        validate_frames(&ctrl->check, block->data[i], block->len[i]);
+    }
+    // Lateness against the line rate by the frame counter, so lost frames do not count; the
+    // earliest is subtracted when the run is over
+    if (ctrl->check.synced) {
+        double sent = (double)(uint32_t)(ctrl->check.next_counter - ctrl->first_counter) * FRAME_LEN;
+        add_latency(stage, block->monotonic_ns / 1e3 - sent / ctrl->rate * 1e6);
+    }
+    ctrl->bytes += block->bytes;
+    stage->bytes += block->bytes;
+    stage->ticks += ticks() - start;
+}
+
+struct stream_thread_arg {
+    struct stream *stream;
+    volatile sig_atomic_t stop;
+};
+
+static void *stream_thread(void *arg) {
+    struct stream_thread_arg *thread = (struct stream_thread_arg*)arg;
+    stream_run(thread->stream, &thread->stop);
+    return NULL;
+}
+
+static int run_stream_thread(struct stream *stream, const struct options *opt, double *elapsed) {
+    struct stream_thread_arg thread = {stream, 0};
+    pthread_t tid;
+    int status = stream_start(stream);
+    if (status) return status;
+    int64_t start = now_usec();
+    pthread_create(&tid, NULL, stream_thread, &thread);
+    while (!do_exit && stream_running(stream) && now_usec() - start < opt->duration * 1e6) usleep(10000);
+    thread.stop = 1;
+    pthread_join(tid, NULL);
+    *elapsed = (now_usec() - start) / 1e6;
+    return stream_status(stream);
+}
+
+static uint32_t epoll_events(short events) {
+    return (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+}
+
+static void pollfd_added(int fd, short events, void *user_data) {
+    struct epoll_event ev = {epoll_events(events), {.fd = fd}};
+    epoll_ctl(*(int*)user_data, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void pollfd_removed(int fd, void *user_data) {
+    epoll_ctl(*(int*)user_data, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// The loop of a service: the stream is one source among others, here a periodic timer
+static int run_stream_epoll(struct stream *stream, struct stream_ctrl *ctrl, const struct options *opt, double *elapsed) {
+    struct itimerspec its = {{0, SERVICE_TIMER_NS}, {0, SERVICE_TIMER_NS}};
+    struct epoll_event ev = {EPOLLIN, {.fd = -1}};
+    int status = 1;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ep < 0 || timer < 0) {
+        fprintf(stderr, "Error: epoll\n%s\n", strerror(errno));
+        goto out;
+    }
+    ev.data.fd = timer;
+    timerfd_settime(timer, 0, &its, NULL);
+    epoll_ctl(ep, EPOLL_CTL_ADD, timer, &ev);
+
+    const struct libusb_pollfd **pollfds = stream_get_pollfds(stream);
+    if (pollfds == NULL) {
+        fprintf(stderr, "Error: No pollfds\n");
+        goto out;
+    }
+    for (int i = 0; pollfds[i]; i++) pollfd_added(pollfds[i]->fd, pollfds[i]->events, &ep);
+    stream_free_pollfds(pollfds);
+    stream_set_pollfd_notifiers(stream, pollfd_added, pollfd_removed, &ep);
+
+    status = stream_start(stream);
+    if (status) goto out_notifiers;
+    int64_t start = now_usec();
+    while (stream_running(stream)) {
+        struct epoll_event events[8];
+        if (do_exit || now_usec() - start >= opt->duration * 1e6) stream_stop(stream);
+        int timeout = stream_get_timeout(stream);
+        if (timeout < 0 || timeout > 100) timeout = 100;
+        int n = epoll_wait(ep, events, 8, timeout);
+        bool usb = n == 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd != timer) {
+                usb = true;
+                continue;
+            }
+            uint64_t expirations;
+            if (read(timer, &expirations, sizeof(expirations)) == sizeof(expirations)) ctrl->timer_ticks += expirations;
+        }
+        if (usb) stream_handle_events(stream);
+    }
+    *elapsed = (now_usec() - start) / 1e6;
+    status = stream_status(stream);
+
+out_notifiers:
+    stream_set_pollfd_notifiers(stream, NULL, NULL, NULL);
+out:
+    if (timer >= 0) close(timer);
+    if (ep >= 0) close(ep);
+    return status;
+}
+
+static int run_stream(const struct options *opt, bool embedded, struct stream_ctrl *ctrl, double *elapsed) {
+    struct stream_config config = {0, stream_block_callback, ctrl};
+    ctrl->stages[STREAM_CALLBACK].name = "callback";
+    struct stream *stream = stream_open(&config);
+    if (stream == NULL) return 1;
+    int status = embedded ? run_stream_epoll(stream, ctrl, opt, elapsed) : run_stream_thread(stream, opt, elapsed);
+    stream_close(stream, NULL);
+
+    struct stage *stage = &ctrl->stages[STREAM_CALLBACK];
+    double earliest = stage->num ? stage->latency[0] : 0;
+    for (size_t i = 0; i < stage->num; i++) earliest = stage->latency[i] < earliest ? stage->latency[i] : earliest;
+    for (size_t i = 0; i < stage->num; i++) stage->latency[i] -= earliest;
+    return status;
+}
+
+/* ---------------------------------------------------------------------------------------
+ * Reporting
+ */
+
+static void cpu_model(char *buf, size_t size) {
+    char line[256];
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    snprintf(buf, size, "unknown");
+    if (fp == NULL) return;
+    while (fgets(line, sizeof(line), fp)) {
+        char *value = strchr(line, ':');
+        if (strncmp(line, "model name", 10) || value == NULL) continue;
+        value += 2;
+        value[strcspn(value, "\n")] = '\0';
+        snprintf(buf, size, "%s", value);
+        break;
+    }
+    fclose(fp);
+}
+
+static void json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', fp);
+        if ((unsigned char)*s >= 0x20) fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void report(const struct options *opt, const char *pipeline, double multiple, double rate, double elapsed,
+                   uint64_t bytes, struct stage *stages, int num_stages, uint64_t lost_frames, uint64_t overflows,
+                   uint64_t bad_frames) {
+    double throughput = elapsed > 0 ? bytes / elapsed : 0;
+    printf("%-8s x%-5g %8.1f MB/s target %8.1f MB/s  lost %" PRIu64 " frames, %" PRIu64 " ring overflows, %" PRIu64 " bad frames\n",
+           pipeline, multiple, throughput / 1e6, rate / 1e6, lost_frames, overflows, bad_frames);
+    printf("  %-14s %12s %10s %10s %10s %10s\n", "stage", TICKS_UNIT "/byte", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int i = 0; i < num_stages; i++) {
+        struct stage *s = &stages[i];
+        qsort(s->latency, s->num, sizeof(double), compare_double);
+        printf("  %-14s %12.3f %10.1f %10.1f %10.1f %10.1f\n", s->name, s->bytes ? (double)s->ticks / s->bytes : 0,
+               percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999), s->num ? s->latency[s->num - 1] : 0);
+    }
+
+    if (opt->json == NULL) return;
+    FILE *fp = fopen(opt->json, "a");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s\n%s\n", opt->json, strerror(errno));
+        return;
+    }
+    char host[256], cpu[256];
+    struct utsname uts;
+    gethostname(host, sizeof(host));
+    host[sizeof(host) - 1] = '\0';
+    cpu_model(cpu, sizeof(cpu));
+    uname(&uts);
+
+    fprintf(fp, "{\"pipeline\":\"%s\",\"version\":", pipeline);
+    json_string(fp, GIT_VERSION);
+    fprintf(fp, ",\"tag\":");
+    json_string(fp, opt->tag ? opt->tag : "");
+    fprintf(fp, ",\"host\":");
+    json_string(fp, host);
+    fprintf(fp, ",\"kernel\":");
+    json_string(fp, uts.release);
+    fprintf(fp, ",\"cpu\":");
+    json_string(fp, cpu);
+    fprintf(fp, ",\"transport\":\"%s\",\"layout\":\"%s\",\"multiple\":%g,\"target_rate\":%.0f,\"duration\":%.3f,"
+                "\"bytes\":%" PRIu64 ",\"throughput\":%.0f,\"lost_frames\":%" PRIu64 ",\"ring_overflows\":%" PRIu64
+                ",\"bad_frames\":%" PRIu64 ",\"ticks_unit\":\"%s\",\"stages\":{",
+            transport_name(), layout_names[opt->layout], multiple, rate, elapsed, bytes, throughput, lost_frames,
+            overflows, bad_frames, TICKS_UNIT);
+    for (int i = 0; i < num_stages; i++) {
+        struct stage *s = &stages[i];
+        fprintf(fp, "%s\"%s\":{\"ticks_per_byte\":%.4f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,\"samples\":%zu}",
+                i ? "," : "", s->name, s->bytes ? (double)s->ticks / s->bytes : 0, percentile(s, 0.5),
+                percentile(s, 0.99), percentile(s, 0.999), s->num ? s->latency[s->num - 1] : 0, s->num);
+    }
+    fprintf(fp, "}}\n");
+    fclose(fp);
+}
+
+/* ---------------------------------------------------------------------------------------
+ * Main
+ */
+
+static void select_emulator(const struct options *opt, double rate) {
+    char spec[128];
+    snprintf(spec, sizeof(spec), "emu:rate=%.0f,layout=%s", rate, layout_names[opt->layout]);
+    setenv(TRANSPORT_ENV, spec, 1);
+}
+
+// The engine opens the device itself, so these runs follow the others
+static int run_streams(const struct options *opt, double multiple, bool synthetic) {
+    static const char *const modes[2] = {"thread", "epoll"};
+    double rate = opt->base_rate * multiple;
+    int status = 0;
+    for (int embedded = 0; embedded < 2 && status == 0 && !do_exit; embedded++) {
+        struct stream_ctrl *ctrl = (struct stream_ctrl*)calloc(1, sizeof(struct stream_ctrl));
+        double elapsed = 0;
+        if (ctrl == NULL) return 1;
+        ctrl->rate = rate;
+        if (synthetic) select_emulator(opt, rate);
+        status = run_stream(opt, embedded, ctrl, &elapsed);
+        if (status == 0) {
+            report(opt, modes[embedded], multiple, rate, elapsed, ctrl->bytes, ctrl->stages, NUM_STREAM_STAGES,
+                   ctrl->check.lost_frames, 0, ctrl->check.bad_frames);
+            if (embedded) {
+                printf("  %-14s %" PRIu64 " of %.0f expirations served\n", "1 ms timer", ctrl->timer_ticks,
+                       elapsed * 1e9 / SERVICE_TIMER_NS);
+            }
+        }
+        free_stages(ctrl->stages, NUM_STREAM_STAGES);
+        free(ctrl);
+    }
+    return status;
+}
+
+static int run(const struct options *opt, double multiple, bool synthetic) {
+    libusb_context *ctx;
+    libusb_device_handle *dev_handle;
+    double rate = opt->base_rate * multiple;
+    int status;
+
+    if (synthetic) select_emulator(opt, rate);
+    status = transport_init(&ctx);
+    if (status) {
+        fprintf(stderr, "%s\n", libusb_strerror((enum libusb_error)status));
+        return status;
+    }
+    // Set up like flexiband_record and the stream engine, the playback run switches the alternate setting
+    dev_handle = stream_open_device(ctx, false);
+    if (dev_handle == NULL) {
+        status = 1;
+        goto err_usb;
+    }
+    status = stream_claim_device(dev_handle);
+    if (status) goto err_dev;
+
+    struct record_ctrl *rec = (struct record_ctrl*)calloc(1, sizeof(struct record_ctrl));
+    struct playback_ctrl *play = (struct playback_ctrl*)calloc(1, sizeof(struct playback_ctrl));
+    double elapsed = 0;
+    if (rec == NULL || play == NULL) {
+        status = 1;
+        goto err_ctrl;
+    }
+    status = run_record(ctx, dev_handle, opt, rec, &elapsed);
+    if (status) goto err_ctrl;
+    report(opt, "record", multiple, rate, elapsed, rec->bytes, rec->stages, NUM_REC_STAGES, rec->check.lost_frames,
+           rec->ring_overflows, rec->check.bad_frames);
+
+    if (!do_exit) {
+        status = run_playback(ctx, dev_handle, opt, play, &elapsed);
+        if (status == 0) {
+            report(opt, "playback", multiple, rate, elapsed, play->bytes, play->stages, NUM_PLAY_STAGES, 0, 0, 0);
+        }
+    }
+
+err_ctrl:
+    if (rec) free_stages(rec->stages, NUM_REC_STAGES);
+    if (play) free_stages(play->stages, NUM_PLAY_STAGES);
+    free(rec);
+    free(play);
+    transport_release_interface(dev_handle, STREAM_INTERFACE);
+err_dev:
+    transport_close(dev_handle);
+err_usb:
+    transport_exit(ctx);
+    return status;
+}
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [options]\n", program_name);
+    printf("  -m <list>   Comma separated multiples of the base rate (default 1,2,4)\n");
+    printf("  -r <rate>   Base rate in bytes/s (default %.0f)\n", BASE_RATE);
+    printf("  -d <sec>    Duration of each record and stream run (default 5)\n");
+    printf("  -l <layout> Payload layout I-3, III-1a or III-1b (default III-1a)\n");
+    printf("  -f <file>   Sink of the record and source of the playback runs (default flexiband_bench.bin)\n");
+    printf("  -k          Keep the sink file\n");
+    printf("  -o <file>   Append results as JSON lines\n");
+    printf("  -t <tag>    Free text stored with the JSON results\n");
+    printf("Without %s set, the emulator is the frame source.\n", TRANSPORT_ENV);
+}
+
+int main(int argc, char *argv[]) {
+    struct options opt;
+    int status = 0;
+    int c;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.base_rate = BASE_RATE;
+    opt.duration = 5;
+    opt.layout = LAYOUT_III_1A;
+    opt.sink = "flexiband_bench.bin";
+    opt.multiples[0] = 1;
+    opt.multiples[1] = 2;
+    opt.multiples[2] = 4;
+    opt.num_multiples = 3;
+
+    while ((c = getopt(argc, argv, "hm:r:d:l:f:ko:t:")) != -1) {
+        switch (c) {
+        case 'm': {
+            char *save;
+            opt.num_multiples = 0;
+            for (char *tok = strtok_r(optarg, ",", &save); tok && opt.num_multiples < MAX_MULTIPLES;
+                 tok = strtok_r(NULL, ",", &save))
+                opt.multiples[opt.num_multiples++] = strtod(tok, NULL);
+            break;
+        }
+        case 'r': opt.base_rate = strtod(optarg, NULL); break;
+        case 'd': opt.duration = strtod(optarg, NULL); break;
+        case 'l': {
+            int i;
+            for (i = 0; i < NUM_LAYOUTS && strcmp(layout_names[i], optarg); i++) {}
+            if (i == NUM_LAYOUTS) {
+                fprintf(stderr, "Error: Unknown layout %s\n", optarg);
+                return 1;
+            }
+            opt.layout = (enum payload_layout)i;
+            break;
+        }
+        case 'f': opt.sink = optarg; break;
+        case 'k': opt.keep = true; break;
+        case 'o': opt.json = optarg; break;
+        case 't': opt.tag = optarg; break;
+        default: print_usage(argv[0]); return c == 'h' ? 0 : 1;
+        }
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+    signal(SIGQUIT, sighandler);
+
+    // Real hardware only runs at its own rate
+    bool synthetic = getenv(TRANSPORT_ENV) == NULL;
+    int runs = synthetic ? opt.num_multiples : 1;
+    for (int i = 0; i < runs && status == 0 && !do_exit; i++) {
+        status = run(&opt, synthetic ? opt.multiples[i] : 1, synthetic);
+        if (status == 0) status = run_streams(&opt, synthetic ? opt.multiples[i] : 1, synthetic);
+    }
+
+    if (!opt.keep) unlink(opt.sink);
+    return status;
+}
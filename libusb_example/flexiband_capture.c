@@ -0,0 +1,159 @@
+/* libusb_example/flexiband_capture.c
+ *
+ * Writer of the capture container, see flexiband_capture.h. It runs in the transfer callback
+ * of flexiband_record, so indexing only looks at every index_interval-th frame.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "flexiband_capture.h"
+#include "flexiband_io.h"
+
+_Static_assert(sizeof(struct capture_header) <= CAPTURE_HEADER_LEN, "capture header too large");
+
+struct capture_writer {
+    int fd;
+    FILE *index;
+    uint32_t header_len;
+    uint32_t interval;
+    uint64_t data_len;       // Frame data written so far
+    uint64_t next_frame;     // Number of the next frame to index
+    bool restart;            // next entry starts a restarted stream
+    unsigned num_entries;
+    struct capture_index_entry entries[CAPTURE_INDEX_BLOCK_ENTRIES];
+};
+
+static int64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int flush_index(struct capture_writer *writer) {
+    struct capture_index_block block;
+    if (writer->num_entries == 0) return 0;
+    memset(&block, 0, sizeof(block));
+    memcpy(block.magic, CAPTURE_INDEX_MAGIC, sizeof(block.magic));
+    block.num_entries = writer->num_entries;
+    fwrite(&block, sizeof(block), 1, writer->index);
+    fwrite(writer->entries, sizeof(struct capture_index_entry), writer->num_entries, writer->index);
+    writer->num_entries = 0;
+    return fflush(writer->index) == 0 && !ferror(writer->index) ? 0 : -1;
+}
+
+void capture_init_header(struct capture_header *header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CAPTURE_MAGIC, sizeof(header->magic));
+    header->version = CAPTURE_VERSION;
+    header->byte_order = CAPTURE_BYTE_ORDER;
+    header->header_len = CAPTURE_HEADER_LEN;
+    header->frame_len = FRAME_LEN;
+    header->layout = CAPTURE_LAYOUT_UNKNOWN;
+    header->index_interval = CAPTURE_INDEX_INTERVAL;
+    header->start_realtime_ns = clock_ns(CLOCK_REALTIME);
+    header->start_monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+}
+
+struct capture_writer *capture_create(const char *filename, const struct capture_header *header) {
+    char path[4096];
+    char *block = NULL;
+    struct capture_writer *writer = (struct capture_writer*)calloc(1, sizeof(struct capture_writer));
+    if (writer == NULL) {
+        fprintf(stderr, "Error: allocating capture writer\n");
+        return NULL;
+    }
+    writer->header_len = header->header_len;
+    writer->interval = header->index_interval ? header->index_interval : 1;
+
+    writer->fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (writer->fd < 0) {
+        fprintf(stderr, "Failed to open %s\n%s\n", filename, strerror(errno));
+        goto err_free;
+    }
+    block = (char*)calloc(1, header->header_len);
+    if (block == NULL || header->header_len < sizeof(*header)) {
+        fprintf(stderr, "Error: invalid capture header length %u\n", header->header_len);
+        goto err_close;
+    }
+    memcpy(block, header, sizeof(*header));
+    if (write_all(writer->fd, block, header->header_len)) {
+        fprintf(stderr, "Failed to write %s\n%s\n", filename, strerror(errno));
+        goto err_close;
+    }
+
+    snprintf(path, sizeof(path), "%s.idx", filename);
+    writer->index = fopen(path, "w");
+    if (writer->index == NULL) {
+        fprintf(stderr, "Failed to open %s\n%s\n", path, strerror(errno));
+        goto err_close;
+    }
+    free(block);
+    return writer;
+
+err_close:
+    free(block);
+    close(writer->fd);
+err_free:
+    free(writer);
+    return NULL;
+}
+
+int capture_write(struct capture_writer *writer, const void *data, size_t len, int64_t monotonic_ns) {
+    const uint8_t *p = (const uint8_t*)data;
+    uint64_t start = writer->data_len;
+    uint64_t end = start + len;
+
+    // Frames split between two writes are skipped, so are frames without preamble
+    while ((writer->next_frame + 1) * FRAME_LEN <= end) {
+        uint64_t offset = writer->next_frame * FRAME_LEN;
+        if (offset < start || !frame_has_preamble(p + (offset - start))) {
+            writer->next_frame++;
+            continue;
+        }
+        struct capture_index_entry *entry = &writer->entries[writer->num_entries++];
+        entry->counter = frame_counter(p + (offset - start));
+        entry->flags = writer->restart ? CAPTURE_INDEX_RESTART : 0;
+        writer->restart = false;
+        entry->offset = writer->header_len + offset;
+        entry->monotonic_ns = monotonic_ns;
+        writer->next_frame += writer->interval;
+        if (writer->num_entries == CAPTURE_INDEX_BLOCK_ENTRIES && flush_index(writer)) return -1;
+    }
+
+    if (write_all(writer->fd, data, len)) return -1;
+    writer->data_len = end;
+    return 0;
+}
+
+void capture_restart(struct capture_writer *writer) {
+    writer->next_frame = (writer->data_len + FRAME_LEN - 1) / FRAME_LEN;
+    writer->restart = true;
+}
+
+int capture_close(struct capture_writer *writer) {
+    int status = flush_index(writer);
+    if (fclose(writer->index)) status = -1;
+    if (close(writer->fd)) status = -1;
+    free(writer);
+    return status;
+}
+
+int capture_read_header(int fd, struct capture_header *header) {
+    ssize_t len = pread(fd, header, sizeof(*header), 0);
+    if (len < 0) return -1;
+    if ((size_t)len < sizeof(header->magic) || memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic))) return 1;
+    if ((size_t)len < sizeof(*header) || header->version != CAPTURE_VERSION || header->byte_order != CAPTURE_BYTE_ORDER ||
+        header->frame_len != FRAME_LEN || header->header_len < sizeof(*header)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
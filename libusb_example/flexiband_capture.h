@@ -0,0 +1,118 @@
+/* libusb_example/flexiband_capture.h
+ *
+ * Capture container written by flexiband_record -c.
+ *
+ * <filename>      CAPTURE_HEADER_LEN bytes of struct capture_header, zero padded, followed by
+ *                 the raw frames exactly as received. The frame data starts page aligned and
+ *                 is contiguous, so it can be mapped and used in place.
+ * <filename>.idx  Sequence of index blocks, each a struct capture_index_block followed by
+ *                 num_entries struct capture_index_entry. A block is appended every
+ *                 CAPTURE_INDEX_BLOCK_ENTRIES entries and when the capture is closed, so an
+ *                 interrupted recording keeps the index up to the last complete block.
+ *
+ * Every index_interval frames an entry maps the frame counter to its file offset and the
+ * host time the transfer holding it completed. After the device was reconnected, the first
+ * frame of the restarted stream is indexed as well and flagged with CAPTURE_INDEX_RESTART: its
+ * counter starts over, so counters only increase between two such entries. All fields are in
+ * host byte order; byte_order tells readers on other hosts what they got.
+ *
+ * Segmented recordings (flexiband_record -S/-G) write one container per segment. The start
+ * times of a segment are those of its first frame on the clocks of the whole recording, and
+ * segment_offset places its frames in the stream of the whole recording.
+ */
+
+#ifndef FLEXIBAND_CAPTURE_H
+#define FLEXIBAND_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flexiband_frame.h"
+
+#define CAPTURE_MAGIC               "FLXBCAP"
+#define CAPTURE_INDEX_MAGIC         "FLXBIDX"
+#define CAPTURE_VERSION             1
+#define CAPTURE_BYTE_ORDER          0x01020304
+#define CAPTURE_HEADER_LEN          4096
+#define CAPTURE_NUM_SLOTS           3
+#define CAPTURE_INDEX_INTERVAL      1024   // frames, 1 MiB of data
+#define CAPTURE_INDEX_BLOCK_ENTRIES 256
+#define CAPTURE_LAYOUT_UNKNOWN      0xffffffff
+#define CAPTURE_INDEX_RESTART       0x1    // capture_index_entry.flags
+
+struct capture_build {
+    uint16_t build;       // Jenkins build number
+    uint16_t reserved;
+    uint32_t hash;        // First eight hex digits of the git hash
+    uint32_t timestamp;   // Seconds since 01.01.2000
+};
+
+struct capture_slot {
+    uint8_t present;      // RF-board EEPROM answered
+    uint8_t serial;
+    uint8_t antenna;
+    uint8_t bandwidth;
+    uint8_t revision;     // One based, 0 if unknown
+    uint8_t reserved[3];
+    uint32_t lo;          // LO frequency
+    char band[12];        // Band name, zero terminated
+};
+
+struct capture_header {
+    char magic[8];                 // CAPTURE_MAGIC
+    uint32_t version;              // CAPTURE_VERSION
+    uint32_t byte_order;           // CAPTURE_BYTE_ORDER
+    uint32_t header_len;           // File offset of the first frame
+    uint32_t frame_len;            // FRAME_LEN
+    uint32_t layout;               // enum payload_layout or CAPTURE_LAYOUT_UNKNOWN
+    uint32_t index_interval;       // Frames between two index entries
+    int64_t start_realtime_ns;     // CLOCK_REALTIME when the recording started
+    int64_t start_monotonic_ns;    // CLOCK_MONOTONIC at the same moment
+    char usb_serial[64];           // Zero terminated, empty if the device has none
+    struct capture_build fx3;
+    struct capture_build atmel;
+    struct capture_build fpga;
+    struct capture_slot slot[CAPTURE_NUM_SLOTS];
+    uint32_t segment;              // Number of the segment, 0 for unsegmented recordings
+    uint32_t reserved;
+    uint64_t segment_offset;       // Frame data recorded before this segment
+};
+
+struct capture_index_entry {
+    uint32_t counter;              // Frame counter of the indexed frame
+    uint32_t flags;                // CAPTURE_INDEX_RESTART
+    uint64_t offset;               // File offset of the frame
+    int64_t monotonic_ns;          // CLOCK_MONOTONIC when its transfer completed
+};
+
+struct capture_index_block {
+    char magic[8];                 // CAPTURE_INDEX_MAGIC
+    uint32_t num_entries;
+    uint32_t reserved;
+};
+
+struct capture_writer;
+
+// Fills magic, version, sizes and both start times; the caller adds the device description
+void capture_init_header(struct capture_header *header);
+
+// Creates <filename> with the header and <filename>.idx. Returns NULL and prints the error on
+// failure.
+struct capture_writer *capture_create(const char *filename, const struct capture_header *header);
+
+// Appends received data, indexing the frames in it. monotonic_ns is the completion time of
+// the transfer the data belongs to. Returns 0 or -1 with errno set.
+int capture_write(struct capture_writer *writer, const void *data, size_t len, int64_t monotonic_ns);
+
+// Marks the end of the stream written so far: the next frame with preamble is indexed as
+// the start of a restarted stream, after a partial frame is skipped
+void capture_restart(struct capture_writer *writer);
+
+// Writes the remaining index entries and closes both files. Returns 0 or -1 with errno set.
+int capture_close(struct capture_writer *writer);
+
+// Reads the header of an open file from offset 0. Returns 0 for a capture container, 1 for a
+// headerless raw recording or -1 on read errors and unsupported versions.
+int capture_read_header(int fd, struct capture_header *header);
+
+#endif
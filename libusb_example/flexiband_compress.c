@@ -0,0 +1,212 @@
+/* libusb_example/flexiband_compress.c
+ *
+ * Converts recordings to compressed archives (see flexiband_archive.h) and back. Both
+ * directions run on a pool of threads; decompression writes every block at its own offset,
+ * so the blocks can be decoded in any order.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "flexiband_archive.h"
+#include "flexiband_reader.h"
+
+#define READ_LEN (4 * 1024 * 1024)
+
+struct decompress_job {
+    const struct archive_reader *reader;
+    int fd;                  // -1 to only verify
+    uint64_t data_offset;    // of the frame data in the output
+    uint64_t next;           // next block, atomic
+    int errors;              // atomic
+};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double process_cpu_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compress_file(const char *input, const char *output, int num_threads, int level, int layout) {
+    struct archive_statistics stat;
+    struct capture_reader *reader = reader_open(input);
+    if (reader == NULL) return 1;
+
+    if (layout < 0 && reader->container && reader->header.layout < NUM_LAYOUTS) layout = reader->header.layout;
+    unsigned payload_len = layout >= 0 ? layout_payload_len((enum payload_layout)layout) : FRAME_MAX_PAYLOAD;
+    uint64_t data_len = reader->map_len - (reader->container ? reader->header.header_len : 0);
+
+    double start = now_sec();
+    struct archive_writer *writer = archive_create(output, reader->container ? &reader->header : NULL, payload_len,
+                                                   num_threads, level);
+    if (writer == NULL) {
+        reader_close(reader);
+        return 1;
+    }
+    int status = 0;
+    for (uint64_t pos = 0; pos < data_len && status == 0; pos += READ_LEN) {
+        size_t len = data_len - pos < READ_LEN ? data_len - pos : READ_LEN;
+        if (archive_write(writer, reader->frames + pos, len)) {
+            fprintf(stderr, "Failed to write %s\n%s\n", output, strerror(errno));
+            status = 1;
+        }
+    }
+    if (archive_close(writer, &stat) && status == 0) {
+        fprintf(stderr, "Failed to write %s\n%s\n", output, strerror(errno));
+        status = 1;
+    }
+    double elapsed = now_sec() - start;
+    reader_close(reader);
+    if (status) return status;
+
+    printf("%.1f MB -> %.1f MB, ratio %.3f, %" PRIu64 " blocks, payload %u bytes per frame\n", stat.raw_bytes / 1e6,
+           stat.compressed_bytes / 1e6, stat.compressed_bytes ? (double)stat.raw_bytes / stat.compressed_bytes : 0,
+           stat.blocks, payload_len);
+    printf("%.1f MB/s with %d threads, %.1f MB/s per core, producer waited for %" PRIu64 " blocks\n",
+           stat.raw_bytes / 1e6 / elapsed, num_threads, stat.cpu_sec > 0 ? stat.raw_bytes / 1e6 / stat.cpu_sec : 0,
+           stat.stalls);
+    return 0;
+}
+
+static void *decompress_thread(void *arg) {
+    struct decompress_job *job = (struct decompress_job*)arg;
+    const struct archive_reader *reader = job->reader;
+    uint8_t *buffer = (uint8_t*)malloc(ARCHIVE_BLOCK_FRAMES * FRAME_LEN + FRAME_LEN);
+    if (buffer == NULL) {
+        __sync_fetch_and_add(&job->errors, 1);
+        return NULL;
+    }
+    for (;;) {
+        uint64_t block = __sync_fetch_and_add(&job->next, 1);
+        if (block >= reader->num_blocks) break;
+        long len = archive_read_block(reader, block, buffer);
+        if (len < 0) {
+            fprintf(stderr, "Error: Block %" PRIu64 " is corrupt\n", block);
+            __sync_fetch_and_add(&job->errors, 1);
+            continue;
+        }
+        if (job->fd < 0) continue;
+        off_t offset = job->data_offset + reader->index[block].first_frame * FRAME_LEN;
+        for (long pos = 0; pos < len;) {
+            ssize_t n = pwrite(job->fd, buffer + pos, len - pos, offset + pos);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                fprintf(stderr, "Error: Write block %" PRIu64 "\n%s\n", block, strerror(errno));
+                __sync_fetch_and_add(&job->errors, 1);
+                break;
+            }
+            pos += n;
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Decompresses to output, or only verifies all blocks if output is NULL
+static int decompress_file(const char *input, const char *output, int num_threads) {
+    struct decompress_job job;
+    pthread_t threads[num_threads];
+    int started = 0;
+    struct stat sb;
+
+    struct archive_reader *reader = archive_open(input);
+    if (reader == NULL) return 1;
+    memset(&job, 0, sizeof(job));
+    job.reader = reader;
+    job.fd = -1;
+    if (output) {
+        job.fd = open(output, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (job.fd < 0) {
+            fprintf(stderr, "Failed to open %s\n%s\n", output, strerror(errno));
+            archive_reader_close(reader);
+            return 1;
+        }
+        if (reader->header.capture_header_len) {
+            uint8_t block[CAPTURE_HEADER_LEN];
+            memset(block, 0, sizeof(block));
+            memcpy(block, &reader->capture, sizeof(reader->capture));
+            if (pwrite(job.fd, block, sizeof(block), 0) != sizeof(block)) job.errors++;
+            job.data_offset = CAPTURE_HEADER_LEN;
+        }
+    }
+
+    double start = now_sec();
+    double cpu_start = process_cpu_sec();
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, decompress_thread, &job)) break;
+        started++;
+    }
+    decompress_thread(&job);
+    for (int i = 1; i <= started; i++) pthread_join(threads[i], NULL);
+    double elapsed = now_sec() - start;
+    double cpu = process_cpu_sec() - cpu_start;
+
+    fstat(reader->fd, &sb);
+    printf("%.1f MB -> %.1f MB in %" PRIu64 " blocks, %.1f MB/s with %d threads, %.1f MB/s per core\n", sb.st_size / 1e6,
+           reader->data_len / 1e6, reader->num_blocks, reader->data_len / 1e6 / elapsed, started + 1,
+           cpu > 0 ? reader->data_len / 1e6 / cpu : 0);
+    if (job.fd >= 0 && close(job.fd)) job.errors++;
+    archive_reader_close(reader);
+    if (job.errors) fprintf(stderr, "Error: %d blocks failed\n", job.errors);
+    return job.errors ? 1 : 0;
+}
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [-j <threads>] [-z <level>] [-l <layout>] <recording> <archive>\n", program_name);
+    printf("       %s -x [-j <threads>] <archive> <recording>\n", program_name);
+    printf("       %s -t [-j <threads>] <archive>\n", program_name);
+    printf("  -z  zlib level 1-9, 0 for Huffman coding only (default 0, as fast and as good for noise-like samples)\n");
+    printf("  -l  Payload layout I-3, III-1a or III-1b, taken from capture containers by default\n");
+    printf("  -x  Decompress\n");
+    printf("  -t  Verify all blocks\n");
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int level = 0;
+    int layout = -1;
+    bool extract = false, verify = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:z:l:xt")) != -1) {
+        switch (opt) {
+        case 'j': num_threads = atoi(optarg); break;
+        case 'z': level = atoi(optarg); break;
+        case 'l':
+            for (layout = 0; layout < NUM_LAYOUTS && strcmp(layout_names[layout], optarg); layout++) {}
+            if (layout == NUM_LAYOUTS) {
+                fprintf(stderr, "Error: Unknown layout %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'x': extract = true; break;
+        case 't': verify = true; break;
+        default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (num_threads < 1) num_threads = 1;
+    if (argc - optind < (verify ? 1 : 2) || level < 0 || level > 9) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (verify) return decompress_file(argv[optind], NULL, num_threads);
+    if (extract) return decompress_file(argv[optind], argv[optind + 1], num_threads);
+    return compress_file(argv[optind], argv[optind + 1], num_threads, level, layout);
+}
@@ -0,0 +1,149 @@
+/* libusb_example/flexiband_decimate.c
+ *
+ * Mixes every band of a recording to baseband and/or filters and decimates it into
+ * <output>.<band>.cf32 or .ci16, like flexiband_record -N and -D do while recording (see
+ * flexiband_reduce.h). Without <output> the bands are only processed, as a benchmark. Either
+ * way the CPU time per band is reported as samples per second on one core.
+ */
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flexiband_reader.h"
+#include "flexiband_reduce.h"
+
+#define CHUNK_FRAMES 4096
+
+static volatile sig_atomic_t do_exit = false;
+
+static void sighandler(int signum) {
+    do_exit = true;
+}
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [-d <decimation>] [-n <taps>] [-w <bandwidth>] [-N <bytes/s>] [-c <band>:<Hz>] [-I] [-l <layout>] <recording> [<output>]\n", program_name);
+    printf("  -d  Keep every <decimation>th sample, default 4, 1 to mix only\n");
+    printf("  -n  Filter taps, default 16 per output sample\n");
+    printf("  -w  Passband edge as fraction of the output Nyquist frequency, default 0.8\n");
+    printf("  -N  Mix every band from its IF to baseband by the LO frequencies in the capture container; the\n"
+           "      recording was taken at <bytes/s>, e.g. 40e6\n");
+    printf("  -c  Centre the baseband of <band> on <Hz> instead of the GPS carrier\n");
+    printf("  -I  Write int16 .ci16 instead of float .cf32\n");
+    printf("  -l  Payload layout I-3, III-1a or III-1b, taken from capture containers by default\n");
+    printf("  Without <output> the bands are filtered for the benchmark only\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct reduce_config config = {CAPTURE_LAYOUT_UNKNOWN, 4, 0, 0.8, REDUCE_CF32, false, {0, 0, 0}};
+    struct reduce_statistics stat;
+    double carriers[NUM_BANDS];
+    double mix_rate = 0, hz;
+    char band_name[8];
+    int b;
+    int status = 0;
+    int opt;
+
+    memcpy(carriers, reduce_carriers, sizeof(carriers));
+    while ((opt = getopt(argc, argv, "d:n:w:N:c:Il:")) != -1) {
+        switch (opt) {
+        case 'd': config.decimation = (unsigned)atoi(optarg); break;
+        case 'n': config.taps = (unsigned)atoi(optarg); break;
+        case 'w': config.bandwidth = atof(optarg); break;
+        case 'N':
+            mix_rate = atof(optarg);
+            config.mix = true;
+            break;
+        case 'c':
+            if (sscanf(optarg, "%7[^:]:%lf", band_name, &hz) != 2) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            for (b = 0; b < NUM_BANDS && strcmp(band_names[b], band_name); b++) {}
+            if (b == NUM_BANDS) {
+                fprintf(stderr, "Error: Unknown band %s\n", band_name);
+                return 1;
+            }
+            carriers[b] = hz;
+            break;
+        case 'I': config.format = REDUCE_CI16; break;
+        case 'l':
+            for (config.layout = 0; config.layout < NUM_LAYOUTS && strcmp(layout_names[config.layout], optarg); config.layout++) {}
+            if (config.layout == NUM_LAYOUTS) {
+                fprintf(stderr, "Error: Unknown layout %s\n", optarg);
+                return 1;
+            }
+            break;
+        default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 1 || config.decimation == 0 || (config.mix && mix_rate <= 0)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (config.taps == 0) config.taps = 16 * config.decimation;
+    const char *output = argc - optind > 1 ? argv[optind + 1] : NULL;
+
+    struct capture_reader *reader = reader_open(argv[optind]);
+    if (reader == NULL) return 1;
+    if (config.layout >= NUM_LAYOUTS) {
+        if (!reader->container || reader->header.layout >= NUM_LAYOUTS) {
+            fprintf(stderr, "Error: Unknown layout, use -l\n");
+            reader_close(reader);
+            return 1;
+        }
+        config.layout = reader->header.layout;
+    }
+    if (config.mix) {
+        struct capture_header header = reader->header;
+        header.layout = config.layout;
+        if (!reader->container || reduce_baseband_shifts(&header, carriers, mix_rate, config.shift) == 0) {
+            fprintf(stderr, "Error: No LO frequencies in %s\n", argv[optind]);
+            reader_close(reader);
+            return 1;
+        }
+        for (b = 0; b < NUM_BANDS; b++) {
+            double sample_rate = mix_rate / FRAME_LEN * unpack_samples_per_frame((enum payload_layout)config.layout, (enum band)b);
+            if (sample_rate > 0) printf("%s shifted by %.0f Hz\n", band_names[b], config.shift[b] * sample_rate);
+        }
+    }
+    struct reduce *reduce = reduce_create(output, &config, false);
+    if (reduce == NULL) {
+        reader_close(reader);
+        return 1;
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (uint64_t first = 0; first < reader->num_frames && !do_exit && status == 0; first += CHUNK_FRAMES) {
+        uint64_t count = CHUNK_FRAMES;
+        const uint8_t *frames = reader_frames(reader, first, &count);
+        if (frames && reduce_write(reduce, frames, count * FRAME_LEN)) status = 1;
+    }
+    if (reduce_close(reduce, &stat)) status = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (status) fprintf(stderr, "Error: Write %s\n", output);
+
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%" PRIu64 " frames in %.2f s, %" PRIu64 " missing frames filled, unpacking %.1f s CPU\n", reader->num_frames,
+           elapsed, stat.missing_frames, stat.unpack_sec);
+    if (config.decimation > 1) {
+        printf("Decimation %u, %u taps, %.0f MFLOP per Msample\n", config.decimation, config.taps,
+               4.0 * config.taps / config.decimation);
+    }
+    for (int b = 0; b < NUM_BANDS; b++) {
+        if (stat.samples[b] == 0) continue;
+        printf("%s: %" PRIu64 " -> %" PRIu64 " samples, %.1f Msamples/s per core\n", band_names[b], stat.samples[b],
+               stat.outputs[b], stat.filter_sec[b] > 0 ? stat.samples[b] / stat.filter_sec[b] / 1e6 : 0);
+    }
+    reader_close(reader);
+    return status;
+}
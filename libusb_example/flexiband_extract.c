@@ -0,0 +1,117 @@
+/* libusb_example/flexiband_extract.c
+ *
+ * Copies a window of a recording into a new raw file, without reading the rest of the
+ * recording. The start is given as frame index, frame counter or seconds after the start of
+ * the recording (capture containers with index only).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "flexiband_reader.h"
+
+#define WRITE_FRAMES 4096  // 4 MiB per write
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [-f <frame> | -c <counter> | -s <seconds>] [-n <frames> | -d <seconds>] <recording> <output>\n", program_name);
+    printf("  -f  First frame, counted from the start of the file\n");
+    printf("  -c  First frame counter\n");
+    printf("  -s  Start in seconds after the start of the recording\n");
+    printf("  -n  Number of frames (default: up to the end)\n");
+    printf("  -d  Duration in seconds\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct capture_reader *reader;
+    int64_t first = 0;
+    uint64_t count = UINT64_MAX;
+    const char *frame_arg = NULL, *counter_arg = NULL;
+    double start_sec = -1, duration_sec = -1;
+    int status = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:c:s:n:d:")) != -1) {
+        switch (opt) {
+        case 'f': frame_arg = optarg; break;
+        case 'c': counter_arg = optarg; break;
+        case 's': start_sec = strtod(optarg, NULL); break;
+        case 'n': count = strtoull(optarg, NULL, 0); break;
+        case 'd': duration_sec = strtod(optarg, NULL); break;
+        default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    reader = reader_open(argv[optind]);
+    if (reader == NULL) return 1;
+
+    if ((start_sec >= 0 || duration_sec >= 0) && reader->index == NULL) {
+        fprintf(stderr, "Error: %s has no time index\n", argv[optind]);
+        status = 1;
+        goto err_reader;
+    }
+    if (frame_arg) {
+        first = strtoll(frame_arg, NULL, 0);
+    } else if (counter_arg) {
+        first = reader_find_counter(reader, strtoul(counter_arg, NULL, 0));
+    } else if (start_sec >= 0) {
+        first = reader_find_time(reader, reader->header.start_monotonic_ns + (int64_t)(start_sec * 1e9));
+    }
+    if (first < 0 || (uint64_t)first >= reader->num_frames) {
+        fprintf(stderr, "Error: Start is not within the %" PRIu64 " frames of %s\n", reader->num_frames, argv[optind]);
+        status = 1;
+        goto err_reader;
+    }
+    if (duration_sec >= 0) {
+        int64_t t0 = reader->index[0].monotonic_ns;
+        if (start_sec >= 0) {
+            t0 = reader->header.start_monotonic_ns + (int64_t)(start_sec * 1e9);
+        } else {
+            // Time of the last index entry at or before a frame or counter start
+            for (size_t i = 0; i < reader->num_index; i++) {
+                if ((reader->index[i].offset - reader->header.header_len) / FRAME_LEN > (uint64_t)first) break;
+                t0 = reader->index[i].monotonic_ns;
+            }
+        }
+        int64_t end = reader_find_time(reader, t0 + (int64_t)(duration_sec * 1e9));
+        count = end > first ? (uint64_t)(end - first) : 0;
+    }
+
+    int fd = open(argv[optind + 1], O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s\n%s\n", argv[optind + 1], strerror(errno));
+        status = 1;
+        goto err_reader;
+    }
+
+    uint64_t written = 0;
+    const uint8_t *frames = reader_frames(reader, first, &count);
+    while (written < count) {
+        size_t len = (count - written < WRITE_FRAMES ? count - written : WRITE_FRAMES) * FRAME_LEN;
+        ssize_t n = write(fd, frames + written * FRAME_LEN, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to write %s\n%s\n", argv[optind + 1], strerror(errno));
+            status = 1;
+            break;
+        }
+        written += n / FRAME_LEN;
+        if (n % FRAME_LEN) lseek(fd, -(off_t)(n % FRAME_LEN), SEEK_CUR);
+    }
+    close(fd);
+    printf("Extracted frames %" PRId64 " to %" PRIu64 " of %" PRIu64 "\n", first, first + written, reader->num_frames);
+
+err_reader:
+    reader_close(reader);
+    return status;
+}
@@ -0,0 +1,108 @@
+/* libusb_example/flexiband_fft.c
+ *
+ * Iterative decimation-in-time FFT, see flexiband_fft.h. The twiddles of every stage are
+ * stored contiguously, so the butterflies of a stage read data and twiddles with unit stride.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "flexiband_fft.h"
+
+struct fft {
+    unsigned n;
+    unsigned *reverse;   // bit reversed index
+    float *tw_re;        // exp(-i pi k / h) of the stage with half size h at h + k
+    float *tw_im;
+};
+
+struct fft *fft_create(unsigned n) {
+    if (n < 2 || (n & (n - 1))) return NULL;
+    struct fft *fft = (struct fft*)calloc(1, sizeof(struct fft));
+    if (fft == NULL) return NULL;
+    fft->n = n;
+    fft->reverse = (unsigned*)malloc(n * sizeof(unsigned));
+    fft->tw_re = (float*)malloc(n * sizeof(float));
+    fft->tw_im = (float*)malloc(n * sizeof(float));
+    if (fft->reverse == NULL || fft->tw_re == NULL || fft->tw_im == NULL) {
+        fft_free(fft);
+        return NULL;
+    }
+
+    unsigned bits = 0;
+    while ((1u << bits) < n) bits++;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned r = 0;
+        for (unsigned b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+        fft->reverse[i] = r;
+    }
+    for (unsigned h = 1; h < n; h <<= 1) {
+        for (unsigned k = 0; k < h; k++) {
+            fft->tw_re[h + k] = (float)cos(M_PI * k / h);
+            fft->tw_im[h + k] = (float)-sin(M_PI * k / h);
+        }
+    }
+    return fft;
+}
+
+void fft_free(struct fft *fft) {
+    if (fft == NULL) return;
+    free(fft->reverse);
+    free(fft->tw_re);
+    free(fft->tw_im);
+    free(fft);
+}
+
+unsigned fft_size(const struct fft *fft) {
+    return fft->n;
+}
+
+void fft_forward(const struct fft *fft, float *re, float *im) {
+    const unsigned n = fft->n;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned r = fft->reverse[i];
+        if (i < r) {
+            float t = re[i]; re[i] = re[r]; re[r] = t;
+            t = im[i]; im[i] = im[r]; im[r] = t;
+        }
+    }
+
+    for (unsigned h = 1; h < n; h <<= 1) {
+        const float *wr = fft->tw_re + h, *wi = fft->tw_im + h;
+        for (unsigned start = 0; start < n; start += 2 * h) {
+            float *ar = re + start, *ai = im + start, *br = re + start + h, *bi = im + start + h;
+            unsigned k = 0;
+#ifdef __SSE__
+            for (; k + 4 <= h; k += 4) {
+                __m128 w_r = _mm_loadu_ps(wr + k), w_i = _mm_loadu_ps(wi + k);
+                __m128 b_r = _mm_loadu_ps(br + k), b_i = _mm_loadu_ps(bi + k);
+                __m128 t_r = _mm_sub_ps(_mm_mul_ps(b_r, w_r), _mm_mul_ps(b_i, w_i));
+                __m128 t_i = _mm_add_ps(_mm_mul_ps(b_r, w_i), _mm_mul_ps(b_i, w_r));
+                __m128 a_r = _mm_loadu_ps(ar + k), a_i = _mm_loadu_ps(ai + k);
+                _mm_storeu_ps(br + k, _mm_sub_ps(a_r, t_r));
+                _mm_storeu_ps(bi + k, _mm_sub_ps(a_i, t_i));
+                _mm_storeu_ps(ar + k, _mm_add_ps(a_r, t_r));
+                _mm_storeu_ps(ai + k, _mm_add_ps(a_i, t_i));
+            }
+#endif
+            for (; k < h; k++) {
+                float t_r = br[k] * wr[k] - bi[k] * wi[k];
+                float t_i = br[k] * wi[k] + bi[k] * wr[k];
+                br[k] = ar[k] - t_r;
+                bi[k] = ai[k] - t_i;
+                ar[k] += t_r;
+                ai[k] += t_i;
+            }
+        }
+    }
+}
+
+// Swapping real and imaginary part conjugates and multiplies by i, which turns the forward
+// transform into the inverse one
+void fft_inverse(const struct fft *fft, float *re, float *im) {
+    fft_forward(fft, im, re);
+}
@@ -0,0 +1,25 @@
+/* libusb_example/flexiband_fft.h
+ *
+ * In-place radix-2 FFT of single precision complex data in split format (real and imaginary
+ * parts in separate arrays), so the butterflies run four at a time with SSE.
+ */
+
+#ifndef FLEXIBAND_FFT_H
+#define FLEXIBAND_FFT_H
+
+struct fft;
+
+// n must be a power of two. Returns NULL if it is not or allocation fails.
+struct fft *fft_create(unsigned n);
+
+void fft_free(struct fft *fft);
+
+unsigned fft_size(const struct fft *fft);
+
+// X[k] = sum x[j] exp(-2 pi i j k / n)
+void fft_forward(const struct fft *fft, float *re, float *im);
+
+// x[j] = sum X[k] exp(2 pi i j k / n), not divided by n
+void fft_inverse(const struct fft *fft, float *re, float *im);
+
+#endif
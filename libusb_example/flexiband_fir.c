@@ -0,0 +1,150 @@
+/* libusb_example/flexiband_fir.c
+ *
+ * Decimating FIR filter, see flexiband_fir.h. The input is converted to float into separate
+ * I and Q buffers behind the last num_taps - 1 samples of history, so every output is a dot
+ * product of the reversed taps with a contiguous window, four taps at a time with SSE.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "flexiband_fir.h"
+
+#define FIR_BLOCK 4096   // samples converted at once, keeps the buffers in L1/L2
+
+struct fir {
+    unsigned decimation;
+    unsigned len;        // taps padded to a multiple of 8, leading zeros
+    float *taps;         // reversed, taps[len - 1] weighs the newest sample
+    float *re;           // len - 1 samples of history, then up to FIR_BLOCK new ones
+    float *im;
+    unsigned fill;       // valid samples in re and im
+    unsigned next;       // index of the newest sample of the next output
+};
+
+struct fir *fir_create(unsigned decimation, unsigned num_taps, double bandwidth) {
+    if (decimation == 0 || num_taps == 0 || bandwidth <= 0 || bandwidth > 1) return NULL;
+    struct fir *fir = (struct fir*)calloc(1, sizeof(struct fir));
+    if (fir == NULL) return NULL;
+    fir->decimation = decimation;
+    fir->len = (num_taps + 7) & ~7u;
+    fir->taps = (float*)calloc(fir->len, sizeof(float));
+    fir->re = (float*)calloc(fir->len - 1 + FIR_BLOCK, sizeof(float));
+    fir->im = (float*)calloc(fir->len - 1 + FIR_BLOCK, sizeof(float));
+    if (fir->taps == NULL || fir->re == NULL || fir->im == NULL) {
+        fir_free(fir);
+        return NULL;
+    }
+
+    // Blackman window, cutoff in cycles per input sample
+    double cutoff = bandwidth * 0.5 / decimation, sum = 0;
+    double *h = (double*)malloc(num_taps * sizeof(double));
+    if (h == NULL) {
+        fir_free(fir);
+        return NULL;
+    }
+    for (unsigned n = 0; n < num_taps; n++) {
+        double t = n - (num_taps - 1) / 2.0;
+        double sinc = t == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * t) / (M_PI * t);
+        double w = num_taps == 1 ? 1 : 0.42 - 0.5 * cos(2 * M_PI * n / (num_taps - 1)) + 0.08 * cos(4 * M_PI * n / (num_taps - 1));
+        h[n] = sinc * w;
+        sum += h[n];
+    }
+    for (unsigned n = 0; n < num_taps; n++) fir->taps[fir->len - 1 - n] = (float)(h[n] / sum);
+    free(h);
+
+    fir->fill = fir->len - 1;
+    fir->next = fir->len - 1;
+    return fir;
+}
+
+void fir_free(struct fir *fir) {
+    if (fir == NULL) return;
+    free(fir->taps);
+    free(fir->re);
+    free(fir->im);
+    free(fir);
+}
+
+unsigned fir_decimation(const struct fir *fir) {
+    return fir->decimation;
+}
+
+static void dot(const struct fir *fir, unsigned newest, float *out) {
+    const float *re = fir->re + newest + 1 - fir->len, *im = fir->im + newest + 1 - fir->len, *taps = fir->taps;
+    unsigned k = 0;
+    float sum_re = 0, sum_im = 0;
+#ifdef __SSE__
+    __m128 re0 = _mm_setzero_ps(), re1 = _mm_setzero_ps(), im0 = _mm_setzero_ps(), im1 = _mm_setzero_ps();
+    for (; k < fir->len; k += 8) {
+        __m128 t0 = _mm_loadu_ps(taps + k), t1 = _mm_loadu_ps(taps + k + 4);
+        re0 = _mm_add_ps(re0, _mm_mul_ps(t0, _mm_loadu_ps(re + k)));
+        re1 = _mm_add_ps(re1, _mm_mul_ps(t1, _mm_loadu_ps(re + k + 4)));
+        im0 = _mm_add_ps(im0, _mm_mul_ps(t0, _mm_loadu_ps(im + k)));
+        im1 = _mm_add_ps(im1, _mm_mul_ps(t1, _mm_loadu_ps(im + k + 4)));
+    }
+    float r[4], i[4];
+    _mm_storeu_ps(r, _mm_add_ps(re0, re1));
+    _mm_storeu_ps(i, _mm_add_ps(im0, im1));
+    sum_re = r[0] + r[1] + r[2] + r[3];
+    sum_im = i[0] + i[1] + i[2] + i[3];
+#endif
+    for (; k < fir->len; k++) {
+        sum_re += taps[k] * re[k];
+        sum_im += taps[k] * im[k];
+    }
+    out[0] = sum_re;
+    out[1] = sum_im;
+}
+
+// One of in and in_float is set, or none for zeros
+static size_t run(struct fir *fir, const int8_t *in, const float *in_float, size_t count, float *out) {
+    const unsigned history = fir->len - 1;
+    size_t outputs = 0;
+    while (count > 0) {
+        unsigned n = history + FIR_BLOCK - fir->fill;
+        if (n > count) n = (unsigned)count;
+        float *re = fir->re + fir->fill, *im = fir->im + fir->fill;
+        if (in) {
+            for (unsigned i = 0; i < n; i++) {
+                re[i] = in[2 * i];
+                im[i] = in[2 * i + 1];
+            }
+            in += 2 * n;
+        } else if (in_float) {
+            for (unsigned i = 0; i < n; i++) {
+                re[i] = in_float[2 * i];
+                im[i] = in_float[2 * i + 1];
+            }
+            in_float += 2 * n;
+        } else {
+            memset(re, 0, n * sizeof(float));
+            memset(im, 0, n * sizeof(float));
+        }
+        fir->fill += n;
+        count -= n;
+
+        for (; fir->next < fir->fill; fir->next += fir->decimation) dot(fir, fir->next, out + 2 * outputs++);
+
+        // Keep the history for the next block
+        unsigned shift = fir->fill - history;
+        memmove(fir->re, fir->re + shift, history * sizeof(float));
+        memmove(fir->im, fir->im + shift, history * sizeof(float));
+        fir->fill = history;
+        fir->next -= shift;
+    }
+    return outputs;
+}
+
+size_t fir_process(struct fir *fir, const int8_t *in, size_t count, float *out) {
+    return run(fir, in, NULL, count, out);
+}
+
+size_t fir_process_float(struct fir *fir, const float *in, size_t count, float *out) {
+    return run(fir, NULL, in, count, out);
+}
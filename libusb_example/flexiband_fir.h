@@ -0,0 +1,34 @@
+/* libusb_example/flexiband_fir.h
+ *
+ * Decimating low-pass FIR filter for the complex samples of one band, as unpacked by
+ * flexiband_unpack.h. Only every decimation-th output is computed, which is the cost of a
+ * polyphase decimator. The filter keeps its history, so a stream can be fed in pieces of any
+ * size, e.g. frame by frame.
+ */
+
+#ifndef FLEXIBAND_FIR_H
+#define FLEXIBAND_FIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct fir;
+
+// Windowed sinc low-pass with unity gain at DC. bandwidth is the passband edge as a fraction
+// of the output Nyquist frequency, e.g. 0.8. Returns NULL on invalid parameters or if
+// allocation fails.
+struct fir *fir_create(unsigned decimation, unsigned num_taps, double bandwidth);
+
+void fir_free(struct fir *fir);
+
+unsigned fir_decimation(const struct fir *fir);
+
+// Filters count complex samples, I and Q interleaved, or count zeros if in is NULL. Writes
+// the outputs as interleaved float I and Q to out and returns their number, at most
+// count / decimation + 1.
+size_t fir_process(struct fir *fir, const int8_t *in, size_t count, float *out);
+
+// Same for float input, e.g. from flexiband_nco.h
+size_t fir_process_float(struct fir *fir, const float *in, size_t count, float *out);
+
+#endif
@@ -18,6 +18,7 @@
 #include <libusb-1.0/libusb.h>
 
 #include "libusb_version_fixes.h"
+#include "transport.h"
 
 #define INTERFACE     0
 #define VID      0x27ae
@@ -53,29 +54,29 @@ int main(int argc, char *argv[]) {
     signal(SIGTERM, sighandler);
     signal(SIGQUIT, sighandler);
 
-    status = libusb_init(&ctx);
+    status = transport_init(&ctx);
     if (status) {
         fprintf(stderr, "%s\n", libusb_strerror((enum libusb_error)status));
         goto err_ret;
     }
 
-    dev_handle = libusb_open_device_with_vid_pid(ctx, VID, PID);
+    dev_handle = transport_open_device_with_vid_pid(ctx, VID, PID);
     if (dev_handle == NULL) {
         fprintf(stderr, "Error: No device with VID=0x%04X, PID=0x%04X\n", VID, PID);
         status = 1;
         goto err_usb;
     }
 
-    if (libusb_kernel_driver_active(dev_handle, INTERFACE) == 1) {
+    if (transport_kernel_driver_active(dev_handle, INTERFACE) == 1) {
         printf("Warning: Kernel driver active, detaching kernel driver...");
-        status = libusb_detach_kernel_driver(dev_handle, INTERFACE);
+        status = transport_detach_kernel_driver(dev_handle, INTERFACE);
         if (status) {
             fprintf(stderr, "%s\n", libusb_strerror((enum libusb_error)status));
             goto err_dev;
         }
     }
 
-    status = libusb_claim_interface(dev_handle, INTERFACE);
+    status = transport_claim_interface(dev_handle, INTERFACE);
     if (status) {
         fprintf(stderr, "Claim interface: %s\n", libusb_strerror((enum libusb_error)status));
         goto err_dev;
@@ -88,9 +89,9 @@ int main(int argc, char *argv[]) {
     }
 
 err_dev:
-    libusb_close(dev_handle);
+    transport_close(dev_handle);
 err_usb:
-    libusb_exit(ctx);
+    transport_exit(ctx);
 err_ret:
     return status;
 }
@@ -103,19 +104,19 @@ static int show_fpga_info(libusb_device_handle *dev_handle) {
 
     printf("Read FPGA info...\n");
     uint16_t build_number;
-    status = libusb_control_transfer(dev_handle, VENDOR_IN, 0x03, 0x0001, 0x00, (unsigned char*)&build_number, sizeof(build_number), 1000);
+    status = transport_control_transfer(dev_handle, VENDOR_IN, 0x03, 0x0001, 0x00, (unsigned char*)&build_number, sizeof(build_number), 1000);
     if (status < 0) {
         fprintf(stderr, "Error: Read FPGA build number\n%s\n", libusb_strerror((enum libusb_error)status));
         goto err_ret;
     }
     uint32_t git_hash;
-    status = libusb_control_transfer(dev_handle, VENDOR_IN, 0x03, 0x0002, 0x00, (unsigned char*)&git_hash, sizeof(git_hash), 1000);
+    status = transport_control_transfer(dev_handle, VENDOR_IN, 0x03, 0x0002, 0x00, (unsigned char*)&git_hash, sizeof(git_hash), 1000);
     if (status < 0) {
         fprintf(stderr, "Error: Read FPGA git hash\n%s\n", libusb_strerror((enum libusb_error)status));
         goto err_ret;
     }
     uint32_t timestamp;
-    status = libusb_control_transfer(dev_handle, VENDOR_IN, 0x03, 0x0003, 0x00, (unsigned char*)&timestamp, sizeof(timestamp), 1000);
+    status = transport_control_transfer(dev_handle, VENDOR_IN, 0x03, 0x0003, 0x00, (unsigned char*)&timestamp, sizeof(timestamp), 1000);
     if (status < 0) {
         fprintf(stderr, "Error: Read FPGA build time\n%s\n", libusb_strerror((enum libusb_error)status));
         goto err_ret;
@@ -152,7 +153,7 @@ static int upload_fpga(libusb_device_handle *dev_handle, const char *filename) {
         unsigned char data[ep0_buf_size];
 
         size_t len = fread(data, sizeof(char), ep0_buf_size, fp);
-        status = libusb_control_transfer(dev_handle, VENDOR_OUT, 0x00, 0xff00, page, data, len, 1000);
+        status = transport_control_transfer(dev_handle, VENDOR_OUT, 0x00, 0xff00, page, data, len, 1000);
         if (status < 0) {
             printf("\n");
             fprintf(stderr, "Error: Upload FPGA config\n%s\n", libusb_strerror((enum libusb_error)status));
@@ -164,7 +165,7 @@ static int upload_fpga(libusb_device_handle *dev_handle, const char *filename) {
         }
         page++;
     }
-    status = libusb_control_transfer(dev_handle, VENDOR_OUT, 0x00, 0xff00, 0xffff, NULL, 0, 1000);
+    status = transport_control_transfer(dev_handle, VENDOR_OUT, 0x00, 0xff00, 0xffff, NULL, 0, 1000);
     if (status) {
         printf("\n");
         fprintf(stderr, "Error: Upload FPGA config\n%s\n", libusb_strerror((enum libusb_error)status));
@@ -0,0 +1,67 @@
+/* libusb_example/flexiband_frame.h
+ *
+ * Framing of the Flexiband data stream, see "Data Format" in README.md.
+ */
+
+#ifndef FLEXIBAND_FRAME_H
+#define FLEXIBAND_FRAME_H
+
+#include <stdint.h>
+
+#define FRAME_LEN          1024
+#define FRAME_PREAMBLE_0   0x55
+#define FRAME_PREAMBLE_1   0xAA
+#define FRAME_HEADER_LEN   6     // preamble and counter
+#define FRAME_MAX_PAYLOAD  1014
+
+enum payload_layout {
+    LAYOUT_I_3,     // L5, 4 bit I and Q per byte
+    LAYOUT_III_1A,  // byte 0: L2 and L1 with 2 bit I and Q, byte 1: L5 with 4 bit I and Q
+    LAYOUT_III_1B,  // bytes 0-3: L2, L1, L5, L5 with 4 bit I and Q each
+    NUM_LAYOUTS
+};
+
+static const char *const layout_names[NUM_LAYOUTS] = {"I-3", "III-1a", "III-1b"};
+
+// Payload bytes per frame, the rest up to FRAME_LEN is padding
+static inline unsigned layout_payload_len(enum payload_layout layout) {
+    return layout == LAYOUT_III_1B ? 1012 : FRAME_MAX_PAYLOAD;
+}
+
+static inline int frame_has_preamble(const uint8_t *frame) {
+    return frame[0] == FRAME_PREAMBLE_0 && frame[1] == FRAME_PREAMBLE_1;
+}
+
+// The counter is transmitted most significant byte first, like all multi byte values
+static inline uint32_t frame_counter(const uint8_t *frame) {
+    return ((uint32_t)frame[2] << 24) | ((uint32_t)frame[3] << 16) | ((uint32_t)frame[4] << 8) | frame[5];
+}
+
+static inline void frame_set_header(uint8_t *frame, uint32_t counter) {
+    frame[0] = FRAME_PREAMBLE_0;
+    frame[1] = FRAME_PREAMBLE_1;
+    frame[2] = counter >> 24;
+    frame[3] = counter >> 16;
+    frame[4] = counter >> 8;
+    frame[5] = counter;
+}
+
+// Frames inserted by flexiband_scan -r for lost frames: zero payload and "GAP" in the last
+// padding bytes, which are zero in frames of the device
+#define FRAME_GAP_MARKER     "GAP"
+#define FRAME_GAP_MARKER_LEN 4
+
+static inline void frame_set_gap_marker(uint8_t *frame, uint32_t counter) {
+    for (int i = FRAME_HEADER_LEN; i < FRAME_LEN; i++) frame[i] = 0;
+    frame_set_header(frame, counter);
+    for (int i = 0; i < FRAME_GAP_MARKER_LEN; i++) frame[FRAME_LEN - FRAME_GAP_MARKER_LEN + i] = FRAME_GAP_MARKER[i];
+}
+
+static inline int frame_is_gap_marker(const uint8_t *frame) {
+    for (int i = 0; i < FRAME_GAP_MARKER_LEN; i++) {
+        if (frame[FRAME_LEN - FRAME_GAP_MARKER_LEN + i] != (uint8_t)FRAME_GAP_MARKER[i]) return 0;
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/* libusb_example/flexiband_gain.c
+ *
+ * Gain decisions, see flexiband_gain.h. For Gaussian noise of standard deviation s, the
+ * fraction beyond the threshold c is erfc(c / (s sqrt(2))), so the measured and the target
+ * fraction give the ratio of the current to the wanted s, i.e. the error in dB. Only part of
+ * it is corrected at once, the DAC to dB relation is nominal.
+ */
+
+#include <math.h>
+
+#include "flexiband_gain.h"
+
+#define LOOP_GAIN 0.7
+
+// Optimal uniform quantizers of a Gaussian (Max, 1960) have the half scale threshold at
+// 0.98 s for 2 bit and 4 * 0.335 s for 4 bit
+double gain_default_target(unsigned bits) {
+    if (bits <= 2) return 0.32;
+    if (bits >= 4) return 0.18;
+    return 0.25;
+}
+
+// x with erfc(x) = y, by bisection; erfc falls monotonically on [0, 4]
+static double erfc_inverse(double y) {
+    double lo = 0, hi = 4;
+    for (int i = 0; i < 40; i++) {
+        double mid = (lo + hi) / 2;
+        if (erfc(mid) > y) lo = mid;
+        else hi = mid;
+    }
+    return (lo + hi) / 2;
+}
+
+static double clamp(double x, double lo, double hi) {
+    return x < lo ? lo : x > hi ? hi : x;
+}
+
+int gain_decide(const struct gain_config *config, const struct gain_slot *slot, const struct stats_band *band,
+                int64_t now, uint64_t offset) {
+    if (slot->band < 0 || slot->pending || band->bits == 0 || band->samples == 0) return -1;
+    if (now < slot->not_before || offset < slot->settled) return -1;
+
+    double target = config->target > 0 ? config->target : gain_default_target(band->bits);
+    double measured = clamp(band->outer, 1e-4, 0.999);
+    // Threshold in units of s now and wanted; the input has to grow by their ratio
+    double error_db = 20 * log10(erfc_inverse(measured) / erfc_inverse(clamp(target, 1e-4, 0.999)));
+    if (fabs(error_db) < config->deadband_db) return -1;
+
+    double step_db = clamp(LOOP_GAIN * error_db, -config->max_step_db, config->max_step_db);
+    long dac = (long)slot->dac + lround(step_db / GAIN_DB_PER_STEP);
+    dac = (long)clamp(dac, slot->dac_min, slot->dac_max);
+    return dac == (long)slot->dac ? -1 : (int)dac;
+}
+
+void gain_applied(const struct gain_config *config, struct gain_slot *slot, unsigned dac, int64_t now, uint64_t offset) {
+    slot->dac = dac;
+    slot->pending = false;
+    slot->not_before = now + config->interval_usec;
+    slot->settled = offset + config->window_bytes;
+}
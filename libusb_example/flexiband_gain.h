@@ -0,0 +1,50 @@
+/* libusb_example/flexiband_gain.h
+ *
+ * Host-side gain control of the RF boards. The amplification DAC of a slot ("Set RF-Board
+ * Amplification" in README.md) is steered so the fraction of I and Q samples at or beyond
+ * half scale (stats_band.outer, see flexiband_stats.h) matches the optimal loading of the
+ * quantizer for Gaussian noise. The decision is made here; sending the request is up to the
+ * caller, which reports back with gain_applied() once the device accepted it.
+ */
+
+#ifndef FLEXIBAND_GAIN_H
+#define FLEXIBAND_GAIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "flexiband_stats.h"
+
+#define GAIN_DB_PER_STEP (70.0 / 255)   // README.md: 0 - 255 is roughly 0 - 70 dB
+
+struct gain_config {
+    double target;           // outer fraction, 0 for the optimum of the band's bit width
+    double deadband_db;      // errors below are ignored
+    double max_step_db;      // largest change at once
+    int64_t interval_usec;   // least time between two changes of a slot
+    uint64_t window_bytes;   // of the statistics, a change is judged only on frames after it
+};
+
+struct gain_slot {
+    int band;                // enum band of the board, -1 if not controlled
+    unsigned dac_min;
+    unsigned dac_max;
+    unsigned dac;            // current value
+    bool pending;            // request in flight
+    int64_t not_before;      // usec
+    uint64_t settled;        // stream offset from which the window only holds frames after the last change
+};
+
+// Outer fraction of a Gaussian input to the optimal uniform quantizer: 0.32 for 2 bit and
+// 0.18 for 4 bit, interpolated in between
+double gain_default_target(unsigned bits);
+
+// New DAC value for the slot, or -1 if it stays. now is monotonic usec, offset the stream
+// position of the newest frame in the statistics.
+int gain_decide(const struct gain_config *config, const struct gain_slot *slot, const struct stats_band *band,
+                int64_t now, uint64_t offset);
+
+// The device took dac at time now with the stream at offset
+void gain_applied(const struct gain_config *config, struct gain_slot *slot, unsigned dac, int64_t now, uint64_t offset);
+
+#endif
@@ -0,0 +1,28 @@
+/* libusb_example/flexiband_io.h
+ *
+ * File output shared by the writers of recordings.
+ */
+
+#ifndef FLEXIBAND_IO_H
+#define FLEXIBAND_IO_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+
+// Writes all of data, continuing after short writes and signals. Returns 0 or -1 with errno set.
+static inline int write_all(int fd, const void *data, size_t len) {
+    const char *p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#endif
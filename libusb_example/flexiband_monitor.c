@@ -0,0 +1,546 @@
+/* libusb_example/flexiband_monitor.c
+ *
+ * Spectrum and waterfall of every band, live from the device or from a recording. Every band
+ * is cut into blocks of n samples, Hann windowed and transformed (see flexiband_fft.h); the
+ * power spectra are averaged into waterfall rows and rows into spectra. Each row and spectrum
+ * is written as a text line
+ *
+ *   row|spectrum <band> <monotonic usec> <counter of the first frame> <n> <dB...>
+ *
+ * with the bins ordered from -fs/2 to fs/2, to a file and/or as datagrams to a unix socket.
+ *
+ * Live, the transfer callback only copies transfers into a ring of slots that a worker thread
+ * processes. If the worker falls behind, whole transfers are dropped instead of delaying the
+ * callback, and -d uses only every n-th transfer to begin with.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <libusb-1.0/libusb.h>
+
+#include "libusb_version_fixes.h"
+#include "flexiband_fft.h"
+#include "flexiband_reader.h"
+#include "flexiband_unpack.h"
+#include "transport.h"
+
+#define INTERFACE     0
+#define ALT_INTERFACE 1
+
+#define VID      0x27ae
+#define PID      0x1016
+#define ENDPOINT 0x83
+#define PKG_LEN (16 * 1024)
+#define NUM_PKG 32
+#define XFER_LEN (NUM_PKG * PKG_LEN)
+#define TIMEOUT_MS 1000
+#define QUEUE_SIZE 4
+#define RING_SLOTS 16
+#define CHUNK_FRAMES (XFER_LEN / FRAME_LEN)   // frames per step when reading a recording
+
+static volatile sig_atomic_t do_exit = false;
+
+struct options {
+    unsigned fft_size;
+    unsigned row_ffts;       // FFTs averaged per waterfall row
+    unsigned spectrum_rows;  // rows averaged per spectrum
+    unsigned decimation;     // use every n-th transfer
+    double duration;         // seconds, 0 until interrupted
+    int layout;              // -1 to take it from the container
+    const char *recording;   // NULL for live
+    const char *output;
+    const char *socket_path;
+};
+
+struct band_state {
+    unsigned per_frame;      // complex samples per frame, 0 if not in the layout
+    float *re;
+    float *im;
+    unsigned fill;
+    uint32_t first_counter;  // of the current row
+    double *row;
+    unsigned row_ffts;
+    double *spectrum;
+    unsigned spectrum_rows;
+    uint64_t ffts;
+    uint64_t samples;        // unpacked
+    double cpu_sec;
+};
+
+struct slot {
+    uint8_t *data;
+    size_t len;
+};
+
+struct monitor {
+    struct options opt;
+    enum payload_layout layout;
+    struct fft *fft;
+    float *window;
+    int8_t *samples;
+    struct band_state bands[NUM_BANDS];
+    FILE *fp;
+    int sock;
+    struct sockaddr_un addr;
+    char *line;
+    size_t line_len;
+    uint64_t frames;
+
+    // Live only
+    struct slot slots[RING_SLOTS];
+    unsigned head;           // next slot filled by the callback
+    unsigned tail;           // next slot processed by the worker
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    bool stopping;
+    unsigned pending;
+    int status;
+    uint64_t transfers;
+    uint64_t skipped;        // by decimation
+    uint64_t dropped;        // worker behind
+};
+
+static void sighandler(int signum) {
+    do_exit = true;
+}
+
+static int64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double thread_cpu_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes bins in dB, DC in the middle. Datagrams are dropped if nobody listens.
+static void emit(struct monitor *mon, const char *kind, enum band band, uint32_t counter, const double *power,
+                 double scale) {
+    unsigned n = mon->opt.fft_size;
+    size_t len = snprintf(mon->line, mon->line_len, "%s %s %" PRId64 " %" PRIu32 " %u", kind, band_names[band],
+                          now_usec(), counter, n);
+    for (unsigned i = 0; i < n; i++) {
+        double p = power[(i + n / 2) % n] * scale;
+        len += snprintf(mon->line + len, mon->line_len - len, " %.1f", p > 0 ? 10 * log10(p) : -200.0);
+    }
+    len += snprintf(mon->line + len, mon->line_len - len, "\n");
+    if (mon->fp) fwrite(mon->line, 1, len, mon->fp);
+    if (mon->sock >= 0) {
+        sendto(mon->sock, mon->line, len, MSG_DONTWAIT, (struct sockaddr*)&mon->addr, sizeof(mon->addr));
+    }
+}
+
+static void transform(struct monitor *mon, enum band b) {
+    struct band_state *band = &mon->bands[b];
+    unsigned n = mon->opt.fft_size;
+    for (unsigned i = 0; i < n; i++) {
+        band->re[i] *= mon->window[i];
+        band->im[i] *= mon->window[i];
+    }
+    fft_forward(mon->fft, band->re, band->im);
+    for (unsigned i = 0; i < n; i++) band->row[i] += band->re[i] * band->re[i] + band->im[i] * band->im[i];
+    band->ffts++;
+    band->fill = 0;
+    if (++band->row_ffts < mon->opt.row_ffts) return;
+
+    // 0 dB is a full scale tone of the 4 bit quantizer (amplitude 8) in the centre of a bin;
+    // the Hann window sums to n / 2
+    double scale = 4.0 / ((double)band->row_ffts * n * n * 64);
+    emit(mon, "row", b, band->first_counter, band->row, scale);
+    for (unsigned i = 0; i < n; i++) band->spectrum[i] += band->row[i];
+    memset(band->row, 0, n * sizeof(double));
+    band->row_ffts = 0;
+    if (++band->spectrum_rows < mon->opt.spectrum_rows) return;
+    emit(mon, "spectrum", b, band->first_counter, band->spectrum, scale / band->spectrum_rows);
+    memset(band->spectrum, 0, n * sizeof(double));
+    band->spectrum_rows = 0;
+}
+
+// Band by band, so the CPU time of each band is measured once per call
+static void process_frames(struct monitor *mon, const uint8_t *data, size_t len) {
+    for (int b = 0; b < NUM_BANDS; b++) {
+        struct band_state *band = &mon->bands[b];
+        int8_t *out[NUM_BANDS] = {NULL, NULL, NULL};
+        if (band->per_frame == 0) continue;
+        out[b] = mon->samples;
+        double start = thread_cpu_sec();
+        for (size_t pos = 0; pos + FRAME_LEN <= len; pos += FRAME_LEN) {
+            const uint8_t *frame = data + pos;
+            if (!frame_has_preamble(frame)) continue;
+            unpack_frame(mon->layout, frame, out);
+            for (unsigned i = 0; i < band->per_frame; i++) {
+                if (band->fill == 0 && band->row_ffts == 0) band->first_counter = frame_counter(frame);
+                band->re[band->fill] = mon->samples[2 * i];
+                band->im[band->fill] = mon->samples[2 * i + 1];
+                if (++band->fill == mon->opt.fft_size) transform(mon, (enum band)b);
+            }
+            band->samples += band->per_frame;
+        }
+        band->cpu_sec += thread_cpu_sec() - start;
+    }
+    mon->frames += len / FRAME_LEN;
+}
+
+static int init_monitor(struct monitor *mon) {
+    unsigned n = mon->opt.fft_size;
+    mon->sock = -1;
+    mon->fft = fft_create(n);
+    if (mon->fft == NULL) {
+        fprintf(stderr, "Error: FFT size %u is not a power of two\n", n);
+        return -1;
+    }
+    mon->window = (float*)malloc(n * sizeof(float));
+    mon->samples = (int8_t*)malloc(2 * FRAME_MAX_PAYLOAD);
+    mon->line_len = 64 + 8 * (size_t)n;
+    mon->line = (char*)malloc(mon->line_len);
+    if (mon->window == NULL || mon->samples == NULL || mon->line == NULL) {
+        fprintf(stderr, "Error: allocating FFT of size %u\n", n);
+        return -1;
+    }
+    for (unsigned i = 0; i < n; i++) mon->window[i] = (float)(0.5 - 0.5 * cos(2 * M_PI * i / n));
+    for (int b = 0; b < NUM_BANDS; b++) {
+        struct band_state *band = &mon->bands[b];
+        band->per_frame = unpack_samples_per_frame(mon->layout, (enum band)b);
+        if (band->per_frame == 0) continue;
+        band->re = (float*)malloc(n * sizeof(float));
+        band->im = (float*)malloc(n * sizeof(float));
+        band->row = (double*)calloc(n, sizeof(double));
+        band->spectrum = (double*)calloc(n, sizeof(double));
+        if (band->re == NULL || band->im == NULL || band->row == NULL || band->spectrum == NULL) {
+            fprintf(stderr, "Error: allocating band %s\n", band_names[b]);
+            return -1;
+        }
+    }
+
+    if (mon->opt.output) {
+        mon->fp = fopen(mon->opt.output, "w");
+        if (mon->fp == NULL) {
+            fprintf(stderr, "Failed to open %s\n%s\n", mon->opt.output, strerror(errno));
+            return -1;
+        }
+    }
+    if (mon->opt.socket_path) {
+        memset(&mon->addr, 0, sizeof(mon->addr));
+        mon->addr.sun_family = AF_UNIX;
+        snprintf(mon->addr.sun_path, sizeof(mon->addr.sun_path), "%s", mon->opt.socket_path);
+        mon->sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (mon->sock < 0) {
+            fprintf(stderr, "Error: Socket\n%s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_monitor(struct monitor *mon) {
+    for (int b = 0; b < NUM_BANDS; b++) {
+        free(mon->bands[b].re);
+        free(mon->bands[b].im);
+        free(mon->bands[b].row);
+        free(mon->bands[b].spectrum);
+    }
+    for (int i = 0; i < RING_SLOTS; i++) free(mon->slots[i].data);
+    if (mon->fp) fclose(mon->fp);
+    if (mon->sock >= 0) close(mon->sock);
+    fft_free(mon->fft);
+    free(mon->window);
+    free(mon->samples);
+    free(mon->line);
+}
+
+static void report(const struct monitor *mon, double elapsed) {
+    printf("%" PRIu64 " frames in %.1f s", mon->frames, elapsed);
+    if (mon->transfers) {
+        printf(", %" PRIu64 " transfers, %" PRIu64 " skipped by decimation, %" PRIu64 " dropped by the worker",
+               mon->transfers, mon->skipped, mon->dropped);
+    }
+    printf("\n");
+    for (int b = 0; b < NUM_BANDS; b++) {
+        const struct band_state *band = &mon->bands[b];
+        if (band->per_frame == 0 || band->cpu_sec <= 0) continue;
+        double per_core = band->samples / band->cpu_sec;
+        printf("%s: %" PRIu64 " FFTs, %.1f Msamples/s per core", band_names[b], band->ffts, per_core / 1e6);
+        if (mon->transfers && elapsed > 0) {
+            // Every transfer holds the same number of frames
+            double rate = (double)mon->frames * mon->transfers / (mon->transfers - mon->skipped - mon->dropped) *
+                          band->per_frame / elapsed;
+            printf(", %.1f%% of a core for all %.1f Msamples/s", 100 * rate / per_core, rate / 1e6);
+        }
+        printf("\n");
+    }
+}
+
+static int run_recording(struct monitor *mon) {
+    struct capture_reader *reader = reader_open(mon->opt.recording);
+    if (reader == NULL) return 1;
+    if (mon->opt.layout < 0) {
+        if (!reader->container || reader->header.layout >= NUM_LAYOUTS) {
+            fprintf(stderr, "Error: Unknown layout, use -l\n");
+            reader_close(reader);
+            return 1;
+        }
+        mon->layout = (enum payload_layout)reader->header.layout;
+    }
+    int status = init_monitor(mon) ? 1 : 0;
+    int64_t start = now_usec();
+    uint64_t step = CHUNK_FRAMES * mon->opt.decimation;
+    for (uint64_t first = 0; status == 0 && first < reader->num_frames && !do_exit; first += step) {
+        uint64_t count = CHUNK_FRAMES;
+        const uint8_t *frames = reader_frames(reader, first, &count);
+        if (frames) process_frames(mon, frames, count * FRAME_LEN);
+    }
+    if (status == 0) {
+        report(mon, (now_usec() - start) / 1e6);
+        printf("%.1f%% of the %" PRIu64 " frames analyzed\n", 100.0 * mon->frames / reader->num_frames, reader->num_frames);
+    }
+    reader_close(reader);
+    return status;
+}
+
+static void transfer_callback(struct libusb_transfer *transfer) {
+    struct monitor *mon = (struct monitor*)transfer->user_data;
+    mon->pending--;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        fprintf(stderr, "Error: Transfer not completed, status %i\n", transfer->status);
+        mon->status = transfer->status;
+        return;
+    }
+
+    if (mon->transfers++ % mon->opt.decimation) {
+        mon->skipped++;
+    } else {
+        pthread_mutex_lock(&mon->lock);
+        bool full = mon->head - mon->tail == RING_SLOTS;
+        pthread_mutex_unlock(&mon->lock);
+        if (full) {
+            mon->dropped++;
+        } else {
+            // Only the callback writes the head slot, no lock needed for the copy
+            struct slot *slot = &mon->slots[mon->head % RING_SLOTS];
+            slot->len = 0;
+            for (int i = 0; i < transfer->num_iso_packets; i++) {
+                if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED) continue;
+                unsigned len = transfer->iso_packet_desc[i].actual_length;
+                memcpy(slot->data + slot->len, libusb_get_iso_packet_buffer_simple(transfer, i), len);
+                slot->len += len;
+            }
+            pthread_mutex_lock(&mon->lock);
+            mon->head++;
+            pthread_cond_signal(&mon->cond);
+            pthread_mutex_unlock(&mon->lock);
+        }
+    }
+
+    if (!mon->stopping && !do_exit) {
+        mon->status = transport_submit_transfer(transfer);
+        if (mon->status == 0) mon->pending++;
+    }
+}
+
+static void *worker_thread(void *arg) {
+    struct monitor *mon = (struct monitor*)arg;
+    for (;;) {
+        pthread_mutex_lock(&mon->lock);
+        while (mon->head == mon->tail && !mon->done) pthread_cond_wait(&mon->cond, &mon->lock);
+        if (mon->head == mon->tail) {
+            pthread_mutex_unlock(&mon->lock);
+            break;
+        }
+        struct slot *slot = &mon->slots[mon->tail % RING_SLOTS];
+        pthread_mutex_unlock(&mon->lock);
+
+        process_frames(mon, slot->data, slot->len);
+
+        pthread_mutex_lock(&mon->lock);
+        mon->tail++;
+        pthread_mutex_unlock(&mon->lock);
+    }
+    return NULL;
+}
+
+static int run_live(struct monitor *mon) {
+    libusb_context *ctx;
+    libusb_device_handle *dev_handle;
+    struct libusb_transfer *transfers[QUEUE_SIZE];
+    pthread_t worker;
+    int status;
+
+    memset(transfers, 0, sizeof(transfers));
+    pthread_mutex_init(&mon->lock, NULL);
+    pthread_cond_init(&mon->cond, NULL);
+    if (init_monitor(mon)) return 1;
+    for (int i = 0; i < RING_SLOTS; i++) {
+        mon->slots[i].data = (uint8_t*)malloc(XFER_LEN);
+        if (mon->slots[i].data == NULL) {
+            fprintf(stderr, "Error: allocating buffer\n");
+            return 1;
+        }
+    }
+
+    status = transport_init(&ctx);
+    if (status) {
+        fprintf(stderr, "%s\n", libusb_strerror((enum libusb_error)status));
+        return 1;
+    }
+    dev_handle = transport_open_device_with_vid_pid(ctx, VID, PID);
+    if (dev_handle == NULL) {
+        fprintf(stderr, "Error: No device with VID=0x%04X, PID=0x%04X\n", VID, PID);
+        status = 1;
+        goto err_usb;
+    }
+    if (transport_kernel_driver_active(dev_handle, INTERFACE) == 1) transport_detach_kernel_driver(dev_handle, INTERFACE);
+    status = transport_claim_interface(dev_handle, INTERFACE);
+    if (status) {
+        fprintf(stderr, "Claim interface: %s\n", libusb_strerror((enum libusb_error)status));
+        goto err_dev;
+    }
+    status = transport_set_interface_alt_setting(dev_handle, INTERFACE, ALT_INTERFACE);
+    if (status) {
+        fprintf(stderr, "Set alternate interface: %s\n", libusb_strerror((enum libusb_error)status));
+        goto err_intf;
+    }
+
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        transfers[i] = libusb_alloc_transfer(NUM_PKG);
+        unsigned char *buffer = (unsigned char*)malloc(XFER_LEN);
+        if (transfers[i] == NULL || buffer == NULL) {
+            fprintf(stderr, "Error: allocating transfer\n");
+            free(buffer);
+            status = 1;
+            goto err_alloc;
+        }
+        libusb_fill_iso_transfer(transfers[i], dev_handle, ENDPOINT, buffer, XFER_LEN, NUM_PKG, transfer_callback, mon, TIMEOUT_MS);
+        libusb_set_iso_packet_lengths(transfers[i], PKG_LEN);
+        transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+
+    if (pthread_create(&worker, NULL, worker_thread, mon)) {
+        fprintf(stderr, "Error: Start worker\n");
+        status = 1;
+        goto err_alloc;
+    }
+    status = transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x00, 0x00, NULL, 0, 1000);
+    if (status) {
+        fprintf(stderr, "Error: Start command\n%s\n", libusb_strerror((enum libusb_error)status));
+        goto err_worker;
+    }
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        status = transport_submit_transfer(transfers[i]);
+        if (status) {
+            fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)status));
+            break;
+        }
+        mon->pending++;
+    }
+
+    int64_t start = now_usec();
+    while (!status && mon->status == 0 && !do_exit && (mon->opt.duration <= 0 || now_usec() - start < mon->opt.duration * 1e6)) {
+        struct timeval tv = {0, 100000};
+        status = transport_handle_events_timeout_completed(ctx, &tv, NULL);
+    }
+    mon->stopping = true;
+    while (mon->pending > 0) transport_handle_events(ctx);
+    double elapsed = (now_usec() - start) / 1e6;
+    transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x01, 0x00, NULL, 0, 1000);
+
+err_worker:
+    pthread_mutex_lock(&mon->lock);
+    mon->done = true;
+    pthread_cond_signal(&mon->cond);
+    pthread_mutex_unlock(&mon->lock);
+    pthread_join(worker, NULL);
+    if (status == 0 && mon->status == 0) report(mon, elapsed);
+err_alloc:
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        if (transfers[i]) libusb_free_transfer(transfers[i]);
+    }
+err_intf:
+    transport_release_interface(dev_handle, INTERFACE);
+err_dev:
+    transport_close(dev_handle);
+err_usb:
+    transport_exit(ctx);
+    pthread_cond_destroy(&mon->cond);
+    pthread_mutex_destroy(&mon->lock);
+    return status ? status : mon->status;
+}
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [-n <fft size>] [-a <ffts>] [-s <rows>] [-d <n>] [-t <seconds>] [-l <layout>] [-f <recording>] [-o <file>] [-u <socket>]\n", program_name);
+    printf("  -n  Samples per FFT, power of two, default 1024\n");
+    printf("  -a  FFTs averaged per waterfall row, default 16\n");
+    printf("  -s  Rows averaged per spectrum, default 64\n");
+    printf("  -d  Use every <n>th transfer or chunk of %d frames only, default 1\n", CHUNK_FRAMES);
+    printf("  -t  Stop after <seconds>, default until interrupted\n");
+    printf("  -l  Payload layout I-3, III-1a or III-1b, taken from capture containers by default\n");
+    printf("  -f  Read a recording instead of the device\n");
+    printf("  -o  Write rows and spectra to <file>\n");
+    printf("  -u  Send rows and spectra as datagrams to the unix <socket>\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct monitor *mon = (struct monitor*)calloc(1, sizeof(struct monitor));
+    int opt;
+    if (mon == NULL) {
+        fprintf(stderr, "Error: allocating monitor\n");
+        return 1;
+    }
+    mon->opt.fft_size = 1024;
+    mon->opt.row_ffts = 16;
+    mon->opt.spectrum_rows = 64;
+    mon->opt.decimation = 1;
+    mon->opt.layout = -1;
+
+    while ((opt = getopt(argc, argv, "n:a:s:d:t:l:f:o:u:")) != -1) {
+        switch (opt) {
+        case 'n': mon->opt.fft_size = (unsigned)atoi(optarg); break;
+        case 'a': mon->opt.row_ffts = (unsigned)atoi(optarg); break;
+        case 's': mon->opt.spectrum_rows = (unsigned)atoi(optarg); break;
+        case 'd': mon->opt.decimation = (unsigned)atoi(optarg); break;
+        case 't': mon->opt.duration = atof(optarg); break;
+        case 'l':
+            for (mon->opt.layout = 0; mon->opt.layout < NUM_LAYOUTS && strcmp(layout_names[mon->opt.layout], optarg); mon->opt.layout++) {}
+            if (mon->opt.layout == NUM_LAYOUTS) {
+                fprintf(stderr, "Error: Unknown layout %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f': mon->opt.recording = optarg; break;
+        case 'o': mon->opt.output = optarg; break;
+        case 'u': mon->opt.socket_path = optarg; break;
+        default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (mon->opt.row_ffts == 0 || mon->opt.spectrum_rows == 0 || mon->opt.decimation == 0 ||
+        (mon->opt.recording == NULL && mon->opt.layout < 0)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (mon->opt.layout >= 0) mon->layout = (enum payload_layout)mon->opt.layout;
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+    signal(SIGQUIT, sighandler);
+
+    int status = mon->opt.recording ? run_recording(mon) : run_live(mon);
+    free_monitor(mon);
+    free(mon);
+    return status;
+}
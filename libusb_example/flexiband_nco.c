@@ -0,0 +1,106 @@
+/* libusb_example/flexiband_nco.c
+ *
+ * NCO, see flexiband_nco.h. The phasors of NCO_BLOCK consecutive samples relative to the
+ * first one are a table computed once; per block only the phasor of the first sample is
+ * evaluated, in double precision, so the phase does not drift and there are no spurs of a
+ * truncated phase table. Each block is converted to split I/Q floats and mixed four samples at
+ * a time with SSE.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "flexiband_nco.h"
+
+#define NCO_BLOCK 1024   // samples, the buffers stay in L1
+
+struct nco {
+    double freq;
+    double phase;            // cycles, [0, 1)
+    float rot_re[NCO_BLOCK]; // exp(2 pi i freq k)
+    float rot_im[NCO_BLOCK];
+    float re[NCO_BLOCK];
+    float im[NCO_BLOCK];
+};
+
+struct nco *nco_create(double freq) {
+    struct nco *nco = (struct nco*)calloc(1, sizeof(struct nco));
+    if (nco == NULL) return NULL;
+    nco->freq = freq - floor(freq);
+    for (unsigned k = 0; k < NCO_BLOCK; k++) {
+        double phase = 2 * M_PI * fmod(nco->freq * k, 1.0);
+        nco->rot_re[k] = (float)cos(phase);
+        nco->rot_im[k] = (float)sin(phase);
+    }
+    return nco;
+}
+
+void nco_free(struct nco *nco) {
+    free(nco);
+}
+
+// Mixes the n samples in re and im
+static void mix_block(struct nco *nco, unsigned n, float *out) {
+    float start_re = (float)cos(2 * M_PI * nco->phase), start_im = (float)sin(2 * M_PI * nco->phase);
+    unsigned k = 0;
+#ifdef __SSE__
+    __m128 s_re = _mm_set1_ps(start_re), s_im = _mm_set1_ps(start_im);
+    for (; k + 4 <= n; k += 4) {
+        __m128 r_re = _mm_loadu_ps(nco->rot_re + k), r_im = _mm_loadu_ps(nco->rot_im + k);
+        __m128 p_re = _mm_sub_ps(_mm_mul_ps(s_re, r_re), _mm_mul_ps(s_im, r_im));
+        __m128 p_im = _mm_add_ps(_mm_mul_ps(s_re, r_im), _mm_mul_ps(s_im, r_re));
+        __m128 x_re = _mm_loadu_ps(nco->re + k), x_im = _mm_loadu_ps(nco->im + k);
+        __m128 y_re = _mm_sub_ps(_mm_mul_ps(x_re, p_re), _mm_mul_ps(x_im, p_im));
+        __m128 y_im = _mm_add_ps(_mm_mul_ps(x_re, p_im), _mm_mul_ps(x_im, p_re));
+        _mm_storeu_ps(out + 2 * k, _mm_unpacklo_ps(y_re, y_im));
+        _mm_storeu_ps(out + 2 * k + 4, _mm_unpackhi_ps(y_re, y_im));
+    }
+#endif
+    for (; k < n; k++) {
+        float p_re = start_re * nco->rot_re[k] - start_im * nco->rot_im[k];
+        float p_im = start_re * nco->rot_im[k] + start_im * nco->rot_re[k];
+        out[2 * k] = nco->re[k] * p_re - nco->im[k] * p_im;
+        out[2 * k + 1] = nco->re[k] * p_im + nco->im[k] * p_re;
+    }
+
+    nco->phase += nco->freq * n;
+    nco->phase -= floor(nco->phase);
+}
+
+void nco_mix(struct nco *nco, const int8_t *in, size_t count, float *out) {
+    while (count > 0) {
+        unsigned n = count < NCO_BLOCK ? (unsigned)count : NCO_BLOCK;
+        if (in) {
+            for (unsigned k = 0; k < n; k++) {
+                nco->re[k] = in[2 * k];
+                nco->im[k] = in[2 * k + 1];
+            }
+            in += 2 * n;
+        } else {
+            memset(nco->re, 0, n * sizeof(float));
+            memset(nco->im, 0, n * sizeof(float));
+        }
+        mix_block(nco, n, out);
+        out += 2 * n;
+        count -= n;
+    }
+}
+
+void nco_mix_float(struct nco *nco, const float *in, size_t count, float *out) {
+    while (count > 0) {
+        unsigned n = count < NCO_BLOCK ? (unsigned)count : NCO_BLOCK;
+        for (unsigned k = 0; k < n; k++) {
+            nco->re[k] = in[2 * k];
+            nco->im[k] = in[2 * k + 1];
+        }
+        mix_block(nco, n, out);
+        in += 2 * n;
+        out += 2 * n;
+        count -= n;
+    }
+}
@@ -0,0 +1,29 @@
+/* libusb_example/flexiband_nco.h
+ *
+ * Numerically controlled oscillator that shifts the complex samples of one band in frequency,
+ * e.g. from the intermediate frequency of an RF board to baseband. The phase is carried
+ * across calls.
+ */
+
+#ifndef FLEXIBAND_NCO_H
+#define FLEXIBAND_NCO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct nco;
+
+// freq is the shift in cycles per sample, negative shifts down. Returns NULL if allocation
+// fails.
+struct nco *nco_create(double freq);
+
+void nco_free(struct nco *nco);
+
+// out[k] = in[k] exp(2 pi i (phase + freq k)) for count complex samples, I and Q
+// interleaved, as float. in NULL stands for zeros; the phase advances all the same.
+void nco_mix(struct nco *nco, const int8_t *in, size_t count, float *out);
+
+// Same for float input
+void nco_mix_float(struct nco *nco, const float *in, size_t count, float *out);
+
+#endif
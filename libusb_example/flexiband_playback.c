@@ -12,6 +12,8 @@
 #include <libusb-1.0/libusb.h>
 
 #include "libusb_version_fixes.h"
+#include "flexiband_capture.h"
+#include "transport.h"
 
 #define INTERFACE     0
 #define ALT_INTERFACE 3
@@ -39,6 +41,7 @@ int main(int argc, char *argv[]) {
     int status = LIBUSB_SUCCESS;
     int fd = -1;
     struct stat sb;
+    struct capture_header header;
     int setfl_flags;
     libusb_context *ctx;
     libusb_device_handle* dev_handle;
@@ -55,41 +58,41 @@ int main(int argc, char *argv[]) {
     signal(SIGTERM, sighandler);
     signal(SIGQUIT, sighandler);
 
-    status = libusb_init(&ctx);
+    status = transport_init(&ctx);
     if (status) {
         fprintf(stderr, "%s\n", libusb_strerror((enum libusb_error)status));
         goto err_ret;
     }
 
-    dev_handle = libusb_open_device_with_vid_pid(ctx, VID, PID);
+    dev_handle = transport_open_device_with_vid_pid(ctx, VID, PID);
     if (dev_handle == NULL) {
         fprintf(stderr, "Error: No device with VID=0x%04X, PID=0x%04X\n", VID, PID);
         status = 1;
         goto err_usb;
     }
 
-    if (libusb_kernel_driver_active(dev_handle, INTERFACE) == 1) {
+    if (transport_kernel_driver_active(dev_handle, INTERFACE) == 1) {
         printf("Warning: Kernel driver active, detaching kernel driver...");
-        status = libusb_detach_kernel_driver(dev_handle, INTERFACE);
+        status = transport_detach_kernel_driver(dev_handle, INTERFACE);
         if (status) {
             fprintf(stderr, "Detach: %s\n", libusb_strerror((enum libusb_error)status));
             goto err_dev;
         }
     }
 
-    status = libusb_reset_device(dev_handle);
+    status = transport_reset_device(dev_handle);
     if (status) {
         fprintf(stderr, "Reset: %s\n", libusb_strerror((enum libusb_error)status));
         goto err_dev;
     }
 
-    status = libusb_claim_interface(dev_handle, INTERFACE);
+    status = transport_claim_interface(dev_handle, INTERFACE);
     if (status) {
         fprintf(stderr, "Claim interface: %s\n", libusb_strerror((enum libusb_error)status));
         goto err_dev;
     }
 
-    status = libusb_set_interface_alt_setting(dev_handle, INTERFACE, ALT_INTERFACE);
+    status = transport_set_interface_alt_setting(dev_handle, INTERFACE, ALT_INTERFACE);
     if (status) {
         fprintf(stderr, "Set alternate interface: %s\n", libusb_strerror((enum libusb_error)status));
         goto err_intf;
@@ -109,16 +112,27 @@ int main(int argc, char *argv[]) {
     }
     fstat(fd, &sb);
 
+    // Capture containers are played back without their header
+    status = capture_read_header(fd, &header);
+    if (status < 0) {
+        fprintf(stderr, "Failed to read %s\n%s\n", filename, strerror(errno));
+        status = 1;
+        close(fd);
+        goto err_intf;
+    }
+    off_t data_start = status == 0 ? header.header_len : 0;
+    lseek(fd, data_start, SEEK_SET);
+
     printf("Playback %s...\n", filename);
-    status = transfer_data(ctx, dev_handle, fd, sb.st_size);
+    status = transfer_data(ctx, dev_handle, fd, sb.st_size - data_start);
     close(fd);
 
 err_intf:
-    libusb_release_interface(dev_handle, INTERFACE);
+    transport_release_interface(dev_handle, INTERFACE);
 err_dev:
-    libusb_close(dev_handle);
+    transport_close(dev_handle);
 err_usb:
-    libusb_exit(ctx);
+    transport_exit(ctx);
 err_ret:
     return status;
 }
@@ -187,7 +201,7 @@ static void transfer_callback(struct libusb_transfer *transfer) {
         long duration = now_usec() - start;
         update_statistics(&ctrl->disk, duration);
 
-        ctrl->status = libusb_submit_transfer(transfer);
+        ctrl->status = transport_submit_transfer(transfer);
         if (ctrl->status) {
             fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)ctrl->status));
             return;
@@ -231,7 +245,7 @@ static int transfer_data(libusb_context *ctx, libusb_device_handle *dev_handle,
    }
 
     // send start command 
-    status = libusb_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x00, 0x00, NULL, 0, 1000);
+    status = transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x00, 0x00, NULL, 0, 1000);
     if (status) {
         fprintf(stderr, "Error: Start command\n%s\n", libusb_strerror((enum libusb_error)status));
         goto err_alloc;
@@ -240,7 +254,7 @@ static int transfer_data(libusb_context *ctx, libusb_device_handle *dev_handle,
     // start all transfers
     for (unsigned i = 0; i < QUEUE_SIZE; i++) {
         read(ctrl.fd, transfers[i]->buffer, XFER_LEN);
-        status = libusb_submit_transfer(transfers[i]);
+        status = transport_submit_transfer(transfers[i]);
         if (status) {
             fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)status));
             goto err_stop;
@@ -252,7 +266,7 @@ static int transfer_data(libusb_context *ctx, libusb_device_handle *dev_handle,
     last_time = start;
     last_bytes = 0;
     while (ctrl.transferred < ctrl.len && ctrl.status == 0 && !do_exit) {
-        status = libusb_handle_events_completed(ctx, NULL);
+        status = transport_handle_events_completed(ctx, NULL);
         if (status) {
             if (status != LIBUSB_ERROR_INTERRUPTED) {
                 fprintf(stderr, "Handle events: %s\n", libusb_strerror((enum libusb_error)status));
@@ -282,13 +296,13 @@ err_stop:
 
     // wait for pending transfers
     while (ctrl.pending > 0) { 
-        status = libusb_handle_events(ctx);
+        status = transport_handle_events(ctx);
         if (status)
             fprintf(stderr, "Error: Wait for cancel\n%s\n", libusb_strerror((enum libusb_error)status));
     }
 
     // send stop command 
-    status = libusb_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x01, 0x00, NULL, 0, 1000);
+    status = transport_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x01, 0x00, NULL, 0, 1000);
     if (status) {
         fprintf(stderr, "Error: Stop command\n%s\n", libusb_strerror((enum libusb_error)status));
     }
@@ -0,0 +1,340 @@
+/* libusb_example/flexiband_reader.c
+ *
+ * Reader of recordings, see flexiband_reader.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flexiband_reader.h"
+
+struct chunk_job {
+    struct capture_reader *reader;
+    uint64_t first;
+    uint64_t count;
+    uint64_t chunk_frames;
+    uint64_t num_chunks;
+    int num_threads;
+    reader_chunk_fn fn;
+    void *user_data;
+    uint64_t next;     // next chunk to take, atomic
+    int result;        // first non-zero result, atomic
+};
+
+static void advise(const struct capture_reader *reader, uint64_t first, uint64_t count, int advice) {
+    static long page_size = 0;
+    if (page_size == 0) page_size = sysconf(_SC_PAGESIZE);
+    if (count == 0 || first >= reader->num_frames) return;
+    if (count > reader->num_frames - first) count = reader->num_frames - first;
+    uintptr_t start = (uintptr_t)reader_frame(reader, first);
+    uintptr_t end = start + count * FRAME_LEN;
+    start &= ~(uintptr_t)(page_size - 1);
+    madvise((void*)start, end - start, advice);
+}
+
+// Loads all complete blocks of <filename>.idx, a missing file is no error
+static int load_index(struct capture_reader *reader, const char *filename) {
+    char path[4096];
+    struct stat sb;
+    uint8_t *buf = NULL;
+    size_t pos = 0;
+
+    snprintf(path, sizeof(path), "%s.idx", filename);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &sb) || sb.st_size == 0) goto out;
+    buf = (uint8_t*)malloc(sb.st_size);
+    reader->index = (struct capture_index_entry*)malloc(sb.st_size);
+    if (buf == NULL || reader->index == NULL || pread(fd, buf, sb.st_size, 0) != sb.st_size) goto err;
+
+    while (pos + sizeof(struct capture_index_block) <= (size_t)sb.st_size) {
+        struct capture_index_block block;
+        memcpy(&block, buf + pos, sizeof(block));
+        size_t len = block.num_entries * sizeof(struct capture_index_entry);
+        if (memcmp(block.magic, CAPTURE_INDEX_MAGIC, sizeof(block.magic)) || pos + sizeof(block) + len > (size_t)sb.st_size) {
+            fprintf(stderr, "Warning: %s is truncated after %zu entries\n", path, reader->num_index);
+            break;
+        }
+        memcpy(reader->index + reader->num_index, buf + pos + sizeof(block), len);
+        reader->num_index += block.num_entries;
+        pos += sizeof(block) + len;
+    }
+out:
+    if (reader->num_index == 0) {
+        free(reader->index);
+        reader->index = NULL;
+    }
+    free(buf);
+    close(fd);
+    return 0;
+err:
+    free(reader->index);
+    reader->index = NULL;
+    reader->num_index = 0;
+    free(buf);
+    close(fd);
+    errno = EIO;
+    return -1;
+}
+
+// Loads <filename>.align, a missing file is no error
+static int load_alignment(struct capture_reader *reader, const char *filename) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.align", filename);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+
+    struct align_header *header = &reader->align;
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) || memcmp(header->magic, ALIGN_MAGIC, sizeof(header->magic)) ||
+        header->version != ALIGN_VERSION) {
+        goto err;
+    }
+    size_t len = header->num_entries * sizeof(struct align_entry);
+    reader->align_entries = (struct align_entry*)malloc(len > 0 ? len : 1);
+    if (reader->align_entries == NULL || pread(fd, reader->align_entries, len, sizeof(*header)) != (ssize_t)len) goto err;
+    reader->num_align = header->num_entries;
+    close(fd);
+    return 0;
+err:
+    free(reader->align_entries);
+    reader->align_entries = NULL;
+    close(fd);
+    errno = EINVAL;
+    return -1;
+}
+
+struct capture_reader *reader_open(const char *filename) {
+    struct stat sb;
+    struct capture_reader *reader = (struct capture_reader*)calloc(1, sizeof(struct capture_reader));
+    if (reader == NULL) {
+        fprintf(stderr, "Error: allocating reader\n");
+        return NULL;
+    }
+
+    reader->fd = open(filename, O_RDONLY);
+    if (reader->fd < 0 || fstat(reader->fd, &sb)) {
+        fprintf(stderr, "Failed to open %s\n%s\n", filename, strerror(errno));
+        goto err_free;
+    }
+    int status = capture_read_header(reader->fd, &reader->header);
+    if (status < 0) {
+        fprintf(stderr, "Failed to read header of %s\n%s\n", filename, strerror(errno));
+        goto err_close;
+    }
+    reader->container = status == 0;
+    size_t data_start = reader->container ? reader->header.header_len : 0;
+    if ((size_t)sb.st_size > data_start) reader->num_frames = (sb.st_size - data_start) / FRAME_LEN;
+
+    if (sb.st_size > 0) {
+        void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Failed to map %s\n%s\n", filename, strerror(errno));
+            goto err_close;
+        }
+        reader->map = (const uint8_t*)map;
+        reader->map_len = sb.st_size;
+        reader->frames = reader->map + data_start;
+    }
+
+    if (reader->container && load_index(reader, filename)) {
+        fprintf(stderr, "Warning: Failed to read index of %s\n%s\n", filename, strerror(errno));
+    }
+    if (load_alignment(reader, filename)) {
+        fprintf(stderr, "Warning: Failed to read alignment of %s\n%s\n", filename, strerror(errno));
+    }
+    return reader;
+
+err_close:
+    if (reader->fd >= 0) close(reader->fd);
+err_free:
+    free(reader);
+    return NULL;
+}
+
+void reader_close(struct capture_reader *reader) {
+    if (reader == NULL) return;
+    if (reader->map) munmap((void*)reader->map, reader->map_len);
+    close(reader->fd);
+    free(reader->index);
+    free(reader->align_entries);
+    free(reader);
+}
+
+const uint8_t *reader_frames(struct capture_reader *reader, uint64_t first, uint64_t *count) {
+    if (first >= reader->num_frames) {
+        *count = 0;
+        return NULL;
+    }
+    if (*count > reader->num_frames - first) *count = reader->num_frames - first;
+    advise(reader, first, *count, MADV_WILLNEED);
+    return reader_frame(reader, first);
+}
+
+// First frame with preamble in [frame, end), -1 if there is none
+static int64_t valid_frame(const struct capture_reader *reader, uint64_t frame, uint64_t end) {
+    for (; frame < end; frame++) {
+        if (frame_has_preamble(reader_frame(reader, frame))) return frame;
+    }
+    return -1;
+}
+
+static uint64_t entry_frame(const struct capture_reader *reader, const struct capture_index_entry *entry) {
+    return (entry->offset - reader->header.header_len) / FRAME_LEN;
+}
+
+// Searches frames [start, end) between two restarts, whose index entries are [first_entry,
+// end_entry). Counters relative to the first valid frame increase through the whole run.
+static int64_t find_in_run(const struct capture_reader *reader, uint32_t counter, uint64_t start, uint64_t end,
+                           size_t first_entry, size_t end_entry) {
+    int64_t first = valid_frame(reader, start, end);
+    if (first < 0) return -1;
+    uint32_t base = frame_counter(reader_frame(reader, first));
+    uint32_t target = counter - base;
+    uint64_t lo = first, hi = end;
+
+    // The index narrows the search to the frames between two entries
+    size_t a = first_entry, b = end_entry;
+    while (a < b) {
+        size_t mid = a + (b - a) / 2;
+        if ((uint32_t)(reader->index[mid].counter - base) <= target) a = mid + 1;
+        else b = mid;
+    }
+    if (a > first_entry && entry_frame(reader, &reader->index[a - 1]) < end) lo = entry_frame(reader, &reader->index[a - 1]);
+    if (a < end_entry && entry_frame(reader, &reader->index[a]) < hi) hi = entry_frame(reader, &reader->index[a]);
+
+    // Frames without preamble are skipped, the result is the first frame at or after the counter
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int64_t frame = valid_frame(reader, mid, hi);
+        if (frame < 0) hi = mid;
+        else if ((uint32_t)(frame_counter(reader_frame(reader, frame)) - base) < target) lo = frame + 1;
+        else hi = mid;
+    }
+    return valid_frame(reader, lo, end);
+}
+
+int64_t reader_find_counter(const struct capture_reader *reader, uint32_t counter) {
+    uint64_t start = 0;
+    size_t first_entry = 0;
+    // Every restart entry of the index ends a run, the runs are searched in file order
+    for (size_t i = 0; i <= reader->num_index; i++) {
+        bool restart = i < reader->num_index && i > 0 && (reader->index[i].flags & CAPTURE_INDEX_RESTART);
+        if (i < reader->num_index && !restart) continue;
+        uint64_t end = restart ? entry_frame(reader, &reader->index[i]) : reader->num_frames;
+        if (end > reader->num_frames) end = reader->num_frames;
+        int64_t frame = find_in_run(reader, counter, start, end, first_entry, i);
+        if (frame >= 0) return frame;
+        start = end;
+        first_entry = i;
+    }
+    return -1;
+}
+
+int64_t reader_find_time(const struct capture_reader *reader, int64_t monotonic_ns) {
+    if (reader->index == NULL) return -1;
+    size_t a = 0, b = reader->num_index;
+    while (a < b) {
+        size_t mid = a + (b - a) / 2;
+        if (reader->index[mid].monotonic_ns <= monotonic_ns) a = mid + 1;
+        else b = mid;
+    }
+    if (a == 0) return entry_frame(reader, &reader->index[0]);
+    if (a == reader->num_index) return entry_frame(reader, &reader->index[a - 1]);
+
+    const struct capture_index_entry *e0 = &reader->index[a - 1], *e1 = &reader->index[a];
+    uint64_t f0 = entry_frame(reader, e0), f1 = entry_frame(reader, e1);
+    int64_t dt = e1->monotonic_ns - e0->monotonic_ns;
+    if (dt <= 0) return f0;
+    return f0 + (uint64_t)((double)(monotonic_ns - e0->monotonic_ns) / dt * (f1 - f0));
+}
+
+// Maps x in one column of the alignment table to the other; the fit covers both ends
+static double align_map(const struct capture_reader *reader, double x, bool to_reference) {
+    const struct align_entry *e = reader->align_entries;
+    size_t n = reader->num_align;
+    if (n == 0) return x;
+    double slope = to_reference ? 1 + reader->align.drift : 1 / (1 + reader->align.drift);
+    double x0 = to_reference ? e[0].frame : e[0].reference_frame;
+    double x1 = to_reference ? e[n - 1].frame : e[n - 1].reference_frame;
+    if (n == 1 || x <= x0) return (to_reference ? e[0].reference_frame : e[0].frame) + (x - x0) * slope;
+    if (x >= x1) return (to_reference ? e[n - 1].reference_frame : e[n - 1].frame) + (x - x1) * slope;
+
+    size_t lo = 0, hi = n - 1;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((to_reference ? e[mid].frame : e[mid].reference_frame) <= x) lo = mid;
+        else hi = mid;
+    }
+    double xl = to_reference ? e[lo].frame : e[lo].reference_frame, xh = to_reference ? e[hi].frame : e[hi].reference_frame;
+    double yl = to_reference ? e[lo].reference_frame : e[lo].frame, yh = to_reference ? e[hi].reference_frame : e[hi].frame;
+    return yl + (x - xl) / (xh - xl) * (yh - yl);
+}
+
+double reader_reference_frame(const struct capture_reader *reader, double frame) {
+    return align_map(reader, frame, true);
+}
+
+double reader_local_frame(const struct capture_reader *reader, double reference_frame) {
+    return align_map(reader, reference_frame, false);
+}
+
+static void *chunk_thread(void *arg) {
+    struct chunk_job *job = (struct chunk_job*)arg;
+    bool first_chunk = true;
+
+    for (;;) {
+        uint64_t chunk = __sync_fetch_and_add(&job->next, 1);
+        if (chunk >= job->num_chunks || job->result) break;
+        uint64_t first = job->first + chunk * job->chunk_frames;
+        uint64_t count = job->chunk_frames;
+        if (count > job->first + job->count - first) count = job->first + job->count - first;
+
+        // The chunk after the ones the other threads take next is likely ours
+        if (first_chunk) advise(job->reader, first, count, MADV_WILLNEED);
+        advise(job->reader, first + job->num_threads * job->chunk_frames, job->chunk_frames, MADV_WILLNEED);
+        first_chunk = false;
+
+        int result = job->fn(reader_frame(job->reader, first), first, count, job->user_data);
+        if (result) __sync_bool_compare_and_swap(&job->result, 0, result);
+        advise(job->reader, first, count, MADV_DONTNEED);
+    }
+    return NULL;
+}
+
+int reader_for_each_chunk(struct capture_reader *reader, uint64_t first, uint64_t count, uint64_t chunk_frames,
+                          int num_threads, reader_chunk_fn fn, void *user_data) {
+    struct chunk_job job;
+    pthread_t threads[num_threads > 0 ? num_threads : 1];
+    int started = 0;
+
+    if (first >= reader->num_frames) return 0;
+    if (count > reader->num_frames - first) count = reader->num_frames - first;
+    if (chunk_frames == 0) chunk_frames = 1;
+    if (num_threads < 1) num_threads = 1;
+
+    memset(&job, 0, sizeof(job));
+    job.reader = reader;
+    job.first = first;
+    job.count = count;
+    job.chunk_frames = chunk_frames;
+    job.num_chunks = (count + chunk_frames - 1) / chunk_frames;
+    job.num_threads = num_threads;
+    job.fn = fn;
+    job.user_data = user_data;
+
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, chunk_thread, &job)) break;
+        started++;
+    }
+    chunk_thread(&job);
+    for (int i = 1; i <= started; i++) pthread_join(threads[i], NULL);
+    return job.result;
+}
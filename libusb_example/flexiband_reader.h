@@ -0,0 +1,101 @@
+/* libusb_example/flexiband_reader.h
+ *
+ * Random access to recordings of flexiband_record, capture containers as well as headerless
+ * raw files. The file is mapped read-only; frames are handed out as pointers into the mapping,
+ * so nothing is copied and only the pages actually touched are read from disk.
+ *
+ * Frames are addressed by their index in the file. A frame counter is resolved with the
+ * side-car index if there is one and a binary search over the counters in the frames
+ * otherwise; host time needs the side-car index of a capture container.
+ *
+ * <filename>.align, written by flexiband_align, places the frames of a recording in the
+ * stream of a reference recording of another device to a fraction of a sample: a struct
+ * align_header followed by num_entries struct align_entry in ascending order.
+ */
+
+#ifndef FLEXIBAND_READER_H
+#define FLEXIBAND_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flexiband_capture.h"
+
+#define ALIGN_MAGIC   "FLXBALN"
+#define ALIGN_VERSION 1
+
+struct align_header {
+    char magic[8];                       // ALIGN_MAGIC
+    uint32_t version;                    // ALIGN_VERSION
+    uint32_t num_entries;
+    uint32_t band;                       // enum band that was correlated
+    uint32_t samples_per_frame;          // of that band
+    double offset;                       // linear fit: reference frame of frame 0
+    double drift;                        // linear fit: reference frames per frame minus 1
+    char reference[256];                 // file name of the reference recording
+};
+
+struct align_entry {
+    double frame;                        // fractional frame index in this recording
+    double reference_frame;              // the same sample in the reference recording
+    float quality;                       // correlation peak over its mean
+    uint32_t reserved;
+};
+
+struct capture_reader {
+    int fd;
+    int container;                       // header is valid
+    struct capture_header header;
+    const uint8_t *map;                  // whole file
+    size_t map_len;
+    const uint8_t *frames;               // first frame
+    uint64_t num_frames;                 // complete frames in the file
+    struct capture_index_entry *index;   // from <filename>.idx, NULL if there is none
+    size_t num_index;
+    struct align_header align;           // valid if num_align > 0
+    struct align_entry *align_entries;   // from <filename>.align, NULL if there is none
+    size_t num_align;
+};
+
+// Called for every chunk by reader_for_each_chunk(). A non-zero return stops the iteration.
+typedef int (*reader_chunk_fn)(const uint8_t *frames, uint64_t first, uint64_t count, void *user_data);
+
+// Maps the file and loads its index. Returns NULL and prints the error on failure.
+struct capture_reader *reader_open(const char *filename);
+
+void reader_close(struct capture_reader *reader);
+
+// Frames [first, first + count) clipped to the file; *count is updated. NULL if first is
+// past the end. Pages are requested with MADV_WILLNEED, so a following sequential pass does
+// not wait for every page fault.
+const uint8_t *reader_frames(struct capture_reader *reader, uint64_t first, uint64_t *count);
+
+static inline const uint8_t *reader_frame(const struct capture_reader *reader, uint64_t frame) {
+    return reader->frames + frame * FRAME_LEN;
+}
+
+// Index of the first frame with the given counter or the next larger one, counted from the
+// first frame of the file, so a counter wrap within the file is handled. The restarts marked
+// in the index split the file into runs with counters of their own, which are searched in
+// file order. -1 if no run has a frame at or after the counter.
+int64_t reader_find_counter(const struct capture_reader *reader, uint32_t counter);
+
+// Index of the frame received at the given CLOCK_MONOTONIC time of the recording host,
+// interpolated between index entries. Times before the first or after the last entry
+// return the first or last indexed frame. -1 without time index.
+int64_t reader_find_time(const struct capture_reader *reader, int64_t monotonic_ns);
+
+// Fractional frame index in the reference recording of the given one of this recording and
+// back, interpolated between the entries of the alignment table and extrapolated with the
+// linear fit beyond them. Without table the frame is returned unchanged.
+double reader_reference_frame(const struct capture_reader *reader, double frame);
+double reader_local_frame(const struct capture_reader *reader, double reference_frame);
+
+// Splits frames [first, first + count) into chunks of chunk_frames and calls fn for each
+// chunk from num_threads threads. Chunks are taken in file order, every thread requests
+// read-ahead of its next chunk before processing the current one and releases the pages of
+// finished chunks. Returns the first non-zero result of fn, or 0.
+int reader_for_each_chunk(struct capture_reader *reader, uint64_t first, uint64_t count, uint64_t chunk_frames,
+                          int num_threads, reader_chunk_fn fn, void *user_data);
+
+#endif
@@ -4,32 +4,85 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <libusb-1.0/libusb.h>
 
 #include "libusb_version_fixes.h"
+#include "flexiband_acq.h"
+#include "flexiband_archive.h"
+#include "flexiband_capture.h"
+#include "flexiband_gain.h"
+#include "flexiband_info.h"
+#include "flexiband_io.h"
+#include "flexiband_reduce.h"
+#include "flexiband_ring.h"
+#include "flexiband_segment.h"
+#include "flexiband_stats.h"
+#include "flexiband_stream.h"
+#include "flexiband_timing.h"
+#include "flexiband_unpack.h"
+#include "transport.h"
 
-#define CONFIGURATION 1
-#define INTERFACE     0
-#define ALT_INTERFACE 1
-
-#define VID      0x27ae
-#define PID      0x1016
-#define ENDPOINT 0x83
 #define PKG_LEN (16 * 1024)
 #define NUM_PKG 32
 #define XFER_LEN (NUM_PKG * PKG_LEN)
 #define TIMEOUT_MS 1000
 #define QUEUE_SIZE 4
+#define NUM_SLOTS 3
+#define NUM_POLL_REQUESTS (NUM_SLOTS + 2)
+#define SPIN_NS 2000000   // the last part of the wait for a scheduled start is spent polling the clock
+#define DRAIN_USEC 2000000  // time for the transfers of a lost device to come back
 
 // Signal handlers are only allowed to use volatile atomic variables
 static volatile sig_atomic_t do_exit = false;
+static struct ring *trigger_ring = NULL;
+
+struct poller;
+struct gain_control;
+
+// Destination of the recorded data, exactly one of the first five is set
+struct sink {
+    int fd;                            // raw file
+    struct capture_writer *capture;    // capture container, -c
+    struct archive_writer *archive;    // compressed archive, -a
+    struct segment_writer *segments;   // segmented recording, -S or -G, raw or containers
+    struct ring *ring;                 // pre-trigger ring, -R, dumps raw or containers
+    struct reduce *reduce;             // reduced-rate bands in addition, -D
+    struct acq *acq;                   // quick-look acquisition snapshots in addition, -A
+    int64_t acq_interval;              // usec between two snapshots
+    struct timing *timing;             // time stamps of the transfers in addition, -t
+    FILE *gaps;                        // device lost and reconnected, -r
+};
 
-static int transfer_data(libusb_context *ctx, libusb_device_handle *dev_handle, int fd, uint64_t len);
+// When the recording starts and how long it lasts, -w and -d
+struct schedule {
+    int64_t start_realtime_ns;         // 0 to start right away
+    int64_t duration_ns;               // 0 without limit
+};
+
+static int transfer_data(libusb_context *ctx, libusb_device_handle **dev_handle, const struct sink *sink, uint64_t len,
+                         const struct schedule *schedule, struct poller *poller, bool reconnect);
+static struct poller *create_poller(libusb_device_handle *dev_handle, const char *filename, int interval_ms,
+                                    struct stats *stats, struct gain_control *gain);
+static struct gain_control *create_gain_control(libusb_device_handle *dev_handle, const struct flexiband_description *desc,
+                                                const struct gain_config *config);
+static void free_poller(struct poller *poller);
+static libusb_device_handle *open_from_daemon(libusb_context *ctx, const char *path, int *sock, int *dev_fd, int *dev_id);
+static int read_daemon_info(int sock, int dev_id, const char *filename, struct flexiband_description *desc);
+static void fill_capture_header(struct capture_header *header, const struct flexiband_description *desc);
+static int64_t now_usec();
+static int64_t now_ns(clockid_t clock);
+static int parse_start_time(const char *text, int64_t *realtime_ns);
+static uint64_t parse_count(const char *text);
 
 // This will catch user initiated CTRL+C type events and allow the program to exit
 void sighandler(int signum) {
@@ -37,18 +90,164 @@ void sighandler(int signum) {
     do_exit = true;
 }
 
+// SIGUSR1 triggers a dump of the ring
+void trigger_handler(int signum) {
+    if (trigger_ring) ring_trigger(trigger_ring);
+}
+
 int main(int argc, char *argv[]) {
     int status = LIBUSB_SUCCESS;
-    int fd = -1;
+    struct sink sink = {-1, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL};
+    int daemon_sock = -1;
+    int daemon_fd = -1;
+    int daemon_id = -1;
+    const char *daemon_path = NULL;
+    int poll_ms = 0;
+    unsigned stats_frames = 0;
+    double gain_sec = 0;
+    struct gain_config gain_config = {0, 1.0, 6.0, 0, 0};
+    struct reduce_config reduce_config = {CAPTURE_LAYOUT_UNKNOWN, 0, 0, 0.8, REDUCE_CF32, false, {0, 0, 0}};
+    double mix_rate = 0;
+    double acq_sec = 0;
+    bool timing = false;
+    struct schedule schedule = {0, 0};
+    uint64_t max_frames = 0;
+    bool reconnect = false;
+    struct poller *poller = NULL;
+    bool container = false;
+    int archive_threads = 0;
+    uint32_t layout = CAPTURE_LAYOUT_UNKNOWN;
+    struct segment_config segment_config = {0, 0, 0};
+    struct ring_config ring_config = {0, 5000000000LL, 5000000000LL, false, NULL, {-1, CAPTURE_LAYOUT_UNKNOWN, 0, 0, 0, 0, 40e6}};
+    double pre_sec, post_sec;
+    double min_open_sec = 0, min_close_sec = 0;
+    char band_name[8];
+    struct capture_header header;
+    struct flexiband_description desc;
     libusb_context *ctx;
     libusb_device_handle* dev_handle;
+    bool usage = false;
+    int opt;
 
-    if (argc < 3) {
-        printf("Usage: %s <bytes to transfer> <filename>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "s:p:b:g:cl:a:S:G:Q:R:W:HT:P:D:N:IA:tw:d:f:r")) != -1) {
+        switch (opt) {
+        case 's': daemon_path = optarg; break;
+        case 'p': poll_ms = atoi(optarg); break;
+        case 'b': stats_frames = (unsigned)atoi(optarg); break;
+        case 'g':
+            if (sscanf(optarg, "%lf,%lf", &gain_sec, &gain_config.target) < 1 || gain_sec <= 0) usage = true;
+            break;
+        case 'c': container = true; break;
+        case 'a': archive_threads = atoi(optarg); break;
+        case 'S': segment_config.max_ns = (int64_t)(atof(optarg) * 1e9); break;
+        case 'G': segment_config.max_bytes = (uint64_t)(atof(optarg) * 1e9); break;
+        case 'Q': segment_config.quota_bytes = (uint64_t)(atof(optarg) * 1e9); break;
+        case 'R': ring_config.ring_bytes = (uint64_t)(atof(optarg) * 1e6); break;
+        case 'W':
+            if (sscanf(optarg, "%lf,%lf", &pre_sec, &post_sec) != 2) usage = true;
+            ring_config.pre_ns = (int64_t)(pre_sec * 1e9);
+            ring_config.post_ns = (int64_t)(post_sec * 1e9);
+            break;
+        case 'H': ring_config.hugepages = true; break;
+        case 'T': ring_config.socket_path = optarg; break;
+        case 'P':
+            ring_config.power.close_db = NAN;
+            if (sscanf(optarg, "%7[^:]:%lf,%lf,%lf,%lf", band_name, &ring_config.power.open_db, &ring_config.power.close_db,
+                       &min_open_sec, &min_close_sec) < 2) {
+                usage = true;
+            }
+            if (isnan(ring_config.power.close_db)) ring_config.power.close_db = ring_config.power.open_db / 2;
+            ring_config.power.min_open_ns = (int64_t)(min_open_sec * 1e9);
+            ring_config.power.min_close_ns = (int64_t)(min_close_sec * 1e9);
+            for (ring_config.power.band = 0; ring_config.power.band < NUM_BANDS &&
+                 strcmp(band_names[ring_config.power.band], band_name); ring_config.power.band++) {}
+            if (ring_config.power.band == NUM_BANDS) usage = true;
+            break;
+        case 'D':
+            if (sscanf(optarg, "%u,%u,%lf", &reduce_config.decimation, &reduce_config.taps, &reduce_config.bandwidth) < 1 ||
+                reduce_config.decimation == 0) {
+                usage = true;
+            }
+            break;
+        case 'N':
+            mix_rate = atof(optarg);
+            reduce_config.mix = true;
+            if (mix_rate <= 0) usage = true;
+            break;
+        case 'I': reduce_config.format = REDUCE_CI16; break;
+        case 'A':
+            acq_sec = atof(optarg);
+            if (acq_sec <= 0) usage = true;
+            break;
+        case 't': timing = true; break;
+        case 'r': reconnect = true; break;
+        case 'w':
+            if (parse_start_time(optarg, &schedule.start_realtime_ns)) usage = true;
+            break;
+        case 'd':
+            schedule.duration_ns = (int64_t)(atof(optarg) * 1e9);
+            if (schedule.duration_ns <= 0) usage = true;
+            break;
+        case 'f':
+            max_frames = parse_count(optarg);
+            if (max_frames == 0) usage = true;
+            break;
+        case 'l':
+            for (layout = 0; layout < NUM_LAYOUTS && strcmp(layout_names[layout], optarg); layout++) {}
+            if (layout == NUM_LAYOUTS) usage = true;
+            break;
+        default: usage = true; break;
+        }
+    }
+    bool segmented = segment_config.max_ns > 0 || segment_config.max_bytes > 0;
+    bool ring = ring_config.ring_bytes > 0;
+    if (usage || argc - optind < 2 || (container && archive_threads > 0) || (segmented && archive_threads > 0) ||
+        (ring && (segmented || archive_threads > 0)) || (stats_frames > 0 && (poll_ms <= 0 || layout >= NUM_LAYOUTS)) ||
+        (gain_sec > 0 && stats_frames == 0) || (reconnect && daemon_path) || ((reduce_config.decimation > 0 || reduce_config.mix || acq_sec > 0) && layout >= NUM_LAYOUTS)) {
+        printf("Usage: %s [-s <flexibandd socket>] [-p <poll interval ms> [-b <frames> [-g <seconds>[,<outer>]]]] [-c | -a <threads>] [-l <layout>] [-t] [-r] [-w <time>] [-d <seconds> | -f <frames>] [-S <seconds>] [-G <GB>] [-Q <GB>] <bytes to transfer> <filename>\n", argv[0]);
+        printf("       %s -R <MB> [-W <pre>,<post>] [-H] [-T <socket>] [-P <band>:<dB>[,<dB>[,<s>[,<s>]]]] [-c] [-l <layout>] ... <bytes to transfer> <filename>\n", argv[0]);
+        printf("  -p  Poll RF-board, AGC and FPGA state while recording, written to <filename>.telemetry\n");
+        printf("  -b  Add power, mean and histograms of every band over the last <frames> to the telemetry, needs -p and -l\n");
+        printf("  -g  Steer the RF-board amplification from the band statistics, at most every <seconds> per board,\n"
+               "      to <outer> of the samples at or beyond half scale (default optimal for the bit width)\n");
+        printf("  -c  Write a capture container with device description and <filename>.idx time index\n");
+        printf("  -a  Write a compressed archive with device description, compressed by <threads> workers\n");
+        printf("  -l  FPGA payload layout stored in the container or archive: I-3, III-1a or III-1b\n");
+        printf("  -D  Also write every band low-pass filtered and decimated to <filename>.<band>.cf32, needs -l;\n"
+               "      <decimation>[,<taps>[,<bandwidth>]], default 16 taps per output sample and 0.8 of its Nyquist frequency\n");
+        printf("  -N  Also mix every band from its IF to baseband before -D, by the LO of its RF-board; the stream\n"
+               "      of <bytes/s> sets the sample rates, e.g. 40e6. Needs -l\n");
+        printf("  -I  Write -D and -N output as int16 .ci16 instead of float .cf32\n");
+        printf("  -A  Search the GPS C/A codes in a few ms of L1 every <seconds> on the spare cores, needs -l;\n"
+               "      the stream rate of -N or 40e6 bytes/s sets the sample rate\n");
+        printf("  -t  Stamp every transfer with the host clocks and fit the frame counter to them, written to\n"
+               "      <filename>.timing\n");
+        printf("  -w  Start at <time>: UTC as 2024-05-01T12:00:00.5, seconds since the epoch or +<seconds> from now.\n"
+               "      The device is opened and everything allocated before, only the start request and the\n"
+               "      transfer submits are left for that moment\n");
+        printf("  -r  Reconnect when the device is lost and continue the recording; the gaps are logged to\n"
+               "      <filename>.gaps and marked in the index of -c and -S/-G containers. Not with -s\n");
+        printf("  -d  Stop after <seconds>\n");
+        printf("  -f  Stop after <frames>\n");
+        printf("  -S  Start a new segment <filename stem>-<UTC time>-<counter><ext> every <seconds>\n");
+        printf("  -G  Start a new segment every <GB>\n");
+        printf("  -Q  Delete the oldest segments to keep all within <GB>\n");
+        printf("  -R  Keep the stream in a <MB> ring in RAM and only write it to segments on a trigger\n");
+        printf("  -W  Seconds before and after the trigger to write, default 5,5\n");
+        printf("  -H  Put the ring in huge pages\n");
+        printf("  -T  Trigger on a \"TRIGGER\" datagram to the unix <socket>; SIGUSR1 always triggers\n");
+        printf("  -P  Record while the power of L1, L2 or L5 is <dB> over its average, needs -l. The window opens\n"
+               "      once the power stayed above <dB> for <s> and closes once it stayed below the second <dB>\n"
+               "      (default half the first) for the second <s>; every frame is checked. The stream rate\n"
+               "      of -N or 40e6 bytes/s converts the times to frames\n");
+        printf("  Triggers, power windows and dumps are logged to <filename>.events\n");
+        printf("  <bytes to transfer> of 0 records until interrupted, counts may be given as 1e9\n");
         return 1;
     }
-    uint64_t len = strtoull(argv[1], NULL, 0);
-    char *filename = argv[2];
+    uint64_t len = parse_count(argv[optind]);
+    if (len == 0) len = UINT64_MAX;
+    if (max_frames > 0 && max_frames < len / FRAME_LEN) len = max_frames * FRAME_LEN;
+    char *filename = argv[optind + 1];
 
     // Define signal handler to catch system generated signals
     // (If user hits CTRL+C, this will deal with it.)
@@ -56,75 +255,410 @@ int main(int argc, char *argv[]) {
     signal(SIGTERM, sighandler);
     signal(SIGQUIT, sighandler);
 
-    status = libusb_init(&ctx);
+    status = transport_init(&ctx);
     if (status) {
         fprintf(stderr, "%s\n", libusb_strerror((enum libusb_error)status));
         goto err_ret;
     }
 
-    dev_handle = libusb_open_device_with_vid_pid(ctx, VID, PID);
+    if (daemon_path) {
+        // The daemon hands over an opened and configured device
+        int64_t start = now_usec();
+        dev_handle = open_from_daemon(ctx, daemon_path, &daemon_sock, &daemon_fd, &daemon_id);
+        if (dev_handle == NULL) {
+            status = 1;
+            goto err_usb;
+        }
+        printf("Got device from %s in %.3f ms\n", daemon_path, (now_usec() - start) / 1000.0);
+        goto claim;
+    }
+
+    dev_handle = stream_open_device(ctx, false);
     if (dev_handle == NULL) {
-        fprintf(stderr, "Error: No device with VID=0x%04X, PID=0x%04X\n", VID, PID);
         status = 1;
         goto err_usb;
     }
 
-    if (libusb_kernel_driver_active(dev_handle, INTERFACE) == 1) {
-        printf("Warning: Kernel driver active, detaching kernel driver...");
-        status = libusb_detach_kernel_driver(dev_handle, INTERFACE);
-        if (status) {
-            fprintf(stderr, "Detach: %s\n", libusb_strerror((enum libusb_error)status));
-            goto err_dev;
+claim:
+    status = stream_claim_device(dev_handle);
+    if (status) goto err_dev;
+
+    // TODO Here we should reset the endpoint to clear any pending data from older transfers.
+    //      Currently not possible with libusb, see http://www.libusb.org/ticket/50
+
+    // The description is read once, from the daemon or through the cache of flexiband_describe()
+    memset(&desc, 0, sizeof(desc));
+    if (daemon_sock >= 0) {
+        if (read_daemon_info(daemon_sock, daemon_id, filename, &desc))
+            fprintf(stderr, "Warning: No device description from %s\n", daemon_path);
+    } else if (container || archive_threads > 0 || reduce_config.mix || acq_sec > 0 || gain_sec > 0) {
+        status = flexiband_describe(ctx, dev_handle, NULL, &desc);
+        if (status < 0) fprintf(stderr, "Warning: Read device description\n%s\n", libusb_strerror((enum libusb_error)status));
+        status = 0;
+    }
+
+    if (container || archive_threads > 0 || reduce_config.mix || acq_sec > 0) {
+        capture_init_header(&header);
+        header.layout = layout;
+        fill_capture_header(&header, &desc);
+        if (schedule.start_realtime_ns > 0) {
+            // The recording starts at the scheduled time, not now
+            header.start_monotonic_ns += schedule.start_realtime_ns - header.start_realtime_ns;
+            header.start_realtime_ns = schedule.start_realtime_ns;
+        }
+    }
+    if (ring) {
+        ring_config.power.layout = layout;
+        if (mix_rate > 0) ring_config.power.data_rate = mix_rate;
+        sink.ring = ring_create(filename, container ? &header : NULL, &ring_config);
+        if (sink.ring == NULL) {
+            status = 1;
+            goto err_intf;
+        }
+        trigger_ring = sink.ring;
+        signal(SIGUSR1, trigger_handler);
+    } else if (segmented) {
+        sink.segments = segment_create(filename, container ? &header : NULL, &segment_config);
+        if (sink.segments == NULL) {
+            status = 1;
+            goto err_intf;
+        }
+    } else if (container) {
+        sink.capture = capture_create(filename, &header);
+        if (sink.capture == NULL) {
+            status = 1;
+            goto err_intf;
+        }
+    } else if (archive_threads > 0) {
+        unsigned payload_len = layout < NUM_LAYOUTS ? layout_payload_len((enum payload_layout)layout) : FRAME_MAX_PAYLOAD;
+        sink.archive = archive_create(filename, &header, payload_len, archive_threads, 0);
+        if (sink.archive == NULL) {
+            status = 1;
+            goto err_intf;
+        }
+    } else {
+        sink.fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (sink.fd < 0) {
+            fprintf(stderr, "Failed to open %s\n%s\n", filename, strerror(errno));
+            status = 1;
+            goto err_intf;
         }
     }
 
-    // The operating system may or may not have already set an active configuration on the device.
-    // It is up to your application to ensure the correct configuration is selected before you
-    // attempt to claim interfaces and perform other operations.
-    // It will cause USB-related device state to be reset (altsetting reset to zero,
-    // endpoint halts cleared, toggles reset).
-    status = libusb_set_configuration(dev_handle, CONFIGURATION);
-    if (status) {
-        fprintf(stderr, "Reset: %s\n", libusb_strerror((enum libusb_error)status));
-        goto err_dev;
+    if (reduce_config.decimation > 0 || reduce_config.mix) {
+        reduce_config.layout = layout;
+        if (reduce_config.decimation == 0) reduce_config.decimation = 1;
+        if (reduce_config.taps == 0) reduce_config.taps = 16 * reduce_config.decimation;
+        if (reduce_config.mix) {
+            int found = reduce_baseband_shifts(&header, reduce_carriers, mix_rate, reduce_config.shift);
+            for (int b = 0; b < NUM_BANDS; b++) {
+                double sample_rate = mix_rate / FRAME_LEN * unpack_samples_per_frame((enum payload_layout)layout, (enum band)b);
+                if (sample_rate > 0) printf("Baseband: %s shifted by %.0f Hz\n", band_names[b], reduce_config.shift[b] * sample_rate);
+            }
+            if (found == 0) fprintf(stderr, "Warning: No LO frequency of any band, mixing by 0 Hz\n");
+        }
+        sink.reduce = reduce_create(filename, &reduce_config, true);
+        if (sink.reduce == NULL) {
+            status = 1;
+            goto err_file;
+        }
     }
 
-    status = libusb_claim_interface(dev_handle, INTERFACE);
-    if (status) {
-        fprintf(stderr, "Claim interface: %s\n", libusb_strerror((enum libusb_error)status));
-        goto err_dev;
+    if (acq_sec > 0) {
+        double shift[NUM_BANDS] = {0, 0, 0};
+        int threads = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        struct acq_config acq_config = {layout, mix_rate > 0 ? mix_rate : 40e6, 0, 10, 5000, threads > 0 ? (unsigned)threads : 1, 10};
+        reduce_baseband_shifts(&header, reduce_carriers, acq_config.data_rate, shift);
+        acq_config.shift = shift[BAND_L1];
+        sink.acq = acq_create(&acq_config);
+        if (sink.acq == NULL) {
+            status = 1;
+            goto err_file;
+        }
+        sink.acq_interval = (int64_t)(acq_sec * 1e6);
     }
 
-    status = libusb_set_interface_alt_setting(dev_handle, INTERFACE, ALT_INTERFACE);
-    if (status) {
-        fprintf(stderr, "Set alternate interface: %s\n", libusb_strerror((enum libusb_error)status));
-        goto err_intf;
+    if (timing) {
+        sink.timing = timing_create(filename);
+        if (sink.timing == NULL) {
+            status = 1;
+            goto err_file;
+        }
     }
 
-    // TODO Here we should reset the endpoint to clear any pending data from older transfers.
-    //      Currently not possible with libusb, see http://www.libusb.org/ticket/50
+    if (reconnect) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.gaps", filename);
+        sink.gaps = fopen(path, "w");
+        if (sink.gaps == NULL) {
+            fprintf(stderr, "Failed to open %s\n%s\n", path, strerror(errno));
+            status = 1;
+            goto err_file;
+        }
+        fprintf(sink.gaps, "# monotonic_usec byte_offset event value\n");
+    }
 
-    fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (fd < 0) {
-        fprintf(stderr, "Failed to open %s\n%s\n", filename, strerror(errno));
-        status = 1;
-        goto err_intf;
+    if (poll_ms > 0) {
+        struct stats *stats = NULL;
+        if (stats_frames > 0) {
+            stats = stats_create((enum payload_layout)layout, stats_frames);
+            if (stats == NULL) {
+                fprintf(stderr, "Error: allocating band statistics\n");
+                status = 1;
+                goto err_file;
+            }
+        }
+        struct gain_control *gain = NULL;
+        if (gain_sec > 0) {
+            gain_config.interval_usec = (int64_t)(gain_sec * 1e6);
+            gain_config.window_bytes = (uint64_t)(stats_frames + STATS_BLOCK_FRAMES - 1) / STATS_BLOCK_FRAMES *
+                                       STATS_BLOCK_FRAMES * FRAME_LEN;
+            gain = create_gain_control(dev_handle, &desc, &gain_config);
+            if (gain == NULL) {
+                stats_free(stats);
+                status = 1;
+                goto err_file;
+            }
+        }
+        poller = create_poller(dev_handle, filename, poll_ms, stats, gain);
+        if (poller == NULL) {
+            status = 1;
+            goto err_file;
+        }
     }
 
     printf("Record %s...\n", filename);
-    status = transfer_data(ctx, dev_handle, fd, len);
-    close(fd);
+    status = transfer_data(ctx, &dev_handle, &sink, len, &schedule, poller, reconnect);
+    free_poller(poller);
+
+err_file:
+    if (sink.capture && capture_close(sink.capture)) {
+        fprintf(stderr, "Error: Close %s\n%s\n", filename, strerror(errno));
+        if (status == 0) status = 1;
+    }
+    if (sink.archive) {
+        struct archive_statistics stat;
+        if (archive_close(sink.archive, &stat)) {
+            fprintf(stderr, "Error: Close %s\n%s\n", filename, strerror(errno));
+            if (status == 0) status = 1;
+        }
+        printf("Archive: ratio %.3f, %.1f MB/s per core, waited for %" PRIu64 " blocks\n",
+               stat.compressed_bytes ? (double)stat.raw_bytes / stat.compressed_bytes : 0,
+               stat.cpu_sec > 0 ? stat.raw_bytes / 1e6 / stat.cpu_sec : 0, stat.stalls);
+    }
+    if (sink.segments) {
+        struct segment_statistics stat;
+        if (segment_close(sink.segments, &stat)) {
+            fprintf(stderr, "Error: Segments of %s failed\n", filename);
+            if (status == 0) status = 1;
+        }
+        printf("Segments: %" PRIu64 " written, %" PRIu64 " pruned, %" PRIu64 " rollovers late\n", stat.segments,
+               stat.pruned, stat.late);
+    }
+    if (sink.ring) {
+        struct ring_statistics stat;
+        signal(SIGUSR1, SIG_DFL);
+        trigger_ring = NULL;
+        if (ring_close(sink.ring, &stat)) {
+            fprintf(stderr, "Error: Dumps of %s failed\n", filename);
+            if (status == 0) status = 1;
+        }
+        printf("Ring: %" PRIu64 " triggers, %" PRIu64 " power windows, %" PRIu64 " dumps with %.1f MB, %.1f MB lost\n",
+               stat.triggers, stat.power_windows, stat.dumps, stat.dumped_bytes / 1e6, stat.lost_bytes / 1e6);
+    }
+    if (sink.reduce) {
+        struct reduce_statistics stat;
+        if (reduce_close(sink.reduce, &stat)) {
+            fprintf(stderr, "Error: Write reduced bands of %s\n", filename);
+            if (status == 0) status = 1;
+        }
+        double filter_sec = 0;
+        for (int b = 0; b < NUM_BANDS; b++) filter_sec += stat.filter_sec[b];
+        printf("Reduced bands: %.1f s CPU for filters, %.1f s for unpacking, %" PRIu64 " missing frames filled, %.1f MB dropped\n",
+               filter_sec, stat.unpack_sec, stat.missing_frames, stat.dropped_bytes / 1e6);
+    }
+    acq_free(sink.acq);
+    if (sink.timing) {
+        struct timing_statistics stat;
+        if (timing_close(sink.timing, &stat)) {
+            fprintf(stderr, "Error: Write %s.timing\n%s\n", filename, strerror(errno));
+            if (status == 0) status = 1;
+        }
+        if (stat.ns_per_frame > 0) {
+            printf("Timing: %" PRIu64 " stamps, %.3f ns per frame (%.0f bytes/s), jitter %.1f us RMS, %.1f us max\n",
+                   stat.stamps, stat.ns_per_frame, FRAME_LEN * 1e9 / stat.ns_per_frame, stat.rms_ns / 1000,
+                   stat.max_residual_ns / 1000);
+        }
+    }
+    if (sink.gaps && fclose(sink.gaps)) {
+        fprintf(stderr, "Error: Write %s.gaps\n%s\n", filename, strerror(errno));
+        if (status == 0) status = 1;
+    }
+    if (sink.fd >= 0) close(sink.fd);
 
 err_intf:
-    libusb_release_interface(dev_handle, INTERFACE);
+    // A device lost for good has already been closed
+    if (dev_handle) transport_release_interface(dev_handle, STREAM_INTERFACE);
 err_dev:
-    libusb_close(dev_handle);
+    if (dev_handle) transport_close(dev_handle);
+    if (daemon_fd >= 0) close(daemon_fd);
+    if (daemon_sock >= 0) close(daemon_sock);
 err_usb:
-    libusb_exit(ctx);
+    transport_exit(ctx);
 err_ret:
     return status;
 }
 
+// Asks the flexibandd daemon for a ready device. The daemon passes the usbfs file descriptor
+// of the device, which is wrapped into a libusb handle. The device stays reserved for us as
+// long as the socket is open.
+static libusb_device_handle *open_from_daemon(libusb_context *ctx, const char *path, int *sock, int *dev_fd, int *dev_id) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    *sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*sock < 0 || connect(*sock, (struct sockaddr*)&addr, sizeof(addr)) || send(*sock, "OPEN\n", 5, 0) != 5) {
+        fprintf(stderr, "Error: Connect to %s\n%s\n", path, strerror(errno));
+        goto err_sock;
+    }
+
+    char line[256];
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { line, sizeof(line) - 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t len = recvmsg(*sock, &msg, MSG_CMSG_CLOEXEC);
+    if (len <= 0) {
+        fprintf(stderr, "Error: No reply from %s\n", path);
+        goto err_sock;
+    }
+    line[len] = '\0';
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (sscanf(line, "OK %d", dev_id) != 1 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Error: %s", line);
+        goto err_sock;
+    }
+    memcpy(dev_fd, CMSG_DATA(cmsg), sizeof(int));
+
+    // libusb does not take ownership, dev_fd has to stay open until transport_close().
+    // Fails with LIBUSB_ERROR_NOT_SUPPORTED if libusb is too old.
+    libusb_device_handle *dev_handle;
+    int status = transport_wrap_sys_device(ctx, (intptr_t)*dev_fd, &dev_handle);
+    if (status == 0) return dev_handle;
+    fprintf(stderr, "Error: Wrap device\n%s\n", libusb_strerror((enum libusb_error)status));
+    close(*dev_fd);
+    *dev_fd = -1;
+
+err_sock:
+    if (*sock >= 0) close(*sock);
+    *sock = -1;
+    return NULL;
+}
+
+// Takes the device description cached by the daemon, without any request on EP0, and stores it
+// next to the recording as well. Returns 0 or -1 if the daemon has none.
+static int read_daemon_info(int sock, int dev_id, const char *filename, struct flexiband_description *desc) {
+    char request[32];
+    char info[4096];
+    size_t len = 0;
+    int n = snprintf(request, sizeof(request), "INFO %d\n", dev_id);
+    if (send(sock, request, n, 0) != n) return -1;
+    // The reply ends with a line containing a single '.'
+    while (len < sizeof(info) - 1) {
+        ssize_t r = recv(sock, info + len, sizeof(info) - 1 - len, 0);
+        if (r <= 0) return -1;
+        len += r;
+        info[len] = '\0';
+        if ((len == 2 && strcmp(info, ".\n") == 0) || (len > 2 && strcmp(info + len - 3, "\n.\n") == 0)) break;
+    }
+    len -= 2;
+    if (len == 0) return -1;
+    info[len] = '\0';
+    if (flexiband_parse_description(info, desc)) return -1;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.info", filename);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Warning: Failed to open %s\n%s\n", path, strerror(errno));
+        return 0;
+    }
+    fwrite(info, 1, len, fp);
+    fclose(fp);
+    return 0;
+}
+
+// Integer, also hex with 0x, or float notation like 1e9 or 2.5e6
+static uint64_t parse_count(const char *text) {
+    char *end;
+    uint64_t count = strtoull(text, &end, 0);
+    if (*end == '.' || *end == 'e' || *end == 'E') {
+        double value = strtod(text, NULL);
+        count = value > 0 ? (uint64_t)value : 0;
+    }
+    return count;
+}
+
+// UTC as YYYY-MM-DDTHH:MM:SS[.fraction], seconds since the epoch, or +seconds from now
+static int parse_start_time(const char *text, int64_t *realtime_ns) {
+    struct tm tm;
+    double seconds;
+    char end;
+    memset(&tm, 0, sizeof(tm));
+    if (text[0] == '+') {
+        if (sscanf(text + 1, "%lf%c", &seconds, &end) != 1 || seconds < 0) return -1;
+        *realtime_ns = now_ns(CLOCK_REALTIME) + (int64_t)(seconds * 1e9);
+    } else if (sscanf(text, "%d-%d-%dT%d:%d:%lf%c", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+                      &seconds, &end) == 6) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        if (seconds < 0 || seconds >= 61) return -1;
+        time_t t = timegm(&tm);
+        if (t == (time_t)-1) return -1;
+        *realtime_ns = (int64_t)t * 1000000000 + (int64_t)(seconds * 1e9);
+    } else {
+        if (sscanf(text, "%lf%c", &seconds, &end) != 1 || seconds <= 0) return -1;
+        *realtime_ns = (int64_t)(seconds * 1e9);
+    }
+    return 0;
+}
+
+static int control_in(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t request, uint16_t value,
+                      uint16_t index, unsigned char *data, uint16_t length) {
+    return transport_control_transfer(dev_handle, request_type | LIBUSB_ENDPOINT_IN, request, value, index, data, length, 1000);
+}
+
+// Copies serial number, builds and RF-board EEPROMs into the capture container header
+static void fill_capture_header(struct capture_header *header, const struct flexiband_description *desc) {
+    const struct flexiband_build_info *from[3] = {&desc->fx3, &desc->atmel, &desc->fpga};
+    struct capture_build *builds[3] = {&header->fx3, &header->atmel, &header->fpga};
+
+    snprintf(header->usb_serial, sizeof(header->usb_serial), "%s", desc->usb_serial);
+    for (int i = 0; i < 3; i++) {
+        builds[i]->build = from[i]->build;
+        builds[i]->hash = from[i]->hash;
+        builds[i]->timestamp = from[i]->timestamp;
+    }
+    for (int slot = 0; slot < CAPTURE_NUM_SLOTS && slot < FLEXIBAND_NUM_SLOTS; slot++) {
+        const struct flexiband_rf_board *board = &desc->slot[slot];
+        struct capture_slot *s = &header->slot[slot];
+        if (!board->present) continue;
+        s->present = 1;
+        s->serial = board->serial;
+        s->antenna = board->antenna;
+        s->bandwidth = board->bandwidth;
+        s->lo = board->lo;
+        snprintf(s->band, sizeof(s->band), "%s", board->band);
+        s->revision = board->revision;
+    }
+}
+
 struct statistics {
     int64_t min;
     int64_t max;
@@ -136,10 +670,83 @@ struct transfer_ctrl {
     uint64_t len;
     uint64_t transferred;
     unsigned pending;
-    int fd;
+    const struct sink *sink;
     int status;
     struct statistics usb;
     struct statistics disk;
+    // Gaps between iso callbacks over the whole recording, split by whether control
+    // requests of the poller were in flight. The difference bounds the cost of polling.
+    struct statistics usb_idle;
+    struct statistics usb_polling;
+    struct statistics band_stats;    // time spent in stats_update() per transfer
+    uint32_t counter;                // of the newest frame
+    int64_t end_ns;                  // monotonic, no more transfers are submitted after it
+    bool write_failed;               // the recording is incomplete
+    const struct poller *poller;
+    // Reconnects after the device was lost, -r
+    unsigned reconnects;
+    int64_t lost;                    // usec the device was lost, 0 once data arrives again
+    uint64_t lost_offset;            // bytes recorded by then
+    int64_t max_recovery;            // usec from the loss to the first data after it
+    bool abandoned;                  // transfers of the lost device did not return, they are leaked
+};
+
+// Control requests polled during the recording, documented in README.md
+struct poll_request {
+    const char *name;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+};
+
+static const struct poll_request poll_requests[NUM_POLL_REQUESTS] = {
+    {"rf_info", 0x05, 0x00, 0},  // antenna fault (bit 0) and supply (bit 1) of each slot
+    {"rf_info", 0x05, 0x00, 1},
+    {"rf_info", 0x05, 0x00, 2},
+    {"agc", 0x01, 0x00, 0x20},
+    {"fpga_state", 0x00, 0x05, 0x00},
+};
+
+// Polls the control plane with asynchronous transfers from the event loop of the recording.
+// The callbacks only store the results; they are written to the side-car file from the main
+// loop, so an iso callback is never delayed by more than a few instructions.
+struct poller {
+    int64_t interval;                // usec
+    int64_t next;                    // time of the next batch
+    int64_t submitted;               // time the current batch was submitted
+    unsigned pending;
+    bool unwritten;                  // results of a completed batch not written yet
+    const uint64_t *transferred;     // byte offset in the recording, for the side-car
+    FILE *fp;
+    struct libusb_transfer *transfers[NUM_POLL_REQUESTS];
+    int results[NUM_POLL_REQUESTS];  // value, or negative libusb_transfer_status
+    int64_t completed[NUM_POLL_REQUESTS];
+    uint64_t offsets[NUM_POLL_REQUESTS];
+    struct statistics callback;      // time spent in poll callbacks
+    struct statistics service;       // time spent submitting and writing results
+    uint64_t batches;
+    struct stats *stats;             // band statistics, -b, updated by the transfer callback
+    const uint32_t *counter;         // of the newest frame in the recording
+    struct gain_control *gain;       // -g, decides when a batch is submitted
+};
+
+// Amplification requests of the gain control, one transfer per slot. Like the poll requests
+// they are asynchronous; a slot has at most one in flight.
+struct gain_control {
+    libusb_device_handle *dev_handle;
+    struct gain_config config;
+    struct gain_slot slots[NUM_SLOTS];
+    struct libusb_transfer *transfers[NUM_SLOTS];
+    unsigned pending;
+    unsigned requested[NUM_SLOTS];
+    bool unwritten[NUM_SLOTS];       // completed, not logged yet
+    int results[NUM_SLOTS];          // 0 or negative libusb_transfer_status
+    int64_t completed[NUM_SLOTS];
+    uint64_t offsets[NUM_SLOTS];
+    uint32_t counters[NUM_SLOTS];    // first frame received after the change
+    int agc;                         // on-board AGC before the recording, -1 if unknown
+    uint64_t changes;
+    uint64_t failures;
 };
 
 static int64_t now_usec() {
@@ -148,6 +755,12 @@ static int64_t now_usec() {
     return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
+static int64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static void init_statistics(struct statistics *stat) {
     stat->min = INT64_MAX;
     stat->max = 0;
@@ -162,6 +775,355 @@ static void update_statistics(struct statistics *stat, int64_t duration) {
     stat->num++;
 }
 
+static void poll_callback(struct libusb_transfer *transfer) {
+    int64_t start = now_usec();
+    struct poller *poller = (struct poller*)transfer->user_data;
+    unsigned i;
+    for (i = 0; i < NUM_POLL_REQUESTS && poller->transfers[i] != transfer; i++) {}
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length == 1) {
+        poller->results[i] = libusb_control_transfer_get_data(transfer)[0];
+    } else {
+        poller->results[i] = transfer->status == LIBUSB_TRANSFER_COMPLETED ? -LIBUSB_TRANSFER_ERROR : -(int)transfer->status;
+    }
+    poller->completed[i] = start;
+    poller->offsets[i] = *poller->transferred;
+    if (--poller->pending == 0) poller->unwritten = true;
+    update_statistics(&poller->callback, now_usec() - start);
+}
+
+static void gain_callback(struct libusb_transfer *transfer) {
+    struct poller *poller = (struct poller*)transfer->user_data;
+    struct gain_control *gain = poller->gain;
+    unsigned i;
+    for (i = 0; i < NUM_SLOTS && gain->transfers[i] != transfer; i++) {}
+    gain->results[i] = transfer->status == LIBUSB_TRANSFER_COMPLETED ? 0 : -(int)transfer->status;
+    gain->completed[i] = now_usec();
+    gain->offsets[i] = *poller->transferred;
+    gain->counters[i] = *poller->counter + 1;
+    gain->unwritten[i] = true;
+    gain->pending--;
+}
+
+// Takes the boards and their DAC ranges from the description, sets them to their default
+// amplification and switches the on-board AGC off, so it does not fight the host. Runs once
+// before the recording starts.
+static struct gain_control *create_gain_control(libusb_device_handle *dev_handle, const struct flexiband_description *desc,
+                                                const struct gain_config *config) {
+    const uint8_t type = LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR;
+    struct gain_control *gain = (struct gain_control*)calloc(1, sizeof(struct gain_control));
+    unsigned char data[1];
+    unsigned controlled = 0;
+    if (gain == NULL) {
+        fprintf(stderr, "Error: allocating gain control\n");
+        return NULL;
+    }
+    gain->dev_handle = dev_handle;
+    gain->config = *config;
+    gain->agc = -1;
+
+    for (int slot = 0; slot < NUM_SLOTS; slot++) {
+        const struct flexiband_rf_board *board = &desc->slot[slot];
+        struct gain_slot *s = &gain->slots[slot];
+        s->band = -1;
+        if (!board->present) continue;
+        // Names like "L1/G1" start with the band
+        for (s->band = 0; s->band < NUM_BANDS && strncmp(board->band, band_names[s->band], strlen(band_names[s->band])); s->band++) {}
+        if (s->band == NUM_BANDS) {
+            printf("Gain control: slot %d band %s not controlled\n", slot, board->band);
+            s->band = -1;
+            continue;
+        }
+        s->dac_min = board->dac_min;
+        s->dac_max = board->dac_max;
+        unsigned dac = board->dac_default;
+        if (s->dac_max <= s->dac_min) s->dac_max = 0xff;
+        if (dac < s->dac_min || dac > s->dac_max) dac = (s->dac_min + s->dac_max) / 2;
+        int status = transport_control_transfer(dev_handle, type | LIBUSB_ENDPOINT_OUT, 0x06, dac, slot, NULL, 0, 1000);
+        if (status) {
+            fprintf(stderr, "Error: Set amplification of slot %d\n%s\n", slot, libusb_strerror((enum libusb_error)status));
+            goto err;
+        }
+        // Logged with the first telemetry
+        s->dac = gain->requested[slot] = dac;
+        gain->unwritten[slot] = true;
+        gain->completed[slot] = now_usec();
+        printf("Gain control: slot %d %s, DAC 0x%02x - 0x%02x, start at 0x%02x\n", slot, band_names[s->band],
+               s->dac_min, s->dac_max, dac);
+
+        unsigned char *buffer = (unsigned char*)calloc(1, LIBUSB_CONTROL_SETUP_SIZE);
+        gain->transfers[slot] = libusb_alloc_transfer(0);
+        if (buffer == NULL || gain->transfers[slot] == NULL) {
+            fprintf(stderr, "Error: allocating transfer\n");
+            free(buffer);
+            goto err;
+        }
+        libusb_fill_control_transfer(gain->transfers[slot], dev_handle, buffer, gain_callback, NULL, TIMEOUT_MS);
+        gain->transfers[slot]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        controlled++;
+    }
+    if (controlled == 0) {
+        fprintf(stderr, "Error: No RF-board to control\n");
+        goto err;
+    }
+
+    if (control_in(dev_handle, type, 0x01, 0x00, 0x20, data, 1) == 1) gain->agc = data[0];
+    if (gain->agc == 1) {
+        transport_control_transfer(dev_handle, type | LIBUSB_ENDPOINT_OUT, 0x01, 0, 0x20, NULL, 0, 1000);
+        printf("Gain control: on-board AGC switched off for the recording\n");
+    }
+    return gain;
+
+err:
+    for (int slot = 0; slot < NUM_SLOTS; slot++) {
+        if (gain->transfers[slot]) libusb_free_transfer(gain->transfers[slot]);
+    }
+    free(gain);
+    return NULL;
+}
+
+// A reconnected device is back at its power-on state: the amplification of the boards and the
+// on-board AGC are set again like before the loss
+static void restore_gain_control(struct gain_control *gain) {
+    const uint8_t type = LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT;
+    for (int slot = 0; slot < NUM_SLOTS; slot++) {
+        struct gain_slot *s = &gain->slots[slot];
+        if (s->band < 0) continue;
+        int status = transport_control_transfer(gain->dev_handle, type, 0x06, s->dac, slot, NULL, 0, 1000);
+        if (status) {
+            fprintf(stderr, "Error: Set amplification of slot %d\n%s\n", slot, libusb_strerror((enum libusb_error)status));
+            gain->failures++;
+        }
+    }
+    if (gain->agc == 1) transport_control_transfer(gain->dev_handle, type, 0x01, 0, 0x20, NULL, 0, 1000);
+}
+
+static void free_gain_control(struct gain_control *gain) {
+    if (gain == NULL) return;
+    if (gain->agc == 1 && gain->dev_handle) {
+        transport_control_transfer(gain->dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+                                   0x01, 1, 0x20, NULL, 0, 1000);
+    }
+    for (int slot = 0; slot < NUM_SLOTS; slot++) {
+        if (gain->transfers[slot]) libusb_free_transfer(gain->transfers[slot]);
+    }
+    free(gain);
+}
+
+static struct poller *create_poller(libusb_device_handle *dev_handle, const char *filename, int interval_ms,
+                                    struct stats *stats, struct gain_control *gain) {
+    struct poller *poller = (struct poller*)calloc(1, sizeof(struct poller));
+    if (poller == NULL) {
+        fprintf(stderr, "Error: allocating poller\n");
+        stats_free(stats);
+        free_gain_control(gain);
+        return NULL;
+    }
+    poller->stats = stats;
+    poller->gain = gain;
+    for (int slot = 0; gain && slot < NUM_SLOTS; slot++) {
+        if (gain->transfers[slot]) gain->transfers[slot]->user_data = poller;
+    }
+    poller->interval = interval_ms * 1000LL;
+    init_statistics(&poller->callback);
+    init_statistics(&poller->service);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.telemetry", filename);
+    poller->fp = fopen(path, "w");
+    if (poller->fp == NULL) {
+        fprintf(stderr, "Failed to open %s\n%s\n", path, strerror(errno));
+        goto err;
+    }
+    fprintf(poller->fp, "# monotonic_usec byte_offset name slot value\n");
+
+    for (unsigned i = 0; i < NUM_POLL_REQUESTS; i++) {
+        const struct poll_request *req = &poll_requests[i];
+        unsigned char *buffer = (unsigned char*)calloc(1, LIBUSB_CONTROL_SETUP_SIZE + 1);
+        poller->transfers[i] = libusb_alloc_transfer(0);
+        if (buffer == NULL || poller->transfers[i] == NULL) {
+            fprintf(stderr, "Error: allocating transfer\n");
+            free(buffer);
+            goto err;
+        }
+        libusb_fill_control_setup(buffer, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN,
+                                  req->request, req->value, req->index, 1);
+        libusb_fill_control_transfer(poller->transfers[i], dev_handle, buffer, poll_callback, poller, TIMEOUT_MS);
+        poller->transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+    return poller;
+
+err:
+    free_poller(poller);
+    return NULL;
+}
+
+static void free_poller(struct poller *poller) {
+    if (poller == NULL) return;
+    for (unsigned i = 0; i < NUM_POLL_REQUESTS; i++) {
+        if (poller->transfers[i]) libusb_free_transfer(poller->transfers[i]);
+    }
+    if (poller->fp) fclose(poller->fp);
+    stats_free(poller->stats);
+    free_gain_control(poller->gain);
+    free(poller);
+}
+
+// One line per value and band, histograms as comma separated counts from the lowest level
+static void write_band_statistics(struct poller *poller) {
+    struct stats_band bands[NUM_BANDS];
+    int64_t now = now_usec();
+    stats_get(poller->stats, bands);
+    for (unsigned b = 0; b < NUM_BANDS; b++) {
+        if (bands[b].bits == 0) continue;
+        const char *name = band_names[b];
+        fprintf(poller->fp, "%" PRId64 " %" PRIu64 " %s_power -1 %.4f\n", now, *poller->transferred, name, bands[b].power);
+        fprintf(poller->fp, "%" PRId64 " %" PRIu64 " %s_mean_i -1 %.4f\n", now, *poller->transferred, name, bands[b].mean_i);
+        fprintf(poller->fp, "%" PRId64 " %" PRIu64 " %s_mean_q -1 %.4f\n", now, *poller->transferred, name, bands[b].mean_q);
+        fprintf(poller->fp, "%" PRId64 " %" PRIu64 " %s_outer -1 %.4f\n", now, *poller->transferred, name, bands[b].outer);
+        for (int q = 0; q < 2; q++) {
+            const uint64_t *hist = q ? bands[b].hist_q : bands[b].hist_i;
+            fprintf(poller->fp, "%" PRId64 " %" PRIu64 " %s_hist_%c -1 ", now, *poller->transferred, name, q ? 'q' : 'i');
+            for (unsigned l = 0; l < (1u << bands[b].bits); l++) fprintf(poller->fp, l ? ",%" PRIu64 : "%" PRIu64, hist[l]);
+            fprintf(poller->fp, "\n");
+        }
+    }
+}
+
+// Logs completed amplification changes with the first frame that can carry them
+static void write_gain_changes(struct poller *poller) {
+    struct gain_control *gain = poller->gain;
+    for (unsigned slot = 0; slot < NUM_SLOTS; slot++) {
+        if (!gain->unwritten[slot]) continue;
+        gain->unwritten[slot] = false;
+        struct gain_slot *s = &gain->slots[slot];
+        if (gain->results[slot] < 0) {
+            fprintf(poller->fp, "%" PRId64 " %" PRIu64 " dac %u error %d\n", gain->completed[slot], gain->offsets[slot],
+                    slot, -gain->results[slot]);
+            gain->failures++;
+            gain_applied(&gain->config, s, s->dac, gain->completed[slot], gain->offsets[slot]);
+            continue;
+        }
+        fprintf(poller->fp, "%" PRId64 " %" PRIu64 " dac %u 0x%02x\n", gain->completed[slot], gain->offsets[slot], slot,
+                gain->requested[slot]);
+        fprintf(poller->fp, "%" PRId64 " %" PRIu64 " dac_frame %u %" PRIu32 "\n", gain->completed[slot],
+                gain->offsets[slot], slot, gain->counters[slot]);
+        if (gain->requested[slot] != s->dac) gain->changes++;
+        gain_applied(&gain->config, s, gain->requested[slot], gain->completed[slot], gain->offsets[slot]);
+    }
+}
+
+static void update_gain(struct poller *poller, int64_t now) {
+    struct gain_control *gain = poller->gain;
+    struct stats_band bands[NUM_BANDS];
+    stats_get(poller->stats, bands);
+    for (unsigned slot = 0; slot < NUM_SLOTS; slot++) {
+        struct gain_slot *s = &gain->slots[slot];
+        if (s->band < 0 || gain->unwritten[slot]) continue;
+        int dac = gain_decide(&gain->config, s, &bands[s->band], now, *poller->transferred);
+        if (dac < 0) continue;
+        struct libusb_transfer *transfer = gain->transfers[slot];
+        libusb_fill_control_setup(transfer->buffer, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+                                  0x06, dac, slot, 0);
+        if (transport_submit_transfer(transfer)) continue;
+        gain->requested[slot] = dac;
+        s->pending = true;
+        gain->pending++;
+    }
+}
+
+static void write_poll_results(struct poller *poller) {
+    for (unsigned i = 0; i < NUM_POLL_REQUESTS; i++) {
+        const struct poll_request *req = &poll_requests[i];
+        fprintf(poller->fp, "%" PRId64 " %" PRIu64 " %s %d ", poller->completed[i], poller->offsets[i], req->name,
+                req->request == 0x05 ? req->index : -1);
+        if (poller->results[i] >= 0) fprintf(poller->fp, "0x%02x\n", poller->results[i]);
+        else fprintf(poller->fp, "error %d\n", -poller->results[i]);
+    }
+    if (poller->stats) write_band_statistics(poller);
+    poller->unwritten = false;
+}
+
+// Called from the main loop between two event handling rounds. Never waits for the device.
+static void service_poller(struct poller *poller) {
+    int64_t start = now_usec();
+    bool busy = false;
+    if (poller->unwritten) {
+        write_poll_results(poller);
+        busy = true;
+    }
+    if (poller->pending == 0 && start >= poller->next && !do_exit) {
+        // Requests on EP0 are executed in order, so the whole batch is queued at once
+        for (unsigned i = 0; i < NUM_POLL_REQUESTS; i++) {
+            if (transport_submit_transfer(poller->transfers[i]) == 0) poller->pending++;
+        }
+        poller->submitted = start;
+        poller->next = start + poller->interval;
+        poller->batches++;
+        if (poller->gain) update_gain(poller, start);
+        busy = true;
+    }
+    if (poller->gain) write_gain_changes(poller);
+    if (busy) update_statistics(&poller->service, now_usec() - start);
+}
+
+static void print_poll_statistics(const struct transfer_ctrl *ctrl, const struct poller *poller) {
+    printf("Polling: %" PRIu64 " batches, callback max %" PRId64 " us, submit/write max %" PRId64 " us\n",
+           poller->batches, poller->callback.max, poller->service.max);
+    if (poller->gain) {
+        printf("Gain control: %" PRIu64 " changes, %" PRIu64 " failed\n", poller->gain->changes, poller->gain->failures);
+    }
+    if (poller->stats && ctrl->band_stats.num > 0) {
+        printf("Band statistics: max %" PRId64 " us per transfer, %.0f MB/s on one core\n", ctrl->band_stats.max,
+               ctrl->band_stats.sum > 0 ? (double)ctrl->transferred / ctrl->band_stats.sum : 0);
+    }
+    if (ctrl->usb_idle.num > 0 && ctrl->usb_polling.num > 0) {
+        printf("USB callback gap: max %" PRId64 " us, avg %" PRId64 " us idle; max %" PRId64 " us, avg %" PRId64 " us while polling\n",
+               ctrl->usb_idle.max, ctrl->usb_idle.sum / ctrl->usb_idle.num,
+               ctrl->usb_polling.max, ctrl->usb_polling.sum / ctrl->usb_polling.num);
+    }
+}
+
+// monotonic_ns is the completion time of the transfer the data belongs to
+static int sink_write(const struct sink *sink, const void *data, size_t len, int64_t monotonic_ns) {
+    if (sink->reduce && reduce_write(sink->reduce, data, len)) return -1;
+    if (sink->acq) acq_feed(sink->acq, data, len);
+    if (sink->capture) return capture_write(sink->capture, data, len, monotonic_ns);
+    if (sink->archive) return archive_write(sink->archive, data, len);
+    if (sink->segments) return segment_write(sink->segments, data, len, monotonic_ns);
+    if (sink->ring) return ring_write(sink->ring, data, len, monotonic_ns);
+    return write_all(sink->fd, data, len);
+}
+
+// The device restarted its stream, the frame counter starts over. Only the index of a
+// container can tell, the other sinks just carry on.
+static void sink_restart(const struct sink *sink) {
+    if (sink->capture) capture_restart(sink->capture);
+    if (sink->segments) segment_restart(sink->segments);
+}
+
+// Called from the main loop: arms the next snapshot when it is due and prints the acquired
+// PRNs of a finished search, also to the telemetry
+static void service_acq(const struct sink *sink, int64_t *next, struct poller *poller, uint64_t transferred,
+                        bool is_terminal) {
+    struct acq_report report;
+    int64_t now = now_usec();
+    if (acq_poll(sink->acq, &report)) {
+        if (is_terminal) printf("\33[2K\r");
+        printf("Acquisition: frame %" PRIu32 ", %u PRNs in %.2f s:", report.counter, report.acquired, report.search_sec);
+        for (int p = 0; p < ACQ_NUM_PRNS; p++) {
+            const struct acq_result *r = &report.prn[p];
+            if (!r->acquired) continue;
+            printf(" %d (%.1f dB-Hz)", p + 1, r->cn0);
+            if (poller) {
+                fprintf(poller->fp, "%" PRId64 " %" PRIu64 " acq_cn0 %d %.1f\n", now, transferred, p + 1, r->cn0);
+                fprintf(poller->fp, "%" PRId64 " %" PRIu64 " acq_doppler %d %.0f\n", now, transferred, p + 1, r->doppler);
+            }
+        }
+        printf(report.acquired ? "\n" : " none\n");
+    }
+    if (now >= *next && acq_start(sink->acq)) *next = now + sink->acq_interval;
+}
+
 static void transfer_callback(struct libusb_transfer *transfer) {
     static int64_t start_usb = -1;
     struct transfer_ctrl *ctrl = (struct transfer_ctrl*)transfer->user_data;
@@ -173,26 +1135,71 @@ static void transfer_callback(struct libusb_transfer *transfer) {
     if (start_usb > 0) {
         int64_t duration = now_usec() - start_usb;
         update_statistics(&ctrl->usb, duration);
+        if (ctrl->poller && (ctrl->poller->pending > 0 || (ctrl->poller->gain && ctrl->poller->gain->pending > 0))) update_statistics(&ctrl->usb_polling, duration);
+        else update_statistics(&ctrl->usb_idle, duration);
     }
 
     // write current transfer to file
     ctrl->pending--;
     if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-        fprintf(stderr, "Error: Transfer not completed, status %i\n", transfer->status);
-        ctrl->status = transfer->status;
+        // The rest of the queue usually fails the same way, only the first one is reported
+        if (ctrl->status == 0) {
+            fprintf(stderr, "Error: Transfer not completed, status %i\n", transfer->status);
+            ctrl->status = transfer->status;
+        }
         return;
     }
-    for (unsigned i = 0; i < transfer->num_iso_packets; i++) {
+    int64_t completed_ns = now_ns(CLOCK_MONOTONIC);
+    // Transfers completing after the end of -d are dropped, so the recording ends there like for -f
+    if (completed_ns >= ctrl->end_ns) return;
+    int64_t completed_realtime_ns = ctrl->sink->timing ? now_ns(CLOCK_REALTIME) : 0;
+    uint64_t transfer_start = ctrl->transferred;
+    if (ctrl->poller && ctrl->poller->stats) {
+        int64_t start = now_usec();
+        uint64_t pos = ctrl->transferred;
+        for (unsigned i = 0; i < transfer->num_iso_packets; i++) {
+            if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED) continue;
+            stats_update(ctrl->poller->stats, libusb_get_iso_packet_buffer_simple(transfer, i),
+                         transfer->iso_packet_desc[i].actual_length, pos);
+            pos += transfer->iso_packet_desc[i].actual_length;
+        }
+        update_statistics(&ctrl->band_stats, now_usec() - start);
+    }
+    for (unsigned i = 0; i < transfer->num_iso_packets && ctrl->transferred < ctrl->len; i++) {
         if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED) continue;
+        // Transfers still in flight when the length is reached are cut, so -f is exact
+        uint64_t len = transfer->iso_packet_desc[i].actual_length;
+        if (len > ctrl->len - ctrl->transferred) len = ctrl->len - ctrl->transferred;
         long start = now_usec();
-        write(ctrl->fd, libusb_get_iso_packet_buffer_simple(transfer, i), transfer->iso_packet_desc[i].actual_length);
+        if (sink_write(ctrl->sink, libusb_get_iso_packet_buffer_simple(transfer, i), len, completed_ns)) {
+            if (!ctrl->write_failed) fprintf(stderr, "Error: Write\n%s\n", strerror(errno));
+            ctrl->write_failed = true;
+            ctrl->status = -1;
+            return;
+        }
         long duration = now_usec() - start;
         update_statistics(&ctrl->disk, duration);
-        ctrl->transferred += transfer->iso_packet_desc[i].actual_length;
+        ctrl->transferred += len;
+    }
+    for (int i = transfer->num_iso_packets - 1; i >= 0; i--) {
+        unsigned len = transfer->iso_packet_desc[i].actual_length;
+        if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED || len < FRAME_LEN) continue;
+        const uint8_t *frame = libusb_get_iso_packet_buffer_simple(transfer, i) + (len / FRAME_LEN - 1) * FRAME_LEN;
+        if (!frame_has_preamble(frame)) break;
+        ctrl->counter = frame_counter(frame);
+        // libusb does not report the USB frame an iso transfer started in
+        if (ctrl->sink->timing && timing_stamp(ctrl->sink->timing, ctrl->counter,
+                                               (unsigned)((ctrl->transferred - transfer_start) / FRAME_LEN),
+                                               completed_ns, completed_realtime_ns, -1)) {
+            fprintf(stderr, "Error: Write time stamps\n%s\n", strerror(errno));
+            ctrl->status = -1;
+            return;
+        }
+        break;
     }
 
-    if (ctrl->transferred < ctrl->len || do_exit) {
-        ctrl->status = libusb_submit_transfer(transfer);
+    if (ctrl->transferred < ctrl->len && completed_ns < ctrl->end_ns && ctrl->status == 0 && !do_exit) {
+        ctrl->status = transport_submit_transfer(transfer);
         if (ctrl->status) {
             fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)ctrl->status));
             return;
@@ -203,9 +1210,134 @@ static void transfer_callback(struct libusb_transfer *transfer) {
     start_usb = now_usec();
 }
 
-static int transfer_data(libusb_context *ctx, libusb_device_handle *dev_handle, int fd, uint64_t len) {
+// Sleeps until shortly before realtime_ns and polls the clock for the rest, so the start is not
+// late by the timer slack. Returns early on CTRL+C.
+static void wait_until(int64_t realtime_ns) {
+    int64_t wake = realtime_ns - SPIN_NS;
+    struct timespec ts = {(time_t)(wake / 1000000000), (long)(wake % 1000000000)};
+    while (!do_exit && clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+    while (!do_exit && now_ns(CLOCK_REALTIME) < realtime_ns) {}
+}
+
+static int hotplug_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data) {
+    // No I/O in here, the device is opened once the event handling returned
+    *(int*)user_data = 1;
+    return 0;
+}
+
+// Failed transfers and a refused submit mean the device is gone; write errors (-1) are final
+static bool device_lost(int status) {
+    return status > 0 || status == LIBUSB_ERROR_NO_DEVICE;
+}
+
+// Brings a lost device back for -r: waits for its transfers, then for the device to reappear,
+// opens and configures it like at the start and restarts the stream with the same transfers,
+// so buffers and writers carry on. The device is looked for on every hotplug arrival and at
+// least once per second. Returns 0 once the transfers are queued again.
+static int reconnect_device(libusb_context *ctx, libusb_device_handle **dev_handle, struct libusb_transfer **transfers,
+                            struct transfer_ctrl *ctrl, struct poller *poller) {
+    const uint8_t type = LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT;
+    struct gain_control *gain = poller ? poller->gain : NULL;
+    int64_t lost = now_usec();
+    printf("\nDevice lost after %.1f MB, reconnecting...\n", ctrl->transferred / 1e6);
+    fflush(stdout);
+    if (poller) fprintf(poller->fp, "%" PRId64 " %" PRIu64 " device_lost -1 %d\n", lost, ctrl->transferred, ctrl->status);
+    fprintf(ctrl->sink->gaps, "%" PRId64 " %" PRIu64 " device_lost %d\n", lost, ctrl->transferred, ctrl->status);
+    fflush(ctrl->sink->gaps);
+
+    // Nothing may be in flight any more when the transfers are moved to the new handle
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) transport_cancel_transfer(transfers[i]);
+    for (unsigned i = 0; poller && i < NUM_POLL_REQUESTS; i++) transport_cancel_transfer(poller->transfers[i]);
+    for (unsigned i = 0; gain && i < NUM_SLOTS; i++) {
+        if (gain->transfers[i]) transport_cancel_transfer(gain->transfers[i]);
+    }
+    while (ctrl->pending > 0 || (poller && (poller->pending > 0 || (gain && gain->pending > 0)))) {
+        struct timeval tv = {0, 100000};
+        if (now_usec() - lost > DRAIN_USEC) {
+            fprintf(stderr, "Error: Transfers of the lost device did not return\n");
+            // libusb may still own them, so they are neither waited for nor freed
+            ctrl->abandoned = true;
+            for (unsigned i = 0; poller && i < NUM_POLL_REQUESTS; i++) poller->transfers[i] = NULL;
+            for (unsigned i = 0; gain && i < NUM_SLOTS; i++) gain->transfers[i] = NULL;
+            return 1;
+        }
+        transport_handle_events_timeout_completed(ctx, &tv, NULL);
+    }
+    transport_release_interface(*dev_handle, STREAM_INTERFACE);
+    transport_close(*dev_handle);
+    *dev_handle = NULL;
+    if (gain) gain->dev_handle = NULL;
+
+    int arrived = 0;
+    libusb_hotplug_callback_handle hotplug;
+    bool has_hotplug = transport_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                                                           STREAM_VID, STREAM_PID, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback,
+                                                           &arrived, &hotplug) == 0;
+    libusb_device_handle *handle = NULL;
+    while (!do_exit && now_ns(CLOCK_MONOTONIC) < ctrl->end_ns) {
+        handle = stream_open_device(ctx, true);
+        if (handle && stream_claim_device(handle) == 0) break;
+        if (handle) transport_close(handle);
+        handle = NULL;
+        struct timeval tv = {1, 0};
+        arrived = 0;
+        transport_handle_events_timeout_completed(ctx, &tv, &arrived);
+    }
+    if (has_hotplug) transport_hotplug_deregister_callback(ctx, hotplug);
+    if (handle == NULL) return 1;
+
+    *dev_handle = handle;
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) transfers[i]->dev_handle = handle;
+    for (unsigned i = 0; poller && i < NUM_POLL_REQUESTS; i++) poller->transfers[i]->dev_handle = handle;
+    if (gain) {
+        gain->dev_handle = handle;
+        for (unsigned i = 0; i < NUM_SLOTS; i++) {
+            if (gain->transfers[i]) gain->transfers[i]->dev_handle = handle;
+        }
+        restore_gain_control(gain);
+    }
+    if (ctrl->sink->timing) timing_restart(ctrl->sink->timing);
+    sink_restart(ctrl->sink);
+
+    int status = transport_control_transfer(handle, type, 0x00, 0x00, 0x00, NULL, 0, 1000);
+    if (status) {
+        fprintf(stderr, "Error: Start command\n%s\n", libusb_strerror((enum libusb_error)status));
+        return status;
+    }
+    ctrl->status = 0;
+    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+        status = transport_submit_transfer(transfers[i]);
+        if (status) {
+            fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)status));
+            return status;
+        }
+        ctrl->pending++;
+    }
+    ctrl->reconnects++;
+    ctrl->lost = lost;
+    ctrl->lost_offset = ctrl->transferred;
+    return 0;
+}
+
+// The first data after a reconnect ends the gap
+static void report_recovery(struct transfer_ctrl *ctrl, struct poller *poller, bool is_terminal) {
+    int64_t now = now_usec();
+    int64_t recovery = now - ctrl->lost;
+    if (recovery > ctrl->max_recovery) ctrl->max_recovery = recovery;
+    if (is_terminal) printf("\33[2K\r");
+    printf("Reconnected: recording continues at %.1f MB after a gap of %.1f ms, frame counter restarted\n",
+           ctrl->lost_offset / 1e6, recovery / 1e3);
+    if (poller) fprintf(poller->fp, "%" PRId64 " %" PRIu64 " reconnect -1 %.1f\n", now, ctrl->lost_offset, recovery / 1e3);
+    fprintf(ctrl->sink->gaps, "%" PRId64 " %" PRIu64 " reconnect %.1f\n", now, ctrl->lost_offset, recovery / 1e3);
+    fflush(ctrl->sink->gaps);
+    ctrl->lost = 0;
+}
+
+static int transfer_data(libusb_context *ctx, libusb_device_handle **dev_handle, const struct sink *sink, uint64_t len,
+                         const struct schedule *schedule, struct poller *poller, bool reconnect) {
     int status = 0;
     bool is_terminal = isatty(fileno(stdout));
+    int64_t next_acq = now_usec();
     time_t start, last_time;
     uint64_t last_bytes;
     struct transfer_ctrl ctrl;
@@ -214,10 +1346,26 @@ static int transfer_data(libusb_context *ctx, libusb_device_handle *dev_handle,
     ctrl.len = len;
     ctrl.transferred = 0;
     ctrl.pending = 0;
-    ctrl.fd = fd;
+    ctrl.sink = sink;
     ctrl.status = 0;
     init_statistics(&ctrl.disk);
     init_statistics(&ctrl.usb);
+    init_statistics(&ctrl.usb_idle);
+    init_statistics(&ctrl.usb_polling);
+    init_statistics(&ctrl.band_stats);
+    ctrl.counter = 0;
+    ctrl.end_ns = INT64_MAX;
+    ctrl.write_failed = false;
+    ctrl.poller = poller;
+    ctrl.reconnects = 0;
+    ctrl.lost = 0;
+    ctrl.lost_offset = 0;
+    ctrl.max_recovery = 0;
+    ctrl.abandoned = false;
+    if (poller) {
+        poller->transferred = &ctrl.transferred;
+        poller->counter = &ctrl.counter;
+    }
 
     for (unsigned i = 0; i < QUEUE_SIZE; i++) {
         transfers[i] = libusb_alloc_transfer(NUM_PKG);
@@ -232,51 +1380,90 @@ static int transfer_data(libusb_context *ctx, libusb_device_handle *dev_handle,
             status = 1;
             goto err_alloc;
         }
-        libusb_fill_iso_transfer(transfers[i], dev_handle, ENDPOINT, buffer, XFER_LEN, NUM_PKG, transfer_callback, &ctrl, TIMEOUT_MS);
+        libusb_fill_iso_transfer(transfers[i], *dev_handle, STREAM_ENDPOINT, buffer, XFER_LEN, NUM_PKG, transfer_callback, &ctrl, TIMEOUT_MS);
         libusb_set_iso_packet_lengths(transfers[i], PKG_LEN);
+        // Fault the buffers in now rather than in the first callbacks; locking them is optional
+        memset(buffer, 0, XFER_LEN);
+        mlock(buffer, XFER_LEN);
    }
 
+    int64_t scheduled = schedule->start_realtime_ns;
+    if (scheduled > 0) {
+        char text[32];
+        time_t t = (time_t)(scheduled / 1000000000);
+        struct tm tm;
+        int64_t wait_ns = scheduled - now_ns(CLOCK_REALTIME);
+        strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", gmtime_r(&t, &tm));
+        if (wait_ns < 0) {
+            fprintf(stderr, "Warning: Start time %s.%06" PRId64 " passed %.3f s ago, starting now\n", text,
+                    scheduled % 1000000000 / 1000, -wait_ns / 1e9);
+        } else {
+            printf("Armed, starting at %s.%06" PRId64 " UTC in %.3f s\n", text, scheduled % 1000000000 / 1000, wait_ns / 1e9);
+            fflush(stdout);
+            wait_until(scheduled);
+            if (do_exit) goto err_alloc;
+        }
+    }
+    int64_t start_request_ns = now_ns(CLOCK_REALTIME);
+    if (schedule->duration_ns > 0) ctrl.end_ns = now_ns(CLOCK_MONOTONIC) + schedule->duration_ns;
+
     // send start command 
-    status = libusb_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x00, 0x00, NULL, 0, 1000);
+    status = transport_control_transfer(*dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x00, 0x00, NULL, 0, 1000);
     if (status) {
         fprintf(stderr, "Error: Start command\n%s\n", libusb_strerror((enum libusb_error)status));
         goto err_alloc;
     }
+    int64_t started_ns = now_ns(CLOCK_REALTIME);
 
     // start all transfers
     for (unsigned i = 0; i < QUEUE_SIZE; i++) {
-        status = libusb_submit_transfer(transfers[i]);
+        status = transport_submit_transfer(transfers[i]);
         if (status) {
             fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)status));
             goto err_stop;
         }
         ctrl.pending++;
     }
+    if (scheduled > 0) {
+        int64_t submitted_ns = now_ns(CLOCK_REALTIME);
+        printf("Start latency: request sent %+.1f us, completed %+.1f us, transfers submitted %+.1f us after the scheduled time\n",
+               (start_request_ns - scheduled) / 1e3, (started_ns - scheduled) / 1e3, (submitted_ns - scheduled) / 1e3);
+    }
 
     start = time(NULL);
     last_time = start;
     last_bytes = 0;
-    while (ctrl.transferred < ctrl.len && ctrl.status == 0 && !do_exit) {
-        status = libusb_handle_events_completed(ctx, NULL);
-        if (status) {
-            if (status != LIBUSB_ERROR_INTERRUPTED) {
-                fprintf(stderr, "Handle events: %s\n", libusb_strerror((enum libusb_error)status));
+    for (;;) {
+        while (ctrl.transferred < ctrl.len && ctrl.pending > 0 && ctrl.status == 0 && !do_exit) {
+            status = transport_handle_events_completed(ctx, NULL);
+            if (status) {
+                if (status != LIBUSB_ERROR_INTERRUPTED) {
+                    fprintf(stderr, "Handle events: %s\n", libusb_strerror((enum libusb_error)status));
+                }
+                goto err_stop;
+            }
+            if (poller) service_poller(poller);
+            if (sink->acq) service_acq(sink, &next_acq, poller, ctrl.transferred, is_terminal);
+            if (ctrl.lost && ctrl.transferred > ctrl.lost_offset) report_recovery(&ctrl, poller, is_terminal);
+            time_t now = time(NULL);
+            if (difftime(now, last_time) > 1.0) {
+                double dt = difftime(now, last_time);
+                if (is_terminal) printf("\33[2K\r");
+                // Around a reconnect a second can pass without data
+                printf("Throughput: %f MB/s, %lu MB / %lu MB  USB: min %lu us, max %lu us, avg %lu us  DISK: min %lu us, max %lu us, avg %lu us",
+                       (double)(ctrl.transferred - last_bytes) / dt / (1000*1000), ctrl.transferred / (1000*1000), ctrl.len / (1000*1000),
+                       ctrl.usb.min, ctrl.usb.max, ctrl.usb.num ? ctrl.usb.sum / ctrl.usb.num : 0,
+                       ctrl.disk.min, ctrl.disk.max, ctrl.disk.num ? ctrl.disk.sum / ctrl.disk.num : 0);
+                if (is_terminal) fflush(stdout); else printf("\n");
+                init_statistics(&ctrl.disk);
+                init_statistics(&ctrl.usb);
+                last_time = now;
+                last_bytes = ctrl.transferred;
             }
-            goto err_stop;
-        }
-        time_t now = time(NULL);
-        if (difftime(now, last_time) > 1.0) {
-            double dt = difftime(now, last_time);
-            if (is_terminal) printf("\33[2K\r");
-            printf("Throughput: %f MB/s, %lu MB / %lu MB  USB: min %lu us, max %lu us, avg %lu us  DISK: min %lu us, max %lu us, avg %lu us",
-                   (double)(ctrl.transferred - last_bytes) / dt / (1000*1000), ctrl.transferred / (1000*1000), ctrl.len / (1000*1000),
-                   ctrl.usb.min, ctrl.usb.max, ctrl.usb.sum / ctrl.usb.num, ctrl.disk.min, ctrl.disk.max, ctrl.disk.sum / ctrl.disk.num);
-            if (is_terminal) fflush(stdout); else printf("\n");
-            init_statistics(&ctrl.disk);
-            init_statistics(&ctrl.usb);
-            last_time = now;
-            last_bytes = ctrl.transferred;
         }
+        if (!reconnect || do_exit || ctrl.transferred >= ctrl.len || !device_lost(ctrl.status)) break;
+        status = reconnect_device(ctx, dev_handle, transfers, &ctrl, poller);
+        if (status) goto err_stop;
     }
     time_t now = time(NULL);
     if (is_terminal) printf("\33[2K\r");
@@ -286,20 +1473,32 @@ err_stop:
     printf("\n");
 
     // wait for pending transfers
-    while (ctrl.pending > 0) { 
-        status = libusb_handle_events(ctx);
+    while (!ctrl.abandoned &&
+           (ctrl.pending > 0 || (poller && (poller->pending > 0 || (poller->gain && poller->gain->pending > 0))))) {
+        status = transport_handle_events(ctx);
         if (status)
             fprintf(stderr, "Error: Wait for cancel\n%s\n", libusb_strerror((enum libusb_error)status));
     }
+    if (poller) {
+        if (poller->unwritten) write_poll_results(poller);
+        if (poller->gain) write_gain_changes(poller);
+        print_poll_statistics(&ctrl, poller);
+    }
+    if (ctrl.reconnects > 0) {
+        printf("Reconnects: %u, longest recovery %.1f ms\n", ctrl.reconnects, ctrl.max_recovery / 1e3);
+    }
+    // A device that did not come back is closed already, one whose transfers hang is gone
+    if (*dev_handle == NULL || ctrl.abandoned) goto err_alloc;
 
     // send stop command 
-    status = libusb_control_transfer(dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x01, 0x00, NULL, 0, 1000);
+    status = transport_control_transfer(*dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x00, 0x01, 0x00, NULL, 0, 1000);
     if (status) {
         fprintf(stderr, "Error: Stop command\n%s\n", libusb_strerror((enum libusb_error)status));
     }
 
 err_alloc:
-    for (unsigned i = 0; i < QUEUE_SIZE; i++) {
+    if (ctrl.write_failed && status == 0) status = 1;
+    for (unsigned i = 0; i < QUEUE_SIZE && !ctrl.abandoned; i++) {
         free(transfers[i]->buffer);
         libusb_free_transfer(transfers[i]);
     }
@@ -0,0 +1,332 @@
+/* libusb_example/flexiband_reduce.c
+ *
+ * Reduced-rate and baseband bands, see flexiband_reduce.h. Frames are unpacked in blocks of
+ * BLOCK_FRAMES, so the samples of a band are mixed and filtered while they are still in the
+ * cache.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flexiband_fir.h"
+#include "flexiband_nco.h"
+#include "flexiband_reduce.h"
+
+#define PATH_LEN 4096
+#define BLOCK_FRAMES 64
+#define RING_SLOTS 16
+#define SLOT_LEN (1024 * FRAME_LEN)
+#define MAX_MISSING_FRAMES (1 << 20)   // larger jumps, e.g. a restart of the device, are not filled
+
+struct band_output {
+    unsigned per_frame;          // complex samples, 0 if the band is not in the layout
+    struct nco *nco;             // NULL without mixing
+    struct fir *fir;             // NULL without decimation
+    FILE *fp;
+    int8_t *in;                  // BLOCK_FRAMES frames
+    float *mixed;
+    float *out;
+    int16_t *out16;
+};
+
+const double reduce_carriers[NUM_BANDS] = {1575.42e6, 1227.60e6, 1176.45e6};
+
+struct slot {
+    uint8_t *data;
+    size_t len;
+};
+
+struct reduce {
+    struct reduce_config config;
+    struct band_output bands[NUM_BANDS];
+    unsigned block_frames;       // unpacked into in
+    bool synced;
+    uint32_t counter;            // of the last frame
+    struct reduce_statistics stat;
+    int errors;
+
+    // Background mode. reduce_write() fills the slot at head, the thread processes the ones
+    // from tail up to head.
+    bool background;
+    struct slot slots[RING_SLOTS];
+    unsigned head;
+    unsigned tail;
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static double thread_cpu_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int reduce_baseband_shifts(const struct capture_header *header, const double carrier[NUM_BANDS], double data_rate,
+                           double shift[NUM_BANDS]) {
+    int found = 0;
+    for (int slot = 0; slot < CAPTURE_NUM_SLOTS; slot++) {
+        const struct capture_slot *s = &header->slot[slot];
+        if (!s->present || s->lo == 0) continue;
+        for (int b = 0; b < NUM_BANDS; b++) {
+            unsigned per_frame = unpack_samples_per_frame((enum payload_layout)header->layout, (enum band)b);
+            // Names like "L1/G1" start with the band
+            if (per_frame == 0 || strncmp(s->band, band_names[b], strlen(band_names[b]))) continue;
+            double sample_rate = data_rate / FRAME_LEN * per_frame;
+            shift[b] = ((double)s->lo - carrier[b]) / sample_rate;
+            found++;
+        }
+    }
+    return found;
+}
+
+// in NULL filters zeros
+static void filter(struct reduce *reduce, int b, const int8_t *in, size_t count) {
+    struct band_output *band = &reduce->bands[b];
+    const float *out = band->out;
+    double start = thread_cpu_sec();
+    size_t n;
+    if (band->nco) {
+        nco_mix(band->nco, in, count, band->mixed);
+        if (band->fir) {
+            n = fir_process_float(band->fir, band->mixed, count, band->out);
+        } else {
+            n = count;
+            out = band->mixed;
+        }
+    } else {
+        n = fir_process(band->fir, in, count, band->out);
+    }
+    if (band->out16) {
+        for (size_t i = 0; i < 2 * n; i++) band->out16[i] = (int16_t)lrintf(out[i] * REDUCE_CI16_SCALE);
+    }
+    reduce->stat.filter_sec[b] += thread_cpu_sec() - start;
+    reduce->stat.samples[b] += count;
+    reduce->stat.outputs[b] += n;
+    if (band->fp == NULL) return;
+    if (band->out16 ? fwrite(band->out16, 2 * sizeof(int16_t), n, band->fp) != n
+                    : fwrite(out, 2 * sizeof(float), n, band->fp) != n) {
+        reduce->errors++;
+    }
+}
+
+static void flush_block(struct reduce *reduce) {
+    for (int b = 0; b < NUM_BANDS; b++) {
+        if (reduce->bands[b].per_frame == 0) continue;
+        filter(reduce, b, reduce->bands[b].in, (size_t)reduce->block_frames * reduce->bands[b].per_frame);
+    }
+    reduce->block_frames = 0;
+}
+
+static void fill_missing(struct reduce *reduce, uint32_t frames) {
+    flush_block(reduce);
+    reduce->stat.missing_frames += frames;
+    while (frames > 0) {
+        uint32_t n = frames < BLOCK_FRAMES ? frames : BLOCK_FRAMES;
+        for (int b = 0; b < NUM_BANDS; b++) {
+            if (reduce->bands[b].per_frame) filter(reduce, b, NULL, (size_t)n * reduce->bands[b].per_frame);
+        }
+        frames -= n;
+    }
+}
+
+static void process_frames(struct reduce *reduce, const uint8_t *data, size_t len) {
+    double start = thread_cpu_sec(), filtered = 0;
+    for (int b = 0; b < NUM_BANDS; b++) filtered += reduce->stat.filter_sec[b];
+
+    for (size_t pos = 0; pos + FRAME_LEN <= len; pos += FRAME_LEN) {
+        const uint8_t *frame = data + pos;
+        if (!frame_has_preamble(frame)) continue;
+        uint32_t counter = frame_counter(frame);
+        uint32_t missing = counter - reduce->counter - 1;
+        if (reduce->synced && missing > 0 && missing <= MAX_MISSING_FRAMES) fill_missing(reduce, missing);
+        reduce->synced = true;
+        reduce->counter = counter;
+
+        int8_t *out[NUM_BANDS];
+        for (int b = 0; b < NUM_BANDS; b++) {
+            struct band_output *band = &reduce->bands[b];
+            out[b] = band->per_frame ? band->in + 2 * (size_t)reduce->block_frames * band->per_frame : NULL;
+        }
+        unpack_frame((enum payload_layout)reduce->config.layout, frame, out);
+        if (++reduce->block_frames == BLOCK_FRAMES) flush_block(reduce);
+    }
+
+    for (int b = 0; b < NUM_BANDS; b++) filtered -= reduce->stat.filter_sec[b];
+    reduce->stat.unpack_sec += thread_cpu_sec() - start + filtered;
+}
+
+static void *reduce_thread(void *arg) {
+    struct reduce *reduce = (struct reduce*)arg;
+    for (;;) {
+        pthread_mutex_lock(&reduce->lock);
+        while (reduce->head == reduce->tail && !reduce->stop) pthread_cond_wait(&reduce->cond, &reduce->lock);
+        if (reduce->head == reduce->tail) {
+            pthread_mutex_unlock(&reduce->lock);
+            break;
+        }
+        struct slot *slot = &reduce->slots[reduce->tail % RING_SLOTS];
+        pthread_mutex_unlock(&reduce->lock);
+
+        process_frames(reduce, slot->data, slot->len);
+
+        pthread_mutex_lock(&reduce->lock);
+        reduce->tail++;
+        pthread_mutex_unlock(&reduce->lock);
+    }
+    return NULL;
+}
+
+static void free_reduce(struct reduce *reduce) {
+    for (int b = 0; b < NUM_BANDS; b++) {
+        nco_free(reduce->bands[b].nco);
+        fir_free(reduce->bands[b].fir);
+        if (reduce->bands[b].fp) fclose(reduce->bands[b].fp);
+        free(reduce->bands[b].in);
+        free(reduce->bands[b].mixed);
+        free(reduce->bands[b].out);
+        free(reduce->bands[b].out16);
+    }
+    for (int i = 0; i < RING_SLOTS; i++) free(reduce->slots[i].data);
+    free(reduce);
+}
+
+struct reduce *reduce_create(const char *stem, const struct reduce_config *config, bool background) {
+    if (config->layout >= NUM_LAYOUTS) {
+        fprintf(stderr, "Error: Reduced bands need the layout\n");
+        return NULL;
+    }
+    if (config->decimation == 0 || (config->decimation == 1 && !config->mix)) {
+        fprintf(stderr, "Error: Reduced bands need decimation or mixing\n");
+        return NULL;
+    }
+    struct reduce *reduce = (struct reduce*)calloc(1, sizeof(struct reduce));
+    if (reduce == NULL) {
+        fprintf(stderr, "Error: allocating reduced bands\n");
+        return NULL;
+    }
+    reduce->config = *config;
+    reduce->background = background;
+
+    for (int b = 0; b < NUM_BANDS; b++) {
+        struct band_output *band = &reduce->bands[b];
+        band->per_frame = unpack_samples_per_frame((enum payload_layout)config->layout, (enum band)b);
+        if (band->per_frame == 0) continue;
+        if (config->decimation > 1) {
+            band->fir = fir_create(config->decimation, config->taps, config->bandwidth);
+            if (band->fir == NULL) {
+                fprintf(stderr, "Error: Invalid filter, decimation %u, %u taps, bandwidth %g\n", config->decimation,
+                        config->taps, config->bandwidth);
+                goto err;
+            }
+        }
+        size_t samples = (size_t)BLOCK_FRAMES * band->per_frame;
+        size_t outputs = band->fir ? samples / config->decimation + 1 : samples;
+        band->in = (int8_t*)malloc(2 * samples);
+        band->out = (float*)malloc(2 * outputs * sizeof(float));
+        if (band->in == NULL || band->out == NULL) goto err_alloc;
+        if (config->mix) {
+            band->nco = nco_create(config->shift[b]);
+            band->mixed = (float*)malloc(2 * samples * sizeof(float));
+            if (band->nco == NULL || band->mixed == NULL) goto err_alloc;
+        }
+        if (config->format == REDUCE_CI16) {
+            band->out16 = (int16_t*)malloc(2 * outputs * sizeof(int16_t));
+            if (band->out16 == NULL) goto err_alloc;
+        }
+        if (stem == NULL) continue;
+        char path[PATH_LEN];
+        snprintf(path, sizeof(path), "%s.%s.%s", stem, band_names[b], config->format == REDUCE_CI16 ? "ci16" : "cf32");
+        band->fp = fopen(path, "wb");
+        if (band->fp == NULL) {
+            fprintf(stderr, "Failed to open %s\n%s\n", path, strerror(errno));
+            goto err;
+        }
+    }
+
+    if (!background) return reduce;
+    for (int i = 0; i < RING_SLOTS; i++) {
+        reduce->slots[i].data = (uint8_t*)malloc(SLOT_LEN);
+        if (reduce->slots[i].data == NULL) {
+            fprintf(stderr, "Error: allocating reduced bands\n");
+            goto err;
+        }
+    }
+    pthread_mutex_init(&reduce->lock, NULL);
+    pthread_cond_init(&reduce->cond, NULL);
+    if (pthread_create(&reduce->thread, NULL, reduce_thread, reduce)) {
+        fprintf(stderr, "Error: Start reduced bands thread\n");
+        pthread_cond_destroy(&reduce->cond);
+        pthread_mutex_destroy(&reduce->lock);
+        goto err;
+    }
+    return reduce;
+
+err_alloc:
+    fprintf(stderr, "Error: allocating reduced bands\n");
+err:
+    free_reduce(reduce);
+    return NULL;
+}
+
+int reduce_write(struct reduce *reduce, const void *data, size_t len) {
+    if (!reduce->background) {
+        process_frames(reduce, (const uint8_t*)data, len);
+        return reduce->errors ? -1 : 0;
+    }
+
+    const uint8_t *p = (const uint8_t*)data;
+    while (len > 0) {
+        size_t n = len < SLOT_LEN ? len : SLOT_LEN;
+        pthread_mutex_lock(&reduce->lock);
+        unsigned free_slots = RING_SLOTS - (reduce->head - reduce->tail);
+        pthread_mutex_unlock(&reduce->lock);
+        struct slot *slot = &reduce->slots[reduce->head % RING_SLOTS];
+        if (slot->len + n > SLOT_LEN) {
+            // The current slot is full, hand it over if there is another one
+            if (free_slots < 2) {
+                reduce->stat.dropped_bytes += len;
+                break;
+            }
+            pthread_mutex_lock(&reduce->lock);
+            reduce->head++;
+            pthread_cond_signal(&reduce->cond);
+            pthread_mutex_unlock(&reduce->lock);
+            slot = &reduce->slots[reduce->head % RING_SLOTS];
+            slot->len = 0;
+        }
+        memcpy(slot->data + slot->len, p, n);
+        slot->len += n;
+        p += n;
+        len -= n;
+    }
+    return reduce->errors ? -1 : 0;
+}
+
+int reduce_close(struct reduce *reduce, struct reduce_statistics *stat) {
+    if (reduce->background) {
+        pthread_mutex_lock(&reduce->lock);
+        if (reduce->slots[reduce->head % RING_SLOTS].len > 0) reduce->head++;
+        reduce->stop = true;
+        pthread_cond_signal(&reduce->cond);
+        pthread_mutex_unlock(&reduce->lock);
+        pthread_join(reduce->thread, NULL);
+        pthread_cond_destroy(&reduce->cond);
+        pthread_mutex_destroy(&reduce->lock);
+    }
+    flush_block(reduce);
+    for (int b = 0; b < NUM_BANDS; b++) {
+        if (reduce->bands[b].fp && fclose(reduce->bands[b].fp)) reduce->errors++;
+        reduce->bands[b].fp = NULL;
+    }
+    int status = reduce->errors ? -1 : 0;
+    if (stat) *stat = reduce->stat;
+    free_reduce(reduce);
+    return status;
+}
@@ -0,0 +1,70 @@
+/* libusb_example/flexiband_reduce.h
+ *
+ * Reduced-rate and baseband bands: the frame stream is unpacked, every band optionally shifted
+ * in frequency (see flexiband_nco.h), e.g. from its IF to baseband, then low-pass filtered and
+ * decimated (see flexiband_fir.h) into <stem>.<band>.cf32 or .ci16, interleaved I and Q as
+ * float or as int16 scaled by REDUCE_CI16_SCALE. Frames missing from the stream, by a jump of
+ * the counter, are filled with zeros so the outputs stay evenly sampled.
+ *
+ * In the background mode used by flexiband_record -D, reduce_write() only copies into a ring
+ * of slots that a thread filters; writes that do not fit are dropped and show up as missing
+ * frames. Otherwise reduce_write() filters in the caller.
+ */
+
+#ifndef FLEXIBAND_REDUCE_H
+#define FLEXIBAND_REDUCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flexiband_capture.h"
+#include "flexiband_frame.h"
+#include "flexiband_unpack.h"
+
+#define REDUCE_CI16_SCALE 1024    // a 4 bit full scale sample mixed to baseband stays below 2^14
+
+enum reduce_format { REDUCE_CF32, REDUCE_CI16 };
+
+// GPS L1, L2 and L5 carriers, the default centre of the baseband
+extern const double reduce_carriers[NUM_BANDS];
+
+struct reduce_config {
+    uint32_t layout;              // enum payload_layout
+    unsigned decimation;          // 1 for no filter
+    unsigned taps;
+    double bandwidth;             // passband edge, fraction of the output Nyquist frequency
+    enum reduce_format format;
+    bool mix;
+    double shift[NUM_BANDS];      // added frequency in cycles per sample, if mix is set
+};
+
+struct reduce_statistics {
+    uint64_t samples[NUM_BANDS];  // complex input samples, including the zeros of missing frames
+    uint64_t outputs[NUM_BANDS];
+    double filter_sec[NUM_BANDS]; // CPU time of mixing, filtering and conversion
+    double unpack_sec;
+    uint64_t missing_frames;
+    uint64_t dropped_bytes;       // background thread behind
+};
+
+struct reduce;
+
+// Shifts that move carrier[band] from where the LO of the RF board in header puts it to 0 Hz,
+// for a stream of data_rate bytes per second. The boards are matched to the bands by name.
+// Returns the number of bands set; the others are left alone.
+int reduce_baseband_shifts(const struct capture_header *header, const double carrier[NUM_BANDS], double data_rate,
+                           double shift[NUM_BANDS]);
+
+// stem NULL filters without writing, for benchmarks. Returns NULL and prints the error on
+// failure.
+struct reduce *reduce_create(const char *stem, const struct reduce_config *config, bool background);
+
+// data holds whole frames. Returns 0 or -1 if writing an output failed.
+int reduce_write(struct reduce *reduce, const void *data, size_t len);
+
+// Filters what is queued, closes the outputs and frees reduce. stat may be NULL. Returns 0 or
+// -1 if writing an output failed.
+int reduce_close(struct reduce *reduce, struct reduce_statistics *stat);
+
+#endif
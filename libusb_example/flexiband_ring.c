@@ -0,0 +1,422 @@
+/* libusb_example/flexiband_ring.c
+ *
+ * Ring buffer of flexiband_record -R, see flexiband_ring.h. ring_write() runs in the transfer
+ * callback: it copies into the ring, stamps the time every TIME_STEP bytes and feeds the power
+ * trigger. Everything else runs on the dump thread, which copies the ring in chunks and checks
+ * after every copy that the chunk was not overwritten meanwhile.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "flexiband_io.h"
+#include "flexiband_ring.h"
+#include "flexiband_segment.h"
+#include "flexiband_unpack.h"
+
+#define HUGE_PAGE (2 * 1024 * 1024)
+#define TIME_STEP (64 * 1024)          // bytes between two time stamps
+#define CHUNK_LEN (4 * 1024 * 1024)    // copied from the ring at once
+#define POLL_MS 10
+
+struct ring_time {
+    uint64_t pos;                      // stream position of a write starting in the step
+    int64_t monotonic_ns;
+};
+
+struct dump {
+    bool active;
+    int fd;                            // raw dumps
+    struct capture_writer *capture;    // container dumps
+    uint64_t start;
+    uint64_t pos;                      // next stream position to write
+    int64_t end_ns;                    // end of the post-trigger window
+    char path[4096];
+};
+
+struct ring {
+    uint8_t *buffer;
+    uint64_t size;
+    struct ring_time *times;           // TIME_STEP k of the stream at k % num_times
+    uint64_t num_times;
+    uint64_t written;                  // stream position, stored after the data, atomic
+    int64_t last_ns;                   // time of the last write, atomic
+    volatile sig_atomic_t requested;   // by ring_trigger()
+    struct trigger *power;             // updated by the transfer callback, NULL without
+
+    char filename[4096];
+    bool container;
+    struct capture_header header;
+    struct ring_config config;
+    int sock;
+
+    // Dump thread only
+    pthread_t thread;
+    int stop;                          // atomic
+    int errors;
+    bool power_open;                   // a power window is open
+    FILE *events;                      // <filename>.events
+    uint8_t *chunk;
+    struct dump dump;
+    struct ring_statistics stat;
+};
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t frame_align_up(uint64_t pos) {
+    return (pos + FRAME_LEN - 1) / FRAME_LEN * FRAME_LEN;
+}
+
+// Oldest position that is safe to copy, leaving the writer an eighth of the ring
+static uint64_t oldest_pos(const struct ring *ring, uint64_t written) {
+    return written > ring->size - ring->size / 8 ? frame_align_up(written - ring->size + ring->size / 8) : 0;
+}
+
+static void ring_copy(const struct ring *ring, uint8_t *out, uint64_t pos, uint64_t len) {
+    uint64_t offset = pos % ring->size;
+    uint64_t first = len < ring->size - offset ? len : ring->size - offset;
+    memcpy(out, ring->buffer + offset, first);
+    memcpy(out + first, ring->buffer, len - first);
+}
+
+static int64_t time_at(const struct ring *ring, uint64_t pos) {
+    return ring->times[pos / TIME_STEP % ring->num_times].monotonic_ns;
+}
+
+// First stamped position in [oldest, written) at or after monotonic_ns, written if none
+static uint64_t position_at(const struct ring *ring, int64_t monotonic_ns, uint64_t oldest, uint64_t written) {
+    if (written == 0) return 0;
+    uint64_t lo = (oldest + TIME_STEP - 1) / TIME_STEP, hi = (written - 1) / TIME_STEP + 1;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (ring->times[mid % ring->num_times].monotonic_ns < monotonic_ns) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo > (written - 1) / TIME_STEP) return written;
+    uint64_t pos = ring->times[lo % ring->num_times].pos;
+    return pos > oldest ? pos : oldest;
+}
+
+int ring_write(struct ring *ring, const void *data, size_t len, int64_t monotonic_ns) {
+    uint64_t pos = ring->written;
+    uint64_t offset = pos % ring->size;
+    size_t first = len < ring->size - offset ? len : ring->size - offset;
+    struct ring_time *t = &ring->times[pos / TIME_STEP % ring->num_times];
+    if (pos == 0 || t->pos / TIME_STEP != pos / TIME_STEP) {
+        t->pos = pos;
+        t->monotonic_ns = monotonic_ns;
+    }
+    memcpy(ring->buffer + offset, data, first);
+    memcpy(ring->buffer, (const uint8_t*)data + first, len - first);
+    if (ring->power) trigger_update(ring->power, (const uint8_t*)data, len, pos, monotonic_ns);
+    __atomic_store_n(&ring->last_ns, monotonic_ns, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->written, pos + len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void ring_trigger(struct ring *ring) {
+    ring->requested = 1;
+}
+
+// Appends "<UTC time> <stream offset> <text>" to the event log
+static void log_event(struct ring *ring, int64_t monotonic_ns, uint64_t pos, const char *format, ...) {
+    char text[32];
+    va_list args;
+    int64_t realtime_ns = ring->header.start_realtime_ns + (monotonic_ns - ring->header.start_monotonic_ns);
+    time_t t = (time_t)(realtime_ns / 1000000000);
+    struct tm tm;
+    if (ring->events == NULL) return;
+    strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", gmtime_r(&t, &tm));
+    fprintf(ring->events, "%s.%06" PRId64 " %" PRIu64 " ", text, realtime_ns % 1000000000 / 1000, pos);
+    va_start(args, format);
+    vfprintf(ring->events, format, args);
+    va_end(args);
+    fputc('\n', ring->events);
+    fflush(ring->events);
+}
+
+static int open_dump(struct ring *ring, int64_t trigger_ns) {
+    struct dump *dump = &ring->dump;
+    uint8_t frame[FRAME_HEADER_LEN];
+    uint64_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+    uint64_t oldest = oldest_pos(ring, written);
+    uint64_t start = frame_align_up(position_at(ring, trigger_ns - ring->config.pre_ns, oldest, written));
+    if (start + FRAME_HEADER_LEN > written) start = frame_align_up(written);
+
+    // Named after the first frame if it is already in the ring, else after the trigger
+    uint32_t counter = 0;
+    int64_t start_ns = trigger_ns;
+    if (start + FRAME_HEADER_LEN <= written) {
+        ring_copy(ring, frame, start, sizeof(frame));
+        if (frame_has_preamble(frame)) counter = frame_counter(frame);
+        start_ns = time_at(ring, start);
+    }
+    int64_t realtime_ns = ring->header.start_realtime_ns + (start_ns - ring->header.start_monotonic_ns);
+    segment_path(ring->filename, realtime_ns, counter, dump->path, sizeof(dump->path));
+
+    dump->fd = -1;
+    dump->capture = NULL;
+    if (ring->container) {
+        struct capture_header header = ring->header;
+        header.start_realtime_ns = realtime_ns;
+        header.start_monotonic_ns = start_ns;
+        header.segment = ring->stat.dumps + 1;
+        header.segment_offset = start;
+        dump->capture = capture_create(dump->path, &header);
+        if (dump->capture == NULL) return -1;
+    } else {
+        dump->fd = open(dump->path, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (dump->fd < 0) {
+            fprintf(stderr, "Failed to open %s\n%s\n", dump->path, strerror(errno));
+            return -1;
+        }
+    }
+    dump->active = true;
+    dump->start = start;
+    dump->pos = start;
+    dump->end_ns = trigger_ns;
+    return 0;
+}
+
+static void close_dump(struct ring *ring) {
+    struct dump *dump = &ring->dump;
+    int status = 0;
+    if (dump->capture && capture_close(dump->capture)) status = -1;
+    if (dump->fd >= 0 && close(dump->fd)) status = -1;
+    if (status) {
+        fprintf(stderr, "Error: Close %s\n%s\n", dump->path, strerror(errno));
+        ring->errors++;
+    }
+    dump->active = false;
+    ring->stat.dumps++;
+    printf("Dumped %.1f MB to %s\n", (dump->pos - dump->start) / 1e6, dump->path);
+    if (dump->pos > dump->start) {
+        log_event(ring, time_at(ring, dump->pos - 1), dump->pos, "dump %s %" PRIu64, dump->path, dump->pos - dump->start);
+    }
+}
+
+static void trigger(struct ring *ring, int64_t trigger_ns, const char *source) {
+    ring->stat.triggers++;
+    if (!ring->dump.active && open_dump(ring, trigger_ns)) {
+        ring->errors++;
+        return;
+    }
+    if (trigger_ns + ring->config.post_ns > ring->dump.end_ns) ring->dump.end_ns = trigger_ns + ring->config.post_ns;
+    printf("Trigger by %s, dumping to %s\n", source, ring->dump.path);
+}
+
+static void power_event(struct ring *ring, const struct trigger_event *event) {
+    const char *band = band_names[ring->config.power.band];
+    if (event->type == TRIGGER_OPEN) {
+        log_event(ring, event->monotonic_ns, event->pos, "open %s %.1f %" PRIu32, band, event->level_db, event->counter);
+        ring->stat.power_windows++;
+        ring->power_open = true;
+        trigger(ring, event->monotonic_ns, "power");
+    } else {
+        log_event(ring, event->monotonic_ns, event->pos, "close %s %.1f %" PRIu32, band, event->level_db, event->counter);
+        ring->power_open = false;
+        int64_t end_ns = event->monotonic_ns + ring->config.post_ns;
+        if (ring->dump.active && end_ns > ring->dump.end_ns) ring->dump.end_ns = end_ns;
+    }
+}
+
+// Writes what arrived of the window. With finish, the dump ends with the data received so far.
+static void write_dump(struct ring *ring, bool finish) {
+    struct dump *dump = &ring->dump;
+    for (;;) {
+        uint64_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+        int64_t last_ns = __atomic_load_n(&ring->last_ns, __ATOMIC_ACQUIRE);
+        uint64_t end = written;
+        bool complete = finish;
+        if (last_ns > dump->end_ns) {
+            end = position_at(ring, dump->end_ns + 1, dump->pos, written) / FRAME_LEN * FRAME_LEN;
+            complete = true;
+        }
+        if (dump->pos >= end) {
+            if (complete) close_dump(ring);
+            return;
+        }
+
+        uint64_t len = end - dump->pos < CHUNK_LEN ? end - dump->pos : CHUNK_LEN;
+        ring_copy(ring, ring->chunk, dump->pos, len);
+        uint64_t oldest = oldest_pos(ring, __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE));
+        if (oldest > dump->pos) {
+            fprintf(stderr, "Warning: Dump fell behind, lost %.1f MB\n", (oldest - dump->pos) / 1e6);
+            ring->stat.lost_bytes += oldest - dump->pos;
+            dump->pos = oldest;
+            continue;
+        }
+        int status = dump->capture ? capture_write(dump->capture, ring->chunk, len, time_at(ring, dump->pos))
+                                   : write_all(dump->fd, ring->chunk, len);
+        if (status) {
+            fprintf(stderr, "Error: Write %s\n%s\n", dump->path, strerror(errno));
+            ring->errors++;
+            close_dump(ring);
+            return;
+        }
+        dump->pos += len;
+        ring->stat.dumped_bytes += len;
+    }
+}
+
+static void *dump_thread(void *arg) {
+    struct ring *ring = (struct ring*)arg;
+    char command[64];
+    while (!__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = {ring->sock, POLLIN, 0};
+        poll(&pfd, ring->sock >= 0 ? 1 : 0, POLL_MS);
+        if (pfd.revents & POLLIN) {
+            ssize_t len = recv(ring->sock, command, sizeof(command), MSG_DONTWAIT);
+            if (len >= 7 && memcmp(command, "TRIGGER", 7) == 0) {
+                int64_t t = now_ns();
+                log_event(ring, t, __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE), "trigger socket");
+                trigger(ring, t, "socket");
+            }
+        }
+        if (ring->requested) {
+            int64_t t = now_ns();
+            ring->requested = 0;
+            log_event(ring, t, __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE), "trigger signal");
+            trigger(ring, t, "signal");
+        }
+        struct trigger_event event;
+        while (ring->power && trigger_next_event(ring->power, &event)) power_event(ring, &event);
+        if (ring->power_open && ring->dump.active) {
+            // Everything received while the window is open, and the post-trigger window after it
+            int64_t end_ns = __atomic_load_n(&ring->last_ns, __ATOMIC_ACQUIRE) + ring->config.post_ns;
+            if (end_ns > ring->dump.end_ns) ring->dump.end_ns = end_ns;
+        }
+        if (ring->dump.active) write_dump(ring, false);
+    }
+    if (ring->dump.active) write_dump(ring, true);
+    return NULL;
+}
+
+static int open_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "Error: Bind %s\n%s\n", path, strerror(errno));
+        if (sock >= 0) close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+struct ring *ring_create(const char *filename, const struct capture_header *header, const struct ring_config *config) {
+    struct ring *ring = (struct ring*)calloc(1, sizeof(struct ring));
+    if (ring == NULL) {
+        fprintf(stderr, "Error: allocating ring\n");
+        return NULL;
+    }
+    ring->sock = -1;
+    ring->config = *config;
+    ring->container = header != NULL;
+    if (header) ring->header = *header;
+    else capture_init_header(&ring->header);
+    snprintf(ring->filename, sizeof(ring->filename), "%s", filename);
+    if (config->power.band >= 0) {
+        ring->power = trigger_create(&config->power);
+        if (ring->power == NULL) goto err_free;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.events", filename);
+    ring->events = fopen(path, "w");
+    if (ring->events == NULL) {
+        fprintf(stderr, "Failed to open %s\n%s\n", path, strerror(errno));
+        goto err_trigger;
+    }
+
+    // Huge pages save TLB misses when copying, the ring is faulted in before the recording
+    ring->size = (config->ring_bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    if (ring->size < 2 * CHUNK_LEN) ring->size = 2 * CHUNK_LEN;
+    ring->buffer = MAP_FAILED;
+    if (config->hugepages) {
+        ring->buffer = (uint8_t*)mmap(NULL, ring->size, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (ring->buffer == MAP_FAILED) printf("Warning: No huge pages reserved, using transparent huge pages\n");
+    }
+    if (ring->buffer == MAP_FAILED) {
+        ring->buffer = (uint8_t*)mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring->buffer == MAP_FAILED) {
+            fprintf(stderr, "Error: Allocate %.1f MB ring\n%s\n", ring->size / 1e6, strerror(errno));
+            goto err_events;
+        }
+        if (config->hugepages) madvise(ring->buffer, ring->size, MADV_HUGEPAGE);
+        memset(ring->buffer, 0, ring->size);
+    }
+
+    ring->num_times = ring->size / TIME_STEP + 1;
+    ring->times = (struct ring_time*)calloc(ring->num_times, sizeof(struct ring_time));
+    ring->chunk = (uint8_t*)malloc(CHUNK_LEN);
+    if (ring->times == NULL || ring->chunk == NULL) {
+        fprintf(stderr, "Error: allocating ring\n");
+        goto err_unmap;
+    }
+    if (config->socket_path) {
+        ring->sock = open_socket(config->socket_path);
+        if (ring->sock < 0) goto err_unmap;
+    }
+    if (pthread_create(&ring->thread, NULL, dump_thread, ring)) {
+        fprintf(stderr, "Error: Start dump thread\n");
+        goto err_sock;
+    }
+    return ring;
+
+err_sock:
+    if (ring->sock >= 0) {
+        close(ring->sock);
+        unlink(config->socket_path);
+    }
+err_unmap:
+    free(ring->times);
+    free(ring->chunk);
+    munmap(ring->buffer, ring->size);
+err_events:
+    fclose(ring->events);
+err_trigger:
+    trigger_free(ring->power);
+err_free:
+    free(ring);
+    return NULL;
+}
+
+int ring_close(struct ring *ring, struct ring_statistics *stat) {
+    __atomic_store_n(&ring->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(ring->thread, NULL);
+    if (ring->sock >= 0) {
+        close(ring->sock);
+        unlink(ring->config.socket_path);
+    }
+    if (stat) *stat = ring->stat;
+    int status = ring->errors ? -1 : 0;
+    if (fclose(ring->events)) status = -1;
+    trigger_free(ring->power);
+    free(ring->times);
+    free(ring->chunk);
+    munmap(ring->buffer, ring->size);
+    free(ring);
+    return status;
+}
@@ -0,0 +1,62 @@
+/* libusb_example/flexiband_ring.h
+ *
+ * Pre-trigger capture, flexiband_record -R. The frame stream goes into a fixed ring buffer
+ * in RAM instead of a file. A trigger dumps the pre-trigger window still in the ring plus the
+ * post-trigger window to <stem>-<UTC time>-<counter><ext>, named like segments (see
+ * flexiband_segment.h), while the ring keeps filling. A trigger during a dump extends it.
+ *
+ * Triggers are SIGUSR1 (via ring_trigger()), "TRIGGER" datagrams on a unix socket and the
+ * power trigger of flexiband_trigger.h. A power window keeps the dump going while it is open
+ * and for the post-trigger window after it closed. Dumps are written by a background thread;
+ * the transfer callback only copies into the ring and updates the power trigger.
+ *
+ * Triggers, power windows and dumps are logged to <filename>.events, one line each:
+ * "<UTC time> <stream offset> <event> ...". A dump is logged when it is complete, at its end.
+ */
+
+#ifndef FLEXIBAND_RING_H
+#define FLEXIBAND_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flexiband_capture.h"
+#include "flexiband_trigger.h"
+
+struct ring_config {
+    uint64_t ring_bytes;       // Rounded up to whole huge pages
+    int64_t pre_ns;            // Window before the trigger, limited by what the ring holds
+    int64_t post_ns;           // Window after the last trigger
+    bool hugepages;            // Try MAP_HUGETLB, else transparent huge pages
+    const char *socket_path;   // NULL for no socket
+    struct trigger_config power;   // band -1 for no power trigger
+};
+
+struct ring_statistics {
+    uint64_t triggers;
+    uint64_t power_windows;
+    uint64_t dumps;
+    uint64_t dumped_bytes;
+    uint64_t lost_bytes;       // Overwritten before they were dumped
+};
+
+struct ring;
+
+// Allocates and faults in the ring and starts the dump thread. header is NULL for raw dumps,
+// else every dump is a capture container with a copy of it. Returns NULL and prints the
+// error on failure.
+struct ring *ring_create(const char *filename, const struct capture_header *header, const struct ring_config *config);
+
+// Copies received data into the ring. monotonic_ns is the completion time of the transfer
+// the data belongs to. Always returns 0.
+int ring_write(struct ring *ring, const void *data, size_t len, int64_t monotonic_ns);
+
+// Requests a trigger now. Async-signal-safe.
+void ring_trigger(struct ring *ring);
+
+// Finishes a running dump with the data received so far and frees the ring. stat may be
+// NULL. Returns 0 or -1 if a dump failed.
+int ring_close(struct ring *ring, struct ring_statistics *stat);
+
+#endif
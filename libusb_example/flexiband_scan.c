@@ -0,0 +1,500 @@
+/* libusb_example/flexiband_scan.c
+ *
+ * Integrity check of recordings: every frame has to start with the preamble and continue the
+ * counter of the frame before it. The data is split into chunks that are scanned in parallel;
+ * every chunk synchronizes on the first preamble confirmed by a second one a frame later.
+ * The chunk results are merged into a report of
+ *
+ *   gaps     frames missing in the counter sequence
+ *   resets   restarts of the device marked in the index (flexiband_record -r) and other jumps
+ *            of the counter by more than MAX_FILL frames; they are neither counted as missing
+ *            frames nor filled
+ *   desyncs  bytes that belong to no frame, like torn frames at transfer boundaries
+ *
+ * With -r the frames are written realigned to a new file; frames missing in a gap are
+ * replaced by gap markers (see flexiband_frame.h) so the sample timing is kept.
+ */
+
+#define _GNU_SOURCE  // O_DIRECT
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "flexiband_reader.h"
+
+#define CHUNK_FRAMES (64 * 1024)     // 64 MiB
+#define WRITE_LEN    (4 * 1024 * 1024)
+#define DIRECT_ALIGN 4096
+#define MAX_FILL     (64 * 1024)     // larger gaps are counter resets, not filled
+
+enum event_type { EVENT_GAP, EVENT_DESYNC };
+
+struct event {
+    enum event_type type;
+    uint64_t offset;       // gap: frame after the gap, desync: first byte
+    uint64_t len;          // desync: bytes
+    uint32_t expected;     // gap: counter expected at offset
+    uint32_t counter;      // gap: counter found at offset
+};
+
+struct chunk_result {
+    int64_t head;          // offset of the first frame, -1 if the chunk has none
+    uint64_t tail;         // end of the last frame or desync
+    uint32_t first_counter;
+    uint32_t last_counter;
+    uint64_t frames;
+    struct event *events;
+    size_t num_events;
+    size_t cap_events;
+};
+
+struct scan {
+    const uint8_t *data;
+    uint64_t data_len;
+    uint64_t chunk_frames;
+    struct chunk_result *chunks;
+};
+
+static bool add_event(struct event **events, size_t *num, size_t *cap, const struct event *event) {
+    if (*num == *cap) {
+        size_t new_cap = *cap ? 2 * *cap : 64;
+        struct event *p = (struct event*)realloc(*events, new_cap * sizeof(struct event));
+        if (p == NULL) return false;
+        *events = p;
+        *cap = new_cap;
+    }
+    (*events)[(*num)++] = *event;
+    return true;
+}
+
+static inline bool has_preamble(const struct scan *scan, uint64_t pos) {
+    return pos + FRAME_HEADER_LEN <= scan->data_len && frame_has_preamble(scan->data + pos);
+}
+
+// First position in [pos, end) with a preamble that is followed by another one a frame
+// later, or by the end of the data. end if there is none.
+static uint64_t resync(const struct scan *scan, uint64_t pos, uint64_t end) {
+    const uint8_t *d = scan->data;
+    if (end + 1 > scan->data_len) end = scan->data_len > 0 ? scan->data_len - 1 : 0;
+    while (pos < end) {
+        uint64_t candidate = end;
+#ifdef __SSE2__
+        // 16 candidates per step: 0x55 at i and 0xAA at i + 1
+        const __m128i p0 = _mm_set1_epi8(FRAME_PREAMBLE_0), p1 = _mm_set1_epi8((char)FRAME_PREAMBLE_1);
+        for (; pos + 17 <= end + 1; pos += 16) {
+            __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(d + pos)), p0);
+            __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(d + pos + 1)), p1);
+            int mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+            if (mask) {
+                candidate = pos + __builtin_ctz(mask);
+                break;
+            }
+        }
+#endif
+        if (candidate == end) {
+            for (; pos < end; pos++) {
+                if (d[pos] == FRAME_PREAMBLE_0 && d[pos + 1] == FRAME_PREAMBLE_1) {
+                    candidate = pos;
+                    break;
+                }
+            }
+        }
+        if (candidate >= end) return end;
+        if (candidate + FRAME_LEN + FRAME_HEADER_LEN > scan->data_len || has_preamble(scan, candidate + FRAME_LEN)) {
+            return candidate;
+        }
+        pos = candidate + 1;
+    }
+    return end;
+}
+
+static int scan_chunk(const uint8_t *frames, uint64_t first, uint64_t count, void *user_data) {
+    struct scan *scan = (struct scan*)user_data;
+    struct chunk_result *r = &scan->chunks[first / scan->chunk_frames];
+    uint64_t start = first * FRAME_LEN;
+    uint64_t end = (first + count) * FRAME_LEN;
+    if (end + FRAME_LEN > scan->data_len) end = scan->data_len;  // the last chunk takes a torn rest
+    struct event event;
+    bool synced = false;
+
+    r->head = -1;
+    uint64_t pos = resync(scan, start, end);
+    while (pos < end) {
+        if (pos + FRAME_LEN > scan->data_len) {
+            // Torn frame at the end of the file
+            memset(&event, 0, sizeof(event));
+            event.type = EVENT_DESYNC;
+            event.offset = pos;
+            event.len = scan->data_len - pos;
+            if (!add_event(&r->events, &r->num_events, &r->cap_events, &event)) return -1;
+            pos = scan->data_len;
+            break;
+        }
+        if (!has_preamble(scan, pos)) {
+            uint64_t next = resync(scan, pos + 1, end);
+            memset(&event, 0, sizeof(event));
+            event.type = EVENT_DESYNC;
+            event.offset = pos;
+            event.len = next - pos;
+            if (!add_event(&r->events, &r->num_events, &r->cap_events, &event)) return -1;
+            pos = next;
+            continue;
+        }
+        if (pos + FRAME_LEN + FRAME_HEADER_LEN <= scan->data_len && !has_preamble(scan, pos + FRAME_LEN)) {
+            // A torn frame has its header, but the next frame starts within it
+            uint64_t next = resync(scan, pos + 1, pos + FRAME_LEN);
+            if (next < pos + FRAME_LEN) {
+                memset(&event, 0, sizeof(event));
+                event.type = EVENT_DESYNC;
+                event.offset = pos;
+                event.len = next - pos;
+                if (!add_event(&r->events, &r->num_events, &r->cap_events, &event)) return -1;
+                pos = next;
+                continue;
+            }
+        }
+        uint32_t counter = frame_counter(scan->data + pos);
+        if (!synced) {
+            r->head = pos;
+            r->first_counter = counter;
+            synced = true;
+        } else if (counter != r->last_counter + 1) {
+            memset(&event, 0, sizeof(event));
+            event.type = EVENT_GAP;
+            event.offset = pos;
+            event.expected = r->last_counter + 1;
+            event.counter = counter;
+            if (!add_event(&r->events, &r->num_events, &r->cap_events, &event)) return -1;
+        }
+        r->last_counter = counter;
+        r->frames++;
+        pos += FRAME_LEN;
+    }
+    r->tail = pos > end ? pos : end;
+    if (r->head < 0) r->tail = end;
+    return 0;
+}
+
+// Joins the chunks: checks the counter across chunk borders, adds the bytes between the end
+// of one chunk and the first frame of the next as desync and coalesces adjacent desyncs.
+static bool merge_chunks(const struct scan *scan, size_t num_chunks, struct event **events, size_t *num) {
+    size_t cap = 0;
+    uint64_t tail = 0;
+    bool synced = false;
+    uint32_t last_counter = 0;
+    struct event event;
+
+    *events = NULL;
+    *num = 0;
+    for (size_t c = 0; c < num_chunks; c++) {
+        const struct chunk_result *r = &scan->chunks[c];
+        if (r->head >= 0) {
+            if ((uint64_t)r->head > tail) {
+                memset(&event, 0, sizeof(event));
+                event.type = EVENT_DESYNC;
+                event.offset = tail;
+                event.len = r->head - tail;
+                if (!add_event(events, num, &cap, &event)) return false;
+            }
+            if (synced && r->first_counter != last_counter + 1) {
+                memset(&event, 0, sizeof(event));
+                event.type = EVENT_GAP;
+                event.offset = r->head;
+                event.expected = last_counter + 1;
+                event.counter = r->first_counter;
+                if (!add_event(events, num, &cap, &event)) return false;
+            }
+            synced = true;
+            last_counter = r->last_counter;
+        }
+        for (size_t i = 0; i < r->num_events; i++) {
+            if (!add_event(events, num, &cap, &r->events[i])) return false;
+        }
+        if (r->head >= 0 || r->num_events > 0) tail = r->tail;
+    }
+    if (tail < scan->data_len) {
+        memset(&event, 0, sizeof(event));
+        event.type = EVENT_DESYNC;
+        event.offset = tail;
+        event.len = scan->data_len - tail;
+        if (!add_event(events, num, &cap, &event)) return false;
+    }
+
+    // Coalesce desyncs that touch each other, e.g. across chunk borders
+    size_t out = 0;
+    for (size_t i = 0; i < *num; i++) {
+        struct event *e = &(*events)[i];
+        if (out > 0) {
+            struct event *prev = &(*events)[out - 1];
+            if (e->type == EVENT_DESYNC && prev->type == EVENT_DESYNC && prev->offset + prev->len == e->offset) {
+                prev->len += e->len;
+                continue;
+            }
+        }
+        (*events)[out++] = *e;
+    }
+    *num = out;
+    return true;
+}
+
+// Host time of a byte offset from the index, -1 without index
+static double offset_seconds(const struct capture_reader *reader, uint64_t offset) {
+    double seconds = -1;
+    for (size_t i = 0; i < reader->num_index; i++) {
+        if (reader->index[i].offset > reader->header.header_len + offset) break;
+        seconds = (reader->index[i].monotonic_ns - reader->header.start_monotonic_ns) / 1e9;
+    }
+    return seconds;
+}
+
+// The index marks the first frame after every restart of the device
+static bool is_restart(const struct capture_reader *reader, uint64_t offset) {
+    size_t a = 0, b = reader->num_index;
+    while (a < b) {
+        size_t mid = a + (b - a) / 2;
+        if (reader->index[mid].offset < reader->header.header_len + offset) a = mid + 1;
+        else b = mid;
+    }
+    return a < reader->num_index && reader->index[a].offset == reader->header.header_len + offset &&
+           (reader->index[a].flags & CAPTURE_INDEX_RESTART);
+}
+
+// A gap that is no loss of frames but a new run of counters
+static bool is_reset(const struct capture_reader *reader, const struct event *e) {
+    return e->type == EVENT_GAP && ((uint32_t)(e->counter - e->expected) > MAX_FILL || is_restart(reader, e->offset));
+}
+
+/* ---------------------------------------------------------------------------------------
+ * Repair
+ */
+
+struct direct_writer {
+    int fd;
+    bool direct;
+    uint8_t *buffer;
+    size_t fill;
+};
+
+static int direct_flush(struct direct_writer *w) {
+    size_t pos = 0;
+    if (w->direct && w->fill % DIRECT_ALIGN) {
+        // Only the last write may be unaligned
+        fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+        w->direct = false;
+    }
+    while (pos < w->fill) {
+        ssize_t n = write(w->fd, w->buffer + pos, w->fill - pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        pos += n;
+    }
+    w->fill = 0;
+    return 0;
+}
+
+static int direct_write(struct direct_writer *w, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t n = WRITE_LEN - w->fill < len ? WRITE_LEN - w->fill : len;
+        memcpy(w->buffer + w->fill, data, n);
+        w->fill += n;
+        data += n;
+        len -= n;
+        if (w->fill == WRITE_LEN && direct_flush(w)) return -1;
+    }
+    return 0;
+}
+
+static int repair(const struct capture_reader *reader, const struct scan *scan, const struct event *events, size_t num,
+                  int64_t head, const char *filename, uint64_t *filled) {
+    struct direct_writer w;
+    uint8_t marker[FRAME_LEN];
+    int status = 0;
+
+    memset(&w, 0, sizeof(w));
+    // The page cache would only hold data that is not read again
+    w.fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT | O_DIRECT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    w.direct = w.fd >= 0;
+    if (w.fd < 0 && errno == EINVAL) {
+        fprintf(stderr, "Warning: %s does not support O_DIRECT\n", filename);
+        w.fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+    if (w.fd < 0) {
+        fprintf(stderr, "Failed to open %s\n%s\n", filename, strerror(errno));
+        return 1;
+    }
+    if (posix_memalign((void**)&w.buffer, DIRECT_ALIGN, WRITE_LEN)) {
+        fprintf(stderr, "Error: allocating buffer\n");
+        close(w.fd);
+        return 1;
+    }
+
+    // The header stays valid, the index does not and is not copied
+    if (reader->container && direct_write(&w, reader->map, reader->header.header_len)) goto err_write;
+
+    uint64_t cursor = head;
+    for (size_t i = 0; i < num; i++) {
+        const struct event *e = &events[i];
+        if (e->offset > cursor && direct_write(&w, scan->data + cursor, e->offset - cursor)) goto err_write;
+        if (e->offset > cursor) cursor = e->offset;
+        if (e->type == EVENT_DESYNC) {
+            cursor = e->offset + e->len;
+            continue;
+        }
+        if (is_reset(reader, e)) continue;
+        uint32_t missing = e->counter - e->expected;
+        for (uint32_t k = 0; k < missing; k++) {
+            frame_set_gap_marker(marker, e->expected + k);
+            if (direct_write(&w, marker, FRAME_LEN)) goto err_write;
+        }
+        *filled += missing;
+    }
+    if (cursor < scan->data_len && direct_write(&w, scan->data + cursor, scan->data_len - cursor)) goto err_write;
+    if (direct_flush(&w)) goto err_write;
+    goto out;
+
+err_write:
+    fprintf(stderr, "Failed to write %s\n%s\n", filename, strerror(errno));
+    status = 1;
+out:
+    free(w.buffer);
+    if (close(w.fd) && status == 0) {
+        fprintf(stderr, "Failed to write %s\n%s\n", filename, strerror(errno));
+        status = 1;
+    }
+    return status;
+}
+
+/* ---------------------------------------------------------------------------------------
+ * Main
+ */
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [-j <threads>] [-c <MiB per chunk>] [-v] [-r <output>] <recording>\n", program_name);
+    printf("  -j  Threads (default: online CPUs)\n");
+    printf("  -v  List every gap, counter reset and desync\n");
+    printf("  -r  Write realigned frames to <output>, lost frames replaced by gap markers\n");
+    printf("Exit status: 0 intact, 1 error, 2 defects found\n");
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t chunk_frames = CHUNK_FRAMES;
+    bool verbose = false;
+    const char *output = NULL;
+    struct scan scan;
+    struct event *events = NULL;
+    size_t num_events = 0;
+    int status = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:c:vr:")) != -1) {
+        switch (opt) {
+        case 'j': num_threads = atoi(optarg); break;
+        case 'c': chunk_frames = strtoull(optarg, NULL, 0) * 1024 * 1024 / FRAME_LEN; break;
+        case 'v': verbose = true; break;
+        case 'r': output = optarg; break;
+        default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 1 || chunk_frames == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct capture_reader *reader = reader_open(argv[optind]);
+    if (reader == NULL) return 1;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.data = reader->frames;
+    scan.data_len = reader->map_len - (reader->container ? reader->header.header_len : 0);
+    scan.chunk_frames = chunk_frames;
+    size_t num_chunks = (reader->num_frames + chunk_frames - 1) / chunk_frames;
+    scan.chunks = (struct chunk_result*)calloc(num_chunks ? num_chunks : 1, sizeof(struct chunk_result));
+    if (scan.chunks == NULL) {
+        fprintf(stderr, "Error: allocating chunks\n");
+        status = 1;
+        goto err_reader;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (reader_for_each_chunk(reader, 0, reader->num_frames, chunk_frames, num_threads, scan_chunk, &scan) ||
+        !merge_chunks(&scan, num_chunks, &events, &num_events)) {
+        fprintf(stderr, "Error: allocating events\n");
+        status = 1;
+        goto err_chunks;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    uint64_t frames = 0, missing = 0, gaps = 0, resets = 0, desyncs = 0, desync_bytes = 0;
+    int64_t head = -1;
+    for (size_t c = 0; c < num_chunks; c++) {
+        frames += scan.chunks[c].frames;
+        if (head < 0) head = scan.chunks[c].head;
+    }
+    for (size_t i = 0; i < num_events; i++) {
+        const struct event *e = &events[i];
+        double seconds = offset_seconds(reader, e->offset);
+        bool reset = is_reset(reader, e);
+        if (reset) {
+            resets++;
+        } else if (e->type == EVENT_GAP) {
+            gaps++;
+            missing += (uint32_t)(e->counter - e->expected);
+        } else {
+            desyncs++;
+            desync_bytes += e->len;
+        }
+        if (!verbose) continue;
+        if (seconds >= 0) printf("%10.3f s ", seconds);
+        if (reset) {
+            printf("reset  at offset %" PRIu64 ": counter %" PRIu32 " expected, %" PRIu32 " found, %s\n", e->offset,
+                   e->expected, e->counter, is_restart(reader, e->offset) ? "counter restart, device reconnected" : "counter reset");
+        } else if (e->type == EVENT_GAP) {
+            printf("gap    at offset %" PRIu64 ": counter %" PRIu32 " expected, %" PRIu32 " found, %" PRIu32 " frames missing\n",
+                   e->offset, e->expected, e->counter, (uint32_t)(e->counter - e->expected));
+        } else {
+            printf("desync at offset %" PRIu64 ": %" PRIu64 " bytes in no frame\n", e->offset, e->len);
+        }
+    }
+    printf("%" PRIu64 " frames, %" PRIu64 " gaps with %" PRIu64 " missing frames, %" PRIu64 " counter resets, %" PRIu64
+           " desyncs with %" PRIu64 " bytes\n", frames, gaps, missing, resets, desyncs, desync_bytes);
+    printf("Scanned %.1f MB in %.3f s with %d threads, %.1f MB/s\n", scan.data_len / 1e6, elapsed, num_threads,
+           elapsed > 0 ? scan.data_len / 1e6 / elapsed : 0);
+    if (num_events > 0) status = 2;
+
+    if (output) {
+        uint64_t filled = 0;
+        if (head < 0) {
+            fprintf(stderr, "Error: No frames in %s\n", argv[optind]);
+            status = 1;
+        } else if (repair(reader, &scan, events, num_events, head, output, &filled)) {
+            status = 1;
+        } else {
+            printf("Wrote %s: %" PRIu64 " frames, %" PRIu64 " gap markers\n", output, frames, filled);
+        }
+    }
+
+err_chunks:
+    for (size_t c = 0; c < num_chunks; c++) free(scan.chunks[c].events);
+    free(scan.chunks);
+    free(events);
+err_reader:
+    reader_close(reader);
+    return status;
+}
@@ -0,0 +1,430 @@
+/* libusb_example/flexiband_segment.c
+ *
+ * Writer of segmented recordings, see flexiband_segment.h. segment_write() runs in the
+ * transfer callback of flexiband_record; it takes the lock only to hand segments over, and
+ * the background thread never holds the lock during file system calls.
+ */
+
+#define _GNU_SOURCE   // fallocate()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "flexiband_io.h"
+#include "flexiband_segment.h"
+
+#define PATH_LEN 4096
+#define MAX_JOBS 8
+
+enum job_kind {
+    JOB_START,     // name the segment after its first frame
+    JOB_FINISH,    // close, trim and prune
+};
+
+struct segment {
+    int fd;                           // raw segments
+    struct capture_writer *capture;   // container segments
+    char path[PATH_LEN];
+    uint32_t number;                  // one based
+    uint32_t first_counter;
+    uint64_t offset;                  // stream data before this segment
+    uint64_t len;                     // frame data written
+    int64_t start_monotonic_ns;
+};
+
+struct finished_segment {
+    char *path;
+    uint64_t size;                    // including the index
+};
+
+struct job {
+    enum job_kind kind;
+    struct segment *segment;
+};
+
+struct segment_writer {
+    char filename[PATH_LEN - 128];    // room for time and counter
+    char stem[PATH_LEN - 128];
+    char ext[64];
+    bool container;
+    struct capture_header header;     // of the whole recording
+    struct segment_config config;
+
+    // Used by segment_write() only
+    struct segment *current;
+    uint64_t data_len;
+    uint32_t num_started;
+    bool late;                        // current segment is overdue
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Protected by lock
+    struct segment *spare;            // NULL while the next segment is prepared
+    struct job jobs[MAX_JOBS];
+    unsigned head;
+    unsigned tail;
+    bool stop;
+    int errors;
+
+    // Used by the background thread only, or before it starts and after it stopped
+    struct finished_segment *finished;
+    size_t num_finished;
+    uint64_t finished_bytes;
+    uint64_t preallocate;             // bytes of frame data per segment
+    unsigned num_spares;
+    struct segment_statistics stat;
+};
+
+// Start of the extension of filename, which only counts in the last path component
+static const char *extension(const char *filename) {
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    const char *dot = strrchr(base, '.');
+    return dot && dot != base && strlen(dot) < 64 ? dot : filename + strlen(filename);
+}
+
+void segment_path(const char *filename, int64_t realtime_ns, uint32_t counter, char *path, size_t size) {
+    char time_str[32];
+    struct tm tm;
+    time_t sec = (time_t)(realtime_ns / 1000000000);
+    const char *ext = extension(filename);
+    gmtime_r(&sec, &tm);
+    strftime(time_str, sizeof(time_str), "%Y%m%dT%H%M%SZ", &tm);
+    snprintf(path, size, "%.*s-%s-%08" PRIx32 "%s", (int)(ext - filename), filename, time_str, counter, ext);
+}
+
+static uint64_t file_size(const char *path) {
+    struct stat sb;
+    return stat(path, &sb) == 0 ? (uint64_t)sb.st_size : 0;
+}
+
+// Segment and its index, if any
+static uint64_t segment_size(const char *path) {
+    char idx[PATH_LEN + 4];
+    snprintf(idx, sizeof(idx), "%s.idx", path);
+    return file_size(path) + file_size(idx);
+}
+
+static void remove_segment(const char *path) {
+    char idx[PATH_LEN + 4];
+    snprintf(idx, sizeof(idx), "%s.idx", path);
+    if (unlink(path) && errno != ENOENT) fprintf(stderr, "Warning: Failed to remove %s\n%s\n", path, strerror(errno));
+    unlink(idx);
+}
+
+static int add_finished(struct segment_writer *writer, const char *path) {
+    struct finished_segment *finished = (struct finished_segment*)realloc(
+        writer->finished, (writer->num_finished + 1) * sizeof(struct finished_segment));
+    if (finished == NULL) return -1;
+    writer->finished = finished;
+    finished[writer->num_finished].path = strdup(path);
+    if (finished[writer->num_finished].path == NULL) return -1;
+    finished[writer->num_finished].size = segment_size(path);
+    writer->finished_bytes += finished[writer->num_finished].size;
+    writer->num_finished++;
+    return 0;
+}
+
+// Deletes the oldest segments until the finished ones, the current and the spare fit
+static void prune(struct segment_writer *writer) {
+    uint64_t reserve = 2 * writer->preallocate;
+    size_t num = 0;
+    if (writer->config.quota_bytes == 0) return;
+    while (num < writer->num_finished && writer->finished_bytes + reserve > writer->config.quota_bytes) {
+        remove_segment(writer->finished[num].path);
+        writer->finished_bytes -= writer->finished[num].size;
+        free(writer->finished[num].path);
+        writer->stat.pruned++;
+        num++;
+    }
+    writer->num_finished -= num;
+    memmove(writer->finished, writer->finished + num, writer->num_finished * sizeof(struct finished_segment));
+}
+
+// Segments of earlier recordings to the same file, their names sort by time
+static void find_segments(struct segment_writer *writer) {
+    char pattern[PATH_LEN + 128];
+    glob_t found;
+    snprintf(pattern, sizeof(pattern), "%s-[0-9]*T[0-9]*Z-*%s", writer->stem, writer->ext);
+    if (glob(pattern, 0, NULL, &found)) return;
+    for (size_t i = 0; i < found.gl_pathc; i++) {
+        size_t len = strlen(found.gl_pathv[i]);
+        if (len > 4 && strcmp(found.gl_pathv[i] + len - 4, ".idx") == 0) continue;
+        if (add_finished(writer, found.gl_pathv[i])) break;
+    }
+    globfree(&found);
+}
+
+// Creates the next segment under a temporary name and reserves its space on disk
+static struct segment *prepare_segment(struct segment_writer *writer) {
+    struct segment *segment = (struct segment*)calloc(1, sizeof(struct segment));
+    if (segment == NULL) {
+        fprintf(stderr, "Error: allocating segment\n");
+        return NULL;
+    }
+    segment->fd = -1;
+    snprintf(segment->path, sizeof(segment->path), "%s-next%u%s", writer->stem, writer->num_spares++, writer->ext);
+
+    if (writer->container) {
+        segment->capture = capture_create(segment->path, &writer->header);
+        if (segment->capture == NULL) goto err_free;
+    } else {
+        segment->fd = open(segment->path, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (segment->fd < 0) {
+            fprintf(stderr, "Failed to open %s\n%s\n", segment->path, strerror(errno));
+            goto err_free;
+        }
+    }
+
+    // The file size stays at what was written, so an interrupted segment has no zero tail
+    if (writer->preallocate > 0) {
+        int fd = open(segment->path, O_WRONLY);
+        off_t start = writer->container ? writer->header.header_len : 0;
+        if (fd >= 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, start, writer->preallocate) && errno != EOPNOTSUPP) {
+            fprintf(stderr, "Warning: Failed to preallocate %s\n%s\n", segment->path, strerror(errno));
+        }
+        if (fd >= 0) close(fd);
+    }
+    return segment;
+
+err_free:
+    free(segment);
+    return NULL;
+}
+
+// Closes a segment that never got data
+static void discard_segment(struct segment *segment) {
+    if (segment->capture) capture_close(segment->capture);
+    if (segment->fd >= 0) close(segment->fd);
+    remove_segment(segment->path);
+    free(segment);
+}
+
+// Stores where the segment starts in the recording and gives it its final name
+static int start_segment(struct segment_writer *writer, struct segment *segment) {
+    char path[PATH_LEN];
+    int64_t realtime_ns = writer->header.start_realtime_ns + (segment->start_monotonic_ns - writer->header.start_monotonic_ns);
+    segment_path(writer->filename, realtime_ns, segment->first_counter, path, sizeof(path));
+
+    if (writer->container) {
+        struct capture_header header = writer->header;
+        header.start_realtime_ns = realtime_ns;
+        header.start_monotonic_ns = segment->start_monotonic_ns;
+        header.segment = segment->number;
+        header.segment_offset = segment->offset;
+        int fd = open(segment->path, O_WRONLY);
+        if (fd < 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            fprintf(stderr, "Error: Write header of %s\n%s\n", segment->path, strerror(errno));
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+
+    if (rename(segment->path, path)) {
+        fprintf(stderr, "Error: Rename %s\n%s\n", segment->path, strerror(errno));
+        return -1;
+    }
+    if (writer->container) {
+        char from[PATH_LEN + 4], to[PATH_LEN + 4];
+        snprintf(from, sizeof(from), "%s.idx", segment->path);
+        snprintf(to, sizeof(to), "%s.idx", path);
+        if (rename(from, to)) {
+            fprintf(stderr, "Error: Rename %s\n%s\n", from, strerror(errno));
+            return -1;
+        }
+    }
+    memcpy(segment->path, path, sizeof(path));
+    return 0;
+}
+
+// Closes the segment, releases the space preallocated beyond its end and prunes
+static int finish_segment(struct segment_writer *writer, struct segment *segment) {
+    int status = 0;
+    if (segment->len == 0) {
+        discard_segment(segment);
+        return 0;
+    }
+    if (segment->capture && capture_close(segment->capture)) status = -1;
+    if (segment->fd >= 0 && close(segment->fd)) status = -1;
+    if (status) fprintf(stderr, "Error: Close %s\n%s\n", segment->path, strerror(errno));
+    if (writer->preallocate > 0) truncate(segment->path, (writer->container ? writer->header.header_len : 0) + segment->len);
+
+    // Without a size limit, the next segments are expected to be as long as this one
+    if (writer->config.max_bytes == 0) writer->preallocate = segment->len;
+    if (add_finished(writer, segment->path)) status = -1;
+    writer->stat.segments++;
+    prune(writer);
+    free(segment);
+    return status;
+}
+
+static void *segment_thread(void *arg) {
+    struct segment_writer *writer = (struct segment_writer*)arg;
+    bool failed = false;   // retried after the next segment is finished and space was pruned
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        if (writer->head != writer->tail) {
+            struct job job = writer->jobs[writer->head % MAX_JOBS];
+            pthread_mutex_unlock(&writer->lock);
+            int status = job.kind == JOB_START ? start_segment(writer, job.segment) : finish_segment(writer, job.segment);
+            if (job.kind == JOB_FINISH) failed = false;
+            pthread_mutex_lock(&writer->lock);
+            if (status) writer->errors++;
+            writer->head++;
+            pthread_cond_broadcast(&writer->cond);
+        } else if (writer->spare == NULL && !writer->stop && !failed) {
+            pthread_mutex_unlock(&writer->lock);
+            struct segment *spare = prepare_segment(writer);
+            pthread_mutex_lock(&writer->lock);
+            writer->spare = spare;
+            failed = spare == NULL;
+        } else if (writer->stop) {
+            break;
+        } else {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Called with the lock held
+static void queue_job(struct segment_writer *writer, enum job_kind kind, struct segment *segment) {
+    writer->jobs[writer->tail % MAX_JOBS].kind = kind;
+    writer->jobs[writer->tail % MAX_JOBS].segment = segment;
+    writer->tail++;
+    pthread_cond_broadcast(&writer->cond);
+}
+
+struct segment_writer *segment_create(const char *filename, const struct capture_header *header,
+                                      const struct segment_config *config) {
+    struct segment_writer *writer = (struct segment_writer*)calloc(1, sizeof(struct segment_writer));
+    if (writer == NULL) {
+        fprintf(stderr, "Error: allocating segment writer\n");
+        return NULL;
+    }
+    const char *ext = extension(filename);
+    if (strlen(filename) >= sizeof(writer->filename)) {
+        fprintf(stderr, "Error: Filename too long\n");
+        goto err_free;
+    }
+    strcpy(writer->filename, filename);
+    memcpy(writer->stem, filename, ext - filename);
+    strcpy(writer->ext, ext);
+
+    writer->container = header != NULL;
+    if (header) writer->header = *header;
+    else capture_init_header(&writer->header);
+    writer->config = *config;
+    writer->preallocate = config->max_bytes;
+
+    find_segments(writer);
+    prune(writer);
+    writer->current = prepare_segment(writer);
+    if (writer->current == NULL) goto err_free;
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->thread, NULL, segment_thread, writer)) {
+        fprintf(stderr, "Error: Start segment thread\n");
+        pthread_cond_destroy(&writer->cond);
+        pthread_mutex_destroy(&writer->lock);
+        discard_segment(writer->current);
+        goto err_free;
+    }
+    return writer;
+
+err_free:
+    for (size_t i = 0; i < writer->num_finished; i++) free(writer->finished[i].path);
+    free(writer->finished);
+    free(writer);
+    return NULL;
+}
+
+static int write_segment(struct segment_writer *writer, const uint8_t *data, size_t len, int64_t monotonic_ns) {
+    struct segment *segment = writer->current;
+    if (segment->len == 0) {
+        segment->number = ++writer->num_started;
+        segment->first_counter = len >= FRAME_HEADER_LEN && frame_has_preamble(data) ? frame_counter(data) : 0;
+        segment->offset = writer->data_len;
+        segment->start_monotonic_ns = monotonic_ns;
+        pthread_mutex_lock(&writer->lock);
+        queue_job(writer, JOB_START, segment);
+        pthread_mutex_unlock(&writer->lock);
+    }
+    if (segment->capture ? capture_write(segment->capture, data, len, monotonic_ns) : write_all(segment->fd, data, len)) {
+        return -1;
+    }
+    segment->len += len;
+    writer->data_len += len;
+    return 0;
+}
+
+int segment_write(struct segment_writer *writer, const void *data, size_t len, int64_t monotonic_ns) {
+    const uint8_t *p = (const uint8_t*)data;
+    struct segment *segment = writer->current;
+    const struct segment_config *config = &writer->config;
+
+    if (segment->len > 0 && ((config->max_ns > 0 && monotonic_ns - segment->start_monotonic_ns >= config->max_ns) ||
+                             (config->max_bytes > 0 && segment->len >= config->max_bytes))) {
+        // Room for finishing this segment and starting the next one
+        pthread_mutex_lock(&writer->lock);
+        bool ready = writer->spare != NULL && writer->tail - writer->head + 2 <= MAX_JOBS;
+        pthread_mutex_unlock(&writer->lock);
+
+        // The next segment starts with the next frame whose header is in this data
+        size_t cut = (FRAME_LEN - writer->data_len % FRAME_LEN) % FRAME_LEN;
+        if (!ready) {
+            if (!writer->late) writer->stat.late++;
+            writer->late = true;
+        } else if (cut + FRAME_HEADER_LEN <= len) {
+            if (cut > 0 && write_segment(writer, p, cut, monotonic_ns)) return -1;
+            p += cut;
+            len -= cut;
+            pthread_mutex_lock(&writer->lock);
+            queue_job(writer, JOB_FINISH, segment);
+            writer->current = writer->spare;
+            writer->spare = NULL;
+            pthread_mutex_unlock(&writer->lock);
+            writer->late = false;
+        }
+    }
+    return len > 0 ? write_segment(writer, p, len, monotonic_ns) : 0;
+}
+
+void segment_restart(struct segment_writer *writer) {
+    if (writer->current->capture && writer->current->len > 0) capture_restart(writer->current->capture);
+}
+
+int segment_close(struct segment_writer *writer, struct segment_statistics *stat) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->tail - writer->head >= MAX_JOBS) pthread_cond_wait(&writer->cond, &writer->lock);
+    queue_job(writer, JOB_FINISH, writer->current);
+    writer->stop = true;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    if (writer->spare) discard_segment(writer->spare);
+    if (stat) *stat = writer->stat;
+    int status = writer->errors ? -1 : 0;
+    for (size_t i = 0; i < writer->num_finished; i++) free(writer->finished[i].path);
+    free(writer->finished);
+    pthread_cond_destroy(&writer->cond);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+    return status;
+}
@@ -0,0 +1,62 @@
+/* libusb_example/flexiband_segment.h
+ *
+ * Segmented recording, written by flexiband_record -S/-G. The frame stream is split on frame
+ * boundaries into files named
+ *
+ *   <stem>-<YYYYmmddTHHMMSSZ>-<counter><ext>
+ *
+ * for a recording to <stem><ext>, with the UTC time the first frame arrived and its frame
+ * counter in hex. The names sort in recording order, and concatenating raw segments gives the
+ * stream without a byte lost. Container segments carry the clock mapping and their offset in
+ * the stream, see flexiband_capture.h.
+ *
+ * All file system work runs on a background thread: the next segment is created and
+ * preallocated before it is needed, finished segments are closed, renamed and pruned to the
+ * quota there. A rollover in segment_write() only swaps two pointers; if the next segment is
+ * not ready yet, the current one grows until it is.
+ */
+
+#ifndef FLEXIBAND_SEGMENT_H
+#define FLEXIBAND_SEGMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flexiband_capture.h"
+
+struct segment_config {
+    int64_t max_ns;            // Segment duration, 0 for no limit
+    uint64_t max_bytes;        // Segment size, 0 for no limit
+    uint64_t quota_bytes;      // Total size of all segments of <stem><ext>, 0 to keep all
+};
+
+struct segment_statistics {
+    uint64_t segments;
+    uint64_t pruned;           // Segments deleted to stay within the quota
+    uint64_t late;             // Rollovers deferred since the next segment was not ready
+};
+
+struct segment_writer;
+
+// Starts a segmented recording to filename. header is NULL for raw segments, else every
+// segment is a capture container with a copy of it. Segments of an earlier recording to the
+// same filename count towards the quota. Returns NULL and prints the error on failure.
+struct segment_writer *segment_create(const char *filename, const struct capture_header *header,
+                                      const struct segment_config *config);
+
+// Appends received data. monotonic_ns is the completion time of the transfer the data
+// belongs to. Returns 0 or -1 with errno set.
+int segment_write(struct segment_writer *writer, const void *data, size_t len, int64_t monotonic_ns);
+
+// Marks a restart of the stream in the current container segment, see capture_restart().
+// A segment starting after the restart needs no mark, its first frame starts its stream.
+void segment_restart(struct segment_writer *writer);
+
+// Formats the name of a segment of filename starting at realtime_ns with frame counter
+void segment_path(const char *filename, int64_t realtime_ns, uint32_t counter, char *path, size_t size);
+
+// Finishes the last segment and stops the background thread. stat may be NULL. Returns 0 or
+// -1 if any segment failed.
+int segment_close(struct segment_writer *writer, struct segment_statistics *stat);
+
+#endif
@@ -0,0 +1,144 @@
+/* libusb_example/flexiband_stats.c
+ *
+ * Statistics of the bands, see flexiband_stats.h. stats_update() runs in the transfer
+ * callback of flexiband_record and costs one counter increment per payload byte. The counts
+ * of every block of STATS_BLOCK_FRAMES frames are kept, so the window slides by adding the
+ * newest block and subtracting the oldest.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flexiband_stats.h"
+
+// See "Payload" in README.md
+static const struct stats_layout layout_fields[NUM_LAYOUTS] = {
+    [LAYOUT_I_3] = {1, 1, {{BAND_L5, 0, 4, 0, 4}}},
+    [LAYOUT_III_1A] = {2, 3, {{BAND_L2, 0, 6, 4, 2}, {BAND_L1, 0, 2, 0, 2}, {BAND_L5, 1, 4, 0, 4}}},
+    [LAYOUT_III_1B] = {4, 4, {{BAND_L2, 0, 4, 0, 4}, {BAND_L1, 1, 4, 0, 4}, {BAND_L5, 2, 4, 0, 4}, {BAND_L5, 3, 4, 0, 4}}},
+};
+
+typedef uint32_t lane_counts[STATS_MAX_LANES][256];
+
+struct stats {
+    enum payload_layout layout;
+    unsigned payload_len;
+    unsigned group;
+    unsigned num_blocks;         // blocks in the window
+    unsigned block_frames;       // frames in the current block
+    uint64_t blocks;             // completed blocks
+    lane_counts *history;        // the last num_blocks blocks, block n at n % num_blocks
+    lane_counts current;
+    uint64_t window[STATS_MAX_LANES][256];
+};
+
+const struct stats_layout *stats_layout(enum payload_layout layout) {
+    return (unsigned)layout < NUM_LAYOUTS ? &layout_fields[layout] : NULL;
+}
+
+struct stats *stats_create(enum payload_layout layout, unsigned window_frames) {
+    if ((unsigned)layout >= NUM_LAYOUTS) return NULL;
+    struct stats *stats = (struct stats*)calloc(1, sizeof(struct stats));
+    if (stats == NULL) return NULL;
+    stats->layout = layout;
+    stats->payload_len = layout_payload_len(layout);
+    stats->group = layout_fields[layout].group;
+    stats->num_blocks = (window_frames + STATS_BLOCK_FRAMES - 1) / STATS_BLOCK_FRAMES;
+    if (stats->num_blocks == 0) stats->num_blocks = 1;
+    stats->history = (lane_counts*)calloc(stats->num_blocks, sizeof(lane_counts));
+    if (stats->history == NULL) {
+        free(stats);
+        return NULL;
+    }
+    return stats;
+}
+
+void stats_free(struct stats *stats) {
+    if (stats == NULL) return;
+    free(stats->history);
+    free(stats);
+}
+
+static void finish_block(struct stats *stats) {
+    lane_counts *oldest = &stats->history[stats->blocks % stats->num_blocks];
+    bool full = stats->blocks >= stats->num_blocks;
+    for (unsigned lane = 0; lane < stats->group; lane++) {
+        for (unsigned b = 0; b < 256; b++) {
+            stats->window[lane][b] += stats->current[lane][b];
+            if (full) stats->window[lane][b] -= (*oldest)[lane][b];
+        }
+    }
+    memcpy(oldest, stats->current, sizeof(lane_counts));
+    memset(stats->current, 0, sizeof(lane_counts));
+    stats->blocks++;
+    stats->block_frames = 0;
+}
+
+void stats_update(struct stats *stats, const uint8_t *data, size_t len, uint64_t pos) {
+    uint64_t first = (pos + FRAME_LEN - 1) / FRAME_LEN * FRAME_LEN;
+    for (uint64_t frame = first; frame + FRAME_LEN <= pos + len; frame += FRAME_LEN) {
+        const uint8_t *p = data + (frame - pos);
+        if (!frame_has_preamble(p)) continue;
+        p += FRAME_HEADER_LEN;
+        // The group size is a constant in every loop, so the lanes are unrolled
+        switch (stats->group) {
+        case 1:
+            for (unsigned i = 0; i < stats->payload_len; i++) stats->current[0][p[i]]++;
+            break;
+        case 2:
+            for (unsigned i = 0; i + 2 <= stats->payload_len; i += 2) {
+                stats->current[0][p[i]]++;
+                stats->current[1][p[i + 1]]++;
+            }
+            break;
+        case 4:
+            for (unsigned i = 0; i + 4 <= stats->payload_len; i += 4) {
+                stats->current[0][p[i]]++;
+                stats->current[1][p[i + 1]]++;
+                stats->current[2][p[i + 2]]++;
+                stats->current[3][p[i + 3]]++;
+            }
+            break;
+        }
+        if (++stats->block_frames == STATS_BLOCK_FRAMES) finish_block(stats);
+    }
+}
+
+static int level(unsigned code, unsigned bits) {
+    return code >= (1u << (bits - 1)) ? (int)code - (1 << bits) : (int)code;
+}
+
+void stats_get(const struct stats *stats, struct stats_band out[NUM_BANDS]) {
+    const struct stats_layout *layout = &layout_fields[stats->layout];
+    double sum_i[NUM_BANDS] = {0}, sum_q[NUM_BANDS] = {0}, sum_power[NUM_BANDS] = {0}, outer[NUM_BANDS] = {0};
+
+    memset(out, 0, NUM_BANDS * sizeof(struct stats_band));
+    for (unsigned f = 0; f < layout->num_fields; f++) {
+        const struct stats_field *field = &layout->fields[f];
+        struct stats_band *band = &out[field->band];
+        unsigned mask = (1u << field->bits) - 1;
+        int half = 1 << (field->bits - 1), quarter = half / 2;
+        band->bits = field->bits;
+        for (unsigned b = 0; b < 256; b++) {
+            uint64_t count = stats->window[field->lane][b];
+            if (count == 0) continue;
+            int i = level((b >> field->shift_i) & mask, field->bits);
+            int q = level((b >> field->shift_q) & mask, field->bits);
+            band->samples += count;
+            band->hist_i[i + half] += count;
+            band->hist_q[q + half] += count;
+            sum_i[field->band] += (double)i * count;
+            sum_q[field->band] += (double)q * count;
+            sum_power[field->band] += (double)(i * i + q * q) * count;
+            outer[field->band] += (double)((i >= quarter || i < -quarter) + (q >= quarter || q < -quarter)) * count;
+        }
+    }
+    for (unsigned b = 0; b < NUM_BANDS; b++) {
+        if (out[b].samples == 0) continue;
+        out[b].mean_i = sum_i[b] / out[b].samples;
+        out[b].mean_q = sum_q[b] / out[b].samples;
+        out[b].power = sum_power[b] / out[b].samples;
+        out[b].outer = outer[b] / (2.0 * out[b].samples);
+    }
+}
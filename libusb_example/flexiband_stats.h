@@ -0,0 +1,68 @@
+/* libusb_example/flexiband_stats.h
+ *
+ * Sample statistics of every band over a sliding window of frames, computed on the packed
+ * payload. Each payload byte holds I and Q of one band (see "Payload" in README.md), so
+ * counting the byte values per position in the payload is enough: histograms, mean and power
+ * of all bands follow from the counts with a lookup per byte value, not per sample.
+ */
+
+#ifndef FLEXIBAND_STATS_H
+#define FLEXIBAND_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flexiband_frame.h"
+#include "flexiband_unpack.h"
+
+#define STATS_BLOCK_FRAMES 256   // the window slides by this many frames
+#define STATS_MAX_LEVELS   16
+#define STATS_MAX_LANES    4
+
+// I and Q of a band in byte position lane of every group of payload bytes
+struct stats_field {
+    enum band band;
+    unsigned lane;
+    unsigned shift_i;
+    unsigned shift_q;
+    unsigned bits;
+};
+
+struct stats_layout {
+    unsigned group;              // bytes until the pattern repeats
+    unsigned num_fields;
+    struct stats_field fields[STATS_MAX_LANES];
+};
+
+struct stats_band {
+    unsigned bits;                       // per I and Q, 0 if the layout does not contain the band
+    uint64_t samples;                    // complex samples in the window
+    uint64_t hist_i[STATS_MAX_LEVELS];   // count of level -2^(bits-1) + n
+    uint64_t hist_q[STATS_MAX_LEVELS];
+    double mean_i;
+    double mean_q;
+    double power;                        // mean of I^2 + Q^2
+    double outer;                        // fraction of I and Q at or beyond +-2^(bits-2)
+};
+
+struct stats;
+
+// Where the bands are in the payload bytes of layout, see "Payload" in README.md. NULL if the
+// layout is unknown.
+const struct stats_layout *stats_layout(enum payload_layout layout);
+
+// window_frames is rounded up to whole blocks. Returns NULL if the layout is unknown or
+// allocation fails.
+struct stats *stats_create(enum payload_layout layout, unsigned window_frames);
+
+void stats_free(struct stats *stats);
+
+// Counts the frames that lie completely in data. pos is the stream position of data, frames
+// start at multiples of FRAME_LEN; frames without preamble are skipped.
+void stats_update(struct stats *stats, const uint8_t *data, size_t len, uint64_t pos);
+
+// Statistics of the last complete window, or of the blocks so far after the start. Bands with
+// bits == 0 are not in the layout.
+void stats_get(const struct stats *stats, struct stats_band out[NUM_BANDS]);
+
+#endif
@@ -0,0 +1,289 @@
+/* libusb_example/flexiband_stream.c
+ *
+ * Capture engine, see flexiband_stream.h. The device setup is shared with flexiband_record and
+ * flexiband_bench: configuration 1, interface 0 in alternate setting 1, iso IN endpoint 0x83,
+ * transfers of 32 packets of 16 KB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "flexiband_stream.h"
+#include "transport.h"
+
+#define CONFIGURATION 1
+#define ALT_INTERFACE 1
+
+#define PKG_LEN (16 * 1024)
+#define XFER_LEN (STREAM_NUM_PKG * PKG_LEN)
+#define TIMEOUT_MS 1000
+#define DRAIN_USEC 2000000  // time for cancelled transfers to come back
+
+struct stream {
+    struct stream_config config;
+    libusb_context *ctx;
+    libusb_device_handle *dev_handle;
+    struct libusb_transfer **transfers;
+    unsigned pending;
+    bool started;
+    bool stopping;
+    int status;
+    struct stream_block block;
+    struct stream_statistics stat;
+};
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stream_callback(struct libusb_transfer *transfer) {
+    struct stream *stream = (struct stream*)transfer->user_data;
+    struct stream_block *block = &stream->block;
+
+    stream->pending--;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        // Cancelled by stream_stop() is the normal end
+        if (!stream->stopping && stream->status == 0) {
+            fprintf(stderr, "Error: Transfer not completed, status %i\n", transfer->status);
+            stream->status = transfer->status;
+        }
+        return;
+    }
+
+    block->monotonic_ns = now_ns();
+    block->num_packets = transfer->num_iso_packets;
+    block->bytes = 0;
+    for (int i = 0; i < transfer->num_iso_packets; i++) {
+        const struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+        block->data[i] = libusb_get_iso_packet_buffer_simple(transfer, i);
+        block->len[i] = desc->status == LIBUSB_TRANSFER_COMPLETED ? desc->actual_length : 0;
+        if (desc->status != LIBUSB_TRANSFER_COMPLETED) stream->stat.failed_packets++;
+        block->bytes += block->len[i];
+    }
+    stream->stat.transfers++;
+    stream->stat.bytes += block->bytes;
+    stream->config.callback(block, stream->config.user_data);
+
+    if (!stream->stopping && stream->status == 0) {
+        int status = transport_submit_transfer(transfer);
+        if (status) {
+            fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)status));
+            stream->status = status;
+            return;
+        }
+        stream->pending++;
+    }
+}
+
+libusb_device_handle *stream_open_device(libusb_context *ctx, bool quiet) {
+    libusb_device_handle *dev_handle = transport_open_device_with_vid_pid(ctx, STREAM_VID, STREAM_PID);
+    if (dev_handle == NULL) {
+        if (!quiet) fprintf(stderr, "Error: No device with VID=0x%04X, PID=0x%04X\n", STREAM_VID, STREAM_PID);
+        return NULL;
+    }
+
+    if (transport_kernel_driver_active(dev_handle, STREAM_INTERFACE) == 1) {
+        printf("Warning: Kernel driver active, detaching kernel driver...");
+        int status = transport_detach_kernel_driver(dev_handle, STREAM_INTERFACE);
+        if (status) {
+            fprintf(stderr, "Detach: %s\n", libusb_strerror((enum libusb_error)status));
+            goto err;
+        }
+    }
+
+    // The operating system may or may not have already set an active configuration on the device.
+    // It is up to your application to ensure the correct configuration is selected before you
+    // attempt to claim interfaces and perform other operations.
+    // It will cause USB-related device state to be reset (altsetting reset to zero,
+    // endpoint halts cleared, toggles reset).
+    int status = transport_set_configuration(dev_handle, CONFIGURATION);
+    if (status) {
+        fprintf(stderr, "Reset: %s\n", libusb_strerror((enum libusb_error)status));
+        goto err;
+    }
+    return dev_handle;
+
+err:
+    transport_close(dev_handle);
+    return NULL;
+}
+
+int stream_claim_device(libusb_device_handle *dev_handle) {
+    int status = transport_claim_interface(dev_handle, STREAM_INTERFACE);
+    if (status) {
+        fprintf(stderr, "Claim interface: %s\n", libusb_strerror((enum libusb_error)status));
+        return status;
+    }
+
+    status = transport_set_interface_alt_setting(dev_handle, STREAM_INTERFACE, ALT_INTERFACE);
+    if (status) {
+        fprintf(stderr, "Set alternate interface: %s\n", libusb_strerror((enum libusb_error)status));
+        transport_release_interface(dev_handle, STREAM_INTERFACE);
+    }
+    return status;
+}
+
+struct stream *stream_open(const struct stream_config *config) {
+    struct stream *stream = (struct stream*)calloc(1, sizeof(struct stream));
+    if (stream == NULL) {
+        fprintf(stderr, "Error: allocating stream\n");
+        return NULL;
+    }
+    stream->config = *config;
+    if (stream->config.queue_size == 0) stream->config.queue_size = STREAM_QUEUE_SIZE;
+
+    int status = transport_init(&stream->ctx);
+    if (status) {
+        fprintf(stderr, "%s\n", libusb_strerror((enum libusb_error)status));
+        goto err_ret;
+    }
+    stream->dev_handle = stream_open_device(stream->ctx, false);
+    if (stream->dev_handle == NULL) goto err_usb;
+    if (stream_claim_device(stream->dev_handle)) goto err_dev;
+
+    stream->transfers = (struct libusb_transfer**)calloc(stream->config.queue_size, sizeof(struct libusb_transfer*));
+    if (stream->transfers == NULL) {
+        fprintf(stderr, "Error: allocating transfer\n");
+        goto err_intf;
+    }
+    for (unsigned i = 0; i < stream->config.queue_size; i++) {
+        stream->transfers[i] = libusb_alloc_transfer(STREAM_NUM_PKG);
+        unsigned char *buffer = (unsigned char*)malloc(XFER_LEN);
+        if (stream->transfers[i] == NULL || buffer == NULL) {
+            fprintf(stderr, "Error: allocating transfer\n");
+            free(buffer);
+            goto err_alloc;
+        }
+        libusb_fill_iso_transfer(stream->transfers[i], stream->dev_handle, STREAM_ENDPOINT, buffer, XFER_LEN, STREAM_NUM_PKG,
+                                 stream_callback, stream, TIMEOUT_MS);
+        libusb_set_iso_packet_lengths(stream->transfers[i], PKG_LEN);
+        stream->transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+    return stream;
+
+err_alloc:
+    for (unsigned i = 0; i < stream->config.queue_size; i++) {
+        if (stream->transfers[i]) libusb_free_transfer(stream->transfers[i]);
+    }
+    free(stream->transfers);
+err_intf:
+    transport_release_interface(stream->dev_handle, STREAM_INTERFACE);
+err_dev:
+    transport_close(stream->dev_handle);
+err_usb:
+    transport_exit(stream->ctx);
+err_ret:
+    free(stream);
+    return NULL;
+}
+
+int stream_start(struct stream *stream) {
+    int status = transport_control_transfer(stream->dev_handle,
+                                            LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+                                            0x00, 0x00, 0x00, NULL, 0, 1000);
+    if (status) {
+        fprintf(stderr, "Error: Start command\n%s\n", libusb_strerror((enum libusb_error)status));
+        return status;
+    }
+    stream->started = true;
+    for (unsigned i = 0; i < stream->config.queue_size; i++) {
+        status = transport_submit_transfer(stream->transfers[i]);
+        if (status) {
+            fprintf(stderr, "Error: Submit transfer\n%s\n", libusb_strerror((enum libusb_error)status));
+            stream->status = status;
+            stream_stop(stream);
+            return status;
+        }
+        stream->pending++;
+    }
+    return 0;
+}
+
+void stream_stop(struct stream *stream) {
+    if (stream->stopping) return;
+    stream->stopping = true;
+    for (unsigned i = 0; i < stream->config.queue_size; i++) transport_cancel_transfer(stream->transfers[i]);
+}
+
+bool stream_running(const struct stream *stream) {
+    return stream->pending > 0;
+}
+
+int stream_status(const struct stream *stream) {
+    return stream->status;
+}
+
+int stream_run(struct stream *stream, const volatile sig_atomic_t *stop) {
+    while (stream_running(stream)) {
+        struct timeval tv = {0, 100000};
+        if (*stop || stream->status) stream_stop(stream);
+        int status = transport_handle_events_timeout_completed(stream->ctx, &tv, NULL);
+        if (status && status != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "Handle events: %s\n", libusb_strerror((enum libusb_error)status));
+            if (stream->status == 0) stream->status = status;
+            stream_stop(stream);
+        }
+    }
+    return stream->status;
+}
+
+const struct libusb_pollfd **stream_get_pollfds(struct stream *stream) {
+    return transport_get_pollfds(stream->ctx);
+}
+
+void stream_free_pollfds(const struct libusb_pollfd **pollfds) {
+    transport_free_pollfds(pollfds);
+}
+
+void stream_set_pollfd_notifiers(struct stream *stream, libusb_pollfd_added_cb added_cb,
+                                 libusb_pollfd_removed_cb removed_cb, void *user_data) {
+    transport_set_pollfd_notifiers(stream->ctx, added_cb, removed_cb, user_data);
+}
+
+int stream_get_timeout(struct stream *stream) {
+    struct timeval tv;
+    // With timerfd support, libusb expires the transfer timeouts through its pollfds
+    if (transport_pollfds_handle_timeouts(stream->ctx)) return -1;
+    if (transport_get_next_timeout(stream->ctx, &tv) != 1) return -1;
+    // Rounded up, waking early would only find nothing to do
+    return (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+}
+
+int stream_handle_events(struct stream *stream) {
+    struct timeval tv = {0, 0};
+    if (stream->status) stream_stop(stream);
+    int status = transport_handle_events_timeout_completed(stream->ctx, &tv, NULL);
+    if (status == LIBUSB_ERROR_INTERRUPTED) status = 0;
+    if (status && stream->status == 0) stream->status = status;
+    return status;
+}
+
+void stream_close(struct stream *stream, struct stream_statistics *stat) {
+    int64_t deadline = now_ns() / 1000 + DRAIN_USEC;
+    // The callbacks use the stream and the transfer buffers, so nothing is freed before all
+    // transfers came back
+    stream_stop(stream);
+    while (stream_running(stream) && now_ns() / 1000 < deadline) {
+        struct timeval tv = {0, 100000};
+        transport_handle_events_timeout_completed(stream->ctx, &tv, NULL);
+    }
+    bool leaked = stream_running(stream);
+    if (leaked) fprintf(stderr, "Error: %u transfers did not come back, leaking them\n", stream->pending);
+    if (stream->started) {
+        transport_control_transfer(stream->dev_handle, LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+                                   0x00, 0x01, 0x00, NULL, 0, 1000);
+    }
+    if (stat) *stat = stream->stat;
+    transport_release_interface(stream->dev_handle, STREAM_INTERFACE);
+    transport_close(stream->dev_handle);
+    transport_exit(stream->ctx);
+    if (leaked) return;
+    for (unsigned i = 0; i < stream->config.queue_size; i++) libusb_free_transfer(stream->transfers[i]);
+    free(stream->transfers);
+    free(stream);
+}
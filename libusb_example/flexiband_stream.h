@@ -0,0 +1,115 @@
+/* libusb_example/flexiband_stream.h
+ *
+ * Capture engine for embedding the record stream in other programs. It opens and configures
+ * the device, keeps the iso transfers queued and hands every completed transfer to a callback,
+ * zero-copy: the data points into the transfer buffers, which are resubmitted as soon as the
+ * callback returns.
+ *
+ * The events can be handled in two ways:
+ *
+ * - Standalone: stream_run() handles them until the stream stopped, usually in a thread of
+ *   its own, like the "thread" pipeline of flexiband_bench.
+ * - Embedded: an existing poll or epoll loop watches the pollfds of stream_get_pollfds(),
+ *   follows changes through stream_set_pollfd_notifiers() and waits at most
+ *   stream_get_timeout(). Whenever a pollfd is ready or the timeout expired, it calls
+ *   stream_handle_events(), which never blocks. The callbacks then run in that loop.
+ *
+ * The functions are not thread-safe; in embedded mode all of them belong to the loop thread.
+ * The backend is chosen by FLEXIBAND_TRANSPORT like for the tools, see transport.h.
+ *
+ * stream_open_device() and stream_claim_device() are the device setup of stream_open() on
+ * their own, for tools that drive the transfers themselves like flexiband_record.
+ */
+
+#ifndef FLEXIBAND_STREAM_H
+#define FLEXIBAND_STREAM_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+#define STREAM_NUM_PKG    32     // iso packets per transfer
+#define STREAM_QUEUE_SIZE 4      // transfers in flight by default
+
+// Device of stream_open_device(), interface and endpoint of stream_claim_device()
+#define STREAM_VID        0x27ae
+#define STREAM_PID        0x1016
+#define STREAM_INTERFACE  0
+#define STREAM_ENDPOINT   0x83   // iso IN
+
+// A completed transfer. data and len are only valid during the callback.
+struct stream_block {
+    unsigned num_packets;
+    const uint8_t *data[STREAM_NUM_PKG];
+    unsigned len[STREAM_NUM_PKG];    // 0 for failed packets
+    uint64_t bytes;                  // sum of len
+    int64_t monotonic_ns;            // when the completion was handled
+};
+
+typedef void (*stream_callback_fn)(const struct stream_block *block, void *user_data);
+
+struct stream_config {
+    unsigned queue_size;             // transfers in flight, 0 for STREAM_QUEUE_SIZE
+    stream_callback_fn callback;
+    void *user_data;
+};
+
+struct stream_statistics {
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t failed_packets;
+};
+
+struct stream;
+
+// Opens the device, detaches a kernel driver and selects the configuration. Returns NULL if it
+// is not there or on errors, which are printed; quiet leaves out the missing device.
+libusb_device_handle *stream_open_device(libusb_context *ctx, bool quiet);
+
+// Claims the interface and selects the alternate setting with the iso endpoint. Returns 0 or a
+// libusb error, which is printed; the interface is released again on failure.
+int stream_claim_device(libusb_device_handle *dev_handle);
+
+// Initializes the transport, opens and claims the device and allocates the transfers; the
+// device does not send yet. Returns NULL and prints the error on failure.
+struct stream *stream_open(const struct stream_config *config);
+
+// Sends the start request and submits the transfers. Returns 0 or a libusb error.
+int stream_start(struct stream *stream);
+
+// Stops resubmitting and cancels the transfers. They come back through the event handling,
+// the stream is not running any more once all have.
+void stream_stop(struct stream *stream);
+
+// True while transfers are in flight
+bool stream_running(const struct stream *stream);
+
+// 0, or the first libusb error or libusb_transfer_status that ended the stream
+int stream_status(const struct stream *stream);
+
+// Standalone mode: handles events until the stream is not running any more, stopping it once
+// *stop is set. Returns stream_status().
+int stream_run(struct stream *stream, const volatile sig_atomic_t *stop);
+
+// Embedded mode: NULL terminated list of the fds to watch for the given events, to be freed
+// with stream_free_pollfds()
+const struct libusb_pollfd **stream_get_pollfds(struct stream *stream);
+
+void stream_free_pollfds(const struct libusb_pollfd **pollfds);
+
+// added_cb and removed_cb are called from stream_handle_events() when fds come and go
+void stream_set_pollfd_notifiers(struct stream *stream, libusb_pollfd_added_cb added_cb,
+                                 libusb_pollfd_removed_cb removed_cb, void *user_data);
+
+// Longest time to wait for the pollfds in ms, as for epoll_wait(): -1 if the fds suffice
+int stream_get_timeout(struct stream *stream);
+
+// Handles what is ready without blocking. Returns 0 or a libusb error.
+int stream_handle_events(struct stream *stream);
+
+// Stops the stream if it is running, waits for the transfers, sends the stop request and
+// closes everything
+void stream_close(struct stream *stream, struct stream_statistics *stat);
+
+#endif
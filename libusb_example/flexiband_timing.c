@@ -0,0 +1,210 @@
+/* libusb_example/flexiband_timing.c
+ *
+ * Writer of the time stamp side-car, see flexiband_timing.h. The stamps of the fit window are
+ * kept relative to the oldest one, so the sums stay exact in doubles over any recording.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flexiband_capture.h"
+#include "flexiband_timing.h"
+
+struct fit {
+    uint64_t frame;          // newest frame in the fit
+    int64_t monotonic_ns;    // fitted time of frame
+    int64_t realtime_ns;
+    double ns_per_frame;
+    double rms_ns;
+    unsigned count;
+};
+
+struct timing {
+    FILE *fp;
+    bool started;
+    bool restarted;                        // the counter starts over at the next stamp
+    uint32_t last_counter;
+    uint64_t frame;                        // unfolded last_counter
+    int64_t next_fit;                      // monotonic ns
+    unsigned num;                          // stamps in the window
+    unsigned head;                         // oldest stamp
+    uint64_t frames[TIMING_WINDOW];
+    int64_t monotonic[TIMING_WINDOW];
+    int64_t realtime[TIMING_WINDOW];
+    bool have_fit;
+    struct fit fit;
+    struct timing_statistics stat;
+};
+
+static int64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct timing *timing_create(const char *filename) {
+    char path[4096];
+    struct timing_header header;
+    struct timing *timing = (struct timing*)calloc(1, sizeof(struct timing));
+    if (timing == NULL) {
+        fprintf(stderr, "Error: allocating timing\n");
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s.timing", filename);
+    timing->fp = fopen(path, "w");
+    if (timing->fp == NULL) {
+        fprintf(stderr, "Failed to open %s\n%s\n", path, strerror(errno));
+        free(timing);
+        return NULL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TIMING_MAGIC, sizeof(header.magic));
+    header.version = TIMING_VERSION;
+    header.byte_order = CAPTURE_BYTE_ORDER;
+    header.frame_len = FRAME_LEN;
+    header.record_len = sizeof(struct timing_record);
+    header.start_realtime_ns = clock_ns(CLOCK_REALTIME);
+    header.start_monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+    if (fwrite(&header, sizeof(header), 1, timing->fp) != 1 || fflush(timing->fp)) {
+        fprintf(stderr, "Failed to write %s\n%s\n", path, strerror(errno));
+        fclose(timing->fp);
+        free(timing);
+        return NULL;
+    }
+    return timing;
+}
+
+// Least squares line through the stamps of the window, leaving out those more than limit_ns
+// above the line of the first pass. Returns false with fewer than two stamps left.
+static bool fit_window(const struct timing *timing, struct fit *fit) {
+    unsigned first = timing->head;
+    uint64_t frame0 = timing->frames[first];
+    int64_t mono0 = timing->monotonic[first];
+    double slope = 0, intercept = 0, limit = INFINITY;
+
+    for (int pass = 0; pass < 2; pass++) {
+        double sx = 0, sy = 0, sxx = 0, sxy = 0, offset = 0;
+        unsigned n = 0;
+        for (unsigned k = 0; k < timing->num; k++) {
+            unsigned i = (first + k) % TIMING_WINDOW;
+            double x = (double)(timing->frames[i] - frame0), y = (double)(timing->monotonic[i] - mono0);
+            if (pass > 0 && y - (intercept + slope * x) > limit) continue;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+            offset += (double)(timing->realtime[i] - timing->monotonic[i]);
+            n++;
+        }
+        double det = n * sxx - sx * sx;
+        if (n < 2 || det <= 0) return pass > 0;
+        slope = (n * sxy - sx * sy) / det;
+        intercept = (sy - slope * sx) / n;
+
+        double sum2 = 0;
+        for (unsigned k = 0; k < timing->num; k++) {
+            unsigned i = (first + k) % TIMING_WINDOW;
+            double x = (double)(timing->frames[i] - frame0), y = (double)(timing->monotonic[i] - mono0);
+            double r = y - (intercept + slope * x);
+            if (r <= limit) sum2 += r * r;
+        }
+        unsigned newest = (first + timing->num - 1) % TIMING_WINDOW;
+        fit->frame = timing->frames[newest];
+        fit->monotonic_ns = mono0 + llround(intercept + slope * (double)(fit->frame - frame0));
+        fit->realtime_ns = fit->monotonic_ns + llround(offset / n);
+        fit->ns_per_frame = slope;
+        fit->rms_ns = sqrt(sum2 / n);
+        fit->count = n;
+        limit = 3 * fit->rms_ns;
+    }
+    return true;
+}
+
+static int write_fit(struct timing *timing) {
+    struct timing_record record;
+    if (!fit_window(timing, &timing->fit)) return 0;
+    timing->have_fit = true;
+    memset(&record, 0, sizeof(record));
+    record.type = TIMING_FIT;
+    record.count = timing->fit.count;
+    record.frame = timing->fit.frame;
+    record.monotonic_ns = timing->fit.monotonic_ns;
+    record.realtime_ns = timing->fit.realtime_ns;
+    record.usb_frame = -1;
+    record.residual_ns = (float)timing->fit.rms_ns;
+    record.ns_per_frame = timing->fit.ns_per_frame;
+    timing->stat.fits++;
+    timing->stat.ns_per_frame = timing->fit.ns_per_frame;
+    timing->stat.rms_ns = timing->fit.rms_ns;
+    if (fwrite(&record, sizeof(record), 1, timing->fp) != 1) return -1;
+    // Flushed with every fit, so an interrupted recording keeps all but the last second
+    return fflush(timing->fp) == 0 ? 0 : -1;
+}
+
+int timing_stamp(struct timing *timing, uint32_t counter, unsigned frames, int64_t monotonic_ns, int64_t realtime_ns,
+                 int32_t usb_frame) {
+    struct timing_record record;
+    if (!timing->started) {
+        timing->started = true;
+        timing->frame = counter;
+        timing->next_fit = monotonic_ns + TIMING_FIT_NS;
+    } else if (timing->restarted) {
+        timing->restarted = false;
+        timing->frame += (uint64_t)counter + 1;
+    } else {
+        timing->frame += (uint32_t)(counter - timing->last_counter);
+    }
+    timing->last_counter = counter;
+
+    unsigned i = (timing->head + timing->num) % TIMING_WINDOW;
+    if (timing->num == TIMING_WINDOW) timing->head = (timing->head + 1) % TIMING_WINDOW;
+    else timing->num++;
+    timing->frames[i] = timing->frame;
+    timing->monotonic[i] = monotonic_ns;
+    timing->realtime[i] = realtime_ns;
+
+    memset(&record, 0, sizeof(record));
+    record.type = TIMING_STAMP;
+    record.count = frames;
+    record.frame = timing->frame;
+    record.monotonic_ns = monotonic_ns;
+    record.realtime_ns = realtime_ns;
+    record.usb_frame = usb_frame;
+    if (timing->have_fit) {
+        double r = monotonic_ns - (timing->fit.monotonic_ns +
+                                   (double)(int64_t)(timing->frame - timing->fit.frame) * timing->fit.ns_per_frame);
+        record.residual_ns = (float)r;
+        if (fabs(r) > timing->stat.max_residual_ns) timing->stat.max_residual_ns = fabs(r);
+    }
+    timing->stat.stamps++;
+    if (fwrite(&record, sizeof(record), 1, timing->fp) != 1) return -1;
+
+    if (monotonic_ns >= timing->next_fit) {
+        timing->next_fit += TIMING_FIT_NS;
+        if (timing->next_fit <= monotonic_ns) timing->next_fit = monotonic_ns + TIMING_FIT_NS;
+        return write_fit(timing);
+    }
+    return 0;
+}
+
+void timing_restart(struct timing *timing) {
+    if (timing->num > 0) write_fit(timing);
+    timing->num = 0;
+    timing->head = 0;
+    timing->have_fit = false;
+    timing->restarted = timing->started;
+}
+
+int timing_close(struct timing *timing, struct timing_statistics *stat) {
+    int status = timing->num > 0 ? write_fit(timing) : 0;
+    if (fclose(timing->fp)) status = -1;
+    if (stat) *stat = timing->stat;
+    free(timing);
+    return status;
+}
@@ -0,0 +1,78 @@
+/* libusb_example/flexiband_timing.h
+ *
+ * Time stamps of the received frames, written by flexiband_record -t to <filename>.timing:
+ * a struct timing_header followed by struct timing_record in the order they were taken.
+ *
+ * Every completed transfer gives a TIMING_STAMP record with both host clocks read when its
+ * callback ran, attributed to the newest frame in it. Callbacks run late by a varying few
+ * hundred microseconds, so a straight line of CLOCK_MONOTONIC over the frame counter is
+ * fitted to the stamps of the last TIMING_WINDOW transfers, and stamps delayed by more than
+ * three times the RMS residual are left out of a second pass. Once per TIMING_FIT_NS a
+ * TIMING_FIT record gives the fitted time of the newest frame and the slope, so the time of
+ * any frame nearby is monotonic_ns + (frame - record.frame) * ns_per_frame. The fit keeps the
+ * average delivery latency of the transfers; it is constant for a given host and setup.
+ *
+ * Frame counters are unfolded over their wraps, starting at the counter of the first stamp.
+ * When the device restarts its counter after a reconnect, the unfolded frames continue after
+ * the last one and the fit starts over.
+ * All fields are in host byte order.
+ */
+
+#ifndef FLEXIBAND_TIMING_H
+#define FLEXIBAND_TIMING_H
+
+#include <stdint.h>
+
+#define TIMING_MAGIC    "FLXBTIM"
+#define TIMING_VERSION  1
+#define TIMING_WINDOW   256                    // transfers in the fit, about 3 s at 40 MB/s
+#define TIMING_FIT_NS   1000000000LL           // between two TIMING_FIT records
+#define TIMING_STAMP    1
+#define TIMING_FIT      2
+
+struct timing_header {
+    char magic[8];                 // TIMING_MAGIC
+    uint32_t version;              // TIMING_VERSION
+    uint32_t byte_order;           // CAPTURE_BYTE_ORDER
+    uint32_t frame_len;            // FRAME_LEN
+    uint32_t record_len;           // sizeof(struct timing_record)
+    int64_t start_realtime_ns;     // CLOCK_REALTIME when the file was created
+    int64_t start_monotonic_ns;    // CLOCK_MONOTONIC at the same moment
+};
+
+struct timing_record {
+    uint32_t type;                 // TIMING_STAMP or TIMING_FIT
+    uint32_t count;                // stamp: frames in the transfer; fit: stamps used
+    uint64_t frame;                // unfolded frame counter
+    int64_t monotonic_ns;          // stamp: when the callback ran; fit: fitted time of frame
+    int64_t realtime_ns;           // stamp: when the callback ran; fit: fitted time of frame
+    int32_t usb_frame;             // stamp: USB frame the transfer started in, -1 if unknown
+    float residual_ns;             // stamp: to the last fit; fit: RMS of the stamps used
+    double ns_per_frame;           // fit: slope; 0 for stamps
+};
+
+struct timing_statistics {
+    uint64_t stamps;
+    uint64_t fits;
+    double ns_per_frame;           // of the last fit, 0 without
+    double rms_ns;                 // RMS residual of the last fit
+    double max_residual_ns;        // largest residual of a stamp to the fit before it
+};
+
+struct timing;
+
+// Creates <filename>.timing. Returns NULL and prints the error on failure.
+struct timing *timing_create(const char *filename);
+
+// Adds the stamp of a transfer whose newest frame has counter. Cheap enough for the transfer
+// callback. Returns 0 or -1 with errno set.
+int timing_stamp(struct timing *timing, uint32_t counter, unsigned frames, int64_t monotonic_ns, int64_t realtime_ns,
+                 int32_t usb_frame);
+
+// The device restarted its frame counter, the next stamp begins a new fit
+void timing_restart(struct timing *timing);
+
+// Writes a last fit, closes the file and frees timing. Returns 0 or -1 with errno set.
+int timing_close(struct timing *timing, struct timing_statistics *stat);
+
+#endif
@@ -0,0 +1,207 @@
+/* libusb_example/flexiband_trigger.c
+ *
+ * Power trigger, see flexiband_trigger.h. The power of a frame is the sum of I^2 + Q^2 over
+ * the fields of the band in the payload bytes (stats_layout()). With SSE2, 16 payload bytes
+ * are widened to 16 bit, I and Q of each field are sign extended by a shift left and an
+ * arithmetic shift right, bytes of other bands are masked and pmaddwd squares and adds
+ * neighbours. The bytes after the last full vector use a table per lane.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "flexiband_stats.h"
+#include "flexiband_trigger.h"
+
+#define QUEUE_LEN 64
+
+enum state { IDLE, ARMING, OPEN, CLOSING };
+
+struct trigger_field {
+    int sll_i;                           // moves the top bit of I to bit 15
+    int sll_q;
+    int sra;                             // 16 - bits
+    uint16_t mask[8];                    // 0xffff for the 16 bit elements of its lane
+};
+
+struct trigger {
+    struct trigger_config config;
+    enum payload_layout layout;
+    unsigned payload_len;
+    unsigned group;
+    unsigned num_fields;
+    struct trigger_field fields[STATS_MAX_LANES];
+    uint8_t squares[STATS_MAX_LANES][256];   // I^2 + Q^2 of the band per lane and byte value
+    double samples_per_frame;
+    double open_ratio;
+    double close_ratio;
+    uint64_t min_open;                   // frames
+    uint64_t min_close;
+
+    double short_power;
+    double long_power;
+    uint64_t frames;
+    enum state state;
+    uint64_t since;                      // frame the threshold was crossed
+    struct trigger_event pending;        // event of that crossing
+
+    struct trigger_event queue[QUEUE_LEN];
+    unsigned head;                       // written by trigger_update(), atomic
+    unsigned tail;                       // written by trigger_next_event(), atomic
+};
+
+static int level(unsigned code, unsigned bits) {
+    return code >= (1u << (bits - 1)) ? (int)code - (1 << bits) : (int)code;
+}
+
+struct trigger *trigger_create(const struct trigger_config *config) {
+    const struct stats_layout *layout = stats_layout((enum payload_layout)config->layout);
+    if (config->band < 0 || layout == NULL) {
+        fprintf(stderr, "Error: The power trigger needs the payload layout\n");
+        return NULL;
+    }
+    if (config->close_db > config->open_db || config->data_rate <= 0) {
+        fprintf(stderr, "Error: The power trigger has to close at or below %.1f dB\n", config->open_db);
+        return NULL;
+    }
+    struct trigger *trigger = (struct trigger*)calloc(1, sizeof(struct trigger));
+    if (trigger == NULL) {
+        fprintf(stderr, "Error: allocating trigger\n");
+        return NULL;
+    }
+    trigger->config = *config;
+    trigger->layout = (enum payload_layout)config->layout;
+    trigger->payload_len = layout_payload_len(trigger->layout);
+    trigger->group = layout->group;
+    for (unsigned f = 0; f < layout->num_fields; f++) {
+        const struct stats_field *field = &layout->fields[f];
+        if ((int)field->band != config->band) continue;
+        struct trigger_field *t = &trigger->fields[trigger->num_fields++];
+        t->sll_i = 16 - (int)(field->shift_i + field->bits);
+        t->sll_q = 16 - (int)(field->shift_q + field->bits);
+        t->sra = 16 - (int)field->bits;
+        for (unsigned k = 0; k < 8; k++) t->mask[k] = k % layout->group == field->lane ? 0xffff : 0;
+        unsigned mask = (1u << field->bits) - 1;
+        for (unsigned b = 0; b < 256; b++) {
+            int i = level((b >> field->shift_i) & mask, field->bits), q = level((b >> field->shift_q) & mask, field->bits);
+            trigger->squares[field->lane][b] += (uint8_t)(i * i + q * q);
+        }
+    }
+    if (trigger->num_fields == 0) {
+        fprintf(stderr, "Error: The power trigger needs a layout with band %s\n", band_names[config->band]);
+        free(trigger);
+        return NULL;
+    }
+    trigger->samples_per_frame = unpack_samples_per_frame(trigger->layout, (enum band)config->band);
+    trigger->open_ratio = pow(10, config->open_db / 10);
+    trigger->close_ratio = pow(10, config->close_db / 10);
+    double frame_rate = config->data_rate / FRAME_LEN;
+    trigger->min_open = (uint64_t)llround(config->min_open_ns / 1e9 * frame_rate);
+    trigger->min_close = (uint64_t)llround(config->min_close_ns / 1e9 * frame_rate);
+    return trigger;
+}
+
+void trigger_free(struct trigger *trigger) {
+    free(trigger);
+}
+
+// Sum of I^2 + Q^2 of the band in one payload
+static uint32_t frame_power(const struct trigger *trigger, const uint8_t *p) {
+    uint32_t sum = 0;
+    unsigned i = 0;
+#ifdef __SSE2__
+    __m128i sll_i[STATS_MAX_LANES], sll_q[STATS_MAX_LANES], sra[STATS_MAX_LANES], mask[STATS_MAX_LANES];
+    for (unsigned f = 0; f < trigger->num_fields; f++) {
+        sll_i[f] = _mm_cvtsi32_si128(trigger->fields[f].sll_i);
+        sll_q[f] = _mm_cvtsi32_si128(trigger->fields[f].sll_q);
+        sra[f] = _mm_cvtsi32_si128(trigger->fields[f].sra);
+        mask[f] = _mm_loadu_si128((const __m128i*)trigger->fields[f].mask);
+    }
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 16 <= trigger->payload_len; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(p + i));
+        // The lanes repeat every 1, 2 or 4 bytes, so both halves share the masks
+        __m128i halves[2] = {_mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero)};
+        for (int h = 0; h < 2; h++) {
+            for (unsigned f = 0; f < trigger->num_fields; f++) {
+                __m128i vi = _mm_and_si128(_mm_sra_epi16(_mm_sll_epi16(halves[h], sll_i[f]), sra[f]), mask[f]);
+                __m128i vq = _mm_and_si128(_mm_sra_epi16(_mm_sll_epi16(halves[h], sll_q[f]), sra[f]), mask[f]);
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(vi, vi));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(vq, vq));
+            }
+        }
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = (uint32_t)_mm_cvtsi128_si32(acc);
+#endif
+    for (; i < trigger->payload_len; i++) sum += trigger->squares[i % trigger->group][p[i]];
+    return sum;
+}
+
+static void push_event(struct trigger *trigger, const struct trigger_event *event) {
+    unsigned head = trigger->head;
+    if (head - __atomic_load_n(&trigger->tail, __ATOMIC_ACQUIRE) >= QUEUE_LEN) return;
+    trigger->queue[head % QUEUE_LEN] = *event;
+    __atomic_store_n(&trigger->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void step(struct trigger *trigger, double power, uint32_t counter, uint64_t pos, int64_t monotonic_ns) {
+    if (trigger->frames++ == 0) trigger->short_power = trigger->long_power = power;
+    trigger->short_power += (power - trigger->short_power) / TRIGGER_SHORT_FRAMES;
+    if (trigger->state == IDLE) trigger->long_power += (power - trigger->long_power) / TRIGGER_LONG_FRAMES;
+    if (trigger->frames <= TRIGGER_LONG_FRAMES || trigger->long_power <= 0) return;
+
+    double ratio = trigger->short_power / trigger->long_power;
+    struct trigger_event crossing = {TRIGGER_OPEN, counter, pos, monotonic_ns, 10 * log10(ratio)};
+    if (trigger->state == IDLE && ratio >= trigger->open_ratio) {
+        trigger->state = ARMING;
+        trigger->since = trigger->frames;
+        trigger->pending = crossing;
+    }
+    if (trigger->state == ARMING) {
+        if (ratio < trigger->open_ratio) {
+            trigger->state = IDLE;
+        } else if (trigger->frames - trigger->since >= trigger->min_open) {
+            push_event(trigger, &trigger->pending);
+            trigger->state = OPEN;
+        }
+    } else if (trigger->state == OPEN && ratio < trigger->close_ratio) {
+        trigger->state = CLOSING;
+        trigger->since = trigger->frames;
+        trigger->pending = crossing;
+        trigger->pending.type = TRIGGER_CLOSE;
+    }
+    if (trigger->state == CLOSING) {
+        if (ratio >= trigger->close_ratio) {
+            trigger->state = OPEN;
+        } else if (trigger->frames - trigger->since >= trigger->min_close) {
+            push_event(trigger, &trigger->pending);
+            trigger->state = IDLE;
+        }
+    }
+}
+
+void trigger_update(struct trigger *trigger, const uint8_t *data, size_t len, uint64_t pos, int64_t monotonic_ns) {
+    uint64_t first = (pos + FRAME_LEN - 1) / FRAME_LEN * FRAME_LEN;
+    for (uint64_t frame = first; frame + FRAME_LEN <= pos + len; frame += FRAME_LEN) {
+        const uint8_t *p = data + (frame - pos);
+        if (!frame_has_preamble(p)) continue;
+        double power = frame_power(trigger, p + FRAME_HEADER_LEN) / trigger->samples_per_frame;
+        step(trigger, power, frame_counter(p), frame, monotonic_ns);
+    }
+}
+
+bool trigger_next_event(struct trigger *trigger, struct trigger_event *event) {
+    unsigned tail = trigger->tail;
+    if (tail == __atomic_load_n(&trigger->head, __ATOMIC_ACQUIRE)) return false;
+    *event = trigger->queue[tail % QUEUE_LEN];
+    __atomic_store_n(&trigger->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
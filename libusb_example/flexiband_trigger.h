@@ -0,0 +1,59 @@
+/* libusb_example/flexiband_trigger.h
+ *
+ * Power trigger of the pre-trigger ring, flexiband_record -R -P. The power of one band is
+ * computed for every frame directly on the packed payload (with SSE2 where available) and
+ * averaged short-term and long-term. A window opens when the short-term power has stayed at
+ * least open_db over the long-term average for min_open_ns, and closes when it has stayed
+ * below close_db for min_close_ns; close_db below open_db gives the hysteresis. The long-term
+ * average is held while a window is open or about to open, so a long event does not raise
+ * its own reference.
+ *
+ * trigger_update() runs in the transfer callback. The opening and closing of windows are
+ * queued as events and taken from another thread with trigger_next_event().
+ */
+
+#ifndef FLEXIBAND_TRIGGER_H
+#define FLEXIBAND_TRIGGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRIGGER_SHORT_FRAMES 128        // short-term average, about 3 ms at 40 MB/s
+#define TRIGGER_LONG_FRAMES  32768      // long-term average, about 1 s at 40 MB/s
+
+struct trigger_config {
+    int band;                  // enum band, -1 for no power trigger
+    uint32_t layout;           // enum payload_layout
+    double open_db;            // short-term over long-term power that opens a window
+    double close_db;           // below which it closes, at most open_db
+    int64_t min_open_ns;       // the power has to stay over open_db this long to open
+    int64_t min_close_ns;      // and below close_db this long to close
+    double data_rate;          // bytes per second, converts the times to frames
+};
+
+enum trigger_event_type { TRIGGER_OPEN, TRIGGER_CLOSE };
+
+struct trigger_event {
+    enum trigger_event_type type;
+    uint32_t counter;          // of the frame that first crossed the threshold
+    uint64_t pos;              // its stream position
+    int64_t monotonic_ns;      // completion time of its transfer
+    double level_db;           // short-term over long-term power at the event
+};
+
+struct trigger;
+
+// Returns NULL and prints the error on failure
+struct trigger *trigger_create(const struct trigger_config *config);
+
+void trigger_free(struct trigger *trigger);
+
+// Evaluates the frames that lie completely in data. pos is the stream position of data,
+// frames without preamble are skipped. Events are dropped if the queue is full.
+void trigger_update(struct trigger *trigger, const uint8_t *data, size_t len, uint64_t pos, int64_t monotonic_ns);
+
+// Takes the oldest queued event. Returns false if there is none.
+bool trigger_next_event(struct trigger *trigger, struct trigger_event *event);
+
+#endif
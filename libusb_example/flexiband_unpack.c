@@ -0,0 +1,72 @@
+/* libusb_example/flexiband_unpack.c
+ *
+ * Every payload byte is unpacked with a lookup table, so a frame costs one table access per
+ * byte and band.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "flexiband_unpack.h"
+
+const char *const band_names[NUM_BANDS] = {"L1", "L2", "L5"};
+
+// 4 bit I [7:4] and Q [3:0] of one byte
+static int8_t iq4[256][2];
+// 2 bit I and Q of two bands: L2 I [7:6], L2 Q [5:4], L1 I [3:2], L1 Q [1:0]
+static int8_t iq2[256][4];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static int8_t sign_extend(unsigned value, int bits) {
+    return (int8_t)(value >= (1u << (bits - 1)) ? (int)value - (1 << bits) : (int)value);
+}
+
+static void init_tables(void) {
+    for (unsigned b = 0; b < 256; b++) {
+        iq4[b][0] = sign_extend(b >> 4, 4);
+        iq4[b][1] = sign_extend(b & 0x0f, 4);
+        iq2[b][0] = sign_extend((b >> 6) & 0x03, 2);
+        iq2[b][1] = sign_extend((b >> 4) & 0x03, 2);
+        iq2[b][2] = sign_extend((b >> 2) & 0x03, 2);
+        iq2[b][3] = sign_extend(b & 0x03, 2);
+    }
+}
+
+unsigned unpack_samples_per_frame(enum payload_layout layout, enum band band) {
+    switch (layout) {
+    case LAYOUT_I_3: return band == BAND_L5 ? FRAME_MAX_PAYLOAD : 0;
+    case LAYOUT_III_1A: return FRAME_MAX_PAYLOAD / 2;
+    case LAYOUT_III_1B: return band == BAND_L5 ? 1012 / 2 : 1012 / 4;
+    default: return 0;
+    }
+}
+
+void unpack_frame(enum payload_layout layout, const uint8_t *frame, int8_t *out[NUM_BANDS]) {
+    const uint8_t *p = frame + FRAME_HEADER_LEN;
+    int8_t *l1 = out[BAND_L1], *l2 = out[BAND_L2], *l5 = out[BAND_L5];
+
+    pthread_once(&tables_once, init_tables);
+    switch (layout) {
+    case LAYOUT_I_3:
+        if (l5 == NULL) break;
+        for (unsigned i = 0; i < FRAME_MAX_PAYLOAD; i++, l5 += 2) memcpy(l5, iq4[p[i]], 2);
+        break;
+    case LAYOUT_III_1A:
+        for (unsigned i = 0; i < FRAME_MAX_PAYLOAD; i += 2) {
+            const int8_t *s = iq2[p[i]];
+            if (l2) { memcpy(l2, s, 2); l2 += 2; }
+            if (l1) { memcpy(l1, s + 2, 2); l1 += 2; }
+            if (l5) { memcpy(l5, iq4[p[i + 1]], 2); l5 += 2; }
+        }
+        break;
+    case LAYOUT_III_1B:
+        for (unsigned i = 0; i < 1012; i += 4) {
+            if (l2) { memcpy(l2, iq4[p[i]], 2); l2 += 2; }
+            if (l1) { memcpy(l1, iq4[p[i + 1]], 2); l1 += 2; }
+            if (l5) { memcpy(l5, iq4[p[i + 2]], 2); memcpy(l5 + 2, iq4[p[i + 3]], 2); l5 += 4; }
+        }
+        break;
+    default:
+        break;
+    }
+}
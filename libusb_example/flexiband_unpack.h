@@ -0,0 +1,25 @@
+/* libusb_example/flexiband_unpack.h
+ *
+ * Unpacks the payload of Flexiband frames into signed 8 bit samples, see "Payload" in
+ * README.md. Samples are two's complement; I and Q are interleaved in the output.
+ */
+
+#ifndef FLEXIBAND_UNPACK_H
+#define FLEXIBAND_UNPACK_H
+
+#include <stdint.h>
+
+#include "flexiband_frame.h"
+
+enum band { BAND_L1, BAND_L2, BAND_L5, NUM_BANDS };
+
+extern const char *const band_names[NUM_BANDS];
+
+// Complex samples of the band in one frame, 0 if the layout does not contain the band
+unsigned unpack_samples_per_frame(enum payload_layout layout, enum band band);
+
+// Unpacks one frame. out[band] receives 2 * unpack_samples_per_frame() bytes; bands with a
+// NULL pointer are skipped.
+void unpack_frame(enum payload_layout layout, const uint8_t *frame, int8_t *out[NUM_BANDS]);
+
+#endif
@@ -0,0 +1,209 @@
+/* libusb_example/transport.c
+ *
+ * Dispatches the transport_* functions to the backend selected by transport_init(), see
+ * transport.h. The libusb backend is a table of the libusb functions themselves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "transport.h"
+
+// Same as libusb_handle_events() and libusb_handle_events_completed()
+#define DEFAULT_EVENT_TIMEOUT_SEC 60
+
+static int usb_init(libusb_context **ctx, const char *options) {
+    return libusb_init(ctx);
+}
+
+static int usb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev, libusb_device_handle **dev_handle) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000107)
+    return libusb_wrap_sys_device(ctx, sys_dev, dev_handle);
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+static int usb_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id,
+                                        int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data,
+                                        libusb_hotplug_callback_handle *callback_handle) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) return LIBUSB_ERROR_NOT_SUPPORTED;
+    return libusb_hotplug_register_callback(ctx, events, flags, vendor_id, product_id, dev_class, cb_fn, user_data,
+                                            callback_handle);
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+static void usb_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+    libusb_hotplug_deregister_callback(ctx, callback_handle);
+#endif
+}
+
+static void usb_free_pollfds(const struct libusb_pollfd **pollfds) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000104)
+    libusb_free_pollfds(pollfds);
+#else
+    free((void*)pollfds);
+#endif
+}
+
+const struct transport_ops transport_usb = {
+    .name = "usb",
+    .init = usb_init,
+    .exit = libusb_exit,
+    .open_device_with_vid_pid = libusb_open_device_with_vid_pid,
+    .wrap_sys_device = usb_wrap_sys_device,
+    .close = libusb_close,
+    .kernel_driver_active = libusb_kernel_driver_active,
+    .detach_kernel_driver = libusb_detach_kernel_driver,
+    .set_configuration = libusb_set_configuration,
+    .reset_device = libusb_reset_device,
+    .claim_interface = libusb_claim_interface,
+    .release_interface = libusb_release_interface,
+    .set_interface_alt_setting = libusb_set_interface_alt_setting,
+    .control_transfer = libusb_control_transfer,
+    .submit_transfer = libusb_submit_transfer,
+    .cancel_transfer = libusb_cancel_transfer,
+    .handle_events_timeout_completed = libusb_handle_events_timeout_completed,
+    .hotplug_register_callback = usb_hotplug_register_callback,
+    .hotplug_deregister_callback = usb_hotplug_deregister_callback,
+    .get_pollfds = libusb_get_pollfds,
+    .free_pollfds = usb_free_pollfds,
+    .set_pollfd_notifiers = libusb_set_pollfd_notifiers,
+    .get_next_timeout = libusb_get_next_timeout,
+    .pollfds_handle_timeouts = libusb_pollfds_handle_timeouts,
+};
+
+static const struct transport_ops *ops = &transport_usb;
+
+int transport_init(libusb_context **ctx) {
+    static const struct transport_ops *const backends[] = {&transport_usb, &transport_emu};
+    const char *spec = getenv(TRANSPORT_ENV);
+    const char *options = NULL;
+
+    if (spec != NULL && spec[0] != '\0') {
+        size_t len = strcspn(spec, ":");
+        ops = NULL;
+        for (unsigned i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+            if (strlen(backends[i]->name) == len && strncmp(backends[i]->name, spec, len) == 0) ops = backends[i];
+        }
+        if (ops == NULL) {
+            fprintf(stderr, "Error: Unknown transport %s\n", spec);
+            ops = &transport_usb;
+            return LIBUSB_ERROR_NOT_SUPPORTED;
+        }
+        if (spec[len] == ':') options = spec + len + 1;
+    }
+    return ops->init(ctx, options);
+}
+
+const char *transport_name(void) {
+    return ops->name;
+}
+
+void transport_exit(libusb_context *ctx) {
+    ops->exit(ctx);
+}
+
+libusb_device_handle *transport_open_device_with_vid_pid(libusb_context *ctx, uint16_t vid, uint16_t pid) {
+    return ops->open_device_with_vid_pid(ctx, vid, pid);
+}
+
+int transport_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev, libusb_device_handle **dev_handle) {
+    return ops->wrap_sys_device(ctx, sys_dev, dev_handle);
+}
+
+void transport_close(libusb_device_handle *dev_handle) {
+    ops->close(dev_handle);
+}
+
+int transport_kernel_driver_active(libusb_device_handle *dev_handle, int interface) {
+    return ops->kernel_driver_active(dev_handle, interface);
+}
+
+int transport_detach_kernel_driver(libusb_device_handle *dev_handle, int interface) {
+    return ops->detach_kernel_driver(dev_handle, interface);
+}
+
+int transport_set_configuration(libusb_device_handle *dev_handle, int configuration) {
+    return ops->set_configuration(dev_handle, configuration);
+}
+
+int transport_reset_device(libusb_device_handle *dev_handle) {
+    return ops->reset_device(dev_handle);
+}
+
+int transport_claim_interface(libusb_device_handle *dev_handle, int interface) {
+    return ops->claim_interface(dev_handle, interface);
+}
+
+int transport_release_interface(libusb_device_handle *dev_handle, int interface) {
+    return ops->release_interface(dev_handle, interface);
+}
+
+int transport_set_interface_alt_setting(libusb_device_handle *dev_handle, int interface, int alt_setting) {
+    return ops->set_interface_alt_setting(dev_handle, interface, alt_setting);
+}
+
+int transport_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t request, uint16_t value,
+                               uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout) {
+    return ops->control_transfer(dev_handle, request_type, request, value, index, data, length, timeout);
+}
+
+int transport_submit_transfer(struct libusb_transfer *transfer) {
+    return ops->submit_transfer(transfer);
+}
+
+int transport_cancel_transfer(struct libusb_transfer *transfer) {
+    return ops->cancel_transfer(transfer);
+}
+
+int transport_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed) {
+    return ops->handle_events_timeout_completed(ctx, tv, completed);
+}
+
+int transport_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id,
+                                        int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data,
+                                        libusb_hotplug_callback_handle *callback_handle) {
+    return ops->hotplug_register_callback(ctx, events, flags, vendor_id, product_id, dev_class, cb_fn, user_data,
+                                          callback_handle);
+}
+
+void transport_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle) {
+    ops->hotplug_deregister_callback(ctx, callback_handle);
+}
+
+const struct libusb_pollfd **transport_get_pollfds(libusb_context *ctx) {
+    return ops->get_pollfds(ctx);
+}
+
+void transport_free_pollfds(const struct libusb_pollfd **pollfds) {
+    ops->free_pollfds(pollfds);
+}
+
+void transport_set_pollfd_notifiers(libusb_context *ctx, libusb_pollfd_added_cb added_cb,
+                                    libusb_pollfd_removed_cb removed_cb, void *user_data) {
+    ops->set_pollfd_notifiers(ctx, added_cb, removed_cb, user_data);
+}
+
+int transport_get_next_timeout(libusb_context *ctx, struct timeval *tv) {
+    return ops->get_next_timeout(ctx, tv);
+}
+
+int transport_pollfds_handle_timeouts(libusb_context *ctx) {
+    return ops->pollfds_handle_timeouts(ctx);
+}
+
+int transport_handle_events_completed(libusb_context *ctx, int *completed) {
+    struct timeval tv = {DEFAULT_EVENT_TIMEOUT_SEC, 0};
+    return ops->handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+int transport_handle_events(libusb_context *ctx) {
+    return transport_handle_events_completed(ctx, NULL);
+}
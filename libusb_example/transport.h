@@ -0,0 +1,120 @@
+/* libusb_example/transport.h
+ *
+ * Pluggable transport for the example tools. All functions mirror the libusb function of the
+ * same name without the transport_ prefix. The backend is chosen by transport_init() from the
+ * environment variable FLEXIBAND_TRANSPORT:
+ *
+ *   unset or "usb"          libusb, i.e. real hardware
+ *   "emu[:<options>]"       loopback emulator of a Flexiband, see transport_emu.c
+ *
+ * Emulator options are comma separated key=value pairs:
+ *
+ *   rate=<bytes/s>          Line rate of the iso stream and the playback sink (default 40e6)
+ *   layout=I-3|III-1a|III-1b  Payload layout of the generated frames (default III-1a)
+ *   drop=<probability>      Frames silently dropped, the counter skips (default 0)
+ *   error=<probability>     Iso packets completed with an error (default 0)
+ *   seed=<n>                Seed of the random generator (default 1)
+ *   amp=<n>                 DAC default of the RF boards, 0x80 loads the quantizers optimally (default 0x80)
+ *   unplug=<seconds>        The device drops off the bus this long after every start request (default never)
+ *   replug=<seconds>        and comes back after this long (default 0.5)
+ *
+ * Example: FLEXIBAND_TRANSPORT=emu:rate=80e6,drop=1e-5 ./flexiband_record 1e9 out.bin
+ *
+ * Hotplug callbacks of the emulator get a NULL device; they run from the event handling like
+ * the libusb ones.
+ *
+ * For event loops of their own, the emulator has one pollfd, a timerfd that becomes readable
+ * when the next transfer is due. It handles all timeouts itself and never calls the pollfd
+ * notifiers, as the fd lives as long as the context.
+ *
+ * The inline helpers of libusb.h (libusb_fill_*, libusb_get_iso_packet_buffer_simple(), ...)
+ * work with both backends and are used as before.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+#define TRANSPORT_ENV "FLEXIBAND_TRANSPORT"
+
+#if !defined(LIBUSB_API_VERSION) || (LIBUSB_API_VERSION < 0x01000102)
+// libusb before 1.0.16 has no hotplug API, transport_hotplug_register_callback() always fails there
+typedef int libusb_hotplug_callback_handle;
+typedef enum { LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED = 1, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT = 2 } libusb_hotplug_event;
+typedef enum { LIBUSB_HOTPLUG_NO_FLAGS = 0, LIBUSB_HOTPLUG_ENUMERATE = 1 } libusb_hotplug_flag;
+#define LIBUSB_HOTPLUG_MATCH_ANY -1
+typedef int (*libusb_hotplug_callback_fn)(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event,
+                                          void *user_data);
+#endif
+
+struct transport_ops {
+    const char *name;
+    int (*init)(libusb_context **ctx, const char *options);
+    void (*exit)(libusb_context *ctx);
+    libusb_device_handle *(*open_device_with_vid_pid)(libusb_context *ctx, uint16_t vid, uint16_t pid);
+    int (*wrap_sys_device)(libusb_context *ctx, intptr_t sys_dev, libusb_device_handle **dev_handle);
+    void (*close)(libusb_device_handle *dev_handle);
+    int (*kernel_driver_active)(libusb_device_handle *dev_handle, int interface);
+    int (*detach_kernel_driver)(libusb_device_handle *dev_handle, int interface);
+    int (*set_configuration)(libusb_device_handle *dev_handle, int configuration);
+    int (*reset_device)(libusb_device_handle *dev_handle);
+    int (*claim_interface)(libusb_device_handle *dev_handle, int interface);
+    int (*release_interface)(libusb_device_handle *dev_handle, int interface);
+    int (*set_interface_alt_setting)(libusb_device_handle *dev_handle, int interface, int alt_setting);
+    int (*control_transfer)(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t request, uint16_t value,
+                            uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout);
+    int (*submit_transfer)(struct libusb_transfer *transfer);
+    int (*cancel_transfer)(struct libusb_transfer *transfer);
+    int (*handle_events_timeout_completed)(libusb_context *ctx, struct timeval *tv, int *completed);
+    int (*hotplug_register_callback)(libusb_context *ctx, int events, int flags, int vendor_id, int product_id,
+                                     int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data,
+                                     libusb_hotplug_callback_handle *callback_handle);
+    void (*hotplug_deregister_callback)(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle);
+    const struct libusb_pollfd **(*get_pollfds)(libusb_context *ctx);
+    void (*free_pollfds)(const struct libusb_pollfd **pollfds);
+    void (*set_pollfd_notifiers)(libusb_context *ctx, libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
+                                 void *user_data);
+    int (*get_next_timeout)(libusb_context *ctx, struct timeval *tv);
+    int (*pollfds_handle_timeouts)(libusb_context *ctx);
+};
+
+extern const struct transport_ops transport_usb;
+extern const struct transport_ops transport_emu;
+
+// Selects the backend from FLEXIBAND_TRANSPORT and initializes it
+int transport_init(libusb_context **ctx);
+void transport_exit(libusb_context *ctx);
+const char *transport_name(void);
+
+libusb_device_handle *transport_open_device_with_vid_pid(libusb_context *ctx, uint16_t vid, uint16_t pid);
+int transport_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev, libusb_device_handle **dev_handle);
+void transport_close(libusb_device_handle *dev_handle);
+int transport_kernel_driver_active(libusb_device_handle *dev_handle, int interface);
+int transport_detach_kernel_driver(libusb_device_handle *dev_handle, int interface);
+int transport_set_configuration(libusb_device_handle *dev_handle, int configuration);
+int transport_reset_device(libusb_device_handle *dev_handle);
+int transport_claim_interface(libusb_device_handle *dev_handle, int interface);
+int transport_release_interface(libusb_device_handle *dev_handle, int interface);
+int transport_set_interface_alt_setting(libusb_device_handle *dev_handle, int interface, int alt_setting);
+int transport_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t request, uint16_t value,
+                               uint16_t index, unsigned char *data, uint16_t length, unsigned int timeout);
+int transport_submit_transfer(struct libusb_transfer *transfer);
+int transport_cancel_transfer(struct libusb_transfer *transfer);
+int transport_handle_events(libusb_context *ctx);
+int transport_handle_events_completed(libusb_context *ctx, int *completed);
+int transport_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed);
+// LIBUSB_ERROR_NOT_SUPPORTED if the platform or libusb has no hotplug support
+int transport_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id,
+                                        int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data,
+                                        libusb_hotplug_callback_handle *callback_handle);
+void transport_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle);
+const struct libusb_pollfd **transport_get_pollfds(libusb_context *ctx);
+void transport_free_pollfds(const struct libusb_pollfd **pollfds);
+void transport_set_pollfd_notifiers(libusb_context *ctx, libusb_pollfd_added_cb added_cb,
+                                    libusb_pollfd_removed_cb removed_cb, void *user_data);
+int transport_get_next_timeout(libusb_context *ctx, struct timeval *tv);
+int transport_pollfds_handle_timeouts(libusb_context *ctx);
+
+#endif
@@ -0,0 +1,971 @@
+/* libusb_example/transport_emu.c
+ *
+ * Loopback emulator of a Flexiband, selected with FLEXIBAND_TRANSPORT=emu[:<options>], see
+ * transport.h. It lets the example tools run without hardware:
+ *
+ * - Iso IN transfers return correctly framed 1024 byte frames (preamble, counter, payload in
+ *   the chosen layout, zero padding) at the configured line rate, once the "Start data
+ *   transfer" request was received. Frames can be dropped and packets failed at random. If
+ *   the application does not keep transfers queued, the frames of the gap are lost, like on
+ *   the device.
+ * - Bulk OUT transfers (playback) are consumed at the line rate. Framing and counter of the
+ *   sunk data are checked.
+ * - The vendor requests documented in README.md are answered from an emulated device state.
+ * - With unplug=, the device drops off the bus that long after each start request: queued
+ *   transfers complete with LIBUSB_TRANSFER_NO_DEVICE, everything else fails with
+ *   LIBUSB_ERROR_NO_DEVICE and the handle is dead. After replug= it can be opened again, in
+ *   its power-on state, and a registered hotplug callback learns about both events.
+ * - The event handling can be driven from an external poll loop: a timerfd, the only pollfd,
+ *   is kept armed for the next due transfer.
+ *
+ * The payload repeats every PATTERN_FRAMES frames. It contains one tone per band in Gaussian
+ * noise, so the data passes through any processing stage like real samples. At the default
+ * amplification the noise loads each quantizer optimally; "Set RF-Board Amplification" scales
+ * the band of the slot by the nominal 70 dB over the DAC range.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+
+#include "flexiband_frame.h"
+#include "transport.h"
+
+#define EMU_VID            0x27ae
+#define NUM_SLOTS          3
+#define PATTERN_FRAMES     64
+#define NS_PER_SEC         1000000000LL
+#define CONTROL_LATENCY_NS 125000  // one microframe per control request
+#define EMU_BUILD          1
+#define EMU_HASH           0x656d7500  // "emu"
+#define EMU_SERIAL         "EMU0001"
+#define FPGA_STATE_IDLE    0xF0
+#define AMP_DEFAULT        0x80
+#define AMP_DB_PER_STEP    (70.0 / 255)
+
+struct emu_node {
+    struct libusb_transfer *transfer;
+    int64_t due;
+    bool cancelled;
+    struct emu_node *next;
+};
+
+struct emu_config {
+    double rate;  // bytes/s
+    enum payload_layout layout;
+    double drop;
+    double error;
+    uint64_t seed;
+    unsigned amp;  // DAC default of the RF boards
+    double unplug; // s after start, 0 for never
+    double replug; // s
+};
+
+struct emu_context;
+
+struct emu_device {
+    struct emu_context *ctx;
+    bool present;
+    bool open;
+    bool started;
+    int alt_setting;
+    int64_t unplug_time;     // 0 if not scheduled
+    int64_t replug_time;
+    uint32_t counter;
+    uint8_t fpga_state;
+    uint8_t agc;
+    uint8_t rf_info[NUM_SLOTS];
+    uint8_t amp[NUM_SLOTS];
+    uint8_t ant_power_default[NUM_SLOTS];
+    // Statistics, printed on exit
+    uint64_t frames;
+    uint64_t dropped_frames;
+    uint64_t error_packets;
+    uint64_t error_frames;
+    uint64_t overrun_frames;
+    uint64_t sunk_bytes;
+    uint64_t sunk_frames;
+    uint64_t bad_frames;
+    uint64_t counter_gaps;
+    uint64_t unplugs;
+    bool sink_synced;
+    uint32_t sink_counter;
+};
+
+struct emu_context {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct emu_config config;
+    struct emu_device device;
+    struct emu_node *queue;  // sorted by due time
+    struct emu_node *free_nodes;
+    int64_t stream_time;     // end of the iso data already scheduled
+    int64_t sink_time;       // end of the playback data already scheduled
+    int64_t control_time;    // EP0 executes one request after the other
+    uint64_t rng;
+    // One hotplug callback, called from the event handling with pending_event
+    libusb_hotplug_callback_fn hotplug_cb;
+    void *hotplug_user_data;
+    int hotplug_events;
+    libusb_hotplug_event pending_event;  // 0 for none
+    int timer_fd;            // readable once the next transfer is due
+    int64_t timer_due;       // what it is armed for, INT64_MAX if disarmed
+    struct libusb_pollfd pollfd;
+    // Samples of the pattern at unit gain, up to two I/Q pairs per byte, drawn once at init
+    float unit[PATTERN_FRAMES][FRAME_MAX_PAYLOAD][4];
+    uint8_t pattern[PATTERN_FRAMES][FRAME_MAX_PAYLOAD];
+};
+
+static int64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static struct emu_device *device_of(libusb_device_handle *dev_handle) {
+    return (struct emu_device*)dev_handle;
+}
+
+static struct emu_context *context_of(libusb_context *ctx) {
+    return (struct emu_context*)ctx;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double random_uniform(struct emu_context *ctx) {
+    ctx->rng ^= ctx->rng >> 12;
+    ctx->rng ^= ctx->rng << 25;
+    ctx->rng ^= ctx->rng >> 27;
+    return ((ctx->rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool random_event(struct emu_context *ctx, double probability) {
+    return probability > 0 && random_uniform(ctx) < probability;
+}
+
+// Standard normal, Box-Muller
+static double random_normal(uint64_t *state) {
+    double u[2];
+    for (int i = 0; i < 2; i++) {
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        u[i] = (((*state * 0x2545F4914F6CDD1DULL) >> 11) + 1) * (1.0 / 9007199254740993.0);
+    }
+    return sqrt(-2 * log(u[0])) * cos(2 * M_PI * u[1]);
+}
+
+// I and Q of a tone of the given phase plus noise, in steps of the quantizer at unit gain: the
+// noise puts 32 % of the 2 bit and 18 % of the 4 bit samples at or beyond half scale, the tone
+// is 6 dB below it
+static void iq_values(float *iq, double cycles, int bits, uint64_t *noise) {
+    double sigma = (1 << (bits - 2)) / (bits <= 2 ? 1.0 : 1.34);
+    iq[0] = sigma * (random_normal(noise) + 0.5 * cos(2 * M_PI * cycles));
+    iq[1] = sigma * (random_normal(noise) + 0.5 * sin(2 * M_PI * cycles));
+}
+
+static uint8_t quantize(float value, int bits, double gain) {
+    int q = (int)floor(gain * value);
+    int max = 1 << (bits - 1);
+    q = q < -max ? -max : q >= max ? max - 1 : q;
+    return (uint8_t)q & ((1 << bits) - 1);
+}
+
+static uint8_t iq_sample(const float *iq, int bits, double gain) {
+    return (quantize(iq[0], bits, gain) << bits) | quantize(iq[1], bits, gain);
+}
+
+// Tones complete an integer number of cycles per pattern, so the repetition is seamless. The
+// noise is drawn once; create_pattern() only scales it.
+static void create_unit_pattern(struct emu_context *ctx) {
+    const double l1_cycles = 37, l2_cycles = 53, l5_cycles = 101;
+    enum payload_layout layout = ctx->config.layout;
+    unsigned len = layout_payload_len(layout);
+    uint64_t noise = 0x9E3779B97F4A7C15ULL;
+
+    for (unsigned f = 0; f < PATTERN_FRAMES; f++) {
+        for (unsigned i = 0; i < len; i++) {
+            float *unit = ctx->unit[f][i];
+            // Sample index within the pattern and number of samples per pattern of the band
+            double n = f * len + i;
+            double total = (double)PATTERN_FRAMES * len;
+            switch (layout) {
+            case LAYOUT_I_3:
+                iq_values(unit, l5_cycles * n / total, 4, &noise);
+                break;
+            case LAYOUT_III_1A:
+                if (i % 2 == 0) {
+                    iq_values(unit, l2_cycles * n / total, 2, &noise);
+                    iq_values(unit + 2, l1_cycles * n / total, 2, &noise);
+                } else {
+                    iq_values(unit, l5_cycles * n / total, 4, &noise);
+                }
+                break;
+            case LAYOUT_III_1B:
+                switch (i % 4) {
+                case 0: iq_values(unit, l2_cycles * n / total, 4, &noise); break;
+                case 1: iq_values(unit, l1_cycles * n / total, 4, &noise); break;
+                default: iq_values(unit, l5_cycles * n / total, 4, &noise); break;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+// Quantizes the unit pattern with the amplification of each slot, cheap enough to run under
+// the lock on every change
+static void create_pattern(struct emu_context *ctx) {
+    enum payload_layout layout = ctx->config.layout;
+    unsigned len = layout_payload_len(layout);
+    double gain[NUM_SLOTS];
+
+    // Slots 0, 1 and 2 hold L1, L2 and L5
+    for (int slot = 0; slot < NUM_SLOTS; slot++) {
+        gain[slot] = pow(10, ((int)ctx->device.amp[slot] - AMP_DEFAULT) * AMP_DB_PER_STEP / 20);
+    }
+
+    for (unsigned f = 0; f < PATTERN_FRAMES; f++) {
+        uint8_t *payload = ctx->pattern[f];
+        memset(payload, 0, FRAME_MAX_PAYLOAD);
+        for (unsigned i = 0; i < len; i++) {
+            const float *unit = ctx->unit[f][i];
+            switch (layout) {
+            case LAYOUT_I_3:
+                payload[i] = iq_sample(unit, 4, gain[2]);
+                break;
+            case LAYOUT_III_1A:
+                if (i % 2 == 0) payload[i] = (iq_sample(unit, 2, gain[1]) << 4) | iq_sample(unit + 2, 2, gain[0]);
+                else payload[i] = iq_sample(unit, 4, gain[2]);
+                break;
+            case LAYOUT_III_1B:
+                switch (i % 4) {
+                case 0: payload[i] = iq_sample(unit, 4, gain[1]); break;
+                case 1: payload[i] = iq_sample(unit, 4, gain[0]); break;
+                default: payload[i] = iq_sample(unit, 4, gain[2]); break;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+static int parse_options(struct emu_config *config, const char *options) {
+    char buf[256];
+    char *save;
+    snprintf(buf, sizeof(buf), "%s", options ? options : "");
+    for (char *opt = strtok_r(buf, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(opt, '=');
+        if (value == NULL) goto err;
+        *value++ = '\0';
+        if (!strcmp(opt, "rate")) {
+            config->rate = strtod(value, NULL);
+            if (config->rate <= 0) goto err;
+        } else if (!strcmp(opt, "layout")) {
+            int i;
+            for (i = 0; i < NUM_LAYOUTS && strcmp(layout_names[i], value); i++) {}
+            if (i == NUM_LAYOUTS) goto err;
+            config->layout = (enum payload_layout)i;
+        } else if (!strcmp(opt, "drop")) {
+            config->drop = strtod(value, NULL);
+        } else if (!strcmp(opt, "error")) {
+            config->error = strtod(value, NULL);
+        } else if (!strcmp(opt, "amp")) {
+            config->amp = strtoul(value, NULL, 0);
+            if (config->amp > 0xff) goto err;
+        } else if (!strcmp(opt, "unplug")) {
+            config->unplug = strtod(value, NULL);
+            if (config->unplug < 0) goto err;
+        } else if (!strcmp(opt, "replug")) {
+            config->replug = strtod(value, NULL);
+            if (config->replug < 0) goto err;
+        } else if (!strcmp(opt, "seed")) {
+            config->seed = strtoull(value, NULL, 0);
+        } else {
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    fprintf(stderr, "Error: Invalid emulator option %s\n", options);
+    return LIBUSB_ERROR_INVALID_PARAM;
+}
+
+static int emu_init(libusb_context **pctx, const char *options) {
+    struct emu_context *ctx = (struct emu_context*)calloc(1, sizeof(struct emu_context));
+    if (ctx == NULL) return LIBUSB_ERROR_NO_MEM;
+
+    ctx->config.rate = 40e6;
+    ctx->config.layout = LAYOUT_III_1A;
+    ctx->config.seed = 1;
+    ctx->config.amp = AMP_DEFAULT;
+    ctx->config.replug = 0.5;
+    int status = parse_options(&ctx->config, options);
+    if (status) {
+        free(ctx);
+        return status;
+    }
+    ctx->rng = ctx->config.seed ? ctx->config.seed : 1;
+    ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ctx->timer_fd < 0) {
+        fprintf(stderr, "Error: Emulator timer\n%s\n", strerror(errno));
+        free(ctx);
+        return LIBUSB_ERROR_OTHER;
+    }
+    ctx->timer_due = INT64_MAX;
+    ctx->pollfd.fd = ctx->timer_fd;
+    ctx->pollfd.events = POLLIN;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    struct emu_device *dev = &ctx->device;
+    dev->ctx = ctx;
+    dev->present = true;
+    dev->fpga_state = FPGA_STATE_IDLE;
+    dev->agc = 1;
+    for (int slot = 0; slot < NUM_SLOTS; slot++) {
+        dev->rf_info[slot] = (1 << 2) | (1 << 1);  // revision 2, antenna supply on
+        dev->amp[slot] = ctx->config.amp;
+        dev->ant_power_default[slot] = 0xFD;
+    }
+    create_unit_pattern(ctx);
+    create_pattern(ctx);
+
+    fprintf(stderr, "Emulated Flexiband: %.1f MB/s, layout %s, drop %g, error %g\n", ctx->config.rate / 1e6,
+            layout_names[ctx->config.layout], ctx->config.drop, ctx->config.error);
+    if (ctx->config.unplug > 0) {
+        fprintf(stderr, "Emulated Flexiband: unplugged %.1f s after each start for %.1f s\n", ctx->config.unplug,
+                ctx->config.replug);
+    }
+    *pctx = (libusb_context*)ctx;
+    return 0;
+}
+
+static void emu_exit(libusb_context *pctx) {
+    struct emu_context *ctx = context_of(pctx);
+    struct emu_device *dev = &ctx->device;
+    if (dev->frames || dev->overrun_frames) {
+        fprintf(stderr, "Emulator: %lu frames sent, %lu dropped, %lu lost in %lu failed packets, %lu lost in overruns\n",
+                dev->frames, dev->dropped_frames, dev->error_frames, dev->error_packets, dev->overrun_frames);
+    }
+    if (dev->sunk_bytes) {
+        fprintf(stderr, "Emulator: %lu bytes sunk, %lu frames, %lu without preamble, %lu counter gaps\n",
+                dev->sunk_bytes, dev->sunk_frames, dev->bad_frames, dev->counter_gaps);
+    }
+    if (dev->unplugs) fprintf(stderr, "Emulator: unplugged %lu times\n", dev->unplugs);
+    while (ctx->queue) {
+        struct emu_node *next = ctx->queue->next;
+        free(ctx->queue);
+        ctx->queue = next;
+    }
+    while (ctx->free_nodes) {
+        struct emu_node *next = ctx->free_nodes->next;
+        free(ctx->free_nodes);
+        ctx->free_nodes = next;
+    }
+    close(ctx->timer_fd);
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+static libusb_device_handle *emu_open_device_with_vid_pid(libusb_context *pctx, uint16_t vid, uint16_t pid) {
+    struct emu_context *ctx = context_of(pctx);
+    // Answers to any product ID, the tools ask for different ones
+    libusb_device_handle *handle = NULL;
+    pthread_mutex_lock(&ctx->lock);
+    if (vid == EMU_VID && ctx->device.present && !ctx->device.open) {
+        ctx->device.open = true;
+        handle = (libusb_device_handle*)&ctx->device;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return handle;
+}
+
+static int emu_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev, libusb_device_handle **dev_handle) {
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static void emu_close(libusb_device_handle *dev_handle) {
+    struct emu_device *dev = device_of(dev_handle);
+    pthread_mutex_lock(&dev->ctx->lock);
+    dev->open = false;
+    pthread_mutex_unlock(&dev->ctx->lock);
+}
+
+static int emu_kernel_driver_active(libusb_device_handle *dev_handle, int interface) {
+    return 0;
+}
+
+static int emu_detach_kernel_driver(libusb_device_handle *dev_handle, int interface) {
+    return 0;
+}
+
+static int emu_set_configuration(libusb_device_handle *dev_handle, int configuration) {
+    return configuration == 1 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int emu_reset_device(libusb_device_handle *dev_handle) {
+    struct emu_device *dev = device_of(dev_handle);
+    pthread_mutex_lock(&dev->ctx->lock);
+    dev->started = false;
+    dev->alt_setting = 0;
+    pthread_mutex_unlock(&dev->ctx->lock);
+    return 0;
+}
+
+static int emu_claim_interface(libusb_device_handle *dev_handle, int interface) {
+    return interface == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int emu_release_interface(libusb_device_handle *dev_handle, int interface) {
+    return interface == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int emu_set_interface_alt_setting(libusb_device_handle *dev_handle, int interface, int alt_setting) {
+    struct emu_device *dev = device_of(dev_handle);
+    int status = 0;
+    pthread_mutex_lock(&dev->ctx->lock);
+    if (dev->open) dev->alt_setting = alt_setting;
+    else status = LIBUSB_ERROR_NO_DEVICE;
+    pthread_mutex_unlock(&dev->ctx->lock);
+    return status;
+}
+
+static int put_be(unsigned char *reply, uint32_t value, int len) {
+    for (int i = 0; i < len; i++) reply[i] = value >> (8 * (len - 1 - i));
+    return len;
+}
+
+// Answers an IN request into reply, returns the length or LIBUSB_ERROR_PIPE (stall)
+static int answer_in(struct emu_device *dev, uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+                     unsigned char *reply) {
+    static const uint32_t lo[NUM_SLOTS] = {1575420000, 1227600000, 1176450000};
+    static const char *const band[NUM_SLOTS] = {"L1", "L2", "L5"};
+    int slot = index;
+
+    if ((type & LIBUSB_REQUEST_TYPE_VENDOR) == 0) {
+        // Standard requests: the device descriptor and the string descriptors of the serial number
+        if (request != LIBUSB_REQUEST_GET_DESCRIPTOR) return LIBUSB_ERROR_PIPE;
+        if ((value >> 8) == LIBUSB_DT_DEVICE) {
+            static const unsigned char device[18] = {
+                18, LIBUSB_DT_DEVICE, 0x00, 0x03, 0, 0, 0, 9,
+                EMU_VID & 0xff, EMU_VID >> 8, 0x16, 0x10, 0x00, 0x01,
+                1, 2, 3, 1,  // iManufacturer, iProduct, iSerialNumber, bNumConfigurations
+            };
+            memcpy(reply, device, sizeof(device));
+            return sizeof(device);
+        }
+        if ((value >> 8) != LIBUSB_DT_STRING) return LIBUSB_ERROR_PIPE;
+        reply[1] = LIBUSB_DT_STRING;
+        if ((value & 0xff) == 0) {
+            put_be(reply + 2, 0x0904, 2);  // language ID 0x0409, little endian
+            return reply[0] = 4;
+        }
+        int len = 2;
+        for (const char *c = EMU_SERIAL; *c; c++) {
+            reply[len++] = *c;
+            reply[len++] = 0;
+        }
+        return reply[0] = len;
+    }
+
+    switch (request) {
+    case 0x00:
+    case 0x02:
+    case 0x03:
+        switch (value) {
+        case 0x00:
+            // Board revisions of interface and base board, the FPGA has none
+            if (request == 0x03) return LIBUSB_ERROR_PIPE;
+            reply[0] = request == 0x00 ? 3 : 1;
+            return 1;
+        case 0x01: return put_be(reply, EMU_BUILD, 2);
+        case 0x02: return put_be(reply, EMU_HASH, 4);
+        case 0x03: return put_be(reply, 0, 4);
+        case 0x05:
+            if (request != 0x00) return LIBUSB_ERROR_PIPE;
+            reply[0] = dev->fpga_state;
+            return 1;
+        }
+        return LIBUSB_ERROR_PIPE;
+    case 0x01:
+        if (index != 0x20) return LIBUSB_ERROR_PIPE;
+        reply[0] = dev->agc;
+        return 1;
+    case 0x04:
+        if (slot >= NUM_SLOTS) return LIBUSB_ERROR_PIPE;
+        switch (value) {
+        case 0x00: reply[0] = 1; return 1;  // EEPROM layout 1
+        case 0x01: reply[0] = slot + 1; return 1;
+        case 0x02: reply[0] = slot; return 1;
+        case 0x03: reply[0] = 20; return 1;
+        case 0x04: return put_be(reply, lo[slot], 4);
+        case 0x08: memset(reply, 0, 8); memcpy(reply, band[slot], strlen(band[slot])); return 8;
+        case 0x10: reply[0] = 0x00; return 1;
+        case 0x11: reply[0] = 0xFF; return 1;
+        case 0x12: reply[0] = dev->ctx->config.amp; return 1;
+        case 0x13: reply[0] = dev->ant_power_default[slot]; return 1;
+        }
+        return LIBUSB_ERROR_PIPE;
+    case 0x05:
+        if (slot >= NUM_SLOTS || value != 0x00) return LIBUSB_ERROR_PIPE;
+        reply[0] = dev->rf_info[slot];
+        return 1;
+    }
+    return LIBUSB_ERROR_PIPE;
+}
+
+static int answer_out(struct emu_device *dev, uint8_t request, uint16_t value, uint16_t index,
+                      const unsigned char *data, uint16_t length) {
+    struct emu_context *ctx = dev->ctx;
+    int slot = index;
+
+    switch (request) {
+    case 0x00:
+        switch (value) {
+        case 0x00:
+            // Start: the counter starts at zero, streaming starts now
+            dev->started = true;
+            dev->counter = 0;
+            ctx->stream_time = now_nsec();
+            if (ctx->config.unplug > 0) dev->unplug_time = ctx->stream_time + (int64_t)(ctx->config.unplug * NS_PER_SEC);
+            return 0;
+        case 0x01: dev->started = false; return 0;
+        case 0x02:
+        case 0x03: return 0;
+        case 0xff00: dev->fpga_state = FPGA_STATE_IDLE; return length;
+        case 0xffff: dev->started = false; return 0;
+        }
+        return LIBUSB_ERROR_PIPE;
+    case 0x01:
+        if (index != 0x20) return LIBUSB_ERROR_PIPE;
+        dev->agc = value & 1;
+        return 0;
+    case 0x04:
+        if (slot >= NUM_SLOTS || value != 0x13 || length < 1) return LIBUSB_ERROR_PIPE;
+        dev->ant_power_default[slot] = data[0];
+        return length;
+    case 0x05:
+        if (slot >= NUM_SLOTS) return LIBUSB_ERROR_PIPE;
+        // Rev2 boards: on=0xFD, off=0xFF
+        dev->rf_info[slot] = (dev->rf_info[slot] & ~0x02) | (value == 0xFD ? 0x02 : 0x00);
+        return 0;
+    case 0x06:
+        if (slot >= NUM_SLOTS) return LIBUSB_ERROR_PIPE;
+        if (dev->amp[slot] != (value & 0xff)) {
+            dev->amp[slot] = value;
+            create_pattern(ctx);
+        }
+        return 0;
+    }
+    return LIBUSB_ERROR_PIPE;
+}
+
+// Called with the lock held
+static int answer_control(struct emu_device *dev, uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+                          unsigned char *data, uint16_t length) {
+    if (type & LIBUSB_ENDPOINT_IN) {
+        unsigned char reply[256];
+        memset(reply, 0, sizeof(reply));
+        int len = answer_in(dev, type, request, value, index, reply);
+        if (len < 0) return len;
+        if (len > length) len = length;
+        memcpy(data, reply, len);
+        return len;
+    }
+    if ((type & LIBUSB_REQUEST_TYPE_VENDOR) == 0) return LIBUSB_ERROR_PIPE;
+    return answer_out(dev, request, value, index, data, length);
+}
+
+static int emu_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t request,
+                                uint16_t value, uint16_t index, unsigned char *data, uint16_t length,
+                                unsigned int timeout) {
+    struct emu_device *dev = device_of(dev_handle);
+    pthread_mutex_lock(&dev->ctx->lock);
+    int status = dev->open ? answer_control(dev, request_type, request, value, index, data, length)
+                           : LIBUSB_ERROR_NO_DEVICE;
+    pthread_mutex_unlock(&dev->ctx->lock);
+    return status;
+}
+
+// Time of the next unplug or replug, INT64_MAX if none is scheduled
+static int64_t presence_change(const struct emu_context *ctx) {
+    const struct emu_device *dev = &ctx->device;
+    if (dev->present) return dev->unplug_time ? dev->unplug_time : INT64_MAX;
+    return dev->replug_time;
+}
+
+// Called with the lock held. Arms the timerfd for the next due transfer or device change, so
+// an external poll loop wakes up in time. A time already passed fires right away.
+static void arm_timer(struct emu_context *ctx) {
+    int64_t next = ctx->queue ? ctx->queue->due : INT64_MAX;
+    int64_t change = presence_change(ctx);
+    if (change < next) next = change;
+    if (next == ctx->timer_due) return;
+    ctx->timer_due = next;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (next != INT64_MAX) {
+        its.it_value.tv_sec = next / NS_PER_SEC;
+        its.it_value.tv_nsec = next % NS_PER_SEC;
+    }
+    timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void queue_insert(struct emu_context *ctx, struct emu_node *node) {
+    struct emu_node **p = &ctx->queue;
+    while (*p && (*p)->due <= node->due) p = &(*p)->next;
+    node->next = *p;
+    *p = node;
+}
+
+static int emu_submit_transfer(struct libusb_transfer *transfer) {
+    struct emu_device *dev = device_of(transfer->dev_handle);
+    struct emu_context *ctx = dev->ctx;
+    int64_t now = now_nsec();
+    int status = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (!dev->open) {
+        status = LIBUSB_ERROR_NO_DEVICE;
+        goto out;
+    }
+    struct emu_node *node = ctx->free_nodes;
+    if (node) ctx->free_nodes = node->next;
+    else node = (struct emu_node*)malloc(sizeof(struct emu_node));
+    if (node == NULL) {
+        status = LIBUSB_ERROR_NO_MEM;
+        goto out;
+    }
+    node->transfer = transfer;
+    node->cancelled = false;
+
+    int64_t bytes = transfer->length;
+    switch (transfer->type) {
+    case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+        bytes = 0;
+        for (int i = 0; i < transfer->num_iso_packets; i++) bytes += transfer->iso_packet_desc[i].length;
+        // Frames produced while no transfer was queued are lost
+        if (dev->started && now > ctx->stream_time) {
+            uint64_t lost = (uint64_t)((now - ctx->stream_time) * ctx->config.rate / NS_PER_SEC / FRAME_LEN);
+            dev->counter += lost;
+            dev->overrun_frames += lost;
+            ctx->stream_time += (int64_t)(lost * FRAME_LEN * NS_PER_SEC / ctx->config.rate);
+        }
+        if (ctx->stream_time < now) ctx->stream_time = now;
+        ctx->stream_time += (int64_t)(bytes * NS_PER_SEC / ctx->config.rate);
+        node->due = ctx->stream_time;
+        break;
+    case LIBUSB_TRANSFER_TYPE_BULK:
+        if (ctx->sink_time < now) ctx->sink_time = now;
+        ctx->sink_time += (int64_t)(bytes * NS_PER_SEC / ctx->config.rate);
+        node->due = ctx->sink_time;
+        break;
+    case LIBUSB_TRANSFER_TYPE_CONTROL:
+        if (ctx->control_time < now) ctx->control_time = now;
+        ctx->control_time += CONTROL_LATENCY_NS;
+        node->due = ctx->control_time;
+        break;
+    default:
+        node->due = now;
+        break;
+    }
+    queue_insert(ctx, node);
+    arm_timer(ctx);
+    pthread_cond_broadcast(&ctx->cond);
+
+out:
+    pthread_mutex_unlock(&ctx->lock);
+    return status;
+}
+
+static int emu_cancel_transfer(struct libusb_transfer *transfer) {
+    struct emu_context *ctx = device_of(transfer->dev_handle)->ctx;
+    int status = LIBUSB_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (struct emu_node **p = &ctx->queue; *p; p = &(*p)->next) {
+        struct emu_node *node = *p;
+        if (node->transfer != transfer || node->cancelled) continue;
+        *p = node->next;
+        node->cancelled = true;
+        node->due = now_nsec();
+        queue_insert(ctx, node);
+        arm_timer(ctx);
+        pthread_cond_broadcast(&ctx->cond);
+        status = 0;
+        break;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return status;
+}
+
+static void fill_iso_transfer(struct emu_context *ctx, struct libusb_transfer *transfer) {
+    struct emu_device *dev = &ctx->device;
+    unsigned payload_len = layout_payload_len(ctx->config.layout);
+
+    for (int i = 0; i < transfer->num_iso_packets; i++) {
+        struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+        unsigned num_frames = desc->length / FRAME_LEN;
+        desc->status = LIBUSB_TRANSFER_COMPLETED;
+        desc->actual_length = 0;
+        if (!dev->started || ctx->device.alt_setting == 0) continue;
+        if (random_event(ctx, ctx->config.error)) {
+            desc->status = LIBUSB_TRANSFER_ERROR;
+            dev->counter += num_frames;
+            dev->error_packets++;
+            dev->error_frames += num_frames;
+            continue;
+        }
+        uint8_t *frame = libusb_get_iso_packet_buffer_simple(transfer, i);
+        for (unsigned f = 0; f < num_frames; f++, dev->counter++) {
+            if (random_event(ctx, ctx->config.drop)) {
+                dev->dropped_frames++;
+                continue;
+            }
+            frame_set_header(frame, dev->counter);
+            memcpy(frame + FRAME_HEADER_LEN, ctx->pattern[dev->counter % PATTERN_FRAMES], payload_len);
+            memset(frame + FRAME_HEADER_LEN + payload_len, 0, FRAME_LEN - FRAME_HEADER_LEN - payload_len);
+            frame += FRAME_LEN;
+            desc->actual_length += FRAME_LEN;
+            dev->frames++;
+        }
+    }
+}
+
+static void sink_bulk_transfer(struct emu_context *ctx, struct libusb_transfer *transfer) {
+    struct emu_device *dev = &ctx->device;
+    for (int pos = 0; pos + FRAME_LEN <= transfer->length; pos += FRAME_LEN) {
+        const uint8_t *frame = transfer->buffer + pos;
+        if (!frame_has_preamble(frame)) {
+            dev->bad_frames++;
+            continue;
+        }
+        uint32_t counter = frame_counter(frame);
+        if (dev->sink_synced && counter != dev->sink_counter + 1) dev->counter_gaps++;
+        dev->sink_counter = counter;
+        dev->sink_synced = true;
+        dev->sunk_frames++;
+    }
+    dev->sunk_bytes += transfer->length;
+    transfer->actual_length = transfer->length;
+}
+
+// Called with the lock held, does everything the device would have done for this transfer
+static void complete_transfer(struct emu_context *ctx, struct libusb_transfer *transfer, bool cancelled) {
+    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    transfer->actual_length = 0;
+    if (cancelled || !ctx->device.present) {
+        transfer->status = cancelled ? LIBUSB_TRANSFER_CANCELLED : LIBUSB_TRANSFER_NO_DEVICE;
+        for (int i = 0; i < transfer->num_iso_packets; i++) {
+            transfer->iso_packet_desc[i].status = transfer->status;
+            transfer->iso_packet_desc[i].actual_length = 0;
+        }
+        return;
+    }
+
+    switch (transfer->type) {
+    case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+        if (transfer->endpoint & LIBUSB_ENDPOINT_IN) fill_iso_transfer(ctx, transfer);
+        else transfer->status = LIBUSB_TRANSFER_STALL;
+        break;
+    case LIBUSB_TRANSFER_TYPE_BULK:
+        if (transfer->endpoint & LIBUSB_ENDPOINT_IN) transfer->status = LIBUSB_TRANSFER_STALL;
+        else sink_bulk_transfer(ctx, transfer);
+        break;
+    case LIBUSB_TRANSFER_TYPE_CONTROL: {
+        struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+        int len = answer_control(&ctx->device, setup->bmRequestType, setup->bRequest,
+                                 libusb_le16_to_cpu(setup->wValue), libusb_le16_to_cpu(setup->wIndex),
+                                 libusb_control_transfer_get_data(transfer), libusb_le16_to_cpu(setup->wLength));
+        if (len < 0) transfer->status = LIBUSB_TRANSFER_STALL;
+        else transfer->actual_length = len;
+        break;
+    }
+    default:
+        transfer->status = LIBUSB_TRANSFER_STALL;
+        break;
+    }
+}
+
+// Called with the lock held. Unplugs or replugs the device when it is time and returns the
+// time of the next change, INT64_MAX if none is scheduled.
+static int64_t update_presence(struct emu_context *ctx, int64_t now) {
+    struct emu_device *dev = &ctx->device;
+    if (dev->present && dev->unplug_time && now >= dev->unplug_time) {
+        // Everything the device had is gone, queued transfers fail right away
+        dev->present = false;
+        dev->open = false;
+        dev->started = false;
+        dev->alt_setting = 0;
+        dev->counter = 0;
+        dev->unplug_time = 0;
+        dev->replug_time = now + (int64_t)(ctx->config.replug * NS_PER_SEC);
+        dev->unplugs++;
+        for (struct emu_node *node = ctx->queue; node; node = node->next) {
+            if (node->due > now) node->due = now;
+        }
+        ctx->pending_event = LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT;
+    } else if (!dev->present && now >= dev->replug_time) {
+        dev->present = true;
+        ctx->pending_event = LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+    }
+    return presence_change(ctx);
+}
+
+static int emu_handle_events_timeout_completed(libusb_context *pctx, struct timeval *tv, int *completed) {
+    struct emu_context *ctx = context_of(pctx);
+    int64_t deadline = now_nsec() + (tv ? tv->tv_sec * NS_PER_SEC + tv->tv_usec * 1000LL : 0);
+    bool handled = false;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!(completed && *completed)) {
+        int64_t now = now_nsec();
+        int64_t change = update_presence(ctx, now);
+        libusb_hotplug_event event = ctx->pending_event;
+        ctx->pending_event = 0;
+        if (event && ctx->hotplug_cb && (ctx->hotplug_events & event)) {
+            libusb_hotplug_callback_fn cb = ctx->hotplug_cb;
+            pthread_mutex_unlock(&ctx->lock);
+            int done = cb(pctx, NULL, event, ctx->hotplug_user_data);
+            pthread_mutex_lock(&ctx->lock);
+            if (done) ctx->hotplug_cb = NULL;
+            handled = true;
+            continue;
+        }
+        struct emu_node *node = ctx->queue;
+        if (node && node->due <= now) {
+            struct libusb_transfer *transfer = node->transfer;
+            ctx->queue = node->next;
+            complete_transfer(ctx, transfer, node->cancelled);
+            node->next = ctx->free_nodes;
+            ctx->free_nodes = node;
+            // Callbacks submit new transfers, so they run without the lock
+            pthread_mutex_unlock(&ctx->lock);
+            transfer->callback(transfer);
+            if (transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER) libusb_free_transfer(transfer);
+            pthread_mutex_lock(&ctx->lock);
+            handled = true;
+            continue;
+        }
+        if (handled || now >= deadline) break;
+
+        int64_t wake = node && node->due < deadline ? node->due : deadline;
+        if (change < wake) wake = change;
+        struct timespec ts = {wake / NS_PER_SEC, wake % NS_PER_SEC};
+        pthread_cond_timedwait(&ctx->cond, &ctx->lock, &ts);
+    }
+    // Consume the expirations and arm for whatever is due next
+    uint64_t expirations;
+    if (read(ctx->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Error: Emulator timer\n%s\n", strerror(errno));
+    }
+    ctx->timer_due = INT64_MIN;
+    arm_timer(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+// Only one callback at a time, which is all the tools need
+static int emu_hotplug_register_callback(libusb_context *pctx, int events, int flags, int vendor_id, int product_id,
+                                         int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data,
+                                         libusb_hotplug_callback_handle *callback_handle) {
+    struct emu_context *ctx = context_of(pctx);
+    if (vendor_id != LIBUSB_HOTPLUG_MATCH_ANY && vendor_id != EMU_VID) return LIBUSB_ERROR_NOT_SUPPORTED;
+    pthread_mutex_lock(&ctx->lock);
+    bool busy = ctx->hotplug_cb != NULL, present = ctx->device.present;
+    if (!busy) {
+        ctx->hotplug_cb = cb_fn;
+        ctx->hotplug_user_data = user_data;
+        ctx->hotplug_events = events;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    if (busy) return LIBUSB_ERROR_BUSY;
+    if (callback_handle) *callback_handle = 1;
+    // Like libusb, LIBUSB_HOTPLUG_ENUMERATE reports a present device during the registration
+    if ((flags & LIBUSB_HOTPLUG_ENUMERATE) && present && (events & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)) {
+        if (cb_fn(pctx, NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data)) {
+            pthread_mutex_lock(&ctx->lock);
+            ctx->hotplug_cb = NULL;
+            pthread_mutex_unlock(&ctx->lock);
+        }
+    }
+    return 0;
+}
+
+static void emu_hotplug_deregister_callback(libusb_context *pctx, libusb_hotplug_callback_handle callback_handle) {
+    struct emu_context *ctx = context_of(pctx);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->hotplug_cb = NULL;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static const struct libusb_pollfd **emu_get_pollfds(libusb_context *pctx) {
+    const struct libusb_pollfd **pollfds = (const struct libusb_pollfd**)calloc(2, sizeof(*pollfds));
+    if (pollfds) pollfds[0] = &context_of(pctx)->pollfd;
+    return pollfds;
+}
+
+static void emu_free_pollfds(const struct libusb_pollfd **pollfds) {
+    free((void*)pollfds);
+}
+
+// The timerfd is the only pollfd for the lifetime of the context, the notifiers are never called
+static void emu_set_pollfd_notifiers(libusb_context *pctx, libusb_pollfd_added_cb added_cb,
+                                     libusb_pollfd_removed_cb removed_cb, void *user_data) {
+}
+
+static int emu_get_next_timeout(libusb_context *pctx, struct timeval *tv) {
+    return 0;
+}
+
+static int emu_pollfds_handle_timeouts(libusb_context *pctx) {
+    return 1;
+}
+
+const struct transport_ops transport_emu = {
+    .name = "emu",
+    .init = emu_init,
+    .exit = emu_exit,
+    .open_device_with_vid_pid = emu_open_device_with_vid_pid,
+    .wrap_sys_device = emu_wrap_sys_device,
+    .close = emu_close,
+    .kernel_driver_active = emu_kernel_driver_active,
+    .detach_kernel_driver = emu_detach_kernel_driver,
+    .set_configuration = emu_set_configuration,
+    .reset_device = emu_reset_device,
+    .claim_interface = emu_claim_interface,
+    .release_interface = emu_release_interface,
+    .set_interface_alt_setting = emu_set_interface_alt_setting,
+    .control_transfer = emu_control_transfer,
+    .submit_transfer = emu_submit_transfer,
+    .cancel_transfer = emu_cancel_transfer,
+    .handle_events_timeout_completed = emu_handle_events_timeout_completed,
+    .hotplug_register_callback = emu_hotplug_register_callback,
+    .hotplug_deregister_callback = emu_hotplug_deregister_callback,
+    .get_pollfds = emu_get_pollfds,
+    .free_pollfds = emu_free_pollfds,
+    .set_pollfd_notifiers = emu_set_pollfd_notifiers,
+    .get_next_timeout = emu_get_next_timeout,
+    .pollfds_handle_timeouts = emu_pollfds_handle_timeouts,
+};